@@ -0,0 +1,38 @@
+/* The server side of fanout_test: a pub/sub server with shared compression.
+ * A text message "+pattern" subscribes (patterns may hold + and # wildcards),
+ * a binary message "topic\npayload" publishes payload to topic */
+
+#include "App.h"
+
+#include <cstdlib>
+
+int main(int argc, char **argv) {
+    int port = argc > 1 ? atoi(argv[1]) : 9001;
+
+    struct PerSocketData {
+
+    };
+
+    uWS::App().ws<PerSocketData>("/*", {
+        .compression = uWS::SHARED_COMPRESSOR,
+        .maxPayloadLength = 64 * 1024,
+        /* Subscribers never speak, so they must not time out */
+        .idleTimeout = 0,
+        /* Slow consumers are dropped past this */
+        .maxBackpressure = 1 * 1024 * 1024,
+        .message = [](auto *ws, std::string_view message, uWS::OpCode opCode) {
+            if (opCode == uWS::OpCode::TEXT && message.length() && message[0] == '+') {
+                ws->subscribe(message.substr(1));
+            } else if (opCode == uWS::OpCode::BINARY) {
+                size_t separator = message.find('\n');
+                if (separator != std::string_view::npos) {
+                    ws->publish(message.substr(0, separator), message.substr(separator + 1), uWS::OpCode::BINARY, true);
+                }
+            }
+        }
+    }).listen(port, [port](auto *token) {
+        if (token) {
+            std::cout << "Listening on port " << port << std::endl;
+        }
+    }).run();
+}
@@ -0,0 +1,357 @@
+/* This benchmark measures end-to-end pub/sub latency against benchmarks/fanout_server.
+
+   One client publishes at a fixed rate, stamping every message with the time it was sent. All other
+   clients subscribe with overlapping wildcard patterns, so that some messages hit a client through
+   several of its subscriptions (it must still get them only once). A share of the clients negotiate
+   permessage-deflate and a share are slow consumers, run in a child process that stalls on every read
+   until the server drops it for backpressure. Every 4 seconds we print p50/p99/p99.9 of the latency as
+   seen by the fast clients, for compressed and uncompressed ones separately.
+   */
+
+#include <libusockets.h>
+int SSL;
+
+#include "latency.h"
+
+#include <unistd.h>
+#include <zlib.h>
+
+char request[] = "GET / HTTP/1.1\r\n"
+                 "Upgrade: websocket\r\n"
+                 "Connection: Upgrade\r\n"
+                 "Sec-WebSocket-Key: x3JJHMbDL1EzLkh9GBhXDw==\r\n"
+                 "Host: server.example.com\r\n"
+                 "Sec-WebSocket-Version: 13\r\n\r\n";
+
+char compressed_request[] = "GET / HTTP/1.1\r\n"
+                            "Upgrade: websocket\r\n"
+                            "Connection: Upgrade\r\n"
+                            "Sec-WebSocket-Key: x3JJHMbDL1EzLkh9GBhXDw==\r\n"
+                            "Sec-WebSocket-Extensions: permessage-deflate\r\n"
+                            "Host: server.example.com\r\n"
+                            "Sec-WebSocket-Version: 13\r\n\r\n";
+
+/* Client i subscribes to the patterns of i % 4, topics are published round robin */
+const char *subscriptions[4][2] = {
+    {"sport/+/score", 0},
+    {"sport/football/#", 0},
+    {"sport/football/score", 0},
+    {"sport/#", "sport/tennis/+"}
+};
+const char *topics[] = {"sport/football/score", "sport/tennis/score", "sport/football/news/today"};
+
+char *host;
+int port;
+int connections;
+int compressed_percent;
+int rate;
+int payload_length;
+int slow;
+
+/* Index of the next client we connect */
+int next_client;
+int upgraded;
+
+struct us_socket_t *publisher;
+struct us_timer_t *publish_timer;
+uint64_t published, delivered;
+double publish_debt;
+
+/* What the publisher could not write yet */
+char *outgoing;
+int outgoing_length, outgoing_capacity;
+
+struct histogram compressed_latency, uncompressed_latency;
+
+/* Compressed messages are independent (the server never takes context over) so one inflater does */
+z_stream inflater;
+char *inflated;
+
+struct http_socket {
+    struct ws_reader reader;
+
+    /* How far we have streamed our upgrade request */
+    char *upgrade;
+    int upgrade_length;
+    int upgrade_offset;
+
+    int is_upgraded;
+    int is_compressed;
+    int index;
+};
+
+/* We don't need any of these */
+void noop(struct us_loop_t *loop) {
+
+}
+
+/* Writes what we can and keeps the rest in order for writable */
+void write_or_buffer(struct us_socket_t *s, char *data, int length) {
+    int written = outgoing_length ? 0 : us_socket_write(SSL, s, data, length, 0);
+    if (written < length) {
+        if (outgoing_length + length - written > outgoing_capacity) {
+            outgoing_capacity = (outgoing_length + length - written) * 2;
+            outgoing = realloc(outgoing, outgoing_capacity);
+        }
+        memcpy(outgoing + outgoing_length, data + written, length - written);
+        outgoing_length += length - written;
+    }
+}
+
+void subscribe(struct us_socket_t *s, const char *pattern) {
+    char message[64], frame[80];
+    int length = snprintf(message, sizeof(message), "+%s", pattern);
+    us_socket_write(SSL, s, frame, ws_client_frame(frame, 1, message, length), 0);
+}
+
+void publish(const char *topic) {
+    static char *message, *frame;
+    if (!message) {
+        message = malloc(256 + payload_length);
+        frame = malloc(256 + payload_length + 8);
+    }
+
+    /* topic\n, then the timestamp followed by compressible filler */
+    int topic_length = (int) strlen(topic);
+    memcpy(message, topic, topic_length);
+    message[topic_length] = '\n';
+    uint64_t timestamp = now_ns();
+    memcpy(message + topic_length + 1, &timestamp, sizeof(timestamp));
+    for (int i = 8; i < payload_length; i++) {
+        message[topic_length + 1 + i] = "{\"score\":[1,0],\"minute\":42},"[i % 29];
+    }
+
+    write_or_buffer(publisher, frame, ws_client_frame(frame, 2, message, topic_length + 1 + payload_length));
+    published++;
+}
+
+/* Publishes rate messages per second, in one millisecond steps */
+void on_publish_timer(struct us_timer_t *t) {
+    for (publish_debt += rate / 1000.0; publish_debt >= 1; publish_debt--) {
+        publish(topics[published % 3]);
+    }
+}
+
+void on_message(void *user, unsigned char opcode, int compressed, char *data, int length) {
+    struct http_socket *http_socket = (struct http_socket *) user;
+
+    /* Slow consumers only exist to load the server */
+    if (slow) {
+        return;
+    }
+
+    if (compressed) {
+        static const char tail[] = {0x00, 0x00, (char) 0xff, (char) 0xff};
+        inflateReset(&inflater);
+        inflater.next_out = (Bytef *) inflated;
+        inflater.avail_out = 8 + payload_length;
+        inflater.next_in = (Bytef *) data;
+        inflater.avail_in = length;
+        inflate(&inflater, Z_SYNC_FLUSH);
+        inflater.next_in = (Bytef *) tail;
+        inflater.avail_in = 4;
+        inflate(&inflater, Z_SYNC_FLUSH);
+
+        data = inflated;
+        length = 8 + payload_length - inflater.avail_out;
+    }
+
+    uint64_t timestamp;
+    if (length < (int) sizeof(timestamp)) {
+        printf("Unexpected message, exiting!\n");
+        exit(-1);
+    }
+    memcpy(&timestamp, data, sizeof(timestamp));
+    histogram_record(http_socket->is_compressed ? &compressed_latency : &uncompressed_latency, now_ns() - timestamp);
+    delivered++;
+}
+
+void next_connection(struct us_socket_t *s) {
+    struct http_socket *http_socket = (struct http_socket *) us_socket_ext(SSL, s);
+
+    /* The first fast client publishes, every other one subscribes */
+    if (http_socket->index || slow) {
+        for (int i = 0; i < 2; i++) {
+            if (subscriptions[http_socket->index % 4][i]) {
+                subscribe(s, subscriptions[http_socket->index % 4][i]);
+            }
+        }
+    } else {
+        publisher = s;
+    }
+
+    if (++upgraded < connections) {
+        return;
+    }
+
+    if (slow) {
+        printf("%d slow consumers connected\n", connections);
+    } else {
+        /* Give the server a second to take in all subscriptions */
+        printf("Running benchmark now...\n");
+        publish_timer = us_create_timer(us_socket_context_loop(SSL, us_socket_context(SSL, s)), 0, 0);
+        us_timer_set(publish_timer, on_publish_timer, 1000, 1);
+        us_socket_timeout(SSL, publisher, LIBUS_TIMEOUT_GRANULARITY);
+    }
+}
+
+void connect_next(struct us_socket_context_t *context) {
+    if (next_client < connections) {
+        us_socket_context_connect(SSL, context, host, port, 0, sizeof(struct http_socket));
+    }
+}
+
+struct us_socket_t *on_http_socket_writable(struct us_socket_t *s) {
+    struct http_socket *http_socket = (struct http_socket *) us_socket_ext(SSL, s);
+
+    /* Are we still not upgraded yet? */
+    if (http_socket->upgrade_offset < http_socket->upgrade_length) {
+        http_socket->upgrade_offset += us_socket_write(SSL, s, http_socket->upgrade + http_socket->upgrade_offset, http_socket->upgrade_length - http_socket->upgrade_offset, 0);
+    } else if (s == publisher && outgoing_length) {
+        int written = us_socket_write(SSL, s, outgoing, outgoing_length, 0);
+        memmove(outgoing, outgoing + written, outgoing_length - written);
+        outgoing_length -= written;
+    }
+
+    return s;
+}
+
+struct us_socket_t *on_http_socket_close(struct us_socket_t *s) {
+
+    /* This is what slow consumers are for */
+    if (slow) {
+        printf("Slow consumer was dropped by the server\n");
+        if (!--connections) {
+            exit(0);
+        }
+        return s;
+    }
+
+    printf("Client was disconnected, exiting!\n");
+    exit(-1);
+
+    return s;
+}
+
+struct us_socket_t *on_http_socket_end(struct us_socket_t *s) {
+    return us_socket_close(SSL, s);
+}
+
+struct us_socket_t *on_http_socket_data(struct us_socket_t *s, char *data, int length) {
+    struct http_socket *http_socket = (struct http_socket *) us_socket_ext(SSL, s);
+
+    /* Stall the whole (child) process, the server sees this as a consumer that cannot keep up */
+    if (slow) {
+        usleep(2000);
+        if (getppid() == 1) {
+            exit(0);
+        }
+    }
+
+    /* Are we already upgraded? */
+    if (http_socket->is_upgraded) {
+        if (!ws_reader_consume(&http_socket->reader, data, length, http_socket, on_message)) {
+            printf("Server sent an invalid frame, exiting!\n");
+            exit(-1);
+        }
+    } else {
+        /* We assume the server is not sending anything immediately following upgrade and that we get rnrn in one chunk */
+        if (length >= 4 && data[length - 1] == '\n' && data[length - 2] == '\r' && data[length - 3] == '\n' && data[length - 4] == '\r') {
+            http_socket->is_upgraded = 1;
+            next_connection(s);
+            connect_next(us_socket_context(SSL, s));
+        }
+    }
+
+    return s;
+}
+
+struct us_socket_t *on_http_socket_open(struct us_socket_t *s, int is_client, char *ip, int ip_length) {
+    struct http_socket *http_socket = (struct http_socket *) us_socket_ext(SSL, s);
+
+    /* Reset state, every compressed_percent of a hundred clients negotiate compression */
+    memset(http_socket, 0, sizeof(struct http_socket));
+    http_socket->index = next_client++;
+    http_socket->is_compressed = http_socket->index % 100 < compressed_percent;
+    http_socket->upgrade = http_socket->is_compressed ? compressed_request : request;
+    http_socket->upgrade_length = (int) strlen(http_socket->upgrade);
+
+    /* Send an upgrade request */
+    http_socket->upgrade_offset = us_socket_write(SSL, s, http_socket->upgrade, http_socket->upgrade_length, 0);
+
+    return s;
+}
+
+struct us_socket_t *on_http_socket_timeout(struct us_socket_t *s) {
+    /* Print current statistics */
+    printf("Published %llu, delivered %llu (%.1f per publish)\n", (unsigned long long) published, (unsigned long long) delivered,
+           published ? (double) delivered / published : 0.0);
+    histogram_print_and_reset(&uncompressed_latency, "Uncompressed");
+    histogram_print_and_reset(&compressed_latency, "Compressed");
+    published = delivered = 0;
+
+    us_socket_timeout(SSL, s, LIBUS_TIMEOUT_GRANULARITY);
+
+    return s;
+}
+
+int main(int argc, char **argv) {
+
+    /* Parse host, port and scenario */
+    if (argc != 9) {
+        printf("Usage: connections host port ssl compressed_percent slow_percent rate size\n"
+               "(try 1000 clients, 50%% compressed, 5%% slow, 1000 messages/second of 128 bytes)\n");
+        return 0;
+    }
+
+    port = atoi(argv[3]);
+    host = malloc(strlen(argv[2]) + 1);
+    memcpy(host, argv[2], strlen(argv[2]) + 1);
+    connections = atoi(argv[1]);
+    SSL = atoi(argv[4]);
+    compressed_percent = atoi(argv[5]);
+    int slow_connections = connections * atoi(argv[6]) / 100;
+    rate = atoi(argv[7]);
+    payload_length = atoi(argv[8]);
+    if (payload_length < 8) {
+        payload_length = 8;
+    }
+    if (payload_length > 16 * 1024) {
+        payload_length = 16 * 1024;
+    }
+
+    /* Slow consumers live in a child process of their own as they stall their whole loop */
+    if (slow_connections && fork() == 0) {
+        slow = 1;
+        connections = slow_connections;
+    } else {
+        connections -= slow_connections;
+    }
+    if (connections < 2 && !slow) {
+        printf("Need at least one publisher and one subscriber\n");
+        return 0;
+    }
+
+    inflateInit2(&inflater, -15);
+    inflated = malloc(8 + payload_length);
+
+    /* Create the event loop */
+    struct us_loop_t *loop = us_create_loop(0, noop, noop, noop, 0);
+
+    /* Create a socket context for HTTP */
+    struct us_socket_context_options_t options = {};
+    struct us_socket_context_t *http_context = us_create_socket_context(SSL, loop, 0, options);
+
+    /* Set up event handlers */
+    us_socket_context_on_open(SSL, http_context, on_http_socket_open);
+    us_socket_context_on_data(SSL, http_context, on_http_socket_data);
+    us_socket_context_on_writable(SSL, http_context, on_http_socket_writable);
+    us_socket_context_on_close(SSL, http_context, on_http_socket_close);
+    us_socket_context_on_timeout(SSL, http_context, on_http_socket_timeout);
+    us_socket_context_on_end(SSL, http_context, on_http_socket_end);
+
+    /* Start making HTTP connections, one at a time */
+    connect_next(http_context);
+
+    us_loop_run(loop);
+}
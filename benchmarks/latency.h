@@ -0,0 +1,172 @@
+/* Shared by the latency benchmarks: timestamps, a latency histogram and just enough of a WebSocket client */
+
+#ifndef LATENCY_H
+#define LATENCY_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/* Monotonic nanoseconds, comparable between processes on the same machine */
+static inline uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ull + (uint64_t) ts.tv_nsec;
+}
+
+/* Log-linear histogram of microseconds: exact below 64 us, then 32 buckets per power of two (3% precision) */
+#define HISTOGRAM_LINEAR 64
+#define HISTOGRAM_SUB_BUCKETS 32
+#define HISTOGRAM_BUCKETS (HISTOGRAM_LINEAR + 36 * HISTOGRAM_SUB_BUCKETS)
+
+struct histogram {
+    uint64_t buckets[HISTOGRAM_BUCKETS];
+    uint64_t count;
+    uint64_t max;
+};
+
+static inline int histogram_bucket(uint64_t us) {
+    if (us < HISTOGRAM_LINEAR) {
+        return (int) us;
+    }
+    int msb = 63 - __builtin_clzll(us);
+    if (msb > 41) {
+        return HISTOGRAM_BUCKETS - 1;
+    }
+    /* The 5 bits following the most significant one select the sub bucket */
+    return HISTOGRAM_LINEAR + (msb - 6) * HISTOGRAM_SUB_BUCKETS + (int) (us >> (msb - 5)) - HISTOGRAM_SUB_BUCKETS;
+}
+
+/* Upper edge of a bucket, which is what we report for percentiles falling in it */
+static inline uint64_t histogram_value(int bucket) {
+    if (bucket < HISTOGRAM_LINEAR) {
+        return (uint64_t) bucket;
+    }
+    int msb = (bucket - HISTOGRAM_LINEAR) / HISTOGRAM_SUB_BUCKETS + 6;
+    uint64_t sub = (uint64_t) ((bucket - HISTOGRAM_LINEAR) % HISTOGRAM_SUB_BUCKETS + HISTOGRAM_SUB_BUCKETS);
+    return ((sub + 1) << (msb - 5)) - 1;
+}
+
+static inline void histogram_record(struct histogram *h, uint64_t ns) {
+    uint64_t us = ns / 1000;
+    h->buckets[histogram_bucket(us)]++;
+    h->count++;
+    if (us > h->max) {
+        h->max = us;
+    }
+}
+
+static inline uint64_t histogram_percentile(struct histogram *h, double percentile) {
+    uint64_t rank = (uint64_t) (percentile / 100.0 * (double) h->count + 0.5), seen = 0;
+    if (rank < 1) {
+        rank = 1;
+    }
+    for (int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        if ((seen += h->buckets[i]) >= rank) {
+            return histogram_value(i) < h->max ? histogram_value(i) : h->max;
+        }
+    }
+    return h->max;
+}
+
+/* Prints one line of percentiles in microseconds and starts over */
+static inline void histogram_print_and_reset(struct histogram *h, const char *label) {
+    if (h->count) {
+        printf("%s: %llu samples, p50 %llu us, p99 %llu us, p99.9 %llu us, max %llu us\n", label, (unsigned long long) h->count,
+               (unsigned long long) histogram_percentile(h, 50), (unsigned long long) histogram_percentile(h, 99),
+               (unsigned long long) histogram_percentile(h, 99.9), (unsigned long long) h->max);
+    } else {
+        printf("%s: no samples\n", label);
+    }
+    memset(h, 0, sizeof(struct histogram));
+}
+
+/* Writes a client frame with an all zero mask (a no-op XOR) into dst, returns its length */
+static inline int ws_client_frame(char *dst, unsigned char opcode, const char *payload, int length) {
+    int header = 2;
+    dst[0] = (char) (128 | opcode);
+    if (length < 126) {
+        dst[1] = (char) (128 | length);
+    } else {
+        dst[1] = (char) (128 | 126);
+        dst[2] = (char) (length >> 8);
+        dst[3] = (char) (length & 255);
+        header = 4;
+    }
+    memset(dst + header, 0, 4);
+    memcpy(dst + header + 4, payload, length);
+    return header + 4 + length;
+}
+
+/* Reassembles server frames over reads, messages are expected to be single, unfragmented frames */
+struct ws_reader {
+    char *buffer;
+    int length;
+    int capacity;
+};
+
+/* Calls on_message for every complete frame, with whether it had the compressed (RSV1) bit set. Returns 0 on protocol error */
+static inline int ws_reader_consume(struct ws_reader *r, char *data, int length, void *user, void (*on_message)(void *user, unsigned char opcode, int compressed, char *payload, int length)) {
+    /* Only copy what spans reads */
+    if (r->length) {
+        if (r->length + length > r->capacity) {
+            r->capacity = (r->length + length) * 2;
+            r->buffer = (char *) realloc(r->buffer, r->capacity);
+        }
+        memcpy(r->buffer + r->length, data, length);
+        data = r->buffer;
+        length += r->length;
+        r->length = 0;
+    }
+
+    while (length >= 2) {
+        unsigned char *frame = (unsigned char *) data;
+        uint64_t payload_length = frame[1] & 127;
+        int header = 2;
+        if (frame[1] & 128) {
+            return 0;
+        }
+        if (payload_length == 126) {
+            if (length < 4) {
+                break;
+            }
+            payload_length = ((uint64_t) frame[2] << 8) | frame[3];
+            header = 4;
+        } else if (payload_length == 127) {
+            if (length < 10) {
+                break;
+            }
+            payload_length = 0;
+            for (int i = 0; i < 8; i++) {
+                payload_length = (payload_length << 8) | frame[2 + i];
+            }
+            header = 10;
+        }
+        if ((uint64_t) length < header + payload_length) {
+            break;
+        }
+
+        on_message(user, frame[0] & 15, (frame[0] & 64) != 0, data + header, (int) payload_length);
+        data += header + payload_length;
+        length -= header + (int) payload_length;
+    }
+
+    /* Keep the tail for the next read (data may already point into our own buffer) */
+    if (length) {
+        if (length > r->capacity) {
+            r->capacity = length * 2;
+            char *buffer = (char *) malloc(r->capacity);
+            memcpy(buffer, data, length);
+            free(r->buffer);
+            r->buffer = buffer;
+        } else {
+            memmove(r->buffer, data, length);
+        }
+        r->length = length;
+    }
+    return 1;
+}
+
+#endif // LATENCY_H
@@ -0,0 +1,193 @@
+/* This benchmark measures WebSocket round trip latency against any echo server, such as examples/EchoServer.
+
+   Every client keeps one message in flight, stamped with the time it was sent. Whenever the echo
+   comes back we record the difference and send the next one. Every 4 seconds we print p50/p99/p99.9.
+   */
+
+#include <libusockets.h>
+int SSL;
+
+#include "latency.h"
+
+char request[] = "GET / HTTP/1.1\r\n"
+                 "Upgrade: websocket\r\n"
+                 "Connection: Upgrade\r\n"
+                 "Sec-WebSocket-Key: x3JJHMbDL1EzLkh9GBhXDw==\r\n"
+                 "Host: server.example.com\r\n"
+                 "Sec-WebSocket-Version: 13\r\n\r\n";
+char *host;
+int port;
+int connections;
+
+/* The message we send, its first 8 bytes are the send timestamp */
+char *payload;
+int payload_length;
+
+struct histogram round_trips;
+
+struct http_socket {
+    /* How far we have streamed our current frame */
+    char *frame;
+    int offset;
+    int frame_length;
+
+    /* How far we have streamed our upgrade request */
+    int upgrade_offset;
+
+    /* Are we upgraded? */
+    int is_upgraded;
+
+    struct ws_reader reader;
+};
+
+/* We don't need any of these */
+void noop(struct us_loop_t *loop) {
+
+}
+
+void send_message(struct us_socket_t *s) {
+    struct http_socket *http_socket = (struct http_socket *) us_socket_ext(SSL, s);
+
+    /* Every socket frames its own copy as the timestamp differs, whatever is not written now is streamed on writable */
+    uint64_t timestamp = now_ns();
+    memcpy(payload, &timestamp, sizeof(timestamp));
+    http_socket->frame_length = ws_client_frame(http_socket->frame, 2, payload, payload_length);
+    http_socket->offset = us_socket_write(SSL, s, http_socket->frame, http_socket->frame_length, 0);
+}
+
+void on_message(void *user, unsigned char opcode, int compressed, char *data, int length) {
+    struct us_socket_t *s = (struct us_socket_t *) user;
+
+    uint64_t timestamp;
+    if (length < (int) sizeof(timestamp) || compressed) {
+        printf("Unexpected echo, is this an echo server without compression?\n");
+        exit(-1);
+    }
+    memcpy(&timestamp, data, sizeof(timestamp));
+    histogram_record(&round_trips, now_ns() - timestamp);
+
+    send_message(s);
+}
+
+void next_connection(struct us_socket_t *s) {
+    if (--connections) {
+        us_socket_context_connect(SSL, us_socket_context(SSL, s), host, port, 0, sizeof(struct http_socket));
+    } else {
+        printf("Running benchmark now...\n");
+
+        us_socket_timeout(SSL, s, LIBUS_TIMEOUT_GRANULARITY);
+    }
+}
+
+struct us_socket_t *on_http_socket_writable(struct us_socket_t *s) {
+    struct http_socket *http_socket = (struct http_socket *) us_socket_ext(SSL, s);
+
+    /* Are we still not upgraded yet? */
+    if (http_socket->upgrade_offset < sizeof(request) - 1) {
+        http_socket->upgrade_offset += us_socket_write(SSL, s, request + http_socket->upgrade_offset, sizeof(request) - 1 - http_socket->upgrade_offset, 0);
+    } else if (http_socket->offset < http_socket->frame_length) {
+        /* Stream whatever is remaining of the frame */
+        http_socket->offset += us_socket_write(SSL, s, http_socket->frame + http_socket->offset, http_socket->frame_length - http_socket->offset, 0);
+    }
+
+    return s;
+}
+
+struct us_socket_t *on_http_socket_close(struct us_socket_t *s) {
+
+    printf("Client was disconnected, exiting!\n");
+    exit(-1);
+
+    return s;
+}
+
+struct us_socket_t *on_http_socket_end(struct us_socket_t *s) {
+    return us_socket_close(SSL, s);
+}
+
+struct us_socket_t *on_http_socket_data(struct us_socket_t *s, char *data, int length) {
+    struct http_socket *http_socket = (struct http_socket *) us_socket_ext(SSL, s);
+
+    /* Are we already upgraded? */
+    if (http_socket->is_upgraded) {
+        if (!ws_reader_consume(&http_socket->reader, data, length, s, on_message)) {
+            printf("Server sent an invalid frame, exiting!\n");
+            exit(-1);
+        }
+    } else {
+        /* We assume the server is not sending anything immediately following upgrade and that we get rnrn in one chunk */
+        if (length >= 4 && data[length - 1] == '\n' && data[length - 2] == '\r' && data[length - 3] == '\n' && data[length - 4] == '\r') {
+            http_socket->is_upgraded = 1;
+            send_message(s);
+            next_connection(s);
+        }
+    }
+
+    return s;
+}
+
+struct us_socket_t *on_http_socket_open(struct us_socket_t *s, int is_client, char *ip, int ip_length) {
+    struct http_socket *http_socket = (struct http_socket *) us_socket_ext(SSL, s);
+
+    /* Reset state */
+    memset(http_socket, 0, sizeof(struct http_socket));
+    http_socket->frame = malloc(payload_length + 8);
+
+    /* Send an upgrade request */
+    http_socket->upgrade_offset = us_socket_write(SSL, s, request, sizeof(request) - 1, 0);
+
+    return s;
+}
+
+struct us_socket_t *on_http_socket_timeout(struct us_socket_t *s) {
+    /* Print current statistics */
+    histogram_print_and_reset(&round_trips, "Round trip");
+
+    us_socket_timeout(SSL, s, LIBUS_TIMEOUT_GRANULARITY);
+
+    return s;
+}
+
+int main(int argc, char **argv) {
+
+    /* Parse host, port and message size */
+    if (argc != 6) {
+        printf("Usage: connections host port ssl size (size is at least 8 bytes)\n");
+        return 0;
+    }
+
+    port = atoi(argv[3]);
+    host = malloc(strlen(argv[2]) + 1);
+    memcpy(host, argv[2], strlen(argv[2]) + 1);
+    connections = atoi(argv[1]);
+    SSL = atoi(argv[4]);
+    payload_length = atoi(argv[5]);
+    if (payload_length < 8) {
+        payload_length = 8;
+    }
+    if (payload_length > 65535) {
+        payload_length = 65535;
+    }
+
+    payload = calloc(1, payload_length);
+
+    /* Create the event loop */
+    struct us_loop_t *loop = us_create_loop(0, noop, noop, noop, 0);
+
+    /* Create a socket context for HTTP */
+    struct us_socket_context_options_t options = {};
+    struct us_socket_context_t *http_context = us_create_socket_context(SSL, loop, 0, options);
+
+    /* Set up event handlers */
+    us_socket_context_on_open(SSL, http_context, on_http_socket_open);
+    us_socket_context_on_data(SSL, http_context, on_http_socket_data);
+    us_socket_context_on_writable(SSL, http_context, on_http_socket_writable);
+    us_socket_context_on_close(SSL, http_context, on_http_socket_close);
+    us_socket_context_on_timeout(SSL, http_context, on_http_socket_timeout);
+    us_socket_context_on_end(SSL, http_context, on_http_socket_end);
+
+    /* Start making HTTP connections */
+    us_socket_context_connect(SSL, http_context, host, port, 0, sizeof(struct http_socket));
+
+    us_loop_run(loop);
+}
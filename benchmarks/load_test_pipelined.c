@@ -0,0 +1,182 @@
+/* This is a simple yet efficient pipelining HTTP benchmark much like WRK with --pipeline */
+
+#include <libusockets.h>
+int SSL;
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+char request[] = "GET / HTTP/1.1\r\n"
+                 "Host: server.example.com\r\n\r\n";
+
+/* Every response starts with this, we count them as they stream by */
+char response_marker[] = "HTTP/1.1 ";
+
+/* Depth many requests back to back */
+char *pipelined_request;
+int pipelined_request_length;
+
+char *host;
+int port;
+int connections;
+int depth;
+
+int responses;
+
+struct http_socket {
+    /* How far we have streamed our pipelined requests */
+    int offset;
+
+    /* How far into the response marker we are, across reads */
+    int marker_offset;
+
+    /* How many responses we still wait for in this batch */
+    int pending;
+};
+
+/* We don't need any of these */
+void on_wakeup(struct us_loop_t *loop) {
+
+}
+
+void on_pre(struct us_loop_t *loop) {
+
+}
+
+/* This is not HTTP POST, it is merely an event emitted post loop iteration */
+void on_post(struct us_loop_t *loop) {
+
+}
+
+void send_batch(struct us_socket_t *s) {
+    struct http_socket *http_socket = (struct http_socket *) us_socket_ext(SSL, s);
+
+    http_socket->pending = depth;
+    http_socket->offset = us_socket_write(SSL, s, pipelined_request, pipelined_request_length, 0);
+}
+
+void next_connection(struct us_socket_t *s) {
+    if (--connections) {
+        us_socket_context_connect(SSL, us_socket_context(SSL, s), host, port, 0, sizeof(struct http_socket));
+    } else {
+        printf("Running benchmark now with pipelining depth %d...\n", depth);
+
+        us_socket_timeout(SSL, s, LIBUS_TIMEOUT_GRANULARITY);
+    }
+}
+
+struct us_socket_t *on_http_socket_writable(struct us_socket_t *s) {
+    struct http_socket *http_socket = (struct http_socket *) us_socket_ext(SSL, s);
+
+    /* Stream whatever is remaining of the batch */
+    if (http_socket->offset < pipelined_request_length) {
+        http_socket->offset += us_socket_write(SSL, s, pipelined_request + http_socket->offset, pipelined_request_length - http_socket->offset, 0);
+    }
+
+    return s;
+}
+
+struct us_socket_t *on_http_socket_close(struct us_socket_t *s) {
+
+    printf("Closed!\n");
+
+    return s;
+}
+
+struct us_socket_t *on_http_socket_end(struct us_socket_t *s) {
+    return us_socket_close(SSL, s);
+}
+
+struct us_socket_t *on_http_socket_data(struct us_socket_t *s, char *data, int length) {
+    struct http_socket *http_socket = (struct http_socket *) us_socket_ext(SSL, s);
+
+    /* Count responses, the marker may be split over reads */
+    for (int i = 0; i < length; i++) {
+        if (data[i] == response_marker[http_socket->marker_offset]) {
+            if (++http_socket->marker_offset == sizeof(response_marker) - 1) {
+                http_socket->marker_offset = 0;
+                http_socket->pending--;
+            }
+        } else {
+            /* The first character of the marker never repeats within it */
+            http_socket->marker_offset = data[i] == response_marker[0];
+        }
+    }
+
+    /* Send the next batch once we have all responses of this one */
+    if (http_socket->pending <= 0) {
+        responses += depth;
+        send_batch(s);
+    }
+
+    return s;
+}
+
+struct us_socket_t *on_http_socket_open(struct us_socket_t *s, int is_client, char *ip, int ip_length) {
+    struct http_socket *http_socket = (struct http_socket *) us_socket_ext(SSL, s);
+
+    /* Reset state */
+    http_socket->marker_offset = 0;
+
+    send_batch(s);
+    next_connection(s);
+
+    return s;
+}
+
+struct us_socket_t *on_http_socket_timeout(struct us_socket_t *s) {
+    /* Print current statistics */
+    printf("Req/sec: %f\n", ((float)responses) / LIBUS_TIMEOUT_GRANULARITY);
+
+    responses = 0;
+    us_socket_timeout(SSL, s, LIBUS_TIMEOUT_GRANULARITY);
+
+    return s;
+}
+
+int main(int argc, char **argv) {
+
+    /* Parse host, port and depth */
+    if (argc != 6) {
+        printf("Usage: connections host port ssl depth (try depth 1, 16 and 64)\n");
+        return 0;
+    }
+
+    port = atoi(argv[3]);
+    host = malloc(strlen(argv[2]) + 1);
+    memcpy(host, argv[2], strlen(argv[2]) + 1);
+    connections = atoi(argv[1]);
+    SSL = atoi(argv[4]);
+    depth = atoi(argv[5]);
+    if (depth < 1) {
+        depth = 1;
+    }
+
+    /* Lay out all requests of a batch back to back */
+    pipelined_request_length = (sizeof(request) - 1) * depth;
+    pipelined_request = malloc(pipelined_request_length);
+    for (int i = 0; i < depth; i++) {
+        memcpy(pipelined_request + i * (sizeof(request) - 1), request, sizeof(request) - 1);
+    }
+
+    /* Create the event loop */
+    struct us_loop_t *loop = us_create_loop(0, on_wakeup, on_pre, on_post, 0);
+
+    /* Create a socket context for HTTP */
+    struct us_socket_context_options_t options = {};
+    struct us_socket_context_t *http_context = us_create_socket_context(SSL, loop, 0, options);
+
+    /* Set up event handlers */
+    us_socket_context_on_open(SSL, http_context, on_http_socket_open);
+    us_socket_context_on_data(SSL, http_context, on_http_socket_data);
+    us_socket_context_on_writable(SSL, http_context, on_http_socket_writable);
+    us_socket_context_on_close(SSL, http_context, on_http_socket_close);
+    us_socket_context_on_timeout(SSL, http_context, on_http_socket_timeout);
+    us_socket_context_on_end(SSL, http_context, on_http_socket_end);
+
+    /* Start making HTTP connections */
+    us_socket_context_connect(SSL, http_context, host, port, 0, sizeof(struct http_socket));
+
+    us_loop_run(loop);
+}
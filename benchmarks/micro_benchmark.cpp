@@ -0,0 +1,563 @@
+/* In-process micro benchmarks of the parsers, the router and the pub/sub tree, no sockets involved.
+ * Every case reports time and heap allocations per operation, pass a substring to only run matching cases */
+
+#include <libusockets.h>
+#include "HttpParser.h"
+#include "HttpRouter.h"
+#include "WebSocketProtocol.h"
+#include "WebSocketHandshake.h"
+#include "WebSocketExtensions.h"
+#include "TopicTreeDraft.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cmath>
+#include <string>
+#include <vector>
+#include <new>
+
+/* Heap allocations made so far. On glibc we interpose malloc itself since the pub/sub tree
+ * and the slab allocator bypass operator new, elsewhere we can only count operator new */
+static size_t allocations = 0;
+
+#if defined(__GLIBC__)
+extern "C" {
+void *__libc_malloc(size_t size);
+void *__libc_calloc(size_t count, size_t size);
+void *__libc_realloc(void *ptr, size_t size);
+
+void *malloc(size_t size) {
+    allocations++;
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t count, size_t size) {
+    allocations++;
+    return __libc_calloc(count, size);
+}
+
+void *realloc(void *ptr, size_t size) {
+    allocations++;
+    return __libc_realloc(ptr, size);
+}
+}
+#else
+void *operator new(size_t size) {
+    allocations++;
+    if (void *p = std::malloc(size ? size : 1)) {
+        return p;
+    }
+    throw std::bad_alloc();
+}
+
+void operator delete(void *p) noexcept {
+    std::free(p);
+}
+
+void operator delete(void *p, size_t) noexcept {
+    std::free(p);
+}
+#endif
+
+static const char *filter = nullptr;
+
+static bool selected(const char *name) {
+    return !filter || strstr(name, filter);
+}
+
+/* Calls f (which performs opsPerCall operations) until enough time has passed, then prints per operation figures.
+ * Returns seconds per operation, 0 if not selected */
+template <typename F>
+double measure(const char *name, size_t opsPerCall, F f) {
+    if (!selected(name)) {
+        return 0;
+    }
+
+    /* Warm up caches and any lazily built state outside of the measurement */
+    f();
+
+    size_t calls = 0, allocationsBefore = allocations;
+    auto start = std::chrono::high_resolution_clock::now();
+    double seconds;
+    do {
+        for (int i = 0; i < 16; i++) {
+            f();
+        }
+        calls += 16;
+        seconds = std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - start).count();
+    } while (seconds < 0.5);
+
+    double ops = (double) calls * opsPerCall;
+    printf("%-44s %10.1f ns/op %10.3f allocs/op\n", name, seconds * 1e9 / ops, (double) (allocations - allocationsBefore) / ops);
+    return seconds / ops;
+}
+
+/* Deterministic xorshift so that every run measures the very same inputs */
+static uint64_t prngState = 0x9e3779b97f4a7c15;
+static uint64_t prng() {
+    prngState ^= prngState << 13;
+    prngState ^= prngState >> 7;
+    prngState ^= prngState << 17;
+    return prngState;
+}
+
+/* Picks ranks 0..n-1 with Zipf distributed popularity, which is what real topics and urls look like */
+struct Zipf {
+    std::vector<double> cdf;
+
+    Zipf(size_t n, double s = 1.0) {
+        double sum = 0;
+        for (size_t i = 1; i <= n; i++) {
+            cdf.push_back(sum += 1.0 / std::pow((double) i, s));
+        }
+        for (double &c : cdf) {
+            c /= sum;
+        }
+    }
+
+    size_t operator()() {
+        double u = (double) (prng() >> 11) / (double) (1ull << 53);
+        return std::min<size_t>(std::lower_bound(cdf.begin(), cdf.end(), u) - cdf.begin(), cdf.size() - 1);
+    }
+};
+
+/* What a browser sends, give or take a header */
+static std::string browserRequest(std::string_view url) {
+    return "GET " + std::string(url) + " HTTP/1.1\r\n"
+           "Host: server.example.com\r\n"
+           "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:78.0) Gecko/20100101 Firefox/78.0\r\n"
+           "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,image/webp,*/*;q=0.8\r\n"
+           "Accept-Language: en-US,en;q=0.5\r\n"
+           "Accept-Encoding: gzip, deflate, br\r\n"
+           "Connection: keep-alive\r\n"
+           "Cookie: session=3f2a9c1e7b5d4f6a8c0e2b4d6f8a0c2e; theme=dark\r\n"
+           "Upgrade-Insecure-Requests: 1\r\n\r\n";
+}
+
+static void benchmarkHttpParser() {
+    const int requestsPerBatch = 32;
+    std::string batch;
+    for (int i = 0; i < requestsPerBatch; i++) {
+        batch += browserRequest("/api/v1/users/" + std::to_string(i) + "/posts?limit=20&offset=40");
+    }
+
+    /* The parser wants some writable padding past the end of every read */
+    std::vector<char> padded(batch.length() + uWS::MINIMUM_HTTP_POST_PADDING * 2);
+    memcpy(padded.data(), batch.data(), batch.length());
+
+    int requests = 0;
+    auto onRequest = [&requests](void *user, uWS::HttpRequest *req) -> void * {
+        requests += req->getHeader("host").length() != 0;
+        return user;
+    };
+    auto onData = [](void *user, std::string_view, bool) -> void * {
+        return user;
+    };
+    auto onError = [](void *user) -> void * {
+        printf("HttpParser failed!\n");
+        exit(1);
+        return user;
+    };
+
+    uWS::HttpParser parser;
+    measure("HttpParser pipelined, one read", requestsPerBatch, [&]() {
+        parser.consumePostPadded(padded.data(), (int) batch.length(), &parser, onRequest, onData, onError);
+    });
+
+    /* Same requests cut at segment size, so that most of them straddle two reads and go through the fallback buffer */
+    const int mss = 1448;
+    std::vector<char> chunk(mss + uWS::MINIMUM_HTTP_POST_PADDING);
+    measure("HttpParser pipelined, 1448 byte reads", requestsPerBatch, [&]() {
+        for (size_t offset = 0; offset < batch.length(); offset += mss) {
+            int length = (int) std::min<size_t>(mss, batch.length() - offset);
+            memcpy(chunk.data(), batch.data() + offset, length);
+            parser.consumePostPadded(chunk.data(), length, &parser, onRequest, onData, onError);
+        }
+    });
+}
+
+/* What an async handler keeps of a request: all of it copied out by hand, or pinned */
+static void benchmarkHttpRequestPin() {
+    std::string request = browserRequest("/api/v1/users/42/posts?limit=20&offset=40");
+    std::vector<char> padded(request.length() + uWS::MINIMUM_HTTP_POST_PADDING);
+
+    auto onData = [](void *user, std::string_view, bool) -> void * {
+        return user;
+    };
+    auto onError = [](void *user) -> void * {
+        printf("HttpParser failed!\n");
+        exit(1);
+        return user;
+    };
+
+    /* Every read is parsed anew, as the parser lowercases header keys in place */
+    uWS::HttpParser parser;
+    auto parse = [&](auto &onRequest) {
+        memcpy(padded.data(), request.data(), request.length());
+        parser.consumePostPadded(padded.data(), (int) request.length(), &parser, onRequest, onData, onError);
+    };
+
+    size_t kept = 0;
+    std::string url, query;
+    std::vector<std::pair<std::string, std::string>> headers;
+    auto copyOut = [&](void *user, uWS::HttpRequest *req) -> void * {
+        url = std::string(req->getUrl());
+        query = std::string(req->getQuery());
+        headers.clear();
+        for (auto [key, value] : *req) {
+            headers.emplace_back(key, value);
+        }
+        kept += headers.size();
+        return user;
+    };
+    measure("HttpRequest kept by copying out headers", 1, [&]() {
+        parse(copyOut);
+    });
+
+    uWS::HttpRequestArena arena;
+    auto pin = [&](void *user, uWS::HttpRequest *req) -> void * {
+        kept += arena.pin(req)->getHeader(uWS::HttpRequest::HOST).length();
+        return user;
+    };
+    measure("HttpRequest kept by pinning into an arena", 1, [&]() {
+        parse(pin);
+    });
+
+    if (!kept) {
+        printf("HttpRequest kept nothing!\n");
+    }
+}
+
+static void benchmarkWebSocketHandshake() {
+    char key[24], accept[28];
+    memcpy(key, "dGhlIHNhbXBsZSBub25jZQ==", 24);
+    measure("WebSocketHandshake accept key", 1, [&]() {
+        uWS::WebSocketHandshake::generate(key, accept);
+        /* Every key differs, like they would */
+        key[accept[0] & 15] = accept[27 - (accept[1] & 7)];
+    });
+
+    /* A reconnect storm: browsers upgrading with permessage-deflate, parsed, negotiated and answered up to what the socket would write */
+    const int requestsPerBatch = 32;
+    std::string batch;
+    for (int i = 0; i < requestsPerBatch; i++) {
+        batch += "GET /ws HTTP/1.1\r\n"
+                 "Host: server.example.com\r\n"
+                 "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:78.0) Gecko/20100101 Firefox/78.0\r\n"
+                 "Origin: https://server.example.com\r\n"
+                 "Connection: keep-alive, Upgrade\r\n"
+                 "Upgrade: websocket\r\n"
+                 "Sec-WebSocket-Version: 13\r\n"
+                 "Sec-WebSocket-Extensions: permessage-deflate; client_max_window_bits\r\n"
+                 "Sec-WebSocket-Key: " + std::string(key, 22).replace(0, 2, std::to_string(10 + i)) + "==\r\n"
+                 "Pragma: no-cache\r\n\r\n";
+    }
+
+    std::vector<char> padded(batch.length() + uWS::MINIMUM_HTTP_POST_PADDING * 2);
+    std::vector<char> response(4096);
+    size_t answered = 0;
+    auto onRequest = [&](void *user, uWS::HttpRequest *req) -> void * {
+        std::string_view secWebSocketKey = req->getHeader(uWS::HttpRequest::SEC_WEBSOCKET_KEY);
+        if (secWebSocketKey.length() != 24) {
+            printf("WebSocket upgrade failed!\n");
+            exit(1);
+        }
+
+        /* What TemplatedApp::ws writes, minus the socket */
+        char *out = response.data();
+        memcpy(out, "HTTP/1.1 ", 9);
+        uWS::WebSocketHandshake::generateUpgradeStatus(secWebSocketKey.data(), out + 9);
+        out += 9 + uWS::WebSocketHandshake::UPGRADE_STATUS_LENGTH;
+
+        uWS::ExtensionsNegotiator<true> extensionsNegotiator(uWS::PERMESSAGE_DEFLATE | uWS::CLIENT_NO_CONTEXT_TAKEOVER | uWS::SERVER_NO_CONTEXT_TAKEOVER);
+        extensionsNegotiator.readOffer(req->getHeader("sec-websocket-extensions"));
+        std::string offer = extensionsNegotiator.generateOffer();
+        memcpy(out, "\r\nSec-WebSocket-Extensions: ", 28);
+        memcpy(out + 28, offer.data(), offer.length());
+        memcpy(out + 28 + offer.length(), "\r\n\r\n", 4);
+
+        answered++;
+        return user;
+    };
+    auto onData = [](void *user, std::string_view, bool) -> void * {
+        return user;
+    };
+    auto onError = [](void *user) -> void * {
+        printf("HttpParser failed!\n");
+        exit(1);
+        return user;
+    };
+
+    uWS::HttpParser parser;
+    double seconds = measure("WebSocket upgrade, request to 101 head", requestsPerBatch, [&]() {
+        memcpy(padded.data(), batch.data(), batch.length());
+        parser.consumePostPadded(padded.data(), (int) batch.length(), &parser, onRequest, onData, onError);
+    });
+    if (seconds) {
+        printf("%-44s %10.0f upgrades/s/core\n", "WebSocket upgrade throughput", 1 / seconds);
+    }
+}
+
+struct WebSocketImpl {
+    static inline size_t messages = 0;
+
+    static bool refusePayloadLength(uint64_t length, uWS::WebSocketState<true> *wState, void *s) {
+        return length > 16 * 1024;
+    }
+
+    static bool setCompressed(uWS::WebSocketState<true> *wState, void *s) {
+        return true;
+    }
+
+    static void forceClose(uWS::WebSocketState<true> *wState, void *s) {
+        printf("WebSocketProtocol failed!\n");
+        exit(1);
+    }
+
+    static bool handleFragment(char *data, size_t length, unsigned int remainingBytes, int opCode, bool fin, uWS::WebSocketState<true> *webSocketState, void *s) {
+        messages += fin && !remainingBytes;
+        return false;
+    }
+};
+
+/* A masked, client to server frame */
+static std::string clientFrame(unsigned char opCode, std::string_view payload) {
+    std::string frame(1, (char) (128 | opCode));
+    if (payload.length() < 126) {
+        frame += (char) (128 | payload.length());
+    } else {
+        frame += (char) (128 | 126);
+        frame += (char) (payload.length() >> 8);
+        frame += (char) (payload.length() & 255);
+    }
+    char mask[4] = {0x12, 0x34, 0x56, 0x78};
+    frame.append(mask, 4);
+    for (size_t i = 0; i < payload.length(); i++) {
+        frame += payload[i] ^ mask[i % 4];
+    }
+    return frame;
+}
+
+static void benchmarkWebSocketProtocol() {
+    std::string json = "{\"type\":\"chat\",\"room\":\"lobby\",\"text\":\"Hello there, how are you?\",\"id\":";
+    for (auto [name, payload] : {std::pair<const char *, std::string>{"WebSocketProtocol 80 byte text frames", json + "1234567890123}"},
+                                 {"WebSocketProtocol 1 kB binary frames", std::string(1024, 'x')},
+                                 {"WebSocketProtocol 8 kB binary frames", std::string(8192, 'x')}}) {
+        /* A full receive buffer worth of frames */
+        std::string frames;
+        while (frames.length() < 256 * 1024) {
+            frames += clientFrame(payload[0] == '{' ? uWS::TEXT : uWS::BINARY, payload);
+        }
+        size_t framesPerBatch = frames.length() / clientFrame(uWS::BINARY, payload).length();
+
+        /* Unmasking happens in place, so every round starts over from a pristine copy (included in the figure) */
+        std::vector<char> buffer(frames.length() + 32);
+        uWS::WebSocketState<true> state;
+        measure(name, framesPerBatch, [&]() {
+            memcpy(buffer.data(), frames.data(), frames.length());
+            uWS::WebSocketProtocol<true, WebSocketImpl>::consume(buffer.data(), (unsigned int) frames.length(), &state, nullptr);
+        });
+    }
+}
+
+static void benchmarkHttpRouter() {
+    /* Something like the API of a forum, with static files and a catch-all */
+    const char *patterns[] = {
+        "/", "/favicon.ico", "/robots.txt", "/static/*", "/assets/css/*", "/assets/js/*",
+        "/login", "/logout", "/register", "/search", "/about", "/contact",
+        "/api/v1/users", "/api/v1/users/:id", "/api/v1/users/:id/posts", "/api/v1/users/:id/posts/:post",
+        "/api/v1/users/:id/followers", "/api/v1/users/:id/following", "/api/v1/users/:id/avatar",
+        "/api/v1/posts", "/api/v1/posts/:id", "/api/v1/posts/:id/comments", "/api/v1/posts/:id/comments/:comment",
+        "/api/v1/posts/:id/likes", "/api/v1/tags", "/api/v1/tags/:tag", "/api/v1/tags/:tag/posts",
+        "/api/v1/notifications", "/api/v1/notifications/:id", "/api/v1/settings", "/api/v1/settings/:section",
+        "/api/v2/users/:id", "/api/v2/posts/:id", "/api/v2/feed", "/api/v2/feed/:cursor",
+        "/admin", "/admin/users", "/admin/users/:id", "/admin/reports", "/admin/reports/:id",
+        "/ws", "/metrics", "/health", "/*"
+    };
+
+    uWS::HttpRouter<int> router;
+    for (const char *pattern : patterns) {
+        for (const char *method : {"get", "post"}) {
+            router.add(method, pattern, [](int &handled, auto) {
+                handled++;
+                return true;
+            });
+        }
+    }
+
+    /* Hits follow popularity, with a tail running into the catch-all */
+    std::vector<std::string> urls = {
+        "/api/v1/posts/1234", "/static/js/app.4f3a2c.js", "/api/v1/users/alex/posts", "/",
+        "/api/v2/feed/eyJvZmZzZXQiOjQwfQ", "/api/v1/posts/1234/comments", "/favicon.ico", "/ws",
+        "/api/v1/users/alex", "/api/v1/notifications", "/assets/css/site.css", "/api/v1/tags/cpp/posts",
+        "/api/v1/posts/99/comments/7", "/login", "/health", "/metrics", "/search",
+        "/admin/users/42", "/api/v1/users/alex/followers", "/does/not/exist/anywhere"
+    };
+    Zipf zipf(urls.size());
+    std::vector<std::string_view> sequence;
+    for (int i = 0; i < 1024; i++) {
+        sequence.push_back(urls[zipf()]);
+    }
+
+    int handled = 0;
+    int getId = router.getMethodId("get");
+    measure("HttpRouter 88 routes, popular urls", sequence.size(), [&]() {
+        for (std::string_view url : sequence) {
+            router.route(getId, url, handled);
+        }
+    });
+
+    /* Only what is looked up by string, like a request would present it */
+    measure("HttpRouter 88 routes, method by name", sequence.size(), [&]() {
+        for (std::string_view url : sequence) {
+            router.route("get", url, handled);
+        }
+    });
+}
+
+static void benchmarkTopicTree() {
+    /* Chat rooms: a few are huge, most are tiny. Some subscribers follow every room of a category */
+    const int numSubscribers = 10000, numRooms = 1000, roomsPerSubscriber = 5, publishesPerDrain = 256;
+
+    size_t deliveries = 0;
+    uWS::TopicTree topicTree([&deliveries](uWS::Subscriber *s, std::pair<size_t, std::string_view *> messages) {
+        deliveries += messages.first;
+        return 0;
+    });
+
+    std::vector<std::string> rooms;
+    for (int i = 0; i < numRooms; i++) {
+        rooms.push_back("chat/" + std::to_string(i % 10) + "/room" + std::to_string(i));
+    }
+
+    Zipf roomPopularity(numRooms);
+    std::vector<uWS::Subscriber *> subscribers;
+    for (int i = 0; i < numSubscribers; i++) {
+        uWS::Subscriber *s = new uWS::Subscriber(nullptr);
+        for (int j = 0; j < roomsPerSubscriber; j++) {
+            topicTree.subscribe(rooms[roomPopularity()], s);
+        }
+        if (i % 100 == 0) {
+            topicTree.subscribe("chat/" + std::to_string(i % 10) + "/#", s);
+        }
+        subscribers.push_back(s);
+    }
+
+    std::vector<std::string_view> sequence;
+    for (int i = 0; i < publishesPerDrain; i++) {
+        sequence.push_back(rooms[roomPopularity()]);
+    }
+
+    std::string message = "{\"type\":\"chat\",\"user\":\"alexhultman\",\"text\":\"Hello there, how are you?\"}";
+    measure("TopicTree publish + drain, zipf rooms", sequence.size(), [&]() {
+        for (std::string_view room : sequence) {
+            topicTree.publish(room, message);
+        }
+        topicTree.drain();
+    });
+
+    /* Per delivered message rather than per publish */
+    size_t deliveriesBefore = deliveries;
+    for (std::string_view room : sequence) {
+        topicTree.publish(room, message);
+    }
+    topicTree.drain();
+    if (selected("TopicTree fanout")) {
+        printf("%-44s %10.1f deliveries/publish\n", "TopicTree fanout", (double) (deliveries - deliveriesBefore) / sequence.size());
+    }
+
+    for (uWS::Subscriber *s : subscribers) {
+        topicTree.unsubscribeAll(s);
+        delete s;
+    }
+}
+
+static void benchmarkTopicTreeChurn() {
+    /* A client resubscribing to 200 market topics after a reconnect, and later dropping them all */
+    uWS::TopicTree topicTree([](uWS::Subscriber *s, std::pair<size_t, std::string_view *> messages) {
+        return 0;
+    });
+
+    std::vector<std::string> topics;
+    for (int i = 0; i < 100; i++) {
+        topics.push_back("market/" + std::to_string(1000 + i * 37) + "/trades");
+        topics.push_back("market/" + std::to_string(1000 + i * 37) + "/book");
+    }
+    std::vector<std::string_view> views(topics.begin(), topics.end());
+
+    /* Others keep the markets alive, like they would be on a real server */
+    uWS::Subscriber other(nullptr);
+    topicTree.subscribe({views.size(), views.data()}, &other);
+
+    uWS::Subscriber subscriber(nullptr);
+    measure("TopicTree subscribe 200 one by one", views.size(), [&]() {
+        for (std::string_view topic : views) {
+            topicTree.subscribe(topic, &subscriber);
+        }
+        topicTree.unsubscribeAll(&subscriber);
+        topicTree.trim();
+    });
+
+    measure("TopicTree subscribe 200 in bulk", views.size(), [&]() {
+        topicTree.subscribe({views.size(), views.data()}, &subscriber);
+        topicTree.unsubscribeAll(&subscriber);
+        topicTree.trim();
+    });
+
+    topicTree.unsubscribeAll(&other);
+}
+
+static void benchmarkTopicTreeWide() {
+    /* One topic per user like user/<id>/notifications, which is all about finding the topic */
+    const int numUsers = 500000, publishesPerDrain = 256;
+    if (!selected("TopicTree publish + drain, 500k")) {
+        return;
+    }
+
+    uWS::TopicTree topicTree([](uWS::Subscriber *s, std::pair<size_t, std::string_view *> messages) {
+        return 0;
+    });
+
+    std::vector<std::string> topics;
+    std::vector<uWS::Subscriber *> subscribers;
+    for (int i = 0; i < numUsers; i++) {
+        topics.push_back("user/" + std::to_string(prng() % 100000000) + "/notifications");
+        subscribers.push_back(new uWS::Subscriber(nullptr));
+        topicTree.subscribe(topics.back(), subscribers.back());
+    }
+
+    std::vector<std::string_view> sequence;
+    for (int i = 0; i < publishesPerDrain; i++) {
+        sequence.push_back(topics[prng() % numUsers]);
+    }
+
+    std::string message = "{\"type\":\"mention\",\"from\":\"alexhultman\",\"post\":1234567}";
+    measure("TopicTree publish + drain, 500k user topics", sequence.size(), [&]() {
+        for (std::string_view topic : sequence) {
+            topicTree.publish(topic, message);
+        }
+        topicTree.drain();
+    });
+
+    for (uWS::Subscriber *s : subscribers) {
+        topicTree.unsubscribeAll(s);
+        delete s;
+    }
+}
+
+int main(int argc, char **argv) {
+    if (argc > 1) {
+        filter = argv[1];
+    }
+
+    benchmarkHttpParser();
+    benchmarkHttpRequestPin();
+    benchmarkWebSocketHandshake();
+    benchmarkWebSocketProtocol();
+    benchmarkHttpRouter();
+    benchmarkTopicTree();
+    benchmarkTopicTreeChurn();
+    benchmarkTopicTreeWide();
+}
@@ -0,0 +1,48 @@
+/* Compares UTF-8 validation of TEXT payloads, vectorized versus scalar */
+
+#include <libusockets.h>
+#include "WebSocketProtocol.h"
+
+#include <chrono>
+#include <cstdio>
+#include <string>
+
+/* Returns MB/s */
+template <typename F>
+double measure(F validate, std::string &text, int runs) {
+    auto start = std::chrono::high_resolution_clock::now();
+    int valid = 0;
+    for (int i = 0; i < runs; i++) {
+        /* Make the compiler forget what it knows about text so that it cannot hoist the call */
+        asm volatile("" : : "r" (text.data()) : "memory");
+        valid += validate((unsigned char *) text.data(), text.length());
+    }
+    double seconds = std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - start).count();
+    if (valid != runs) {
+        printf("Validation failed!\n");
+    }
+    return (double) text.length() * runs / seconds / 1e6;
+}
+
+int main() {
+    /* JSON-like messages, pure ASCII and with frequent CJK user names */
+    std::string ascii, mixed;
+    while (ascii.length() < 64 * 1024) {
+        ascii += "{\"user\":\"alexhultman\",\"message\":\"Hello there, how are you?\",\"id\":1234567},";
+        mixed += "{\"user\":\"\xe5\xb1\xb1\xe7\x94\xb0\xe5\xa4\xaa\xe9\x83\x8e\",\"message\":\"\xe3\x81\x93\xe3\x82\x93\xe3\x81\xab\xe3\x81\xa1\xe3\x81\xaf, caf\xc3\xa9 \xf0\x9f\x98\x80\",\"id\":1234567},";
+    }
+
+    for (size_t size : {64, 512, 4096, 65536}) {
+        std::string a = ascii.substr(0, size), m = mixed.substr(0, size);
+        /* Don't cut in the middle of a sequence */
+        while ((m.back() & 0xc0) == 0x80 || (m.back() & 0x80)) {
+            m.pop_back();
+        }
+
+        int runs = (int) (200 * 1024 * 1024 / size);
+        printf("%6zu bytes ASCII: scalar %8.0f MB/s, vectorized %8.0f MB/s\n", size,
+               measure(uWS::protocol::isValidUtf8Scalar, a, runs), measure(uWS::protocol::isValidUtf8, a, runs));
+        printf("%6zu bytes mixed: scalar %8.0f MB/s, vectorized %8.0f MB/s\n", size,
+               measure(uWS::protocol::isValidUtf8Scalar, m, runs), measure(uWS::protocol::isValidUtf8, m, runs));
+    }
+}
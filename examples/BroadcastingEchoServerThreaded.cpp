@@ -0,0 +1,51 @@
+#include "MultiApp.h"
+#include <thread>
+
+int main() {
+    /* ws->getUserData returns one of these */
+    struct PerSocketData {
+
+    };
+
+    /* One pub/sub space shared by all threads */
+    uWS::Hub hub;
+
+    /* Broadcasting echo server, one App per core */
+    uWS::MultiApp().routes([&hub](uWS::App &app) {
+
+        app.join(hub).ws<PerSocketData>("/*", {
+            /* Settings */
+            .compression = uWS::SHARED_COMPRESSOR,
+            .maxPayloadLength = 16 * 1024,
+            .idleTimeout = 10,
+            .maxBackpressure = 1 * 1024 * 1204,
+            /* Handlers */
+            .open = [](auto *ws, auto *req) {
+                ws->subscribe("broadcast");
+            },
+            .message = [&hub](auto *ws, std::string_view message, uWS::OpCode opCode) {
+                /* Reaches subscribers of every thread, not only ours */
+                hub.publish("broadcast", message, opCode);
+            },
+            .drain = [](auto *ws) {
+                /* Check getBufferedAmount here */
+            },
+            .ping = [](auto *ws) {
+
+            },
+            .pong = [](auto *ws) {
+
+            },
+            .close = [](auto *ws, int code, std::string_view message) {
+                /* We automatically unsubscribe from any topic here */
+            }
+        });
+
+    }).listen(9001, [](auto *token) {
+        if (token) {
+            std::cout << "Thread " << std::this_thread::get_id() << " listening on port " << 9001 << std::endl;
+        } else {
+            std::cout << "Thread " << std::this_thread::get_id() << " failed to listen on port 9001" << std::endl;
+        }
+    }).run();
+}
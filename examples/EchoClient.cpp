@@ -0,0 +1,37 @@
+/* We simply call the root header file "App.h", giving you uWS::App and uWS::SSLApp */
+#include "App.h"
+
+/* This is a simple WebSocket client example, keeping a few connections to the EchoServer example open.
+ * You may compile it with "WITH_OPENSSL=1 make" or with "make" */
+
+int main() {
+    /* ws->getUserData returns one of these */
+    struct PerSocketData {
+        /* Fill with user data */
+    };
+
+    /* Connections are made as soon as we have a pool, and replaced as they drop */
+    uWS::SSLApp().wsClient<PerSocketData>("localhost", 9001, "/", {
+        /* Settings */
+        .connections = 4,
+        .reconnectDelay = 1000,
+        .maxReconnectDelay = 30000,
+        .maxPayloadLength = 16 * 1024,
+        .idleTimeout = 10,
+        /* Handlers */
+        .open = [](auto *ws) {
+            /* Open event here, you may access ws->getUserData() which points to a PerSocketData struct */
+            ws->send("Hello!", uWS::OpCode::TEXT);
+        },
+        .message = [](auto *ws, std::string_view message, uWS::OpCode opCode) {
+            /* Echoes of the echoes, our frames are masked as clients have to */
+            ws->send(message, opCode);
+        },
+        .drain = [](auto *ws) {
+            /* Check ws->getBufferedAmount() here */
+        },
+        .close = [](auto *ws, int code, std::string_view message) {
+            /* A replacement is on its way */
+        }
+    }).run();
+}
@@ -34,10 +34,10 @@ int main() {
             /* Check ws->getBufferedAmount() here */
         },
         .ping = [](auto *ws) {
-            /* Not implemented yet */
+            /* Pings are answered for you, this is just a sign of life */
         },
         .pong = [](auto *ws) {
-            /* Not implemented yet */
+            /* Idle sockets are pinged automatically, ws->getRoundTripTime() holds how long the last one took */
         },
         .close = [](auto *ws, int code, std::string_view message) {
             /* You may access ws->getUserData() here */
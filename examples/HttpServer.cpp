@@ -1,11 +1,7 @@
 /* This is a simple HTTP(S) web server much like Python's SimpleHTTPServer */
 
 #include <App.h>
-
-/* Helpers for this example */
-#include "helpers/AsyncFileReader.h"
-#include "helpers/AsyncFileStreamer.h"
-#include "helpers/Middleware.h"
+#include <StaticFileCache.h>
 
 /* optparse */
 #define OPTPARSE_IMPLEMENTATION
@@ -60,15 +56,17 @@ int main(int argc, char **argv) {
         goto fail;
     }
 
-    AsyncFileStreamer asyncFileStreamer(root);
+    /* Files are sent with sendfile over HTTP and from mappings over HTTPS */
+    uWS::StaticFileCache staticFileCache(root);
 
     /* Either serve over HTTP or HTTPS */
     struct us_socket_context_options_t empty_ssl_options = {};
     if (memcmp(&ssl_options, &empty_ssl_options, sizeof(empty_ssl_options))) {
         /* HTTPS */
-        uWS::SSLApp(ssl_options).get("/*", [&asyncFileStreamer](auto *res, auto *req) {
-            serveFile(res, req);
-            asyncFileStreamer.streamFile(res, req->getUrl());
+        uWS::SSLApp(ssl_options).get("/*", [&staticFileCache](auto *res, auto *req) {
+            if (!staticFileCache.serve(res, req)) {
+                res->writeStatus("404 Not Found")->end("Not found");
+            }
         }).listen(port, [port, root](auto *token) {
             if (token) {
                 std::cout << "Serving " << root << " over HTTPS a " << port << std::endl;
@@ -76,9 +74,10 @@ int main(int argc, char **argv) {
         }).run();
     } else {
         /* HTTP */
-        uWS::App().get("/*", [&asyncFileStreamer](auto *res, auto *req) {
-            serveFile(res, req);
-            asyncFileStreamer.streamFile(res, req->getUrl());
+        uWS::App().get("/*", [&staticFileCache](auto *res, auto *req) {
+            if (!staticFileCache.serve(res, req)) {
+                res->writeStatus("404 Not Found")->end("Not found");
+            }
         }).listen(port, [port, root](auto *token) {
             if (token) {
                 std::cout << "Serving " << root << " over HTTP a " << port << std::endl;
@@ -24,6 +24,7 @@
 #include "HttpContext.h"
 #include "HttpResponse.h"
 #include "WebSocketContext.h"
+#include "WebSocketClientContext.h"
 #include "WebSocket.h"
 #include "WebSocketExtensions.h"
 #include "WebSocketHandshake.h"
@@ -46,6 +47,10 @@ private:
     /* The app always owns at least one http context, but creates websocket contexts on demand */
     HttpContext<SSL> *httpContext;
     std::vector<WebSocketContext<SSL, true> *> webSocketContexts;
+    std::vector<WebSocketClientContext<SSL> *> webSocketClientContexts;
+
+    /* The Hub our websocket contexts join, if any */
+    Hub *hub = nullptr;
 
 public:
 
@@ -59,11 +64,110 @@ public:
         httpContext->use(std::move(handler));
     }
 
-    /* Publishes a message to all websocket contexts */
-    void publish(std::string_view topic, std::string_view message, OpCode opCode, bool compress = false) {
+    /* Sets the largest request head we accept, heads split across reads are buffered up to this */
+    TemplatedApp &&maxHeaderSize(unsigned int maxHeaderSize) {
+        httpContext->setMaxHeaderSize(maxHeaderSize);
+        return std::move(*this);
+    }
+
+    /* Publishes a message to all websocket contexts, retained ones are also sent to later subscribers of the topic */
+    void publish(std::string_view topic, std::string_view message, OpCode opCode, bool compress = false, bool retain = false) {
+        if (!webSocketContexts.size()) {
+            return;
+        }
+
+        /* Framed and compressed once for all contexts, each tree takes over one reference */
+        SharedMessage *sharedMessage = WebSocketContextData<SSL>::frame((LoopData *) us_loop_ext((us_loop_t *) Loop::get()), message, opCode, compress);
+        for (auto *webSocketContext : webSocketContexts) {
+            webSocketContext->getExt()->topicTree.publish(topic, sharedMessage->ref(), retain);
+        }
+        sharedMessage->unref();
+    }
+
+    /* Forgets the retained message of a topic in all websocket contexts */
+    void clearRetained(std::string_view topic) {
+        for (auto *webSocketContext : webSocketContexts) {
+            webSocketContext->getExt()->topicTree.clearRetained(topic);
+        }
+    }
+
+    /* Sets what lagging subscribers of this topic (or pattern, exactly as subscribed to) get in all websocket contexts.
+     * DROP skips them until they drain, CONFLATE sends them only the latest message once they drain, BUFFER is the default */
+    void setSlowConsumerPolicy(std::string_view topic, SlowConsumerPolicy policy) {
+        for (auto *webSocketContext : webSocketContexts) {
+            webSocketContext->getExt()->topicTree.setPolicy(topic, policy);
+        }
+    }
+
+    /* Joins all current and future websocket contexts to this Hub, so that
+     * hub.publish from any thread reaches the subscribers of this App */
+    TemplatedApp &&join(Hub &hub) {
+        this->hub = &hub;
         for (auto *webSocketContext : webSocketContexts) {
-            webSocketContext->getExt()->publish(topic, message, opCode, compress);
+            hub.join(&webSocketContext->getExt()->hubQueue);
         }
+        return std::move(*this);
+    }
+
+    /* Moves a WebSocket to the same route of another App (registered in the same order), on that App's loop and thread.
+     * Only sockets between messages, with nothing buffered and no dedicated compressor are moved, anything else returns false
+     * and stays. Subscriptions follow (without retained messages being sent again), user data is copied bytewise.
+     * The socket is gone from here on returning true, so never call this from within one of its own handlers, and the
+     * target has to outlive the handoff. Needs a uSockets with us_socket_from_fd (UWS_HAS_SOCKET_FROM_FD), not for SSL */
+    bool handoff([[maybe_unused]] WebSocket<SSL, true> *webSocket, [[maybe_unused]] TemplatedApp *target) {
+#ifdef UWS_HAS_SOCKET_FROM_FD
+        us_socket_context_t *context = us_socket_context(SSL, (us_socket_t *) webSocket);
+        for (size_t route = 0; route < webSocketContexts.size(); route++) {
+            if (webSocketContexts[route]->getSocketContext() != context) {
+                continue;
+            }
+            if (route >= target->webSocketContexts.size()) {
+                return false;
+            }
+
+            std::unique_ptr<WebSocketHandoff> webSocketHandoff = WebSocketContext<SSL, true>::depart(webSocket);
+            if (!webSocketHandoff) {
+                return false;
+            }
+
+            Loop *loop = (Loop *) us_socket_context_loop(SSL, (us_socket_context_t *) target->httpContext);
+            loop->defer([webSocketContext = target->webSocketContexts[route], webSocketHandoff = std::move(webSocketHandoff)]() mutable {
+                webSocketContext->arrive(std::move(webSocketHandoff));
+            });
+            return true;
+        }
+#endif
+        return false;
+    }
+
+    /* Hands off the next count WebSockets of this App to become readable (the busy ones) to target, see handoff.
+     * Call on this App's thread, such as from a timer. One App per loop can shed at a time, a count of 0 stops.
+     * Does nothing where handoff is compiled out */
+    void shed([[maybe_unused]] unsigned int count, [[maybe_unused]] TemplatedApp *target) {
+        LoopData *loopData = (LoopData *) us_loop_ext((us_loop_t *) Loop::get());
+#ifdef UWS_HAS_SOCKET_FROM_FD
+        loopData->shedQuota = count;
+        loopData->shedHandler = [this, target](us_socket_t *s) {
+            return handoff((WebSocket<SSL, true> *) s, target);
+        };
+#else
+        loopData->shedQuota = 0;
+#endif
+        if (!loopData->shedQuota) {
+            loopData->shedHandler = nullptr;
+        }
+    }
+
+    /* Counters of every loop in this process, summed. Callable from any thread */
+    static Metrics::Snapshot getMetrics() {
+        return Metrics::collectAll();
+    }
+
+    /* Serves getMetrics() in Prometheus text format */
+    TemplatedApp &&metrics(std::string pattern = "/metrics") {
+        return std::move(get(pattern, [](auto *res, auto *req) {
+            res->writeHeader("Content-Type", "text/plain; version=0.0.4")->end(getMetrics().prometheus());
+        }));
     }
 
     ~TemplatedApp() {
@@ -74,6 +178,10 @@ public:
             for (auto *webSocketContext : webSocketContexts) {
                 webSocketContext->free();
             }
+
+            for (auto *webSocketClientContext : webSocketClientContexts) {
+                webSocketClientContext->free();
+            }
         }
     }
 
@@ -87,6 +195,9 @@ public:
 
         /* Move webSocketContexts */
         webSocketContexts = std::move(other.webSocketContexts);
+        webSocketClientContexts = std::move(other.webSocketClientContexts);
+
+        hub = other.hub;
     }
 
     TemplatedApp(us_socket_context_options_t options = {}) {
@@ -100,14 +211,32 @@ public:
     struct WebSocketBehavior {
         CompressOptions compression = DISABLED;
         int maxPayloadLength = 16 * 1024;
+        /* In whole seconds. Expiry rides the uSockets timeout sweep (every LIBUS_TIMEOUT_GRANULARITY seconds) rather than
+         * a timer per socket, so it may come that much late. Activity re-arms it lazily, rounded up to the next second */
         int idleTimeout = 120;
+        /* Opt in to have sockets idle for idleTimeout pinged, and closed only if that goes unanswered for another idleTimeout.
+         * Otherwise idleTimeout closes them right away, as it always did */
+        bool sendPingsAutomatically = false;
         int maxBackpressure = 1 * 1024 * 1204;
+        /* Subscribers buffering more than this lag, see setSlowConsumerPolicy */
+        int lagBackpressure = 64 * 1024;
+        /* Shared compressor messages of at least this size are compressed in the pool, if given one */
+        CompressionPool *compressionPool = nullptr;
+        size_t compressionOffloadThreshold = 64 * 1024;
+        /* Sizes the streams of DEDICATED_COMPRESSOR, smaller windows are negotiated with server_max_window_bits */
+        CompressionProfile compressionProfile = {};
+        /* A preset deflate dictionary for clients that know it, used by the shared compressor and the inflater of this route.
+         * Plain browsers cannot inflate what is sent with one, so only set it on routes of your own clients */
+        std::string compressionDictionary = {};
         fu2::unique_function<void(uWS::WebSocket<SSL, true> *, HttpRequest *)> open = nullptr;
         fu2::unique_function<void(uWS::WebSocket<SSL, true> *, std::string_view, uWS::OpCode)> message = nullptr;
         fu2::unique_function<void(uWS::WebSocket<SSL, true> *)> drain = nullptr;
         fu2::unique_function<void(uWS::WebSocket<SSL, true> *)> ping = nullptr;
         fu2::unique_function<void(uWS::WebSocket<SSL, true> *)> pong = nullptr;
         fu2::unique_function<void(uWS::WebSocket<SSL, true> *, int, std::string_view)> close = nullptr;
+        /* Called instead of close on a socket being handed off, and instead of open once it arrived, see handoff */
+        fu2::unique_function<void(uWS::WebSocket<SSL, true> *)> depart = nullptr;
+        fu2::unique_function<void(uWS::WebSocket<SSL, true> *)> arrive = nullptr;
     };
 
     template <typename UserData>
@@ -122,6 +251,14 @@ public:
         /* We need to clear this later on */
         webSocketContexts.push_back(webSocketContext);
 
+        /* Traced by route, see Loop::setTracing */
+        webSocketContext->getExt()->messageTracePoint.attach(&((LoopData *) us_loop_ext((us_loop_t *) Loop::get()))->metrics, "WS " + pattern);
+
+        /* Cross-thread publishes reach this context too */
+        if (hub) {
+            hub->join(&webSocketContext->getExt()->hubQueue);
+        }
+
         /* Quick fix to disable any compression if set */
 #ifdef UWS_NO_ZLIB
         behavior.compression = uWS::DISABLED;
@@ -137,31 +274,41 @@ public:
                 loopData->inflationStream = new InflationStream;
                 loopData->deflationStream = new DeflationStream;
             }
+
+            /* Routes with a dictionary have streams of their own rather than the loop's */
+            if (behavior.compressionDictionary.length()) {
+                webSocketContext->getExt()->setCompressionDictionary(std::move(behavior.compressionDictionary));
+            }
         }
 
         /* Copy all handlers */
         webSocketContext->getExt()->messageHandler = std::move(behavior.message);
         webSocketContext->getExt()->drainHandler = std::move(behavior.drain);
         webSocketContext->getExt()->closeHandler = std::move(behavior.close);
+        webSocketContext->getExt()->pingHandler = std::move(behavior.ping);
+        webSocketContext->getExt()->pongHandler = std::move(behavior.pong);
+        webSocketContext->getExt()->departHandler = std::move(behavior.depart);
+        webSocketContext->getExt()->arriveHandler = std::move(behavior.arrive);
 
         /* Copy settings */
         webSocketContext->getExt()->maxPayloadLength = behavior.maxPayloadLength;
         webSocketContext->getExt()->idleTimeout = behavior.idleTimeout;
+        webSocketContext->getExt()->sendPingsAutomatically = behavior.sendPingsAutomatically;
         webSocketContext->getExt()->maxBackpressure = behavior.maxBackpressure;
+        webSocketContext->getExt()->lagBackpressure = behavior.lagBackpressure;
+        webSocketContext->getExt()->compressionPool = behavior.compressionPool;
+        webSocketContext->getExt()->compressionOffloadThreshold = behavior.compressionOffloadThreshold;
+        webSocketContext->getExt()->userDataSize = sizeof(UserData);
 
         return std::move(get(pattern, [webSocketContext, httpContext = this->httpContext, behavior = std::move(behavior)](auto *res, auto *req) mutable {
 
             /* If we have this header set, it's a websocket */
-            std::string_view secWebSocketKey = req->getHeader("sec-websocket-key");
+            std::string_view secWebSocketKey = req->getHeader(HttpRequest::SEC_WEBSOCKET_KEY);
             if (secWebSocketKey.length() == 24) {
-                /* Note: OpenSSL can be used here to speed this up somewhat */
-                char secWebSocketAccept[29] = {};
-                WebSocketHandshake::generate(secWebSocketKey.data(), secWebSocketAccept);
-
-                res->writeStatus("101 Switching Protocols")
-                    ->writeHeader("Upgrade", "websocket")
-                    ->writeHeader("Connection", "Upgrade")
-                    ->writeHeader("Sec-WebSocket-Accept", secWebSocketAccept);
+                /* The status line and the headers every upgrade has, accept key included, are written as one */
+                char upgradeStatus[WebSocketHandshake::UPGRADE_STATUS_LENGTH];
+                WebSocketHandshake::generateUpgradeStatus(secWebSocketKey.data(), upgradeStatus);
+                res->writeStatus({upgradeStatus, WebSocketHandshake::UPGRADE_STATUS_LENGTH});
 
                 /* Select first subprotocol if present */
                 std::string_view secWebSocketProtocol = req->getHeader("sec-websocket-protocol");
@@ -172,6 +319,7 @@ public:
                 /* Negotiate compression */
                 bool perMessageDeflate = false;
                 bool slidingDeflateWindow = false;
+                CompressionProfile compressionProfile = behavior.compressionProfile;
                 if (behavior.compression != DISABLED) {
                     std::string_view extensions = req->getHeader("sec-websocket-extensions");
                     if (extensions.length()) {
@@ -185,7 +333,7 @@ public:
                         }
 
                         /* isServer = true */
-                        ExtensionsNegotiator<true> extensionsNegotiator(wantedOptions);
+                        ExtensionsNegotiator<true> extensionsNegotiator(wantedOptions, std::max<int>(9, std::min<int>(15, behavior.compressionProfile.windowBits)));
                         extensionsNegotiator.readOffer(extensions);
 
                         /* Todo: remove these mid string copies */
@@ -202,6 +350,7 @@ public:
                         /* Is the server allowed to compress with a sliding window? */
                         if (!(extensionsNegotiator.getNegotiatedOptions() & SERVER_NO_CONTEXT_TAKEOVER)) {
                             slidingDeflateWindow = true;
+                            compressionProfile.windowBits = extensionsNegotiator.getNegotiatedServerMaxWindowBits();
                         }
                     }
                 }
@@ -210,14 +359,19 @@ public:
                 res->upgrade();
 
                 /* Move any backpressure */
-                std::string backpressure(std::move(((AsyncSocketData<SSL> *) res->getHttpResponseData())->buffer));
+                BackPressure backpressure(std::move(((AsyncSocketData<SSL> *) res->getHttpResponseData())->buffer));
 
                 /* Keep any fallback buffer alive until we returned from open event, keeping req valid */
-                std::string fallback(std::move(res->getHttpResponseData()->salvageFallbackBuffer()));
+                std::string fallback(res->getHttpResponseData()->salvageFallbackBuffer());
 
                 /* Destroy HttpResponseData */
                 res->getHttpResponseData()->~HttpResponseData();
 
+                Metrics &metrics = ((LoopData *) us_loop_ext((us_loop_t *) Loop::get()))->metrics;
+                metrics.sub(Metrics::HTTP_CONNECTIONS);
+                metrics.add(Metrics::WEBSOCKETS);
+                metrics.add(Metrics::WEBSOCKET_UPGRADES);
+
                 /* Adopting a socket invalidates it, do not rely on it directly to carry any data */
                 WebSocket<SSL, true> *webSocket = (WebSocket<SSL, true> *) us_socket_context_adopt_socket(SSL,
                             (us_socket_context_t *) webSocketContext, (us_socket_t *) res, sizeof(WebSocketData) + sizeof(UserData));
@@ -227,12 +381,12 @@ public:
 
                 /* Initialize websocket with any moved backpressure intact */
                 httpContext->upgradeToWebSocket(
-                            webSocket->init(perMessageDeflate, slidingDeflateWindow, std::move(backpressure))
+                            webSocket->init(perMessageDeflate, slidingDeflateWindow, compressionProfile, std::move(backpressure))
                             );
 
-                /* Emit open event and start the timeout */
+                /* Start the timeout, it is only re-armed as it fires. Emit open event */
+                us_socket_timeout(SSL, (us_socket_t *) webSocket, behavior.idleTimeout);
                 if (behavior.open) {
-                    us_socket_timeout(SSL, (us_socket_t *) webSocket, behavior.idleTimeout);
                     behavior.open(webSocket, req);
                 }
 
@@ -247,6 +401,24 @@ public:
         }));
     }
 
+    /* Keeps a pool of behavior.connections WebSockets to host:port/path open (over TLS if SSL), replacing them as they drop.
+     * The pool keeps the loop alive for as long as the app lives */
+    template <typename UserData>
+    TemplatedApp &&wsClient(std::string host, int port, std::string path, WebSocketClientBehavior<SSL> &&behavior) {
+        /* Don't compile if alignment rules cannot be satisfied */
+        static_assert(alignof(UserData) <= LIBUS_EXT_ALIGNMENT,
+        "µWebSockets cannot satisfy UserData alignment requirements. You need to recompile µSockets with LIBUS_EXT_ALIGNMENT adjusted accordingly.");
+
+        auto *webSocketClientContext = WebSocketClientContext<SSL>::create(Loop::get(), std::move(host), port, std::move(path), std::move(behavior), sizeof(UserData));
+
+        /* We need to clear this later on */
+        if (webSocketClientContext) {
+            webSocketClientContexts.push_back(webSocketClientContext);
+        }
+
+        return std::move(*this);
+    }
+
     TemplatedApp &&get(std::string pattern, fu2::unique_function<void(HttpResponse<SSL> *, HttpRequest *)> &&handler) {
         httpContext->onHttp("get", pattern, std::move(handler));
         return std::move(*this);
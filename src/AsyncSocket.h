@@ -23,6 +23,16 @@
 #include "LoopData.h"
 #include "AsyncSocketData.h"
 
+#include <string_view>
+#include <algorithm>
+
+/* Non-SSL sockets can gather many buffers into one syscall */
+#ifndef _WIN32
+#include <sys/socket.h>
+#include <sys/uio.h>
+#define UWS_HAS_WRITEV
+#endif
+
 namespace uWS {
 
     template <bool, bool> struct WebSocketContext;
@@ -31,10 +41,14 @@ template <bool SSL>
 struct AsyncSocket {
     template <bool> friend struct HttpContext;
     template <bool, bool> friend struct WebSocketContext;
-    template <bool> friend struct WebSocketContextData;
+    template <bool, bool> friend struct WebSocketContextData;
+    template <bool> friend struct WebSocketClientContext;
     friend struct TopicTree;
 
 protected:
+    /* Most chunks we gather into one writev */
+    static constexpr int MAX_GATHERED_CHUNKS = 63;
+
     /* Get loop data for socket */
     LoopData *getLoopData() {
         return (LoopData *) us_loop_ext(us_socket_context_loop(SSL, us_socket_context(SSL, (us_socket_t *) this)));
@@ -63,7 +77,9 @@ protected:
     /* Cork this socket. Only one socket may ever be corked per-loop at any given time */
     void cork() {
         /* What if another socket is corked? */
-        getLoopData()->corkedSocket = this;
+        LoopData *loopData = getLoopData();
+        loopData->corkedSocket = this;
+        loopData->corkedBytes = 0;
     }
 
     /* Returns wheter we are corked or not */
@@ -80,16 +96,21 @@ protected:
     std::pair<char *, bool> getSendBuffer(size_t size) {
         /* If we are corked and we have room, return the cork buffer itself */
         LoopData *loopData = getLoopData();
-        if (loopData->corkedSocket == this && loopData->corkOffset + size < LoopData::CORK_BUFFER_SIZE) {
+        if (loopData->corkedSocket == this && loopData->corkOffset + size < (size_t) loopData->corkBufferSize) {
             char *sendBuffer = loopData->corkBuffer + loopData->corkOffset;
             loopData->corkOffset += size;
             return {sendBuffer, false};
         } else {
             /* Slow path for now, we want to always be corked if possible */
-            return {(char *) malloc(size), true};
+            return {(char *) loopData->slabAllocator.allocate(size), true};
         }
     }
 
+    /* Returns a send buffer which required write back to the loop it came from */
+    void freeSendBuffer(char *sendBuffer, size_t size) {
+        getLoopData()->slabAllocator.deallocate(sendBuffer, size);
+    }
+
     /* Returns the user space backpressure. */
     int getBufferedAmount() {
         return getAsyncSocketData()->buffer.size();
@@ -103,6 +124,95 @@ protected:
         return std::string_view(buf, ipLength);
     }
 
+    /* Writes off the cork buffer while staying corked. On backpressure the remainder is buffered,
+     * we are uncorked and false is returned */
+    bool flushCork(LoopData *loopData, AsyncSocketData<SSL> *asyncSocketData) {
+        if (!loopData->corkOffset) {
+            return true;
+        }
+
+        int written = us_socket_write(SSL, (us_socket_t *) this, loopData->corkBuffer, loopData->corkOffset, 1);
+        if (written < loopData->corkOffset) {
+            asyncSocketData->buffer.append(loopData->corkBuffer + written, loopData->corkOffset - written);
+            loopData->corkOffset = 0;
+            loopData->corkedSocket = nullptr;
+            return false;
+        }
+
+        loopData->corkOffset = 0;
+        return true;
+    }
+
+#ifdef UWS_HAS_WRITEV
+    /* Sends the cork buffer (if corked) followed by chunks in one syscall, without copying them anywhere.
+     * What did not fit is handed to us_socket_write (so that we poll for writable) and buffered like write does */
+    std::pair<int, bool> gatherWrite(LoopData *loopData, AsyncSocketData<SSL> *asyncSocketData, const std::string_view *chunks, int count, bool optionally) {
+        struct iovec vecs[MAX_GATHERED_CHUNKS + 1];
+        int numVecs = 0;
+
+        /* The cork buffer may well hold what another socket corked, then it is none of our business */
+        int corked = loopData->corkedSocket == this ? loopData->corkOffset : 0;
+        if (corked) {
+            vecs[numVecs++] = {loopData->corkBuffer, (size_t) corked};
+            loopData->corkOffset = 0;
+        }
+        for (int i = 0; i < count; i++) {
+            vecs[numVecs++] = {(void *) chunks[i].data(), chunks[i].length()};
+        }
+
+        struct msghdr msg = {};
+        msg.msg_iov = vecs;
+        msg.msg_iovlen = numVecs;
+#ifdef MSG_NOSIGNAL
+        ssize_t sent = sendmsg(us_poll_fd((us_poll_t *) this), &msg, MSG_NOSIGNAL);
+#else
+        ssize_t sent = sendmsg(us_poll_fd((us_poll_t *) this), &msg, 0);
+#endif
+        if (sent < 0) {
+            sent = 0;
+        }
+
+        /* Count what got written (anywhere) of the chunks, the cork buffer is already accounted for */
+        int written = 0;
+        bool failed = false;
+        for (int i = 0; i < numVecs; i++) {
+            const char *base = (const char *) vecs[i].iov_base;
+            int length = (int) vecs[i].iov_len;
+            int offset = (int) std::min<size_t>(sent, length);
+            sent -= offset;
+
+            /* The first short vector goes through us_socket_write which also sets up polling for writable */
+            if (offset < length && !failed) {
+                offset += us_socket_write(SSL, (us_socket_t *) this, base + offset, length - offset, i + 1 < numVecs);
+                failed = offset < length;
+            }
+
+            /* Corked data can never be optional */
+            bool isCork = corked && !i;
+            if (offset < length && (isCork || !optionally)) {
+                asyncSocketData->buffer.append(base + offset, length - offset);
+                offset = length;
+            }
+
+            if (!isCork) {
+                written += offset;
+            }
+
+            /* Optional writes stop at the first chunk we could not write in full */
+            if (offset < length) {
+                break;
+            }
+        }
+
+        /* We are no longer corked under backpressure */
+        if (failed && corked) {
+            loopData->corkedSocket = nullptr;
+        }
+
+        return {written, failed};
+    }
+#endif
+
     /* Write in three levels of prioritization: cork-buffer, syscall, socket-buffer. Always drain if possible.
      * Returns pair of bytes written (anywhere) and wheter or not this call resulted in the polling for
      * writable (or we are in a state that implies polling for writable). */
@@ -116,16 +226,16 @@ protected:
         AsyncSocketData<SSL> *asyncSocketData = getAsyncSocketData();
 
         /* We are limited if we have a per-socket buffer */
-        if (asyncSocketData->buffer.length()) {
-            /* Write off as much as we can */
-            int written = us_socket_write(SSL, (us_socket_t *) this, asyncSocketData->buffer.data(), asyncSocketData->buffer.length(), /*nextLength != 0 | */length);
+        while (asyncSocketData->buffer.length()) {
+            /* Write off as much as we can, one segment at a time */
+            std::string_view segment = asyncSocketData->buffer.front();
+            int written = us_socket_write(SSL, (us_socket_t *) this, segment.data(), (int) segment.length(), segment.length() < asyncSocketData->buffer.length() || length);
 
-            /* On failure return, otherwise continue down the function */
-            if (written < asyncSocketData->buffer.length()) {
-
-                /* Update buffering (todo: we can do better here if we keep track of what happens to this guy later on) */
-                asyncSocketData->buffer = asyncSocketData->buffer.substr(written);
+            /* Only what was written is dropped, the rest stays in place */
+            asyncSocketData->buffer.drain(written);
 
+            /* On failure return, otherwise continue down the function */
+            if (written < (int) segment.length()) {
                 if (optionally) {
                     /* Thankfully we can exit early here */
                     return {0, true};
@@ -136,33 +246,67 @@ protected:
                     return {length, true};
                 }
             }
-
-            /* At this point we simply have no buffer and can continue as normal */
-            asyncSocketData->buffer.clear();
         }
 
+        /* At this point we simply have no buffer and can continue as normal */
         if (length) {
             if (loopData->corkedSocket == this) {
                 /* We are corked */
-                if (LoopData::CORK_BUFFER_SIZE - loopData->corkOffset >= length) {
+                loopData->corkedBytes += length;
+                if (loopData->corkBufferSize - loopData->corkOffset >= length) {
                     /* If the entire chunk fits in cork buffer */
                     memcpy(loopData->corkBuffer + loopData->corkOffset, src, length);
                     loopData->corkOffset += length;
                     /* Fall through to default return */
                 } else {
-                    /* Strategy differences between SSL and non-SSL regarding syscall minimizing */
+                    loopData->metrics.add(Metrics::CORK_OVERFLOWS);
+
+                    /* Pipelined requests keep responding into the cork buffer, so rather than uncorking on overflow
+                     * (and paying syscalls per response for the rest of this read) we flush it and stay corked */
+#ifdef UWS_HAS_WRITEV
+                    /* Without SSL we can send the cork buffer and this chunk off in one go */
+                    if constexpr (!SSL) {
+                        std::string_view chunk(src, length);
+                        return gatherWrite(loopData, asyncSocketData, &chunk, 1, optionally);
+                    }
+#endif
+
+                    int stripped = 0;
                     if constexpr (SSL) {
-                        /* Cork up as much as we can */
-                        int stripped = LoopData::CORK_BUFFER_SIZE - loopData->corkOffset;
+                        /* Cork up as much as we can, full records are cheaper */
+                        stripped = loopData->corkBufferSize - loopData->corkOffset;
                         memcpy(loopData->corkBuffer + loopData->corkOffset, src, stripped);
-                        loopData->corkOffset = LoopData::CORK_BUFFER_SIZE;
+                        loopData->corkOffset = loopData->corkBufferSize;
+                    }
+
+                    if (!flushCork(loopData, asyncSocketData)) {
+                        /* We are no longer corked, the flushed remainder is already buffered */
+                        if (optionally) {
+                            return {stripped, true};
+                        }
+                        asyncSocketData->buffer.append(src + stripped, length - stripped);
+                        return {length, true};
+                    }
 
-                        auto [written, failed] = uncork(src + stripped, length - stripped, optionally);
-                        return {written + stripped, failed};
+                    /* Continue corking into the now empty buffer if we can */
+                    int remaining = length - stripped;
+                    if (remaining <= loopData->corkBufferSize) {
+                        memcpy(loopData->corkBuffer, src + stripped, remaining);
+                        loopData->corkOffset = remaining;
+                        return {length, false};
                     }
 
-                    /* For non-SSL we take the penalty of two syscalls */
-                    return uncork(src, length, optionally);
+                    /* Too big to ever cork, send it off directly */
+                    int written = us_socket_write(SSL, (us_socket_t *) this, src + stripped, remaining, nextLength != 0);
+                    if (written < remaining) {
+                        loopData->corkedSocket = nullptr;
+                        if (optionally) {
+                            return {stripped + written, true};
+                        }
+                        asyncSocketData->buffer.append(src + stripped + written, remaining - written);
+                        return {length, true};
+                    }
+                    /* Fall through to default return */
                 }
             } else {
                 /* We are not corked */
@@ -176,11 +320,6 @@ protected:
                     }
 
                     /* Fall back to worst possible case (should be very rare for HTTP) */
-                    /* At least we can reserve room for next chunk if we know it up front */
-                    if (nextLength) {
-                        asyncSocketData->buffer.reserve(asyncSocketData->buffer.length() + length - written + nextLength);
-                    }
-
                     /* Buffer this chunk */
                     asyncSocketData->buffer.append(src + written, length - written);
 
@@ -195,6 +334,69 @@ protected:
         return {length, false};
     }
 
+    /* Writes many chunks as if written one after another with write, returns likewise. Chunks that would not fit
+     * the cork buffer anyway are gathered into one syscall instead of first being copied */
+    std::pair<int, bool> writev(const std::string_view *chunks, int count, bool optionally = false) {
+        int length = 0;
+        for (int i = 0; i < count; i++) {
+            length += (int) chunks[i].length();
+        }
+
+        /* Fake success if closed, just like write */
+        if (us_socket_is_closed(SSL, (us_socket_t *) this)) {
+            return {length, false};
+        }
+
+#ifdef UWS_HAS_WRITEV
+        if constexpr (!SSL) {
+            LoopData *loopData = getLoopData();
+            AsyncSocketData<SSL> *asyncSocketData = getAsyncSocketData();
+
+            /* Small chunks are better off copied into the cork buffer, and prior backpressure has to go first */
+            bool fitsCork = loopData->corkedSocket == this && loopData->corkBufferSize - loopData->corkOffset >= length;
+            if (!fitsCork && !asyncSocketData->buffer.length()) {
+                if (loopData->corkedSocket == this) {
+                    loopData->corkedBytes += length;
+                    loopData->metrics.add(Metrics::CORK_OVERFLOWS);
+                }
+
+                /* One syscall per batch of chunks until one comes up short */
+                int written = 0;
+                for (int offset = 0; offset < count; offset += MAX_GATHERED_CHUNKS) {
+                    int batch = std::min<int>(count - offset, MAX_GATHERED_CHUNKS);
+                    auto [batchWritten, failed] = gatherWrite(loopData, asyncSocketData, chunks + offset, batch, optionally);
+                    written += batchWritten;
+
+                    if (failed) {
+                        /* Anything after a short batch is buffered as a whole, unless optional */
+                        for (int i = offset + batch; i < count && !optionally; i++) {
+                            asyncSocketData->buffer.append(chunks[i].data(), chunks[i].length());
+                            written += (int) chunks[i].length();
+                        }
+                        return {written, true};
+                    }
+                }
+                return {written, false};
+            }
+        }
+#endif
+
+        /* Otherwise write them one by one */
+        int written = 0;
+        bool failed = false;
+        for (int i = 0; i < count; i++) {
+            auto [chunkWritten, chunkFailed] = write(chunks[i].data(), (int) chunks[i].length(), optionally, i + 1 < count ? (int) chunks[i + 1].length() : 0);
+            written += chunkWritten;
+            failed |= chunkFailed;
+
+            /* Optional writes stop at the first failure */
+            if (chunkFailed && optionally) {
+                break;
+            }
+        }
+        return {written, failed};
+    }
+
     /* Uncork this socket and flush or buffer any corked and/or passed data. It is essential to remember doing this. */
     /* It does NOT count bytes written from cork buffer (they are already accounted for in the write call responsible for its corking)! */
     std::pair<int, bool> uncork(const char *src = nullptr, int length = 0, bool optionally = false) {
@@ -203,6 +405,9 @@ protected:
         if (loopData->corkedSocket == this) {
             loopData->corkedSocket = nullptr;
 
+            /* Feed adaptive sizing of the cork buffer */
+            loopData->sampleCorkedBytes(loopData->corkedBytes);
+
             if (loopData->corkOffset) {
                 /* Corked data is already accounted for via its write call */
                 auto [written, failed] = write(loopData->corkBuffer, loopData->corkOffset, false, length);
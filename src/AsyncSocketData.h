@@ -18,7 +18,7 @@
 #ifndef UWS_ASYNCSOCKETDATA_H
 #define UWS_ASYNCSOCKETDATA_H
 
-#include <string>
+#include "BackPressure.h"
 
 namespace uWS {
 
@@ -26,11 +26,11 @@ namespace uWS {
 
 template <bool SSL>
 struct AsyncSocketData {
-    /* This will do for now */
-    std::string buffer;
+    /* Segmented so that partial drains do not copy what is left */
+    BackPressure buffer;
 
     /* Allow move constructing us */
-    AsyncSocketData(std::string &&backpressure) : buffer(std::move(backpressure)) {
+    AsyncSocketData(BackPressure &&backpressure) : buffer(std::move(backpressure)) {
 
     }
 
@@ -0,0 +1,229 @@
+/*
+ * Authored by Alex Hultman, 2018-2019.
+ * Intellectual property of third-party.
+
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+
+ *     http://www.apache.org/licenses/LICENSE-2.0
+
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef UWS_BACKPRESSURE_H
+#define UWS_BACKPRESSURE_H
+
+/* A chained buffer of fixed size segments for user space backpressure. Appends never move
+ * what is already buffered and draining is proportional to what was written, not to what is left.
+ * Only one pointer in size as every socket has one: the last segment and total length are kept in the first */
+
+#include <string_view>
+#include <cstring>
+#include <cstddef>
+#include <algorithm>
+
+#include "Metrics.h"
+
+namespace uWS {
+
+struct BackPressure {
+private:
+    /* One full TLS record per segment */
+    static const unsigned int SEGMENT_SIZE = 16 * 1024;
+
+    /* Most free segments we keep per thread */
+    static const unsigned int MAX_POOLED_SEGMENTS = 64;
+
+    struct Segment {
+        Segment *next;
+        unsigned int head;
+        unsigned int tail;
+        /* Only meaningful in the head segment */
+        Segment *last;
+        size_t total;
+        char data[SEGMENT_SIZE];
+    };
+
+    /* Trivially destructible so that releases still work after the cleaner ran at thread exit */
+    struct Pool {
+        Segment *free = nullptr;
+        unsigned int count = 0;
+        bool closed = false;
+    };
+
+    static Pool &getPool() {
+        static thread_local Pool pool;
+        static thread_local struct Cleaner {
+            ~Cleaner() {
+                while (pool.free) {
+                    Segment *next = pool.free->next;
+                    delete pool.free;
+                    pool.free = next;
+                }
+                pool.count = 0;
+                pool.closed = true;
+            }
+        } cleaner;
+        (void) cleaner;
+        return pool;
+    }
+
+    static Segment *allocate() {
+        Pool &pool = getPool();
+        Segment *segment = pool.free;
+        if (segment) {
+            pool.free = segment->next;
+            pool.count--;
+        } else {
+            segment = new Segment;
+        }
+        segment->next = nullptr;
+        segment->head = segment->tail = 0;
+        segment->last = segment;
+        segment->total = 0;
+        return segment;
+    }
+
+    static void release(Segment *segment) {
+        Pool &pool = getPool();
+        if (pool.closed || pool.count == MAX_POOLED_SEGMENTS) {
+            delete segment;
+        } else {
+            segment->next = pool.free;
+            pool.free = segment;
+            pool.count++;
+        }
+    }
+
+    Segment *head = nullptr;
+
+    /* Buffered bytes are accounted to the loop of this thread, if any */
+    static void account(bool buffered, size_t length) {
+        if (!length) {
+            return;
+        }
+        if (Metrics *metrics = Metrics::get()) {
+            if (buffered) {
+                metrics->add(Metrics::BACKPRESSURE_BYTES, length);
+            } else {
+                metrics->sub(Metrics::BACKPRESSURE_BYTES, length);
+            }
+        }
+    }
+
+public:
+    BackPressure() = default;
+    BackPressure(const BackPressure &) = delete;
+    BackPressure &operator=(const BackPressure &) = delete;
+
+    BackPressure(BackPressure &&other) : head(other.head) {
+        other.head = nullptr;
+    }
+
+    BackPressure &operator=(BackPressure &&other) {
+        if (this != &other) {
+            clear();
+            head = other.head;
+            other.head = nullptr;
+        }
+        return *this;
+    }
+
+    ~BackPressure() {
+        clear();
+    }
+
+    /* Total buffered bytes, O(1) */
+    size_t length() const {
+        return head ? head->total : 0;
+    }
+
+    size_t size() const {
+        return length();
+    }
+
+    bool empty() const {
+        return !length();
+    }
+
+    /* Copies src in after everything already buffered */
+    void append(const char *src, size_t length) {
+        if (!length) {
+            return;
+        }
+        if (!head) {
+            if (Metrics *metrics = Metrics::get()) {
+                metrics->add(Metrics::BACKPRESSURE_EVENTS);
+            }
+            head = allocate();
+        }
+        account(true, length);
+        head->total += length;
+        while (length) {
+            Segment *tail = head->last;
+            if (tail->tail == SEGMENT_SIZE) {
+                tail->next = allocate();
+                tail = head->last = tail->next;
+            }
+
+            size_t stripped = std::min<size_t>(length, SEGMENT_SIZE - tail->tail);
+            memcpy(tail->data + tail->tail, src, stripped);
+            tail->tail += (unsigned int) stripped;
+            src += stripped;
+            length -= stripped;
+        }
+    }
+
+    /* The oldest contiguous part of what is buffered, empty if nothing is */
+    std::string_view front() const {
+        if (!head) {
+            return {};
+        }
+        return {head->data + head->head, head->tail - head->head};
+    }
+
+    /* Removes bytes from the front, typically what was just written */
+    void drain(size_t bytes) {
+        if (!bytes) {
+            return;
+        }
+        account(false, bytes);
+        head->total -= bytes;
+        while (bytes) {
+            size_t stripped = std::min<size_t>(bytes, head->tail - head->head);
+            head->head += (unsigned int) stripped;
+            bytes -= stripped;
+
+            if (head->head == head->tail) {
+                /* The next segment takes over the last segment and what is left */
+                Segment *next = head->next;
+                if (next) {
+                    next->last = head->last;
+                    next->total = head->total;
+                }
+                release(head);
+                head = next;
+            }
+        }
+    }
+
+    void clear() {
+        account(false, length());
+        while (head) {
+            Segment *next = head->next;
+            release(head);
+            head = next;
+        }
+    }
+};
+
+static_assert(sizeof(BackPressure) == sizeof(void *), "BackPressure has to stay one pointer in size");
+
+}
+
+#endif // UWS_BACKPRESSURE_H
@@ -0,0 +1,204 @@
+/*
+ * Authored by Alex Hultman, 2018-2019.
+ * Intellectual property of third-party.
+
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+
+ *     http://www.apache.org/licenses/LICENSE-2.0
+
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef UWS_BUFFERPOOL_H
+#define UWS_BUFFERPOOL_H
+
+/* Per-loop pool of large, short-lived buffers such as those reassembling fragmented messages. Sizes are rounded up to
+ * power of two classes of 4 kb to 1 mb and released buffers are kept for reuse within a budget, anything larger or over
+ * budget goes straight back to the heap. No locks as everything allocated here stays on one thread */
+
+#include <cstdlib>
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+#include <vector>
+
+namespace uWS {
+
+struct BufferPool {
+private:
+    static const unsigned int MIN_SHIFT = 12;
+    static const unsigned int NUM_CLASSES = 9;
+    static const size_t MAX_BUFFER_SIZE = (size_t) 1 << (MIN_SHIFT + NUM_CLASSES - 1);
+
+    std::vector<char *> freeLists[NUM_CLASSES];
+
+    static unsigned int sizeClass(size_t size) {
+        unsigned int index = 0;
+        while (((size_t) 1 << (MIN_SHIFT + index)) < size) {
+            index++;
+        }
+        return index;
+    }
+
+public:
+    /* Released buffers beyond this many bytes are freed rather than kept */
+    size_t maxCachedBytes = 4 * 1024 * 1024;
+
+    /* Counters for tuning, a hit is a buffer reused off a free list */
+    struct Counters {
+        unsigned long long hits = 0;
+        unsigned long long misses = 0;
+        unsigned long long oversized = 0;
+        size_t cachedBytes = 0;
+    } counters;
+
+    BufferPool() = default;
+    BufferPool(const BufferPool &) = delete;
+    BufferPool &operator=(const BufferPool &) = delete;
+
+    ~BufferPool() {
+        for (std::vector<char *> &freeList : freeLists) {
+            for (char *buffer : freeList) {
+                ::free(buffer);
+            }
+        }
+    }
+
+    /* Size is rounded up to what we actually hand out */
+    char *allocate(size_t &size) {
+        if (size > MAX_BUFFER_SIZE) {
+            counters.oversized++;
+            return (char *) malloc(size);
+        }
+
+        unsigned int index = sizeClass(size);
+        size = (size_t) 1 << (MIN_SHIFT + index);
+        if (freeLists[index].size()) {
+            counters.hits++;
+            counters.cachedBytes -= size;
+            char *buffer = freeLists[index].back();
+            freeLists[index].pop_back();
+            return buffer;
+        }
+
+        counters.misses++;
+        return (char *) malloc(size);
+    }
+
+    /* Size has to be what allocate handed out */
+    void deallocate(char *buffer, size_t size) {
+        if (!buffer) {
+            return;
+        }
+
+        if (size > MAX_BUFFER_SIZE || counters.cachedBytes + size > maxCachedBytes) {
+            ::free(buffer);
+            return;
+        }
+
+        counters.cachedBytes += size;
+        freeLists[sizeClass(size)].push_back(buffer);
+    }
+};
+
+/* A growable byte buffer backed by a BufferPool, the subset of std::string we need. Memory is only held until release.
+ * Only one pointer in size as to not weigh on every socket: its length, capacity and pool live in front of the memory it holds */
+struct PooledBuffer {
+private:
+    struct Header {
+        BufferPool *bufferPool;
+        size_t length;
+        size_t capacity;
+    };
+
+    /* Our header, or while we hold no memory our pool tagged with the lowest bit */
+    uintptr_t handle;
+
+    Header *header() {
+        return (handle & 1) ? nullptr : (Header *) handle;
+    }
+
+    BufferPool *getBufferPool() {
+        return (handle & 1) ? (BufferPool *) (handle & ~(uintptr_t) 1) : ((Header *) handle)->bufferPool;
+    }
+
+public:
+    PooledBuffer(BufferPool *bufferPool) : handle((uintptr_t) bufferPool | 1) {}
+    PooledBuffer(const PooledBuffer &) = delete;
+    PooledBuffer &operator=(const PooledBuffer &) = delete;
+
+    ~PooledBuffer() {
+        release();
+    }
+
+    char *data() {
+        Header *h = header();
+        return h ? (char *) (h + 1) : nullptr;
+    }
+
+    size_t length() {
+        Header *h = header();
+        return h ? h->length : 0;
+    }
+
+    void reserve(size_t size) {
+        Header *h = header();
+        if (size > (h ? h->capacity : 0)) {
+            BufferPool *bufferPool = getBufferPool();
+            size_t blockSize = sizeof(Header) + size;
+            Header *newHeader = (Header *) bufferPool->allocate(blockSize);
+            newHeader->bufferPool = bufferPool;
+            newHeader->length = 0;
+            newHeader->capacity = blockSize - sizeof(Header);
+            if (h) {
+                if (h->length) {
+                    memcpy(newHeader + 1, h + 1, h->length);
+                }
+                newHeader->length = h->length;
+                bufferPool->deallocate((char *) h, sizeof(Header) + h->capacity);
+            }
+            handle = (uintptr_t) newHeader;
+        }
+    }
+
+    /* Growing leaves the new bytes uninitialized */
+    void resize(size_t size) {
+        Header *h = header();
+        size_t capacity = h ? h->capacity : 0;
+        if (size > capacity) {
+            reserve(size > capacity * 2 ? size : capacity * 2);
+            h = header();
+        }
+        if (h) {
+            h->length = size;
+        }
+    }
+
+    void append(const char *data, size_t length) {
+        size_t offset = this->length();
+        resize(offset + length);
+        if (length) {
+            memcpy(this->data() + offset, data, length);
+        }
+    }
+
+    /* Empties us and hands the memory back to the pool */
+    void release() {
+        if (Header *h = header()) {
+            BufferPool *bufferPool = h->bufferPool;
+            bufferPool->deallocate((char *) h, sizeof(Header) + h->capacity);
+            handle = (uintptr_t) bufferPool | 1;
+        }
+    }
+};
+
+static_assert(sizeof(PooledBuffer) == sizeof(void *), "PooledBuffer has to stay one pointer in size");
+
+}
+
+#endif // UWS_BUFFERPOOL_H
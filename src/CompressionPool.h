@@ -0,0 +1,106 @@
+/*
+ * Authored by Alex Hultman, 2018-2019.
+ * Intellectual property of third-party.
+
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+
+ *     http://www.apache.org/licenses/LICENSE-2.0
+
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef UWS_COMPRESSIONPOOL_H
+#define UWS_COMPRESSIONPOOL_H
+
+/* A CompressionPool deflates large messages on worker threads so that they do not stall their loop.
+ * Every worker has its own stateless compressor, which is why only the shared compressor can be offloaded.
+ * A pool can be shared by many Apps and loops, but has to outlive all of them */
+
+#include "PerMessageDeflate.h"
+
+#include "f2/function2.hpp"
+
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <vector>
+#include <string>
+#include <string_view>
+#include <algorithm>
+
+namespace uWS {
+
+struct CompressionPool {
+private:
+    std::mutex mutex;
+    std::condition_variable condition;
+    std::deque<fu2::unique_function<void()>> jobs;
+    std::vector<std::thread> threads;
+    bool stopping = false;
+
+    void work() {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (true) {
+            condition.wait(lock, [this]() { return stopping || !jobs.empty(); });
+
+            /* Whatever was submitted still runs, its results are deferred to loops that outlive us */
+            if (jobs.empty()) {
+                return;
+            }
+
+            fu2::unique_function<void()> job = std::move(jobs.front());
+            jobs.pop_front();
+
+            lock.unlock();
+            job();
+            lock.lock();
+        }
+    }
+
+public:
+    CompressionPool(unsigned int numThreads = std::thread::hardware_concurrency()) {
+        for (unsigned int i = 0; i < std::max<unsigned int>(numThreads, 1); i++) {
+            threads.emplace_back([this]() { work(); });
+        }
+    }
+
+    ~CompressionPool() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        condition.notify_all();
+        for (std::thread &thread : threads) {
+            thread.join();
+        }
+    }
+
+    /* Runs the job on some worker, it hands its result back with Loop::defer */
+    void submit(fu2::unique_function<void()> &&job) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            jobs.emplace_back(std::move(job));
+        }
+        condition.notify_one();
+    }
+
+    /* Deflates with the calling worker's own compressor, reset after every message like the shared compressor.
+     * Valid until the next call on this thread */
+    static std::string_view deflate(std::string_view raw) {
+        static thread_local ZlibContext zlibContext;
+        static thread_local DeflationStream deflationStream;
+
+        return deflationStream.deflate(&zlibContext, raw, true);
+    }
+};
+
+}
+
+#endif // UWS_COMPRESSIONPOOL_H
@@ -26,6 +26,7 @@
 #include "AsyncSocket.h"
 
 #include <string_view>
+#include <memory>
 #include "f2/function2.hpp"
 
 namespace uWS {
@@ -66,6 +67,10 @@ private:
             /* Init socket ext */
             new (us_socket_ext(SSL, s)) HttpResponseData<SSL>;
 
+            Metrics &metrics = ((AsyncSocket<SSL> *) s)->getLoopData()->metrics;
+            metrics.add(Metrics::HTTP_CONNECTIONS);
+            metrics.add(Metrics::HTTP_CONNECTIONS_TOTAL);
+
             /* Call filter */
             HttpContextData<SSL> *httpContextData = getSocketContextDataS(s);
             for (auto &f : httpContextData->filterHandlers) {
@@ -87,13 +92,15 @@ private:
             }
 
             /* Signal broken HTTP request only if we have a pending request */
-            if (httpResponseData->onAborted) {
-                httpResponseData->onAborted();
+            if (httpResponseData->handlers && httpResponseData->handlers->onAborted) {
+                httpResponseData->handlers->onAborted();
             }
 
             /* Destruct socket ext */
             httpResponseData->~HttpResponseData<SSL>();
 
+            ((AsyncSocket<SSL> *) s)->getLoopData()->metrics.sub(Metrics::HTTP_CONNECTIONS);
+
             return s;
         });
 
@@ -130,6 +137,7 @@ private:
                 /* Reset httpResponse */
                 HttpResponseData<SSL> *httpResponseData = (HttpResponseData<SSL> *) us_socket_ext(SSL, (us_socket_t *) s);
                 httpResponseData->offset = 0;
+                httpResponseData->chunkRemaining = 0;
 
                 /* Are we not ready for another request yet? Terminate the connection. */
                 if (httpResponseData->state & HttpResponseData<SSL>::HTTP_RESPONSE_PENDING) {
@@ -139,6 +147,7 @@ private:
 
                 /* Mark pending request and emit it */
                 httpResponseData->state = HttpResponseData<SSL>::HTTP_RESPONSE_PENDING;
+                ((AsyncSocket<SSL> *) s)->getLoopData()->metrics.add(Metrics::HTTP_REQUESTS);
 
                 /* General middleware functionality */
                 for (auto &f : httpContextData->useHandlers) {
@@ -173,14 +182,14 @@ private:
                 }
 
                 /* Returning from a request handler without responding or attaching an onAborted handler is ill-use */
-                if (!((HttpResponse<SSL> *) s)->hasResponded() && !httpResponseData->onAborted) {
+                if (!((HttpResponse<SSL> *) s)->hasResponded() && !(httpResponseData->handlers && httpResponseData->handlers->onAborted)) {
                     /* Throw exception here? */
                     std::cerr << "Error: Returning from a request handler without responding or attaching an abort handler is forbidden!" << std::endl;
                     std::terminate();
                 }
 
                 /* If we have not responded and we have a data handler, we need to timeout to enfore client sending the data */
-                if (!((HttpResponse<SSL> *) s)->hasResponded() && httpResponseData->inStream) {
+                if (!((HttpResponse<SSL> *) s)->hasResponded() && httpResponseData->handlers && httpResponseData->handlers->inStream) {
                     us_socket_timeout(SSL, (us_socket_t *) s, HTTP_IDLE_TIMEOUT_S);
                 }
 
@@ -189,7 +198,7 @@ private:
 
             }, [httpResponseData](void *user, std::string_view data, bool fin) -> void * {
                 /* We always get an empty chunk even if there is no data */
-                if (httpResponseData->inStream) {
+                if (httpResponseData->handlers && httpResponseData->handlers->inStream) {
 
                     /* Todo: can this handle timeout for non-post as well? */
                     if (fin) {
@@ -201,7 +210,9 @@ private:
                     }
 
                     /* We might respond in the handler, so do not change timeout after this */
-                    httpResponseData->inStream(data, fin);
+                    ((AsyncSocket<SSL> *) user)->getLoopData()->trace(httpResponseData->tracePoint, [&]() {
+                        httpResponseData->handlers->inStream(data, fin);
+                    });
 
                     /* Was the socket closed? */
                     if (us_socket_is_closed(SSL, (struct us_socket_t *) user)) {
@@ -216,7 +227,7 @@ private:
                     /* If we were given the last data chunk, reset data handler to ensure following
                      * requests on the same socket won't trigger any previously registered behavior */
                     if (fin) {
-                        httpResponseData->inStream = nullptr;
+                        httpResponseData->handlers->inStream = nullptr;
                     }
                 }
                 return user;
@@ -224,10 +235,15 @@ private:
                  /* Close any socket on HTTP errors */
                 us_socket_close(SSL, (us_socket_t *) user);
                 return nullptr;
-            });
+            }, httpContextData->maxHeaderSize);
 
             // basically we need to uncork in all cases, except for nullptr
             if (returnedSocket != nullptr) {
+                /* A partial request now waits in the fallback buffer */
+                if (httpResponseData->getFallbackLength()) {
+                    ((AsyncSocket<SSL> *) s)->getLoopData()->metrics.add(Metrics::HTTP_FALLBACK_BUFFERINGS);
+                }
+
                 /* Timeout on uncork failure */
                 auto [written, failed] = ((AsyncSocket<SSL> *) returnedSocket)->uncork();
                 if (failed) {
@@ -264,13 +280,13 @@ private:
             HttpResponseData<SSL> *httpResponseData = (HttpResponseData<SSL> *) asyncSocket->getAsyncSocketData();
 
             /* Ask the developer to write data and return success (true) or failure (false), OR skip sending anything and return success (true). */
-            if (httpResponseData->onWritable) {
+            if (httpResponseData->handlers && httpResponseData->handlers->onWritable) {
                 /* We are now writable, so hang timeout again, the user does not have to do anything so we should hang until end or tryEnd rearms timeout */
                 us_socket_timeout(SSL, s, 0);
 
                 /* We expect the developer to return whether or not write was successful (true).
                  * If write was never called, the developer should still return true so that we may drain. */
-                bool success = httpResponseData->onWritable(httpResponseData->offset);
+                bool success = httpResponseData->handlers->onWritable(httpResponseData->offset);
 
                 /* The developer indicated that their onWritable failed. */
                 if (!success) {
@@ -354,14 +370,27 @@ public:
         getSocketContextData()->useHandlers.emplace_back(std::move(useHandler));
     }
 
+    /* Requests with heads larger than this are refused */
+    void setMaxHeaderSize(unsigned int maxHeaderSize) {
+        getSocketContextData()->maxHeaderSize = maxHeaderSize;
+    }
+
     /* Register an HTTP route handler acording to URL pattern */
     void onHttp(std::string method, std::string pattern, fu2::unique_function<void(HttpResponse<SSL> *, HttpRequest *)> &&handler) {
         HttpContextData<SSL> *httpContextData = getSocketContextData();
 
-        httpContextData->router.add(method, pattern, [handler = std::move(handler)](typename HttpContextData<SSL>::RouterData &user, std::pair<int, std::string_view *> params) mutable {
+        /* Requests routed here, and their bodies, are traced by method and pattern */
+        auto tracePoint = std::make_unique<Metrics::TracePoint>();
+        tracePoint->attach(&((LoopData *) us_loop_ext(us_socket_context_loop(SSL, getSocketContext())))->metrics, method + " " + pattern);
+
+        httpContextData->router.add(method, pattern, [handler = std::move(handler), tracePoint = std::move(tracePoint)](typename HttpContextData<SSL>::RouterData &user, std::pair<int, std::string_view *> params) mutable {
             user.httpRequest->setYield(false);
             user.httpRequest->setParameters(params);
-            handler(user.httpResponse, user.httpRequest);
+
+            ((HttpResponseData<SSL> *) us_socket_ext(SSL, (us_socket_t *) user.httpResponse))->tracePoint = tracePoint.get();
+            ((AsyncSocket<SSL> *) user.httpResponse)->getLoopData()->trace(tracePoint.get(), [&]() {
+                handler(user.httpResponse, user.httpRequest);
+            });
 
             /* If any handler yielded, the router will keep looking for a suitable handler. */
             if (user.httpRequest->getYield()) {
@@ -19,6 +19,7 @@
 #define UWS_HTTPCONTEXTDATA_H
 
 #include "HttpRouter.h"
+#include "HttpParser.h"
 
 #include <vector>
 #include "f2/function2.hpp"
@@ -42,6 +43,9 @@ private:
 
     HttpRouter<RouterData> router;
     void *upgradedWebSocket = nullptr;
+
+    /* Largest request head we buffer up when split across reads */
+    unsigned int maxHeaderSize = DEFAULT_MAX_HEADER_SIZE;
 };
 
 }
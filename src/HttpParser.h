@@ -23,18 +23,46 @@
 /* The HTTP parser is an independent module subject to unit testing / fuzz testing */
 
 #include <string>
+#include <vector>
 #include <cstring>
+#include <cstdint>
+#include <climits>
 #include <algorithm>
 #include "f2/function2.hpp"
 
+/* Header scanning is vectorized where the compiler targets SSE2 and char is signed, like the scalar loop assumes */
+#if (defined(__SSE2__) || defined(_M_X64)) && CHAR_MIN < 0
+#define UWS_HTTP_VECTOR_SCAN
+#include <emmintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#endif
+
 namespace uWS {
 
 /* We require at least this much post padding */
 static const int MINIMUM_HTTP_POST_PADDING = 32;
 
+/* How large a request head split across reads may grow by default, configurable per App */
+static const unsigned int DEFAULT_MAX_HEADER_SIZE = 4 * 1024;
+
 struct HttpRequest {
 
     friend struct HttpParser;
+    friend struct HttpRequestArena;
+
+public:
+    /* Headers captured into dedicated slots while parsing */
+    enum WellKnownHeader {
+        CONTENT_LENGTH,
+        HOST,
+        UPGRADE,
+        SEC_WEBSOCKET_KEY,
+        CONNECTION,
+        TRANSFER_ENCODING,
+        NUM_WELL_KNOWN_HEADERS
+    };
 
 private:
     const static int MAX_HEADERS = 50;
@@ -44,8 +72,64 @@ private:
     int querySeparator;
     bool didYield;
 
+    /* Headers are chained in buckets by length and first and last byte, index 0 (the request line) ends a chain */
+    const static int HEADER_BUCKETS = 32;
+    unsigned char bucketHeads[HEADER_BUCKETS];
+    unsigned char nextInBucket[MAX_HEADERS];
+    std::string_view wellKnownHeaders[NUM_WELL_KNOWN_HEADERS];
+
+    static unsigned int bucket(std::string_view key) {
+        return (unsigned int) (key.length() + (unsigned char) key[0] * 3 + (unsigned char) key[key.length() - 1] * 5) % HEADER_BUCKETS;
+    }
+
+    /* Called by the parser for every header in order, key being lowercased and non-empty */
+    void indexHeader(unsigned char index) {
+        std::string_view key = headers[index].key;
+
+        /* Chains are kept newest first, lookups take the last match to return the first one like a linear scan */
+        unsigned int b = bucket(key);
+        nextInBucket[index] = bucketHeads[b];
+        bucketHeads[b] = index;
+
+        int wellKnown = NUM_WELL_KNOWN_HEADERS;
+        switch (key.length()) {
+        case 4: wellKnown = key == "host" ? HOST : wellKnown; break;
+        case 7: wellKnown = key == "upgrade" ? UPGRADE : wellKnown; break;
+        case 10: wellKnown = key == "connection" ? CONNECTION : wellKnown; break;
+        case 14: wellKnown = key == "content-length" ? CONTENT_LENGTH : wellKnown; break;
+        case 17: wellKnown = key == "transfer-encoding" ? TRANSFER_ENCODING : (key == "sec-websocket-key" ? SEC_WEBSOCKET_KEY : wellKnown); break;
+        }
+        if (wellKnown != NUM_WELL_KNOWN_HEADERS && !wellKnownHeaders[wellKnown].data()) {
+            wellKnownHeaders[wellKnown] = headers[index].value;
+        }
+    }
+
+    void resetIndex() {
+        memset(bucketHeads, 0, sizeof(bucketHeads));
+        for (std::string_view &value : wellKnownHeaders) {
+            value = std::string_view(nullptr, 0);
+        }
+    }
+
     std::pair<int, std::string_view *> currentParameters;
 
+    /* The bytes every visible view points into, from the request line up to the end of the last header */
+    std::string_view getHead() {
+        Header *last = headers;
+        while (last[1].key.length()) {
+            last++;
+        }
+        return std::string_view(headers->key.data(), (size_t) (last->value.data() + last->value.length() - headers->key.data()));
+    }
+
+    /* Points a view into head at the same bytes of copy instead, leaving any other be */
+    static void rebase(std::string_view &view, std::string_view head, char *copy) {
+        uintptr_t offset = (uintptr_t) view.data() - (uintptr_t) head.data();
+        if (view.data() && offset <= head.length()) {
+            view = std::string_view(copy + offset, view.length());
+        }
+    }
+
 public:
     bool getYield() {
         return didYield;
@@ -87,12 +171,22 @@ public:
     }
 
     std::string_view getHeader(std::string_view lowerCasedHeader) {
-        for (Header *h = headers; (++h)->key.length(); ) {
-            if (h->key.length() == lowerCasedHeader.length() && !strncmp(h->key.data(), lowerCasedHeader.data(), lowerCasedHeader.length())) {
-                return h->value;
+        if (!lowerCasedHeader.length()) {
+            return std::string_view(nullptr, 0);
+        }
+
+        std::string_view value(nullptr, 0);
+        for (unsigned char index = bucketHeads[bucket(lowerCasedHeader)]; index; index = nextInBucket[index]) {
+            if (headers[index].key == lowerCasedHeader) {
+                value = headers[index].value;
             }
         }
-        return std::string_view(nullptr, 0);
+        return value;
+    }
+
+    /* Constant time lookup of a header captured while parsing */
+    std::string_view getHeader(WellKnownHeader wellKnownHeader) {
+        return wellKnownHeaders[wellKnownHeader];
     }
 
     std::string_view getUrl() {
@@ -126,13 +220,248 @@ public:
 
 };
 
+/* Keeps a copy of a request valid past its handler, for responses sent later. One is recycled for all requests of a
+ * connection, so pinning costs a copy of the head and no allocation once it has held a head as large */
+struct HttpRequestArena {
+private:
+    HttpRequest request;
+    std::string head;
+    std::vector<std::string_view> parameters;
+
+public:
+    HttpRequest *pin(HttpRequest *req) {
+        if (req == &request) {
+            return req;
+        }
+
+        std::string_view original = req->getHead();
+        head.assign(original.data(), original.length());
+
+        /* Headers past the terminating one are never looked at */
+        HttpRequest::Header *terminator = req->headers + 1;
+        while (terminator->key.length()) {
+            terminator++;
+        }
+        std::copy(req->headers, terminator + 1, request.headers);
+        memcpy(request.bucketHeads, req->bucketHeads, sizeof(request.bucketHeads));
+        memcpy(request.nextInBucket, req->nextInBucket, sizeof(request.nextInBucket));
+        std::copy(std::begin(req->wellKnownHeaders), std::end(req->wellKnownHeaders), request.wellKnownHeaders);
+        request.querySeparator = req->querySeparator;
+        request.didYield = req->didYield;
+
+        for (HttpRequest::Header *header = request.headers; header->key.length() || header == request.headers; header++) {
+            HttpRequest::rebase(header->key, original, head.data());
+            HttpRequest::rebase(header->value, original, head.data());
+        }
+        for (std::string_view &value : request.wellKnownHeaders) {
+            HttpRequest::rebase(value, original, head.data());
+        }
+
+        /* Parameters live in the router until the next request */
+        parameters.clear();
+        if (req->currentParameters.first >= 0) {
+            parameters.assign(req->currentParameters.second, req->currentParameters.second + req->currentParameters.first + 1);
+        }
+        for (std::string_view &parameter : parameters) {
+            HttpRequest::rebase(parameter, original, head.data());
+        }
+        request.currentParameters = {req->currentParameters.first, parameters.data()};
+
+        return &request;
+    }
+};
+
 struct HttpParser {
 
 private:
-    std::string fallback;
+    /* Partial requests are kept here until the rest arrives, created on first use and kept for the requests to follow */
+    struct Fallback {
+        std::string buffer;
+
+        /* How far into buffer we know there are only complete header lines, and how many */
+        size_t scanned = 0;
+        unsigned int lines = 0;
+    } *fallback = nullptr;
     unsigned int remainingStreamingBytes = 0;
 
-    const size_t MAX_FALLBACK_SIZE = 1024 * 4;
+    /* Where we are in a chunked body, which can be split anywhere between calls */
+    enum ChunkState : unsigned char {
+        CHUNK_NONE,
+        CHUNK_SIZE,
+        CHUNK_EXTENSION,
+        CHUNK_SIZE_LF,
+        CHUNK_DATA,
+        CHUNK_DATA_CR,
+        CHUNK_DATA_LF,
+        CHUNK_TRAILER,
+        CHUNK_TRAILER_LINE,
+        CHUNK_TRAILER_LF,
+        CHUNK_END_LF
+    } chunkState = CHUNK_NONE;
+    unsigned char chunkDigits = 0;
+    uint64_t chunkRemaining = 0;
+
+    /* Whether the last transfer coding is chunked */
+    static bool isChunked(std::string_view transferEncoding) {
+        while (transferEncoding.length() && (transferEncoding.back() == ' ' || transferEncoding.back() == '\t')) {
+            transferEncoding.remove_suffix(1);
+        }
+        if (transferEncoding.length() < 7) {
+            return false;
+        }
+        for (int i = 0; i < 7; i++) {
+            if ((transferEncoding[transferEncoding.length() - 7 + i] | 32) != "chunked"[i]) {
+                return false;
+            }
+        }
+        if (transferEncoding.length() == 7) {
+            return true;
+        }
+        char separator = transferEncoding[transferEncoding.length() - 8];
+        return separator == ',' || separator == ' ' || separator == '\t';
+    }
+
+    /* Decodes as much of a chunked body as we have, emitting every chunk (or part of it) straight from data.
+     * Returns what the data handler returned, the error handler on malformed input */
+    void *consumeChunks(char *&data, int &length, void *user, fu2::unique_function<void *(void *, std::string_view, bool)> &dataHandler, fu2::unique_function<void *(void *)> &errorHandler) {
+        while (length) {
+            if (chunkState == CHUNK_DATA) {
+                unsigned int emittable = (unsigned int) std::min<uint64_t>(chunkRemaining, (uint64_t) length);
+                if (!(chunkRemaining -= emittable)) {
+                    chunkState = CHUNK_DATA_CR;
+                }
+                void *returnedUser = dataHandler(user, std::string_view(data, emittable), false);
+                data += emittable;
+                length -= emittable;
+                if (returnedUser != user) {
+                    return returnedUser;
+                }
+                continue;
+            }
+
+            char c = *data++;
+            length--;
+
+            switch (chunkState) {
+            case CHUNK_SIZE: {
+                int digit = (c >= '0' && c <= '9') ? c - '0' : ((c | 32) >= 'a' && (c | 32) <= 'f') ? (c | 32) - 'a' + 10 : -1;
+                if (digit >= 0) {
+                    /* We never accept chunks of 4 GB or more */
+                    if (++chunkDigits > 8) {
+                        chunkState = CHUNK_NONE;
+                        return errorHandler(user);
+                    }
+                    chunkRemaining = chunkRemaining * 16 + (uint64_t) digit;
+                } else if (chunkDigits && (c == ';' || c == ' ' || c == '\t')) {
+                    chunkState = CHUNK_EXTENSION;
+                } else if (chunkDigits && c == '\r') {
+                    chunkState = CHUNK_SIZE_LF;
+                } else {
+                    chunkState = CHUNK_NONE;
+                    return errorHandler(user);
+                }
+                break;
+            }
+            case CHUNK_EXTENSION:
+                /* Extensions are ignored */
+                if (c == '\r') {
+                    chunkState = CHUNK_SIZE_LF;
+                }
+                break;
+            case CHUNK_SIZE_LF:
+                if (c != '\n') {
+                    chunkState = CHUNK_NONE;
+                    return errorHandler(user);
+                }
+                /* The last chunk is empty and followed by optional trailers */
+                chunkState = chunkRemaining ? CHUNK_DATA : CHUNK_TRAILER;
+                break;
+            case CHUNK_DATA_CR:
+            case CHUNK_DATA_LF:
+                if (c != (chunkState == CHUNK_DATA_CR ? '\r' : '\n')) {
+                    chunkState = CHUNK_NONE;
+                    return errorHandler(user);
+                }
+                if (chunkState == CHUNK_DATA_CR) {
+                    chunkState = CHUNK_DATA_LF;
+                } else {
+                    chunkState = CHUNK_SIZE;
+                    chunkDigits = 0;
+                }
+                break;
+            case CHUNK_TRAILER:
+                chunkState = c == '\r' ? CHUNK_END_LF : CHUNK_TRAILER_LINE;
+                break;
+            case CHUNK_TRAILER_LINE:
+                /* Trailers are ignored */
+                if (c == '\r') {
+                    chunkState = CHUNK_TRAILER_LF;
+                }
+                break;
+            case CHUNK_TRAILER_LF:
+                if (c != '\n') {
+                    chunkState = CHUNK_NONE;
+                    return errorHandler(user);
+                }
+                chunkState = CHUNK_TRAILER;
+                break;
+            case CHUNK_END_LF:
+                chunkState = CHUNK_NONE;
+                if (c != '\n') {
+                    return errorHandler(user);
+                }
+                /* Signal the end of the body, leaving anything following for the next request */
+                return dataHandler(user, {}, true);
+            default:
+                break;
+            }
+        }
+        return user;
+    }
+
+    /* Walks the header lines of fallback we have not seen yet exactly like getHeaders does, without modifying them.
+     * Returns true once getHeaders would get to a conclusion, so that we parse the head once and not on every read */
+    bool scanFallback() {
+        char *data = fallback->buffer.data();
+        size_t length = fallback->buffer.length();
+
+        while (true) {
+            /* The key ends at ':' or anything below 33, we need that byte and the one after it */
+            size_t p = fallback->scanned;
+            for (; p < length && (data[p] != ':') & (data[p] > 32); p++);
+            if (p + 1 >= length) {
+                return false;
+            }
+
+            /* The end of the head, or an error */
+            if (data[p] == '\r') {
+                return true;
+            }
+
+            for (p++; p < length && (data[p] == ':' || data[p] < 33) && data[p] != '\r'; p++);
+            char *carriageReturn = (char *) memchr(data + p, '\r', length - p);
+            if (!carriageReturn || carriageReturn + 1 == data + length) {
+                return false;
+            }
+
+            /* An error */
+            if (carriageReturn[1] != '\n') {
+                return true;
+            }
+
+            /* A complete header line, getHeaders gives up at MAX_HEADERS */
+            fallback->scanned = (size_t) (carriageReturn + 2 - data);
+            if (++fallback->lines >= HttpRequest::MAX_HEADERS) {
+                return true;
+            }
+        }
+    }
+
+    void startChunks() {
+        chunkState = CHUNK_SIZE;
+        chunkDigits = 0;
+        chunkRemaining = 0;
+    }
 
     static unsigned int toUnsignedInteger(std::string_view str) {
         unsigned int unsignedIntegerValue = 0;
@@ -142,11 +471,64 @@ private:
         return unsignedIntegerValue;
     }
 
-    static unsigned int getHeaders(char *postPaddedBuffer, char *end, struct HttpRequest::Header *headers) {
+#ifdef UWS_HTTP_VECTOR_SCAN
+    static inline int firstSet(int mask) {
+#ifdef _MSC_VER
+        unsigned long index;
+        _BitScanForward(&index, (unsigned long) mask);
+        return (int) index;
+#else
+        return __builtin_ctz((unsigned int) mask);
+#endif
+    }
+
+    /* Lowercases a key 16 bytes at a time, stopping at ':' or anything below 33 exactly like the scalar loop.
+     * The fence at end makes us stop before it, the post padding makes it fine to load and store past it */
+    static inline char *consumeKey(char *p) {
+        const __m128i colon = _mm_set1_epi8(':'), space = _mm_set1_epi8(33), lowerCase = _mm_set1_epi8(32);
+        const __m128i indices = _mm_setr_epi8(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+        for (;; p += 16) {
+            __m128i v = _mm_loadu_si128((__m128i *) p);
+            int stops = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v, colon), _mm_cmplt_epi8(v, space)));
+            if (!stops) {
+                _mm_storeu_si128((__m128i *) p, _mm_or_si128(v, lowerCase));
+            } else {
+                /* Only what comes before the stop is part of the key */
+                int length = firstSet(stops);
+                __m128i key = _mm_cmplt_epi8(indices, _mm_set1_epi8((char) length));
+                _mm_storeu_si128((__m128i *) p, _mm_or_si128(v, _mm_and_si128(key, lowerCase)));
+                return p + length;
+            }
+        }
+    }
+
+    /* Like memchr for '\r' but relying on the fence at end, returns nullptr if we only found the fence */
+    static inline char *findCarriageReturn(char *p, char *end) {
+        const __m128i carriageReturn = _mm_set1_epi8('\r');
+        for (;; p += 16) {
+            int found = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((__m128i *) p), carriageReturn));
+            if (found) {
+                p += firstSet(found);
+                return p == end ? nullptr : p;
+            }
+        }
+    }
+#endif
+
+    static unsigned int getHeaders(char *postPaddedBuffer, char *end, HttpRequest *req) {
         char *preliminaryKey, *preliminaryValue, *start = postPaddedBuffer;
+        struct HttpRequest::Header *headers = req->headers;
+
+        /* Headers following one with an empty key are never visible, as with iteration */
+        req->resetIndex();
+        bool indexing = true;
 
         for (unsigned int i = 0; i < HttpRequest::MAX_HEADERS; i++) {
+#ifdef UWS_HTTP_VECTOR_SCAN
+            postPaddedBuffer = consumeKey(preliminaryKey = postPaddedBuffer);
+#else
             for (preliminaryKey = postPaddedBuffer; (*postPaddedBuffer != ':') & (*postPaddedBuffer > 32); *(postPaddedBuffer++) |= 32);
+#endif
             if (*postPaddedBuffer == '\r') {
                 if ((postPaddedBuffer != end) & (postPaddedBuffer[1] == '\n') & (i > 0)) {
                     headers->key = std::string_view(nullptr, 0);
@@ -158,10 +540,19 @@ private:
                 headers->key = std::string_view(preliminaryKey, (size_t) (postPaddedBuffer - preliminaryKey));
                 for (postPaddedBuffer++; (*postPaddedBuffer == ':' || *postPaddedBuffer < 33) && *postPaddedBuffer != '\r'; postPaddedBuffer++);
                 preliminaryValue = postPaddedBuffer;
+#ifdef UWS_HTTP_VECTOR_SCAN
+                postPaddedBuffer = findCarriageReturn(postPaddedBuffer, end);
+#else
                 postPaddedBuffer = (char *) memchr(postPaddedBuffer, '\r', end - postPaddedBuffer);
+#endif
                 if (postPaddedBuffer && postPaddedBuffer[1] == '\n') {
                     headers->value = std::string_view(preliminaryValue, (size_t) (postPaddedBuffer - preliminaryValue));
                     postPaddedBuffer += 2;
+
+                    /* The request line is not a header */
+                    if (i > 0 && (indexing = indexing && headers->key.length())) {
+                        req->indexHeader((unsigned char) i);
+                    }
                     headers++;
                 } else {
                     return 0;
@@ -173,11 +564,11 @@ private:
 
     // the only caller of getHeaders
     template <int CONSUME_MINIMALLY>
-    std::pair<int, void *> fenceAndConsumePostPadded(char *data, int length, void *user, HttpRequest *req, fu2::unique_function<void *(void *, HttpRequest *)> &requestHandler, fu2::unique_function<void *(void *, std::string_view, bool)> &dataHandler) {
+    std::pair<int, void *> fenceAndConsumePostPadded(char *data, int length, void *user, HttpRequest *req, fu2::unique_function<void *(void *, HttpRequest *)> &requestHandler, fu2::unique_function<void *(void *, std::string_view, bool)> &dataHandler, fu2::unique_function<void *(void *)> &errorHandler) {
         int consumedTotal = 0;
         data[length] = '\r';
 
-        for (int consumed; length && (consumed = getHeaders(data, data + length, req->headers)); ) {
+        for (int consumed; length && (consumed = getHeaders(data, data + length, req)); ) {
             data += consumed;
             length -= consumed;
             consumedTotal += consumed;
@@ -188,6 +579,9 @@ private:
             const char *querySeparatorPtr = (const char *) memchr(req->headers->value.data(), '?', req->headers->value.length());
             req->querySeparator = (querySeparatorPtr ? querySeparatorPtr : req->headers->value.data() + req->headers->value.length()) - req->headers->value.data();
 
+            /* Until routed */
+            req->currentParameters = {-1, nullptr};
+
             /* If returned socket is not what we put in we need
              * to break here as we either have upgraded to
              * WebSockets or otherwise closed the socket. */
@@ -198,9 +592,20 @@ private:
             }
 
             // todo: do not check this for GET (get should not have a body)
-            // todo: also support reading chunked streams
-            std::string_view contentLengthString = req->getHeader("content-length");
-            if (contentLengthString.length()) {
+            std::string_view contentLengthString = req->getHeader(HttpRequest::CONTENT_LENGTH);
+            if (isChunked(req->getHeader(HttpRequest::TRANSFER_ENCODING))) {
+                /* Chunked takes precedence over any content-length */
+                startChunks();
+
+                if (!CONSUME_MINIMALLY) {
+                    int unconsumed = length;
+                    void *returnedUser = consumeChunks(data, length, user, dataHandler, errorHandler);
+                    consumedTotal += unconsumed - length;
+                    if (returnedUser != user) {
+                        return {consumedTotal, returnedUser};
+                    }
+                }
+            } else if (contentLengthString.length()) {
                 remainingStreamingBytes = toUnsignedInteger(contentLengthString);
 
                 if (!CONSUME_MINIMALLY) {
@@ -225,13 +630,30 @@ private:
     }
 
 public:
+    HttpParser() = default;
+    HttpParser(const HttpParser &) = delete;
+    HttpParser &operator=(const HttpParser &) = delete;
+
+    ~HttpParser() {
+        delete fallback;
+    }
+
+    /* Bytes of a partial request kept until the rest of it arrives */
+    size_t getFallbackLength() {
+        return fallback ? fallback->buffer.length() : 0;
+    }
 
     /* We do this to prolong the validity of parsed headers by keeping only the fallback buffer alive */
-    std::string &&salvageFallbackBuffer() {
-        return std::move(fallback);
+    std::string salvageFallbackBuffer() {
+        if (!fallback) {
+            return {};
+        }
+        fallback->scanned = 0;
+        fallback->lines = 0;
+        return std::move(fallback->buffer);
     }
 
-    void *consumePostPadded(char *data, int length, void *user, fu2::unique_function<void *(void *, HttpRequest *)> &&requestHandler, fu2::unique_function<void *(void *, std::string_view, bool)> &&dataHandler, fu2::unique_function<void *(void *)> &&errorHandler) {
+    void *consumePostPadded(char *data, int length, void *user, fu2::unique_function<void *(void *, HttpRequest *)> &&requestHandler, fu2::unique_function<void *(void *, std::string_view, bool)> &&dataHandler, fu2::unique_function<void *(void *)> &&errorHandler, unsigned int maxHeaderSize = DEFAULT_MAX_HEADER_SIZE) {
 
         HttpRequest req;
 
@@ -256,24 +678,39 @@ public:
                 }
             }
 
-        } else if (fallback.length()) {
-            int had = fallback.length();
+        } else if (chunkState) {
+            void *returnedUser = consumeChunks(data, length, user, dataHandler, errorHandler);
+            if (returnedUser != user) {
+                return returnedUser;
+            }
+        } else if (getFallbackLength()) {
+            std::string &buffer = fallback->buffer;
+            int had = buffer.length();
 
-            int maxCopyDistance = std::min(MAX_FALLBACK_SIZE - fallback.length(), (size_t) length);
+            int maxCopyDistance = (int) std::min((size_t) maxHeaderSize - std::min<size_t>(maxHeaderSize, buffer.length()), (size_t) length);
 
-            /* We don't want fallback to be short string optimized, since we want to move it */
-            fallback.reserve(fallback.length() + maxCopyDistance + std::max<int>(MINIMUM_HTTP_POST_PADDING, sizeof(std::string)));
-            fallback.append(data, maxCopyDistance);
+            /* We don't want fallback to be short string optimized, since we want to move it.
+             * Growing geometrically keeps a slowly dripping head from being copied over and over */
+            size_t neededCapacity = buffer.length() + maxCopyDistance + std::max<int>(MINIMUM_HTTP_POST_PADDING, sizeof(std::string));
+            if (buffer.capacity() < neededCapacity) {
+                buffer.reserve(std::max(neededCapacity, buffer.capacity() * 2));
+            }
+            buffer.append(data, maxCopyDistance);
 
             // break here on break
-            std::pair<int, void *> consumed = fenceAndConsumePostPadded<true>(fallback.data(), fallback.length(), user, &req, requestHandler, dataHandler);
+            std::pair<int, void *> consumed = {0, user};
+            if (scanFallback()) {
+                consumed = fenceAndConsumePostPadded<true>(buffer.data(), buffer.length(), user, &req, requestHandler, dataHandler, errorHandler);
+            }
             if (consumed.second != user) {
                 return consumed.second;
             }
 
             if (consumed.first) {
 
-                fallback.clear();
+                buffer.clear();
+                fallback->scanned = 0;
+                fallback->lines = 0;
 
                 data += consumed.first - had;
                 length -= consumed.first - had;
@@ -296,10 +733,15 @@ public:
                             return returnedUser;
                         }
                     }
+                } else if (chunkState) {
+                    void *returnedUser = consumeChunks(data, length, user, dataHandler, errorHandler);
+                    if (returnedUser != user) {
+                        return returnedUser;
+                    }
                 }
 
             } else {
-                if (fallback.length() == MAX_FALLBACK_SIZE) {
+                if (buffer.length() >= maxHeaderSize) {
                     // note: you don't really need error handler, just return something strange!
                     // we could have it return a constant pointer to denote error!
                     return errorHandler(user);
@@ -308,7 +750,7 @@ public:
             }
         }
 
-        std::pair<int, void *> consumed = fenceAndConsumePostPadded<false>(data, length, user, &req, requestHandler, dataHandler);
+        std::pair<int, void *> consumed = fenceAndConsumePostPadded<false>(data, length, user, &req, requestHandler, dataHandler, errorHandler);
         if (consumed.second != user) {
             return consumed.second;
         }
@@ -317,8 +759,11 @@ public:
         length -= consumed.first;
 
         if (length) {
-            if (length < MAX_FALLBACK_SIZE) {
-                fallback.append(data, length);
+            if ((unsigned int) length < maxHeaderSize) {
+                if (!fallback) {
+                    fallback = new Fallback;
+                }
+                fallback->buffer.append(data, length);
             } else {
                 return errorHandler(user);
             }
@@ -24,10 +24,14 @@
 #include "HttpResponseData.h"
 #include "HttpContextData.h"
 #include "Utilities.h"
+#include "StaticFile.h"
+#include "HttpResponseTemplate.h"
+#include "Loop.h"
 
 #include "f2/function2.hpp"
 
-/* todo: tryWrite is missing currently, only send smaller segments with write */
+#include <memory>
+#include <algorithm>
 
 namespace uWS {
 
@@ -47,15 +51,6 @@ private:
         return (HttpResponseData<SSL> *) Super::getAsyncSocketData();
     }
 
-    /* Write an unsigned 32-bit integer in hex */
-    void writeUnsignedHex(unsigned int value) {
-        char buf[10];
-        int length = utils::u32toaHex(value, buf);
-
-        /* For now we do this copy */
-        Super::write(buf, length);
-    }
-
     /* Write an unsigned 32-bit integer */
     void writeUnsigned(unsigned int value) {
         char buf[10];
@@ -67,9 +62,11 @@ private:
 
     /* When we are done with a response we mark it like so */
     void markDone(HttpResponseData<SSL> *httpResponseData) {
-        httpResponseData->onAborted = nullptr;
-        /* Also remove onWritable so that we do not emit when draining behind the scenes. */
-        httpResponseData->onWritable = nullptr;
+        if (httpResponseData->handlers) {
+            httpResponseData->handlers->onAborted = nullptr;
+            /* Also remove onWritable so that we do not emit when draining behind the scenes. */
+            httpResponseData->handlers->onWritable = nullptr;
+        }
 
         /* We are done with this request */
         httpResponseData->state &= ~HttpResponseData<SSL>::HTTP_RESPONSE_PENDING;
@@ -80,6 +77,52 @@ private:
         writeHeader("uWebSockets", "v0.16");
     }
 
+    /* Writes data in chunked encoding, first completing any chunk left open by an optional write.
+     * Returns how many bytes of data were accepted and whether we failed (wait for writable) */
+    std::pair<int, bool> internalWrite(std::string_view data, bool optional) {
+        HttpResponseData<SSL> *httpResponseData = getHttpResponseData();
+        int accepted = 0;
+        bool owedFailed = false;
+
+        /* What an earlier chunk header promised goes out raw */
+        if (httpResponseData->chunkRemaining) {
+            int owed = (int) std::min<size_t>(httpResponseData->chunkRemaining, data.length());
+            auto [written, failed] = Super::write(data.data(), owed, optional);
+            httpResponseData->chunkRemaining -= written;
+            httpResponseData->offset += written;
+            accepted = written;
+            owedFailed = failed;
+            if ((failed && optional) || httpResponseData->chunkRemaining) {
+                return {accepted, failed};
+            }
+            data.remove_prefix(owed);
+        }
+
+        if (!data.length()) {
+            return {accepted, owedFailed};
+        }
+
+        /* Chunk header and data leave together */
+        char header[14] = "\r\n";
+        int headerLength = utils::u32toaHex(data.length(), header + 2) + 2;
+        header[headerLength++] = '\r';
+        header[headerLength++] = '\n';
+        std::string_view chunks[] = {{header, (size_t) headerLength}, data};
+        auto [written, failed] = Super::writev(chunks, 2, optional);
+
+        /* The header is never optional, whatever of it did not make it is buffered behind what did */
+        if (written < headerLength) {
+            Super::write(header + written, headerLength - written);
+            written = headerLength;
+        }
+
+        /* The rest of this chunk is owed by the next write */
+        int dataWritten = written - headerLength;
+        httpResponseData->chunkRemaining = (unsigned int) (data.length() - dataWritten);
+        httpResponseData->offset += dataWritten;
+        return {accepted + dataWritten, failed || owedFailed};
+    }
+
     /* Returns true on success, indicating that it might be feasible to write more data.
      * Will start timeout if stream reaches totalSize or write failure. */
     bool internalEnd(std::string_view data, int totalSize, bool optional, bool allowContentLength = true) {
@@ -94,24 +137,37 @@ private:
         HttpResponseData<SSL> *httpResponseData = getHttpResponseData();
         if (httpResponseData->state & HttpResponseData<SSL>::HTTP_WRITE_CALLED) {
 
-            /* We do not have tryWrite-like functionalities, so ignore optional in this path */
+            /* Optional ends, or ends completing an open chunk, write the data first and terminate once it is all out */
+            if (optional || httpResponseData->chunkRemaining) {
+                auto [accepted, failed] = internalWrite(data, optional);
+                if (accepted < (int) data.length() || (optional && failed)) {
+                    Super::timeout(HTTP_TIMEOUT_S);
+                    return false;
+                }
+
+                /* Ending short of what the open chunk promised cannot be framed */
+                if (httpResponseData->chunkRemaining) {
+                    Super::close();
+                    return false;
+                }
 
-            /* Do not allow sending 0 chunk here */
-            if (data.length()) {
-                Super::write("\r\n", 2);
-                writeUnsignedHex(data.length());
-                Super::write("\r\n", 2);
+                Super::write("\r\n0\r\n\r\n", 7);
+            } else if (data.length()) {
+                /* Do not allow sending 0 chunk here */
+                char hex[10];
+                int hexLength = utils::u32toaHex(data.length(), hex);
 
                 /* Ignoring optional for now */
-                Super::write(data.data(), data.length());
+                std::string_view chunks[] = {"\r\n", {hex, (size_t) hexLength}, "\r\n", data, "\r\n0\r\n\r\n"};
+                Super::writev(chunks, 5);
+                httpResponseData->offset += (int) data.length();
+            } else {
+                /* Terminating 0 chunk */
+                Super::write("\r\n0\r\n\r\n", 7);
             }
 
-            /* Terminating 0 chunk */
-            Super::write("\r\n0\r\n\r\n", 7);
-
             markDone(httpResponseData);
 
-            /* tryEnd can never fail when in chunked mode, since we do not have tryWrite (yet), only write */
             Super::timeout(HTTP_TIMEOUT_S);
             return true;
         } else {
@@ -158,11 +214,121 @@ private:
         }
     }
 
+    /* Writes the head of a template in one go, unless end was already called */
+    void writeTemplate(const HttpResponseTemplate &responseTemplate, unsigned int totalSize) {
+        HttpResponseData<SSL> *httpResponseData = getHttpResponseData();
+        if (httpResponseData->state & (HttpResponseData<SSL>::HTTP_END_CALLED | HttpResponseData<SSL>::HTTP_WRITE_CALLED)) {
+            return;
+        }
+
+        /* A status written by hand replaces the one of the template */
+        size_t skip = (httpResponseData->state & HttpResponseData<SSL>::HTTP_STATUS_CALLED) ? responseTemplate.statusLength : 0;
+        size_t headLength = responseTemplate.head.length() - skip;
+
+        auto [sendBuffer, requiresWrite] = Super::getSendBuffer(headLength + 14);
+        memcpy(sendBuffer, responseTemplate.head.data() + skip, headLength);
+        if (responseTemplate.dateOffset != -1) {
+            Loop *loop = (Loop *) us_socket_context_loop(SSL, us_socket_context(SSL, (us_socket_t *) this));
+            memcpy(sendBuffer + responseTemplate.dateOffset - skip, loop->getDate().data(), HttpResponseTemplate::DATE_LENGTH);
+        }
+        size_t length = headLength + utils::u32toa(totalSize, sendBuffer + headLength);
+        memcpy(sendBuffer + length, "\r\n\r\n", 4);
+        length += 4;
+
+        if (requiresWrite) {
+            Super::write(sendBuffer, (int) length);
+            Super::freeSendBuffer(sendBuffer, headLength + 14);
+        } else {
+            /* Give back what the Content-Length did not need */
+            LoopData *loopData = Super::getLoopData();
+            loopData->corkOffset -= (int) (headLength + 14 - length);
+            loopData->corkedBytes += (int) length;
+        }
+
+        httpResponseData->state |= HttpResponseData<SSL>::HTTP_STATUS_CALLED | HttpResponseData<SSL>::HTTP_END_CALLED;
+    }
+
     /* This call is identical to end, but will never write content-length and is thus suitable for upgrades */
     void upgrade() {
         internalEnd({nullptr, 0}, 0, false, false);
     }
 
+#ifndef _WIN32
+    /* Sends what is left of the file. Returns 1 when done (and marked so), 0 when waiting for writable and -1 if we closed.
+     * Nothing is touched after the response is marked done, as that destroys the onWritable handler calling us */
+    int streamFile(StaticFile *file, size_t &fileOffset) {
+        HttpResponseData<SSL> *httpResponseData = getHttpResponseData();
+
+#ifdef UWS_HAS_SENDFILE
+        if constexpr (!SSL) {
+            LoopData *loopData = Super::getLoopData();
+            AsyncSocketData<SSL> *asyncSocketData = Super::getAsyncSocketData();
+
+            /* Whatever is corked or buffered has to leave before the file does */
+            if (loopData->corkedSocket == this && !Super::flushCork(loopData, asyncSocketData)) {
+                Super::timeout(HTTP_TIMEOUT_S);
+                return 0;
+            }
+            if (asyncSocketData->buffer.length() && Super::write(nullptr, 0, true).second) {
+                Super::timeout(HTTP_TIMEOUT_S);
+                return 0;
+            }
+
+            int fd = us_poll_fd((us_poll_t *) this);
+            while (fileOffset < file->size) {
+                size_t remaining = file->size - fileOffset;
+                off_t offset = (off_t) fileOffset;
+                ssize_t sent = sendfile(fd, file->fd, &offset, remaining);
+                if (sent > 0) {
+                    fileOffset += sent;
+                    httpResponseData->offset += (int) sent;
+                    if ((size_t) sent == remaining) {
+                        break;
+                    }
+                }
+
+                /* sendfile bypasses uSockets, so a one byte write takes its place in failing and polling for writable */
+                char next;
+                if (pread(file->fd, &next, 1, (off_t) fileOffset) != 1) {
+                    /* The file shrunk under us, we cannot deliver what Content-Length promised */
+                    Super::close();
+                    return -1;
+                }
+                if (us_socket_write(SSL, (us_socket_t *) this, &next, 1, 0) != 1) {
+                    Super::timeout(HTTP_TIMEOUT_S);
+                    return 0;
+                }
+                fileOffset++;
+                httpResponseData->offset++;
+            }
+        } else
+#endif
+        {
+            std::string_view body = file->view();
+            if (file->size && !body.data()) {
+                Super::close();
+                return -1;
+            }
+
+            /* Write as much as possible without causing backpressure, in bounded chunks */
+            while (fileOffset < file->size) {
+                int chunkLength = (int) std::min<size_t>(file->size - fileOffset, 1024 * 1024);
+                auto [written, failed] = Super::write(body.data() + fileOffset, chunkLength, true);
+                fileOffset += written;
+                httpResponseData->offset += written;
+                if (failed) {
+                    Super::timeout(HTTP_TIMEOUT_S);
+                    return 0;
+                }
+            }
+        }
+
+        Super::timeout(HTTP_TIMEOUT_S);
+        markDone(httpResponseData);
+        return 1;
+    }
+#endif
+
 public:
     /* Immediately terminate this Http response */
     using Super::close;
@@ -184,9 +350,8 @@ public:
         /* Update status */
         httpResponseData->state |= HttpResponseData<SSL>::HTTP_STATUS_CALLED;
 
-        Super::write("HTTP/1.1 ", 9);
-        Super::write(status.data(), status.length());
-        Super::write("\r\n", 2);
+        std::string_view chunks[] = {"HTTP/1.1 ", status, "\r\n"};
+        Super::writev(chunks, 3);
         return this;
     }
 
@@ -194,10 +359,8 @@ public:
     HttpResponse *writeHeader(std::string_view key, std::string_view value) {
         writeStatus(HTTP_200_OK);
 
-        Super::write(key.data(), key.length());
-        Super::write(": ", 2);
-        Super::write(value.data(), value.length());
-        Super::write("\r\n", 2);
+        std::string_view chunks[] = {key, ": ", value, "\r\n"};
+        Super::writev(chunks, 4);
         return this;
     }
 
@@ -215,20 +378,66 @@ public:
         internalEnd(data, data.length(), false);
     }
 
+#ifndef _WIN32
+    /* End the response with a file and its precomputed headers. Plaintext sockets send it straight from the page cache
+     * with sendfile, SSL sockets write it from a mapping. What does not fit is streamed on writable, keeping the file alive */
+    void endFile(std::shared_ptr<StaticFile> file) {
+        writeStatus(HTTP_200_OK);
+
+        HttpResponseData<SSL> *httpResponseData = getHttpResponseData();
+        if (!(httpResponseData->state & HttpResponseData<SSL>::HTTP_END_CALLED)) {
+            writeMark();
+            Super::write(file->headers.data(), (int) file->headers.length());
+            httpResponseData->state |= HttpResponseData<SSL>::HTTP_END_CALLED;
+        }
+
+        size_t fileOffset = 0;
+        if (streamFile(file.get(), fileOffset) == 0) {
+            typename HttpResponseData<SSL>::Handlers *handlers = httpResponseData->getHandlers();
+            handlers->onWritable = [this, file, fileOffset](int) mutable {
+                return streamFile(file.get(), fileOffset) == 1;
+            };
+
+            /* We have not responded yet, so we need an abort handler */
+            if (!handlers->onAborted) {
+                handlers->onAborted = []() {};
+            }
+        }
+    }
+#endif
+
+    /* End the response without any body nor Content-Length, as required for 304 Not Modified */
+    void endWithoutBody() {
+        internalEnd({nullptr, 0}, 0, false, false);
+    }
+
+    /* End the response with the head of a template, filling in Date and Content-Length */
+    void end(const HttpResponseTemplate &responseTemplate, std::string_view data = {}) {
+        writeTemplate(responseTemplate, (unsigned int) data.length());
+        internalEnd(data, data.length(), false);
+    }
+
+    /* Like tryEnd, with the head of a template */
+    std::pair<bool, bool> tryEnd(const HttpResponseTemplate &responseTemplate, std::string_view data, int totalSize = 0) {
+        writeTemplate(responseTemplate, (unsigned int) (totalSize ? totalSize : data.length()));
+        return {internalEnd(data, totalSize, true), hasResponded()};
+    }
+
     /* Try and end the response. Returns [true, true] on success.
      * Starts a timeout in some cases. Returns [ok, hasResponded] */
     std::pair<bool, bool> tryEnd(std::string_view data, int totalSize = 0) {
         return {internalEnd(data, totalSize, true), hasResponded()};
     }
 
-    /* Write parts of the response in chunking fashion. Starts timeout if failed. */
-    bool write(std::string_view data) {
+private:
+    /* Shared by write and tryWrite, the first call starts chunked encoding */
+    std::pair<int, bool> chunkedWrite(std::string_view data, bool optional) {
         writeStatus(HTTP_200_OK);
 
         /* Do not allow sending 0 chunks, they mark end of response */
         if (!data.length()) {
             /* If you called us, then according to you it was fine to call us so it's fine to still call us */
-            return true;
+            return {0, false};
         }
 
         HttpResponseData<SSL> *httpResponseData = getHttpResponseData();
@@ -241,17 +450,25 @@ public:
             httpResponseData->state |= HttpResponseData<SSL>::HTTP_WRITE_CALLED;
         }
 
-        Super::write("\r\n", 2);
-        writeUnsignedHex(data.length());
-        Super::write("\r\n", 2);
-
-        auto [written, failed] = Super::write(data.data(), data.length());
+        auto [accepted, failed] = internalWrite(data, optional);
         if (failed) {
             Super::timeout(HTTP_TIMEOUT_S);
         }
+        return {accepted, failed};
+    }
 
+public:
+    /* Write parts of the response in chunking fashion, buffering what does not fit. Starts timeout if failed. */
+    bool write(std::string_view data) {
         /* If we did not fail the write, accept more */
-        return !failed;
+        return !chunkedWrite(data, false).second;
+    }
+
+    /* Write parts of the response in chunking fashion without buffering anything. Returns how many bytes were accepted,
+     * anything less than all means wait for onWritable and continue from its offset (getWriteOffset counts accepted bytes).
+     * A partly accepted chunk stays open, so the next write, tryWrite or tryEnd has to start with the rest of the data */
+    int tryWrite(std::string_view data) {
+        return chunkedWrite(data, true).first;
     }
 
     /* Get the current byte write offset for this Http response */
@@ -294,7 +511,7 @@ public:
     HttpResponse *onWritable(fu2::unique_function<bool(int)> &&handler) {
         HttpResponseData<SSL> *httpResponseData = getHttpResponseData();
 
-        httpResponseData->onWritable = std::move(handler);
+        httpResponseData->getHandlers()->onWritable = std::move(handler);
         return this;
     }
 
@@ -302,14 +519,24 @@ public:
     HttpResponse *onAborted(fu2::unique_function<void()> &&handler) {
         HttpResponseData<SSL> *httpResponseData = getHttpResponseData();
 
-        httpResponseData->onAborted = std::move(handler);
+        httpResponseData->getHandlers()->onAborted = std::move(handler);
         return this;
     }
 
+    /* Copies req for a response sent after returning from the handler, valid until this response ended, was aborted or upgraded.
+     * Headers, url, query and parameters need not be copied one by one then, and the memory is reused by the requests to follow */
+    HttpRequest *pin(HttpRequest *req) {
+        typename HttpResponseData<SSL>::Handlers *handlers = getHttpResponseData()->getHandlers();
+        if (!handlers->requestArena) {
+            handlers->requestArena = new HttpRequestArena;
+        }
+        return handlers->requestArena->pin(req);
+    }
+
     /* Attach a read handler for data sent. Will be called with FIN set true if last segment. */
     void onData(fu2::unique_function<void(std::string_view, bool)> &&handler) {
         HttpResponseData<SSL> *data = getHttpResponseData();
-        data->inStream = std::move(handler);
+        data->getHandlers()->inStream = std::move(handler);
     }
 };
 
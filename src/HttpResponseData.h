@@ -22,6 +22,7 @@
 
 #include "HttpParser.h"
 #include "AsyncSocketData.h"
+#include "Metrics.h"
 
 #include "f2/function2.hpp"
 
@@ -41,17 +42,52 @@ private:
         HTTP_ENDED_STREAM_OUT = 16 // not used
     };
 
-    /* Per socket event handlers */
-    fu2::unique_function<bool(int)> onWritable;
-    fu2::unique_function<void()> onAborted;
-    fu2::unique_function<void(std::string_view, bool)> inStream; // onData
+    /* Per socket event handlers, off the socket as most requests are answered right away. Created on first use and kept for the requests to follow */
+    struct Handlers {
+        fu2::unique_function<bool(int)> onWritable;
+        fu2::unique_function<void()> onAborted;
+        fu2::unique_function<void(std::string_view, bool)> inStream; // onData
+
+        /* Where requests answered later are pinned, see HttpResponse::pin */
+        HttpRequestArena *requestArena = nullptr;
+
+        ~Handlers() {
+            delete requestArena;
+        }
+    } *handlers = nullptr;
+
+    Handlers *getHandlers() {
+        if (!handlers) {
+            handlers = new Handlers;
+        }
+        return handlers;
+    }
+
+    /* The route of the current request, its body is traced there too */
+    Metrics::TracePoint *tracePoint = nullptr;
+
     /* Outgoing offset */
     int offset = 0;
 
+    /* Bytes still owed to a chunk header already sent */
+    unsigned int chunkRemaining = 0;
+
     /* Current state (content-length sent, status sent, write called, etc */
     int state = 0;
+
+public:
+    HttpResponseData() = default;
+    HttpResponseData(const HttpResponseData &) = delete;
+    HttpResponseData &operator=(const HttpResponseData &) = delete;
+
+    ~HttpResponseData() {
+        delete handlers;
+    }
 };
 
+/* Every socket carries one, mind what is added */
+static_assert(sizeof(HttpResponseData<false>) <= 64, "HttpResponseData grew past its budget");
+
 }
 
 #endif // UWS_HTTPRESPONSEDATA_H
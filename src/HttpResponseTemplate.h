@@ -0,0 +1,66 @@
+/*
+ * Authored by Alex Hultman, 2018-2019.
+ * Intellectual property of third-party.
+
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+
+ *     http://www.apache.org/licenses/LICENSE-2.0
+
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef UWS_HTTPRESPONSETEMPLATE_H
+#define UWS_HTTPRESPONSETEMPLATE_H
+
+/* A response head serialized once, status line and static headers included, with slots
+ * for the cached Date and the Content-Length. Emitted with one copy into the cork buffer */
+
+#include <string>
+#include <string_view>
+#include <initializer_list>
+#include <utility>
+
+namespace uWS {
+
+struct HttpResponseTemplate {
+    template <bool> friend struct HttpResponse;
+private:
+    /* Width of an IMF-fixdate such as "Sun, 06 Nov 1994 08:49:37 GMT" */
+    static const int DATE_LENGTH = 29;
+
+    /* Ends with "Content-Length: ", the value and the blank line follow per response */
+    std::string head;
+    size_t statusLength = 0;
+    int dateOffset = -1;
+
+public:
+    HttpResponseTemplate(std::string_view status, std::initializer_list<std::pair<std::string_view, std::string_view>> headers, bool date = true) {
+        head.append("HTTP/1.1 ").append(status).append("\r\n");
+        statusLength = head.length();
+
+        for (auto &header : headers) {
+            head.append(header.first).append(": ").append(header.second).append("\r\n");
+        }
+
+        /* Same mark as writeMark */
+        head.append("uWebSockets: v0.16\r\n");
+
+        if (date) {
+            head.append("Date: ");
+            dateOffset = (int) head.length();
+            head.append(DATE_LENGTH, ' ').append("\r\n");
+        }
+
+        head.append("Content-Length: ");
+    }
+};
+
+}
+
+#endif // UWS_HTTPRESPONSETEMPLATE_H
@@ -26,9 +26,9 @@
 #include <map>
 #include <vector>
 #include <cstring>
+#include <cstdint>
 #include <iostream>
 #include <string_view>
-#include <sstream>
 #include <string>
 
 #include "f2/function2.hpp"
@@ -66,16 +66,138 @@ private:
 
     HttpRouter(const HttpRouter &other) = delete;
 
+    /* The tree we add routes to, it is compiled into the flat form below before routing */
     struct Node {
         std::string name;
         std::vector<Node *> children;
         short handler = 0; // unhandled
     } tree;
 
+    enum ChildKind : unsigned char {
+        STATIC,
+        PARAMETER,
+        WILDCARD
+    };
+
+    /* A compiled child, ordinal is its position among its siblings which decides matching order */
+    struct CompiledChild {
+        unsigned int node;
+        unsigned int ordinal;
+    };
+
+    /* Static children live in a collision free hash table, parameters and wildcards are listed in order */
+    struct CompiledNode {
+        unsigned int nameOffset, nameLength;
+        ChildKind kind;
+        short handler;
+        unsigned int firstDynamic, numDynamic;
+        unsigned int firstSlot, slotMask, seed;
+    };
+
+    /* Everything the matcher touches, contiguous and rebuilt by compile() */
+    std::vector<CompiledNode> compiledNodes;
+    std::vector<CompiledChild> dynamicChildren;
+    std::vector<CompiledChild> staticSlots;
+    std::string compiledNames;
+    bool compiled = false;
+
+    /* An empty static slot */
+    static const unsigned int NO_NODE = UINT32_MAX;
+
+    /* Explicit stack replacing recursion, one frame per URL segment plus the method */
+    struct Frame {
+        unsigned int node;
+        int urlSegment;
+        unsigned int nextDynamic;
+        CompiledChild staticMatch;
+        bool pushedParameter;
+    } frames[MAX_URL_SEGMENTS + 2];
+
     std::string_view currentUrl;
     std::string_view urlSegmentVector[MAX_URL_SEGMENTS];
     int urlSegmentTop;
 
+    static unsigned int hash(unsigned int seed, std::string_view name) {
+        /* FNV-1a */
+        unsigned int h = 2166136261u ^ seed;
+        for (unsigned char c : name) {
+            h = (h ^ c) * 16777619u;
+        }
+        return h;
+    }
+
+    std::string_view compiledName(const CompiledNode &node) {
+        return std::string_view(compiledNames.data() + node.nameOffset, node.nameLength);
+    }
+
+    /* Flattens a node and all its children, returns its index. The root treats every child as static (methods) */
+    unsigned int compileNode(Node *node, bool isRoot) {
+        unsigned int index = (unsigned int) compiledNodes.size();
+        ChildKind kind = STATIC;
+        if (!isRoot && node != &tree && node->name.length()) {
+            kind = node->name[0] == '*' ? WILDCARD : (node->name[0] == ':' ? PARAMETER : STATIC);
+        }
+        compiledNodes.push_back({(unsigned int) compiledNames.length(), (unsigned int) node->name.length(), kind, node->handler, 0, 0, 0, 0, 0});
+        compiledNames.append(node->name);
+
+        std::vector<CompiledChild> statics, dynamics;
+        for (unsigned int i = 0; i < node->children.size(); i++) {
+            unsigned int child = compileNode(node->children[i], false);
+            if (node == &tree || compiledNodes[child].kind == STATIC) {
+                statics.push_back({child, i});
+            } else {
+                dynamics.push_back({child, i});
+            }
+        }
+
+        CompiledNode &compiledNode = compiledNodes[index];
+        compiledNode.firstDynamic = (unsigned int) dynamicChildren.size();
+        compiledNode.numDynamic = (unsigned int) dynamics.size();
+        dynamicChildren.insert(dynamicChildren.end(), dynamics.begin(), dynamics.end());
+
+        /* Find a table size and seed without collisions, names are unique among siblings */
+        compiledNode.firstSlot = (unsigned int) staticSlots.size();
+        if (statics.size()) {
+            for (unsigned int size = 2; ; size *= 2) {
+                if (size < statics.size() * 2) {
+                    continue;
+                }
+                for (unsigned int seed = 0; seed < 64; seed++) {
+                    std::vector<CompiledChild> slots(size, {NO_NODE, 0});
+                    bool collided = false;
+                    for (CompiledChild &child : statics) {
+                        CompiledChild &slot = slots[hash(seed, compiledName(compiledNodes[child.node])) & (size - 1)];
+                        if (slot.node != NO_NODE) {
+                            collided = true;
+                            break;
+                        }
+                        slot = child;
+                    }
+                    if (!collided) {
+                        compiledNodes[index].slotMask = size - 1;
+                        compiledNodes[index].seed = seed;
+                        staticSlots.insert(staticSlots.end(), slots.begin(), slots.end());
+                        return index;
+                    }
+                }
+            }
+        }
+        return index;
+    }
+
+    /* Returns the static child named so, or NO_NODE */
+    CompiledChild findStatic(const CompiledNode &node, std::string_view name) {
+        /* Tables are at least 2 slots, so a zero mask means no static children */
+        if (!node.slotMask) {
+            return {NO_NODE, 0};
+        }
+        CompiledChild slot = staticSlots[node.firstSlot + (hash(node.seed, name) & node.slotMask)];
+        if (slot.node != NO_NODE && compiledName(compiledNodes[slot.node]) == name) {
+            return slot;
+        }
+        return {NO_NODE, 0};
+    }
+
     /* Set URL for router. Will reset any URL cache */
     inline void setUrl(std::string_view url) {
         /* Remove / from input URL */
@@ -114,49 +236,81 @@ private:
         return urlSegmentVector[urlSegment];
     }
 
-    /* Experimental path, executes as many handlers it can */
-    bool executeHandlers(Node *parent, int urlSegment, USERDATA &userData) {
-        /* If we have no more URL and not on first round, return where we may stand */
-        if (urlSegment && !getUrlSegment(urlSegment).length()) {
-            /* We have reached accross the entire URL with no stoppage, execute */
-            int handlerIndex = parent->handler;
-            if (handlerIndex) {
-                return handlers[handlerIndex](userData, {routeParameters.paramsTop, routeParameters.params});
+    /* Prepares a frame for trying the children of node at urlSegment */
+    void enterFrame(Frame &frame, unsigned int node, int urlSegment) {
+        frame.node = node;
+        frame.urlSegment = urlSegment;
+        frame.nextDynamic = 0;
+        frame.pushedParameter = false;
+        frame.staticMatch = findStatic(compiledNodes[node], getUrlSegment(urlSegment));
+    }
+
+    /* Executes as many handlers it can, in the order of a depth first search through siblings in insertion order */
+    bool executeHandlers(unsigned int methodNode, USERDATA &userData) {
+        int top = 0;
+        enterFrame(frames[0], methodNode, 0);
+
+        while (top >= 0) {
+            Frame &frame = frames[top];
+            CompiledNode &node = compiledNodes[frame.node];
+
+            /* Coming back from a failed parameter match, unwind parameter stack */
+            if (frame.pushedParameter) {
+                routeParameters.pop();
+                frame.pushedParameter = false;
+            }
+
+            /* If we have no more URL and not on first round, return where we may stand */
+            if (frame.urlSegment && !getUrlSegment(frame.urlSegment).length()) {
+                /* We have reached accross the entire URL with no stoppage, execute */
+                if (node.handler && handlers[node.handler](userData, {routeParameters.paramsTop, routeParameters.params})) {
+                    return true;
+                }
+                top--;
+                continue;
+            }
+
+            /* Pick whichever comes first of the next dynamic child and the static match */
+            CompiledChild next = {NO_NODE, 0};
+            if (frame.nextDynamic < node.numDynamic) {
+                next = dynamicChildren[node.firstDynamic + frame.nextDynamic];
+            }
+            bool isStatic = frame.staticMatch.node != NO_NODE && (next.node == NO_NODE || frame.staticMatch.ordinal < next.ordinal);
+            if (isStatic) {
+                next = frame.staticMatch;
+                frame.staticMatch.node = NO_NODE;
+            } else if (next.node != NO_NODE) {
+                frame.nextDynamic++;
             } else {
-                /* Unhandled */
-                return false;
+                /* Out of children */
+                top--;
+                continue;
             }
-        }
 
-        for (auto *p : parent->children) {
-            if (p->name.length() && p->name[0] == '*') {
+            CompiledNode &child = compiledNodes[next.node];
+            if (child.kind == WILDCARD && !isStatic) {
                 /* Wildcard match (can be seen as a shortcut) */
-                int handlerIndex = p->handler;
-                if (handlerIndex) {
-                    int handler = handlers[handlerIndex](userData, {routeParameters.paramsTop, routeParameters.params});
-                    if (handler) {
-                        return handler;
+                if (child.handler) {
+                    if (handlers[child.handler](userData, {routeParameters.paramsTop, routeParameters.params})) {
+                        return true;
                     }
                 } else {
                     /* Unhandled */
-                    return false;
+                    top--;
                 }
-            } else if (p->name.length() && p->name[0] == ':' && getUrlSegment(urlSegment).length()) {
+            } else if (child.kind == PARAMETER && !isStatic) {
                 /* Parameter match */
-                routeParameters.push(getUrlSegment(urlSegment));
-                int handler = executeHandlers(p, urlSegment + 1, userData);
-                if (handler) {
-                    return handler;
-                } else {
-                    // unwind parameter stack
-                    routeParameters.pop();
+                std::string_view segment = getUrlSegment(frame.urlSegment);
+                if (segment.length()) {
+                    routeParameters.push(segment);
+                    frame.pushedParameter = true;
+                    top++;
+                    enterFrame(frames[top], next.node, frame.urlSegment + 1);
                 }
-            } else if (p->name == getUrlSegment(urlSegment)) {
+            } else {
                 /* Static match */
-                int handler = executeHandlers(p, urlSegment + 1, userData);
-                if (handler) {
-                    return handler;
-                }
+                top++;
+                enterFrame(frames[top], next.node, frame.urlSegment + 1);
             }
         }
         return false;
@@ -197,28 +351,39 @@ public:
         printNode(&tree, -1);
     }
 
+    /* Freezes all added routes into the flat form used for matching, done lazily by route if needed */
+    void compile() {
+        compiledNodes.clear();
+        dynamicChildren.clear();
+        staticSlots.clear();
+        compiledNames.clear();
+        compileNode(&tree, true);
+        compiled = true;
+    }
+
     /* Register a route to be routed */
     HttpRouter *add(std::string method, std::string_view pattern, fu2::unique_function<bool(USERDATA &, std::pair<int, std::string_view *>)> &&handler) {
         /* Step over any initial slash */
-        if (pattern[0] == '/') {
+        if (pattern.length() && pattern[0] == '/') {
             pattern = pattern.substr(1);
         }
 
-        /* Parse the route as a vector of strings */
-        std::vector<std::string> route;
+        /* Parse the route as a vector of segments, like getline would split them */
+        std::vector<std::string_view> route;
         route.push_back(method);
 
-        std::stringstream test;
-        test << pattern;
-
         /* Empty pattern or / is the default */
         if (!pattern.length()) {
             route.push_back("");
         }
 
-        std::string segment;
-        while(std::getline(test, segment, '/')) {
-           route.push_back(segment);
+        while (pattern.length()) {
+            size_t slash = pattern.find('/');
+            route.push_back(pattern.substr(0, slash));
+            if (slash == std::string_view::npos) {
+                break;
+            }
+            pattern = pattern.substr(slash + 1);
         }
 
         /* Add this handler to the list of handlers */
@@ -228,7 +393,7 @@ public:
         /* Build the routing tree */
         Node *parent = &tree;
         for (unsigned int i = 0; i < route.size(); i++) {
-            std::string node = route[i];
+            std::string_view node = route[i];
             // do we already have this?
             Node *found = nullptr;
             for (auto *child : parent->children) {
@@ -241,9 +406,9 @@ public:
             if (!found) {
                 if (i == route.size() - 1) {
                     // only ever touch the handler id on the leaf node
-                    parent->children.push_back(found = new Node({node, {}, handlerIndex}));
+                    parent->children.push_back(found = new Node({std::string(node), {}, handlerIndex}));
                 } else {
-                    parent->children.push_back(found = new Node({node, {}, 0}));
+                    parent->children.push_back(found = new Node({std::string(node), {}, 0}));
                 }
             } else if (i == route.size() - 1) {
                 // touch leaf node of existing path
@@ -252,31 +417,45 @@ public:
             parent = found;
         }
 
+        /* We need to be compiled again */
+        compiled = false;
+
         return this;
     }
 
+    /* Integer id of a method for use with route, or -1 if no route has this method */
+    int getMethodId(std::string_view method) {
+        if (!compiled) {
+            compile();
+        }
+
+        CompiledChild methodNode = findStatic(compiledNodes[0], method);
+        return methodNode.node == NO_NODE ? -1 : (int) methodNode.node;
+    }
+
     /* Routes by method and url until handler found and said handler consumes the request by returning true.
      * If a handler returns false, we keep searching for another match. If we cannot find a handler that
      * a) matches the url and method and b) consume the request, then we fail and return false.
      * In that case, a second pass where method changed to "*" to denote "any" could be used to
      * give such routes a chance. If second pass fails, we have an unhandled request and you may
      * do whatever you want with your connection, such as close it, or respond with a fix message */
-    bool route(std::string_view method, std::string_view url, USERDATA &userData) {
+    bool route(int methodId, std::string_view url, USERDATA &userData) {
+        /* We did not find any handler for this method.
+         * You may want to re-route with "*" as method. */
+        if (methodId < 0) {
+            return false;
+        }
+
         /* Reset url parsing cache */
         setUrl(url);
         routeParameters.reset();
 
-        /* Begin by finding the method node */
-        for (auto &p : tree.children) {
-            if (p->name == method) {
-                /* Then route the url */
-                return executeHandlers(p, 0, userData);
-            }
-        }
+        /* Then route the url */
+        return executeHandlers((unsigned int) methodId, userData);
+    }
 
-        /* We did not find any handler for this method.
-         * You may want to re-route with "*" as method. */
-        return false;
+    bool route(std::string_view method, std::string_view url, USERDATA &userData) {
+        return route(getMethodId(method), url, userData);
     }
 };
 
@@ -0,0 +1,181 @@
+/*
+ * Authored by Alex Hultman, 2018-2019.
+ * Intellectual property of third-party.
+
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+
+ *     http://www.apache.org/licenses/LICENSE-2.0
+
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef UWS_HUB_H
+#define UWS_HUB_H
+
+/* A Hub spans one logical pub/sub space over many threads, each with its own Loop and App.
+ * Publishes can come from any thread, are framed once and handed to every joined TopicTree
+ * via a lock-free queue which the owning Loop drains in its pre/post handler */
+
+#include <libusockets.h>
+
+#include "WebSocketProtocol.h"
+#include "TopicTreeDraft.h"
+#include "CompressionPool.h"
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <string_view>
+#include <algorithm>
+#include <cstring>
+
+namespace uWS {
+
+struct Hub;
+
+/* Multiple producer, single consumer queue of one joined TopicTree */
+struct HubQueue {
+    friend struct Hub;
+private:
+    struct Node {
+        Node *next;
+        /* The topic is stored right after the framed message */
+        SharedMessage *message;
+        unsigned int topicLength;
+    };
+
+    /* Pushed to from any thread, taken in whole by the owning thread */
+    std::atomic<Node *> head = nullptr;
+
+    /* Returns whether we were empty, only then do we need a wakeup */
+    bool push(Node *node) {
+        node->next = head.load(std::memory_order_relaxed);
+        while (!head.compare_exchange_weak(node->next, node, std::memory_order_release, std::memory_order_relaxed));
+        return !node->next;
+    }
+
+    /* Takes everything out in publish order */
+    Node *takeAll() {
+        Node *list = head.exchange(nullptr, std::memory_order_acquire), *reversed = nullptr;
+        while (list) {
+            Node *next = list->next;
+            list->next = reversed;
+            reversed = list;
+            list = next;
+        }
+        return reversed;
+    }
+
+public:
+    Hub *hub = nullptr;
+    us_loop_t *loop = nullptr;
+    TopicTree *topicTree = nullptr;
+
+    /* Called on the owning thread, moves all passed publishes into the TopicTree */
+    void drain() {
+        for (Node *node = takeAll(); node; ) {
+            Node *next = node->next;
+            /* The tree takes over our reference */
+            topicTree->publish(std::string_view(node->message->data() + node->message->length, node->topicLength), node->message);
+            delete node;
+            node = next;
+        }
+    }
+
+    /* Drops anything not yet drained */
+    void clear() {
+        for (Node *node = takeAll(); node; ) {
+            Node *next = node->next;
+            node->message->unref();
+            delete node;
+            node = next;
+        }
+    }
+};
+
+struct Hub {
+private:
+    typedef std::shared_ptr<const std::vector<HubQueue *>> Members;
+
+    /* Joining and leaving is rare and replaces the members with an altered copy under this lock,
+     * publishers never take it but hold a reference to whatever copy was current as they began */
+    std::mutex membersMutex;
+    Members members = std::make_shared<const std::vector<HubQueue *>>();
+
+public:
+    /* Must be called on the thread owning the queue */
+    void join(HubQueue *hubQueue) {
+        std::lock_guard<std::mutex> lock(membersMutex);
+        hubQueue->hub = this;
+        std::shared_ptr<std::vector<HubQueue *>> joined = std::make_shared<std::vector<HubQueue *>>(*members);
+        joined->push_back(hubQueue);
+        std::atomic_store(&members, Members(std::move(joined)));
+    }
+
+    /* Must be called on the thread owning the queue, nothing will be pushed to it after this */
+    void leave(HubQueue *hubQueue) {
+        Members previous;
+        {
+            std::lock_guard<std::mutex> lock(membersMutex);
+            std::shared_ptr<std::vector<HubQueue *>> left = std::make_shared<std::vector<HubQueue *>>(*members);
+            left->erase(std::remove(left->begin(), left->end(), hubQueue), left->end());
+            previous = members;
+            std::atomic_store(&members, Members(std::move(left)));
+            hubQueue->hub = nullptr;
+        }
+
+        /* Publishers which began before us may still push to us, they are done once they let go of their copy */
+        while (previous.use_count() > 1) {
+            std::this_thread::yield();
+        }
+        std::atomic_thread_fence(std::memory_order_acquire);
+        hubQueue->clear();
+    }
+
+private:
+    /* Frames the message once, with the topic following it */
+    static SharedMessage *frame(std::string_view topic, std::string_view message, OpCode opCode, bool compressed) {
+        SharedMessage *sharedMessage = SharedMessage::create(protocol::messageFrameSize(message.length()) + topic.length());
+        sharedMessage->length = (unsigned int) protocol::formatMessage<true>(sharedMessage->data(), message.data(), message.length(), opCode, message.length(), compressed);
+        memcpy(sharedMessage->data() + sharedMessage->length, topic.data(), topic.length());
+        return sharedMessage;
+    }
+
+public:
+    /* Publishes to every joined TopicTree, can be called from any thread.
+     * Compressed messages are deflated once, on the calling thread, with a reset stream of its own */
+    void publish(std::string_view topic, std::string_view message, OpCode opCode, bool compress = false) {
+        SharedMessage *sharedMessage = frame(topic, message, opCode, false);
+#ifndef UWS_NO_ZLIB
+        if (compress && opCode < 3) {
+            SharedMessage *compressedMessage = frame(topic, CompressionPool::deflate(message), opCode, true);
+            compressedMessage->uncompressed = sharedMessage;
+            sharedMessage = compressedMessage;
+        }
+#endif
+
+        Members current = std::atomic_load(&members);
+        for (HubQueue *hubQueue : *current) {
+            HubQueue::Node *node = new HubQueue::Node {nullptr, sharedMessage->ref(), (unsigned int) topic.length()};
+
+            /* Only the first push into an empty queue needs to wake the loop up, the rest coalesce */
+            if (hubQueue->push(node)) {
+                us_wakeup_loop(hubQueue->loop);
+            }
+        }
+
+        sharedMessage->unref();
+    }
+};
+
+}
+
+#endif // UWS_HUB_H
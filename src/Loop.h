@@ -29,25 +29,40 @@ private:
     static void wakeupCb(us_loop_t *loop) {
         LoopData *loopData = (LoopData *) us_loop_ext(loop);
 
-        /* Swap current deferQueue */
-        loopData->deferMutex.lock();
-        int oldDeferQueue = loopData->currentDeferQueue;
-        loopData->currentDeferQueue = (loopData->currentDeferQueue + 1) % 2;
-        loopData->deferMutex.unlock();
+        /* Take everything pushed so far, it comes out newest first */
+        LoopData::DeferNode *node = loopData->deferHead.exchange(nullptr, std::memory_order_acquire), *reversed = nullptr;
+        while (node) {
+            LoopData::DeferNode *next = node->next;
+            node->next = reversed;
+            reversed = node;
+            node = next;
+        }
 
-        /* Drain the queue */
-        for (auto &x : loopData->deferQueues[oldDeferQueue]) {
-            x();
+        /* Drain the queue in order */
+        while (reversed) {
+            LoopData::DeferNode *next = reversed->next;
+            reversed->cb();
+            delete reversed;
+            reversed = next;
         }
-        loopData->deferQueues[oldDeferQueue].clear();
     }
 
     static void preCb(us_loop_t *loop) {
         LoopData *loopData = (LoopData *) us_loop_ext(loop);
 
+        if (loopData->tracing) {
+            loopData->iterationStart = std::chrono::steady_clock::now();
+        }
+
         for (auto &p : loopData->preHandlers) {
             p.second((Loop *) loop);
         }
+
+        /* Whatever the pre handlers read, the poll comes next and nothing after it may use that reading */
+        loopData->timestampStale = true;
+
+        /* Only now, what the pre handlers deferred has to wake the poll up or it would wait for the next event */
+        loopData->inIteration = true;
     }
 
     static void postCb(us_loop_t *loop) {
@@ -56,6 +71,69 @@ private:
         for (auto &p : loopData->postHandlers) {
             p.second((Loop *) loop);
         }
+
+        /* Anything deferred from here on needs a wakeup to not be left waiting for the next event */
+        loopData->inIteration = false;
+
+        /* Run what our own thread deferred, which may defer more for next iteration */
+        loopData->runningDeferQueue.swap(loopData->localDeferQueue);
+        for (auto &cb : loopData->runningDeferQueue) {
+            cb();
+        }
+        loopData->runningDeferQueue.clear();
+
+        /* Iterations begun before tracing was enabled have no start */
+        if (loopData->tracing && loopData->iterationStart.time_since_epoch().count()) {
+            loopData->traced("loop iteration", loopData->metrics.loopIteration, loopData->iterationStart);
+        }
+    }
+
+    /* Arms the wheel timer for the next slot holding anything, unless it already fires before that.
+     * Pending timers keep the loop alive, so an empty wheel lets go of its us_timer_t (after this iteration, it may be firing) */
+    static void armWheelTimer(Loop *loop) {
+        LoopData *loopData = (LoopData *) us_loop_ext((us_loop_t *) loop);
+
+        uint64_t timeout = loopData->timerWheel.timeout(loopData->timestamp);
+        if (!timeout) {
+            if (loopData->wheelTimer && loopData->wheelTimerDue != UINT64_MAX) {
+                loopData->wheelTimerDue = UINT64_MAX;
+                loop->defer([loop, loopData]() {
+                    if (loopData->timerWheel.empty() && loopData->wheelTimer) {
+                        us_timer_close(loopData->wheelTimer);
+                        loopData->wheelTimer = nullptr;
+                    }
+                });
+            }
+            return;
+        }
+
+        if (!loopData->wheelTimer) {
+            loopData->wheelTimer = us_create_timer((us_loop_t *) loop, 0, sizeof(Loop *));
+            *(Loop **) us_timer_ext(loopData->wheelTimer) = loop;
+            loopData->wheelTimerDue = 0;
+        } else if (loopData->wheelTimerDue && loopData->wheelTimerDue <= loopData->timestamp + timeout) {
+            return;
+        }
+
+        loopData->wheelTimerDue = loopData->timestamp + timeout;
+        us_timer_set(loopData->wheelTimer, [](us_timer_t *t) {
+            Loop *loop = *(Loop **) us_timer_ext(t);
+            LoopData *loopData = (LoopData *) us_loop_ext((us_loop_t *) loop);
+
+            loopData->wheelTimerDue = 0;
+            loopData->updateTimestamp();
+            loopData->timerWheel.advance(loopData->timestamp);
+            armWheelTimer(loop);
+        }, (int) std::min<uint64_t>(timeout, INT32_MAX), 0);
+    }
+
+    uint64_t setTimer(unsigned int milliseconds, unsigned int interval, fu2::unique_function<void()> &&cb) {
+        LoopData *loopData = (LoopData *) us_loop_ext((us_loop_t *) this);
+
+        loopData->updateTimestamp();
+        uint64_t id = loopData->timerWheel.set(loopData->timestamp, milliseconds, interval, std::move(cb));
+        armWheelTimer(this);
+        return id;
     }
 
     Loop() = delete;
@@ -104,6 +182,12 @@ public:
     /* Freeing the default loop should be done once */
     void free() {
         LoopData *loopData = (LoopData *) us_loop_ext((us_loop_t *) this);
+        if (loopData->dateTimer) {
+            us_timer_close(loopData->dateTimer);
+        }
+        if (loopData->wheelTimer) {
+            us_timer_close(loopData->wheelTimer);
+        }
         loopData->~LoopData();
         /* uSockets will track whether this loop is owned by us or a borrowed alien loop */
         us_loop_free((us_loop_t *) this);
@@ -139,12 +223,97 @@ public:
     void defer(fu2::unique_function<void()> &&cb) {
         LoopData *loopData = (LoopData *) us_loop_ext((us_loop_t *) this);
 
-        //if (std::thread::get_id() == ) // todo: add fast path for same thread id
-        loopData->deferMutex.lock();
-        loopData->deferQueues[loopData->currentDeferQueue].emplace_back(std::move(cb));
-        loopData->deferMutex.unlock();
+        /* Fast path for our own thread, no atomics and most often no wakeup */
+        if (std::this_thread::get_id() == loopData->threadId) {
+            bool wasEmpty = loopData->localDeferQueue.empty();
+            loopData->localDeferQueue.emplace_back(std::move(cb));
+
+            /* Within an iteration the post handler will get to it anyways */
+            if (wasEmpty && !loopData->inIteration) {
+                us_wakeup_loop((us_loop_t *) this);
+            }
+            return;
+        }
+
+        LoopData::DeferNode *node = new LoopData::DeferNode {loopData->deferHead.load(std::memory_order_relaxed), std::move(cb)};
+        while (!loopData->deferHead.compare_exchange_weak(node->next, node, std::memory_order_release, std::memory_order_relaxed));
+
+        /* Only the first push into an empty queue wakes the loop up, the rest coalesce into that wakeup */
+        if (!node->next) {
+            us_wakeup_loop((us_loop_t *) this);
+        }
+    }
+
+    /* Returns the current Date header value, kept up to date once a second by a timer which does not keep the loop alive */
+    std::string_view getDate() {
+        LoopData *loopData = (LoopData *) us_loop_ext((us_loop_t *) this);
+
+        if (!loopData->dateTimer) {
+            loopData->updateDate();
+            loopData->dateTimer = us_create_timer((us_loop_t *) this, 1, sizeof(LoopData *));
+            *(LoopData **) us_timer_ext(loopData->dateTimer) = loopData;
+            us_timer_set(loopData->dateTimer, [](us_timer_t *t) {
+                (*(LoopData **) us_timer_ext(t))->updateDate();
+            }, 1000, 1000);
+        }
+        return {loopData->date, sizeof(loopData->date)};
+    }
+
+    /* Runs cb once, in milliseconds. Returns an id for clearTimer, pending timers keep the loop alive */
+    uint64_t setTimeout(unsigned int milliseconds, fu2::unique_function<void()> &&cb) {
+        return setTimer(milliseconds, 0, std::move(cb));
+    }
+
+    /* Runs cb every milliseconds until cleared, periods we fell behind by entirely are skipped rather than run back to back */
+    uint64_t setInterval(unsigned int milliseconds, fu2::unique_function<void()> &&cb) {
+        return setTimer(milliseconds, std::max(milliseconds, 1u), std::move(cb));
+    }
+
+    /* Returns whether the timer was still pending (or an interval), it may be cleared from its own callback */
+    bool clearTimer(uint64_t id) {
+        LoopData *loopData = (LoopData *) us_loop_ext((us_loop_t *) this);
+
+        return loopData->timerWheel.clear(id);
+    }
+
+    /* Returns the hit and miss counters of this loop's slab allocator */
+    SlabAllocator::Counters getSlabCounters() {
+        LoopData *loopData = (LoopData *) us_loop_ext((us_loop_t *) this);
+
+        return loopData->slabAllocator.counters;
+    }
+
+    /* Sets the cork buffer size, responses larger than this take more syscalls.
+     * A larger maxSize lets the buffer grow toward the 95th percentile of corked responses, up to maxSize */
+    void setCorkBufferSize(int size, int maxSize = 0) {
+        LoopData *loopData = (LoopData *) us_loop_ext((us_loop_t *) this);
+
+        loopData->resizeCorkBuffer(size);
+        loopData->maxCorkBufferSize = maxSize > size ? maxSize : 0;
+    }
+
+    int getCorkBufferSize() {
+        LoopData *loopData = (LoopData *) us_loop_ext((us_loop_t *) this);
+
+        return loopData->corkBufferSize;
+    }
+
+    /* Times loop iterations and user handlers into the histograms of App::getMetrics, per route pattern and
+     * WebSocket context. Anything running for at least stallMilliseconds is reported to stallHandler by name */
+    void setTracing(bool enabled, unsigned int stallMilliseconds = 0, fu2::unique_function<void(std::string_view, unsigned long long)> &&stallHandler = nullptr) {
+        LoopData *loopData = (LoopData *) us_loop_ext((us_loop_t *) this);
+
+        loopData->tracing = enabled;
+        loopData->stallMicros = (unsigned long long) stallMilliseconds * 1000;
+        loopData->stallHandler = std::move(stallHandler);
+        loopData->iterationStart = {};
+    }
+
+    /* Returns how many writes did not fit the cork buffer so far, for tuning its size. Always 0 with UWS_NO_METRICS */
+    unsigned long long getCorkOverflows() {
+        LoopData *loopData = (LoopData *) us_loop_ext((us_loop_t *) this);
 
-        us_wakeup_loop((us_loop_t *) this);
+        return loopData->metrics.value(Metrics::CORK_OVERFLOWS);
     }
 
     /* Actively block and run this loop */
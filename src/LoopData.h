@@ -21,13 +21,27 @@
 #include <thread>
 #include <functional>
 #include <vector>
-#include <mutex>
+#include <atomic>
 #include <map>
+#include <algorithm>
+#include <cstring>
+#include <chrono>
+#include <string_view>
 
 #include "PerMessageDeflate.h"
+#include "SlabAllocator.h"
+#include "BufferPool.h"
+#include "Metrics.h"
+#include "TimerWheel.h"
 
 #include "f2/function2.hpp"
 
+#include <ctime>
+#include <cstdio>
+
+struct us_timer_t;
+struct us_socket_t;
+
 namespace uWS {
 
 struct Loop;
@@ -35,15 +49,34 @@ struct Loop;
 struct alignas(16) LoopData {
     friend struct Loop;
 private:
-    std::mutex deferMutex;
-    int currentDeferQueue = 0;
-    std::vector<fu2::unique_function<void()>> deferQueues[2];
+    /* Intrusive node of the cross-thread defer queue */
+    struct DeferNode {
+        DeferNode *next;
+        fu2::unique_function<void()> cb;
+    };
+
+    /* Lock-free multiple producer, single consumer stack, taken in whole and reversed on wakeup */
+    std::atomic<DeferNode *> deferHead = nullptr;
+
+    /* Callbacks deferred from our own thread never touch the above */
+    std::thread::id threadId = std::this_thread::get_id();
+    std::vector<fu2::unique_function<void()>> localDeferQueue, runningDeferQueue;
+
+    /* Set from after the pre handlers until post, while we are guaranteed to reach the post handler without blocking */
+    bool inIteration = false;
 
     /* Map from void ptr to handler */
     std::map<void *, fu2::unique_function<void(Loop *)>> postHandlers, preHandlers;
 
 public:
     ~LoopData() {
+        /* Whatever was deferred but never ran is dropped */
+        for (DeferNode *node = deferHead.exchange(nullptr); node; ) {
+            DeferNode *next = node->next;
+            delete node;
+            node = next;
+        }
+
         /* If we have had App.ws called with compression we need to clear this */
         if (zlibContext) {
             delete zlibContext;
@@ -53,14 +86,150 @@ public:
         delete [] corkBuffer;
     }
 
+    /* Small per-socket allocations of this loop, declared first as to outlive the rest */
+    SlabAllocator slabAllocator;
+
+    /* Large buffers lent to sockets for as long as they reassemble a message */
+    BufferPool bufferPool;
+
+    /* Counters of this loop, readable from any thread */
+    Metrics metrics;
+
+    /* Handler tracing, off unless enabled with Loop::setTracing */
+    bool tracing = false;
+    unsigned long long stallMicros = 0;
+    fu2::unique_function<void(std::string_view, unsigned long long)> stallHandler = nullptr;
+    std::chrono::steady_clock::time_point iterationStart;
+
+    /* Records what ran since start and reports it if it stalled us */
+    void traced(std::string_view name, Metrics::Histogram &histogram, std::chrono::steady_clock::time_point start) {
+        unsigned long long micros = (unsigned long long) std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+        metrics.record(histogram, micros);
+        if (stallMicros && micros >= stallMicros && stallHandler) {
+            stallHandler(name, micros);
+        }
+    }
+
+    /* Runs a user handler, timed into its trace point while tracing */
+    template <class F>
+    void trace(Metrics::TracePoint *tracePoint, F &&f) {
+        if (!tracing || !tracePoint) {
+            f();
+            return;
+        }
+
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        f();
+        traced(tracePoint->name, tracePoint->histogram, start);
+    }
+
     /* Good 16k for SSL perf. */
-    static const int CORK_BUFFER_SIZE = 16 * 1024;
+    static const int DEFAULT_CORK_BUFFER_SIZE = 16 * 1024;
+
+    /* Adaptive sizing samples corked bytes per uncork into buckets of this granularity */
+    static const int CORK_HISTOGRAM_GRANULARITY = 4 * 1024;
+    static const int CORK_HISTOGRAM_BUCKETS = 64;
+    static const unsigned int CORK_SAMPLE_WINDOW = 1024;
 
     /* Cork data */
-    char *corkBuffer = new char[CORK_BUFFER_SIZE];
+    int corkBufferSize = DEFAULT_CORK_BUFFER_SIZE;
+    char *corkBuffer = new char[DEFAULT_CORK_BUFFER_SIZE];
     int corkOffset = 0;
     void *corkedSocket = nullptr;
 
+    /* Bytes written while corked since the last cork */
+    int corkedBytes = 0;
+
+    /* If non-zero we grow toward the 95th percentile of corked bytes, up to this ceiling */
+    int maxCorkBufferSize = 0;
+    unsigned int corkSamples = 0;
+    unsigned int corkHistogram[CORK_HISTOGRAM_BUCKETS] = {};
+
+    /* Keeps whatever is corked */
+    void resizeCorkBuffer(int size) {
+        size = std::max<int>(size, corkOffset);
+        char *newCorkBuffer = new char[size];
+        memcpy(newCorkBuffer, corkBuffer, corkOffset);
+        delete [] corkBuffer;
+        corkBuffer = newCorkBuffer;
+        corkBufferSize = size;
+    }
+
+    /* Called on every uncork with what was written while corked */
+    void sampleCorkedBytes(int bytes) {
+        if (!maxCorkBufferSize) {
+            return;
+        }
+
+        corkHistogram[std::min<int>(bytes / CORK_HISTOGRAM_GRANULARITY, CORK_HISTOGRAM_BUCKETS - 1)]++;
+        if (++corkSamples < CORK_SAMPLE_WINDOW) {
+            return;
+        }
+
+        /* Find the bucket holding the 95th percentile and grow to its upper bound */
+        unsigned int seen = 0;
+        int bucket = 0;
+        for (; bucket < CORK_HISTOGRAM_BUCKETS - 1; bucket++) {
+            seen += corkHistogram[bucket];
+            if (seen >= CORK_SAMPLE_WINDOW * 95 / 100) {
+                break;
+            }
+        }
+        int wanted = bucket == CORK_HISTOGRAM_BUCKETS - 1 ? maxCorkBufferSize : std::min<int>((bucket + 1) * CORK_HISTOGRAM_GRANULARITY, maxCorkBufferSize);
+        if (wanted > corkBufferSize) {
+            resizeCorkBuffer(wanted);
+        }
+
+        corkSamples = 0;
+        memset(corkHistogram, 0, sizeof(corkHistogram));
+    }
+
+    /* The Date header value, refreshed once a second by a timer created on first use */
+    char date[29];
+    struct us_timer_t *dateTimer = nullptr;
+
+    void updateDate() {
+        time_t now = time(nullptr);
+        struct tm tm;
+#ifdef _WIN32
+        gmtime_s(&tm, &now);
+#else
+        gmtime_r(&now, &tm);
+#endif
+        static const char days[] = "SunMonTueWedThuFriSat", months[] = "JanFebMarAprMayJunJulAugSepOctNovDec";
+        char buffer[32];
+        snprintf(buffer, sizeof(buffer), "%.3s, %02d %.3s %04d %02d:%02d:%02d GMT", days + tm.tm_wday * 3, tm.tm_mday,
+                 months + tm.tm_mon * 3, tm.tm_year + 1900, tm.tm_hour, tm.tm_min, tm.tm_sec);
+        memcpy(date, buffer, sizeof(date));
+    }
+
+    /* Milliseconds of a steady clock, read once per iteration so that stamping activity costs no clock read.
+     * The pre handler runs before polling, possibly blocking for long, so it only marks the reading stale for
+     * getTimestamp to refresh it on first use after the poll returns */
+    uint64_t timestamp = 0;
+    bool timestampStale = true;
+
+    void updateTimestamp() {
+        timestamp = (uint64_t) std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+        timestampStale = false;
+    }
+
+    uint64_t getTimestamp() {
+        if (timestampStale) {
+            updateTimestamp();
+        }
+        return timestamp;
+    }
+
+    /* Timers of Loop::setTimeout and Loop::setInterval, all driven by one us_timer_t armed for the next slot that holds any */
+    TimerWheel timerWheel;
+    struct us_timer_t *wheelTimer = nullptr;
+    uint64_t wheelTimerDue = 0;
+
+    /* Set by TemplatedApp::shed, how many more WebSockets go elsewhere as they next become readable and how */
+    unsigned int shedQuota = 0;
+    fu2::unique_function<bool(us_socket_t *)> shedHandler = nullptr;
+
     /* Per message deflate data */
     ZlibContext *zlibContext = nullptr;
     InflationStream *inflationStream = nullptr;
@@ -0,0 +1,306 @@
+/*
+ * Authored by Alex Hultman, 2018-2019.
+ * Intellectual property of third-party.
+
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+
+ *     http://www.apache.org/licenses/LICENSE-2.0
+
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef UWS_METRICS_H
+#define UWS_METRICS_H
+
+/* Runtime counters of one loop, updated from its own thread only. Every counter is a relaxed atomic written
+ * as a plain load and store, so the hot paths pay no locked instructions yet any thread may read a consistent
+ * value. Building with UWS_NO_METRICS compiles every update out, leaving all counters at zero */
+
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <vector>
+#include <string>
+#include <map>
+#include <algorithm>
+
+namespace uWS {
+
+struct Metrics {
+    enum Id {
+        HTTP_CONNECTIONS,
+        HTTP_CONNECTIONS_TOTAL,
+        HTTP_REQUESTS,
+        HTTP_FALLBACK_BUFFERINGS,
+        WEBSOCKETS,
+        WEBSOCKET_UPGRADES,
+        WEBSOCKET_MESSAGES_RECEIVED,
+        WEBSOCKET_MESSAGES_SENT,
+        WEBSOCKET_PUBLISHES,
+        BACKPRESSURE_BYTES,
+        BACKPRESSURE_EVENTS,
+        CORK_OVERFLOWS,
+        DEFLATE_BYTES_IN,
+        DEFLATE_BYTES_OUT,
+        INFLATE_BYTES_IN,
+        INFLATE_BYTES_OUT,
+        NUM_COUNTERS
+    };
+
+    /* Power of two buckets of microseconds, the last one takes anything above a second */
+    static const unsigned int HISTOGRAM_BUCKETS = 21;
+
+    struct Histogram {
+        std::atomic<unsigned long long> buckets[HISTOGRAM_BUCKETS + 1] = {};
+        std::atomic<unsigned long long> sum = 0;
+    };
+
+    /* A named histogram of handler durations, such as those of one route. Listed with the metrics it is attached to */
+    struct TracePoint {
+        std::string name;
+        Histogram histogram;
+        Metrics *metrics = nullptr;
+
+        TracePoint() = default;
+        TracePoint(const TracePoint &) = delete;
+        TracePoint &operator=(const TracePoint &) = delete;
+
+        void attach(Metrics *metrics, std::string name) {
+            std::lock_guard<std::mutex> lock(getRegistry().mutex);
+            this->name = std::move(name);
+            this->metrics = metrics;
+            metrics->tracePoints.push_back(this);
+        }
+
+        ~TracePoint() {
+            if (metrics) {
+                std::lock_guard<std::mutex> lock(getRegistry().mutex);
+                metrics->tracePoints.erase(std::find(metrics->tracePoints.begin(), metrics->tracePoints.end(), this));
+            }
+        }
+    };
+
+    std::atomic<unsigned long long> counters[NUM_COUNTERS] = {};
+
+    /* Time spent in TopicTree::drain whenever it had something to send */
+    Histogram topicDrain;
+
+    /* Time from waking up to going back to sleep, only while tracing */
+    Histogram loopIteration;
+
+    /* Plain values summed over any number of loops */
+    struct Snapshot {
+        struct HistogramValues {
+            unsigned long long buckets[HISTOGRAM_BUCKETS + 1] = {};
+            unsigned long long sum = 0;
+
+            void add(const Histogram &histogram) {
+                for (unsigned int i = 0; i <= HISTOGRAM_BUCKETS; i++) {
+                    buckets[i] += histogram.buckets[i].load(std::memory_order_relaxed);
+                }
+                sum += histogram.sum.load(std::memory_order_relaxed);
+            }
+        };
+
+        unsigned long long counters[NUM_COUNTERS] = {};
+        HistogramValues topicDrain, loopIteration;
+
+        /* Trace points of the same name, from any loop, add up */
+        std::map<std::string, HistogramValues> handlers;
+
+        /* Buckets are cumulative and bounded in seconds */
+        static void appendHistogram(std::string &text, const char *name, std::string labels, const HistogramValues &values) {
+            unsigned long long cumulative = 0;
+            for (unsigned int i = 0; i <= HISTOGRAM_BUCKETS; i++) {
+                cumulative += values.buckets[i];
+                std::string bound = i == HISTOGRAM_BUCKETS ? "+Inf" : std::to_string((double) (1ull << i) / 1e6);
+                text.append(name).append("_bucket{").append(labels).append("le=\"").append(bound).append("\"} ").append(std::to_string(cumulative)).append("\n");
+            }
+            if (labels.length()) {
+                labels = "{" + labels.substr(0, labels.length() - 1) + "}";
+            }
+            text.append(name).append("_sum").append(labels).append(" ").append(std::to_string((double) values.sum / 1e6)).append("\n");
+            text.append(name).append("_count").append(labels).append(" ").append(std::to_string(cumulative)).append("\n");
+        }
+
+        /* Prometheus text exposition format, version 0.0.4 */
+        std::string prometheus() const {
+            static const char *names[NUM_COUNTERS][3] = {
+                {"uws_http_connections", "gauge", "Open HTTP connections"},
+                {"uws_http_connections_total", "counter", "Accepted HTTP connections"},
+                {"uws_http_requests_total", "counter", "Parsed HTTP requests"},
+                {"uws_http_fallback_bufferings_total", "counter", "Reads leaving a partial request buffered"},
+                {"uws_websockets", "gauge", "Open WebSockets"},
+                {"uws_websocket_upgrades_total", "counter", "HTTP connections upgraded to WebSocket"},
+                {"uws_websocket_messages_received_total", "counter", "WebSocket messages received"},
+                {"uws_websocket_messages_sent_total", "counter", "WebSocket messages sent"},
+                {"uws_websocket_publishes_total", "counter", "Messages published to topics"},
+                {"uws_backpressure_bytes", "gauge", "Bytes buffered in user space waiting for the kernel"},
+                {"uws_backpressure_events_total", "counter", "Writes that started buffering on a socket"},
+                {"uws_cork_overflows_total", "counter", "Writes that did not fit the cork buffer"},
+                {"uws_deflate_bytes_in_total", "counter", "Bytes given to permessage-deflate compression"},
+                {"uws_deflate_bytes_out_total", "counter", "Bytes produced by permessage-deflate compression"},
+                {"uws_inflate_bytes_in_total", "counter", "Bytes given to permessage-deflate decompression"},
+                {"uws_inflate_bytes_out_total", "counter", "Bytes produced by permessage-deflate decompression"}
+            };
+
+            std::string text;
+            for (int i = 0; i < NUM_COUNTERS; i++) {
+                text.append("# HELP ").append(names[i][0]).append(" ").append(names[i][2]).append("\n");
+                text.append("# TYPE ").append(names[i][0]).append(" ").append(names[i][1]).append("\n");
+                text.append(names[i][0]).append(" ").append(std::to_string(counters[i])).append("\n");
+            }
+
+            text.append("# HELP uws_topic_drain_seconds Time spent sending out pub/sub batches\n");
+            text.append("# TYPE uws_topic_drain_seconds histogram\n");
+            appendHistogram(text, "uws_topic_drain_seconds", "", topicDrain);
+
+            text.append("# HELP uws_loop_iteration_seconds Time from wakeup to sleep of event loops, while tracing\n");
+            text.append("# TYPE uws_loop_iteration_seconds histogram\n");
+            appendHistogram(text, "uws_loop_iteration_seconds", "", loopIteration);
+
+            text.append("# HELP uws_handler_seconds Time spent in user handlers, while tracing\n");
+            text.append("# TYPE uws_handler_seconds histogram\n");
+            for (auto &[name, values] : handlers) {
+                /* Label values escape backslashes, quotes and newlines */
+                std::string escaped;
+                for (char c : name) {
+                    if (c == '\\' || c == '"') {
+                        escaped += '\\';
+                    } else if (c == '\n') {
+                        escaped += "\\n";
+                        continue;
+                    }
+                    escaped += c;
+                }
+                appendHistogram(text, "uws_handler_seconds", "handler=\"" + escaped + "\",", values);
+            }
+            return text;
+        }
+    };
+
+private:
+    /* Every living loop's metrics, only locked when loops come and go or someone takes a snapshot */
+    struct Registry {
+        std::mutex mutex;
+        std::vector<Metrics *> metrics;
+    };
+
+    static Registry &getRegistry() {
+        static Registry registry;
+        return registry;
+    }
+
+    /* The metrics of the loop owning this thread, for code that knows nothing of loops */
+    /* Attached trace points, guarded by the registry */
+    std::vector<TracePoint *> tracePoints;
+
+    static Metrics *&threadMetrics() {
+        static thread_local Metrics *metrics = nullptr;
+        return metrics;
+    }
+
+    static void increment(std::atomic<unsigned long long> &counter, unsigned long long n) {
+        counter.store(counter.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+    }
+
+public:
+    Metrics() {
+        std::lock_guard<std::mutex> lock(getRegistry().mutex);
+        getRegistry().metrics.push_back(this);
+        threadMetrics() = this;
+    }
+
+    ~Metrics() {
+        std::lock_guard<std::mutex> lock(getRegistry().mutex);
+        auto &metrics = getRegistry().metrics;
+        metrics.erase(std::find(metrics.begin(), metrics.end(), this));
+        if (threadMetrics() == this) {
+            threadMetrics() = nullptr;
+        }
+    }
+
+    Metrics(const Metrics &) = delete;
+    Metrics &operator=(const Metrics &) = delete;
+
+    static Metrics *get() {
+        return threadMetrics();
+    }
+
+    void add(Id id, unsigned long long n = 1) {
+#ifndef UWS_NO_METRICS
+        increment(counters[id], n);
+#endif
+    }
+
+    /* One counter of this loop alone, callable from any thread */
+    unsigned long long value(Id id) const {
+        return counters[id].load(std::memory_order_relaxed);
+    }
+
+    /* For gauges */
+    void sub(Id id, unsigned long long n = 1) {
+#ifndef UWS_NO_METRICS
+        increment(counters[id], 0 - n);
+#endif
+    }
+
+    void record(Histogram &histogram, unsigned long long micros) {
+#ifndef UWS_NO_METRICS
+        unsigned int bucket = 0;
+        while (bucket < HISTOGRAM_BUCKETS && (1ull << bucket) < micros) {
+            bucket++;
+        }
+        increment(histogram.buckets[bucket], 1);
+        increment(histogram.sum, micros);
+#endif
+    }
+
+    /* Adds our values to a snapshot, with the registry locked */
+    void collect(Snapshot &snapshot) const {
+        for (int i = 0; i < NUM_COUNTERS; i++) {
+            snapshot.counters[i] += counters[i].load(std::memory_order_relaxed);
+        }
+        snapshot.topicDrain.add(topicDrain);
+        snapshot.loopIteration.add(loopIteration);
+        for (TracePoint *tracePoint : tracePoints) {
+            snapshot.handlers[tracePoint->name].add(tracePoint->histogram);
+        }
+    }
+
+    /* Sums every living loop, callable from any thread */
+    static Snapshot collectAll() {
+        Snapshot snapshot;
+        std::lock_guard<std::mutex> lock(getRegistry().mutex);
+        for (Metrics *metrics : getRegistry().metrics) {
+            metrics->collect(snapshot);
+        }
+        return snapshot;
+    }
+};
+
+/* Times a scope into a histogram, nothing when compiled out */
+struct MetricsTimer {
+#ifndef UWS_NO_METRICS
+    Metrics *metrics;
+    Metrics::Histogram &histogram;
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+    MetricsTimer(Metrics *metrics, Metrics::Histogram &histogram) : metrics(metrics), histogram(histogram) {}
+
+    ~MetricsTimer() {
+        metrics->record(histogram, (unsigned long long) std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count());
+    }
+#else
+    MetricsTimer(Metrics *, Metrics::Histogram &) {}
+#endif
+};
+
+}
+
+#endif // UWS_METRICS_H
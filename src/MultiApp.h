@@ -0,0 +1,367 @@
+/*
+ * Authored by Alex Hultman, 2018-2019.
+ * Intellectual property of third-party.
+
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+
+ *     http://www.apache.org/licenses/LICENSE-2.0
+
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef UWS_MULTIAPP_H
+#define UWS_MULTIAPP_H
+
+/* A MultiApp runs one App per thread (by default one per core) from a single route definition.
+ * They all listen to the same port via SO_REUSEPORT, which uSockets sets on every listen socket */
+
+#include "App.h"
+
+#include <thread>
+#include <future>
+#include <memory>
+#include <vector>
+#include <string>
+#include <functional>
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#include <sys/socket.h>
+#include <linux/filter.h>
+#endif
+
+namespace uWS {
+
+template <bool SSL>
+struct TemplatedMultiApp {
+private:
+    struct Worker {
+        std::thread thread;
+        /* Only set while the thread lives, reset with Control::mutex held */
+        std::atomic<Loop *> loop{nullptr};
+        us_listen_socket_t *listenSocket = nullptr;
+
+        /* Seen by the other workers' rebalancing probes, the App is only set while it runs */
+        std::atomic<TemplatedApp<SSL> *> app{nullptr};
+        std::atomic<unsigned int> lag{0};
+        std::atomic<unsigned long long> webSockets{0};
+        uint64_t probeTimer = 0;
+    };
+
+    us_socket_context_options_t socketContextOptions;
+    unsigned int numThreads;
+    bool pinThreads = true;
+    bool steerConnections = false;
+
+    /* See rebalance */
+    bool rebalancing = false;
+    unsigned int rebalanceLag = 0;
+
+    /* Shared by run, the workers and close (from any thread), held by pointer so that we stay movable.
+     * The mutex guards workers, closing and every Worker::loop being set or reset.
+     * Workers wait for each other to return from run before letting go of their App and loop, handoffs may target either */
+    struct Control {
+        std::mutex mutex;
+        std::atomic<bool> closing{false};
+        unsigned int running = 0;
+        std::condition_variable finished;
+    };
+    std::unique_ptr<Control> control{new Control};
+
+    /* Copyable, as every thread builds its own App from it */
+    std::function<void(TemplatedApp<SSL> &)> routeDefinition;
+
+    std::string host;
+    int port = 0;
+    int listenOptions = 0;
+    fu2::unique_function<void(us_listen_socket_t *)> listenHandler = nullptr;
+
+    std::vector<std::unique_ptr<Worker>> workers;
+
+    /* Pins the calling thread to one core */
+    static void pinToCore(unsigned int core) {
+#ifdef __linux__
+        cpu_set_t cpuSet;
+        CPU_ZERO(&cpuSet);
+        CPU_SET(core, &cpuSet);
+        pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &cpuSet);
+#endif
+    }
+
+    /* Lets the kernel hand every new connection to the listen socket of the core that received it.
+     * Listen sockets join the reuseport group in worker order, worker i being pinned to core i */
+    void attachSteeringProgram() {
+#if defined(__linux__) && defined(SO_ATTACH_REUSEPORT_CBPF)
+        struct sock_filter code[] = {
+            {BPF_LD | BPF_W | BPF_ABS, 0, 0, (__u32) (SKF_AD_OFF + SKF_AD_CPU)},
+            {BPF_ALU | BPF_MOD | BPF_K, 0, 0, (__u32) workers.size()},
+            {BPF_RET | BPF_A, 0, 0, 0}
+        };
+        struct sock_fprog program = {3, code};
+
+        int fd = us_poll_fd((us_poll_t *) workers[0]->listenSocket);
+        setsockopt(fd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &program, sizeof(program));
+#endif
+    }
+
+    static const unsigned int PROBE_INTERVAL = 250;
+
+    /* Runs every PROBE_INTERVAL on every worker. Lag is how late the probe fires, smoothed, in milliseconds.
+     * A worker lagging past rebalanceLag and twice as much as the least lagging one sheds a share of the difference in
+     * WebSockets to it, at most an eighth of its own per probe (so that it can tell whether it helped) */
+    void probe(Worker *worker, TemplatedApp<SSL> *app, uint64_t &due) {
+        LoopData *loopData = (LoopData *) us_loop_ext((us_loop_t *) worker->loop.load());
+        uint64_t now = loopData->getTimestamp();
+        unsigned int late = due && now > due ? (unsigned int) (now - due) : 0;
+        due = now + PROBE_INTERVAL;
+
+        unsigned int lag = (worker->lag.load(std::memory_order_relaxed) * 3 + late) / 4;
+        unsigned long long webSockets = loopData->metrics.value(Metrics::WEBSOCKETS);
+        worker->lag.store(lag, std::memory_order_relaxed);
+        worker->webSockets.store(webSockets, std::memory_order_relaxed);
+
+        if (lag < rebalanceLag || control->closing.load(std::memory_order_relaxed)) {
+            shed(loopData, app, 0, nullptr);
+            return;
+        }
+
+        Worker *idlest = nullptr;
+        for (auto &other : workers) {
+            if (other.get() != worker && other->app.load(std::memory_order_acquire)
+                && (!idlest || other->lag.load(std::memory_order_relaxed) < idlest->lag.load(std::memory_order_relaxed))) {
+                idlest = other.get();
+            }
+        }
+
+        unsigned long long theirs = idlest ? idlest->webSockets.load(std::memory_order_relaxed) : 0;
+        if (!idlest || lag < 2 * idlest->lag.load(std::memory_order_relaxed) || webSockets <= theirs + 1) {
+            shed(loopData, app, 0, nullptr);
+            return;
+        }
+
+        shed(loopData, app, (unsigned int) std::min<unsigned long long>((webSockets - theirs) / 2, webSockets / 8 + 1), idlest->app.load(std::memory_order_relaxed));
+    }
+
+    /* Like TemplatedApp::shed, but stopping as soon as close is called rather than by the next probe */
+    void shed(LoopData *loopData, TemplatedApp<SSL> *app, unsigned int count, TemplatedApp<SSL> *target) {
+        loopData->shedQuota = count;
+        if (!count) {
+            loopData->shedHandler = nullptr;
+            return;
+        }
+        loopData->shedHandler = [control = control.get(), loopData, app, target](us_socket_t *s) {
+            if (control->closing.load(std::memory_order_relaxed)) {
+                loopData->shedQuota = 0;
+                return false;
+            }
+            return app->handoff((WebSocket<SSL, true> *) s, target);
+        };
+    }
+
+public:
+    TemplatedMultiApp(us_socket_context_options_t options = {}, unsigned int threads = std::thread::hardware_concurrency()) : socketContextOptions(options) {
+        numThreads = threads ? threads : 1;
+    }
+
+    TemplatedMultiApp(const TemplatedMultiApp &other) = delete;
+    TemplatedMultiApp(TemplatedMultiApp &&other) = default;
+
+    /* Number of threads (and Apps) to run */
+    TemplatedMultiApp &&threads(unsigned int threads) {
+        numThreads = threads ? threads : 1;
+        return std::move(*this);
+    }
+
+    /* Pin thread i to core i (modulo cores), on by default and Linux only */
+    TemplatedMultiApp &&pin(bool pin) {
+        pinThreads = pin;
+        return std::move(*this);
+    }
+
+    /* Attach a BPF program steering connections to the thread pinned to the core they arrived on.
+     * Only makes sense together with pinning and one thread per core, Linux only */
+    TemplatedMultiApp &&steer(bool steer) {
+        steerConnections = steer;
+        return std::move(*this);
+    }
+
+    /* Moves WebSockets off workers whose loop lags by at least lag milliseconds onto the least lagging one, see
+     * TemplatedApp::handoff for which sockets can move and what it takes. All Apps must have the same routes.
+     * Does nothing where handoff is compiled out (without UWS_HAS_SOCKET_FROM_FD) or for SSL */
+    TemplatedMultiApp &&rebalance([[maybe_unused]] bool rebalance, unsigned int lag = 20) {
+#ifdef UWS_HAS_SOCKET_FROM_FD
+        rebalancing = rebalance && !SSL;
+#else
+        rebalancing = false;
+#endif
+        rebalanceLag = lag;
+        return std::move(*this);
+    }
+
+    /* Called once on every thread with that thread's App, register all routes and behaviors here */
+    TemplatedMultiApp &&routes(std::function<void(TemplatedApp<SSL> &)> &&definition) {
+        routeDefinition = std::move(definition);
+        return std::move(*this);
+    }
+
+    /* Every App listens once run, the handler is called once per thread (never concurrently) */
+    TemplatedMultiApp &&listen(std::string host, int port, int options, fu2::unique_function<void(us_listen_socket_t *)> &&handler) {
+        this->host = std::move(host);
+        this->port = port;
+        listenOptions = options;
+        listenHandler = std::move(handler);
+        return std::move(*this);
+    }
+
+    TemplatedMultiApp &&listen(std::string host, int port, fu2::unique_function<void(us_listen_socket_t *)> &&handler) {
+        return listen(std::move(host), port, 0, std::move(handler));
+    }
+
+    TemplatedMultiApp &&listen(int port, int options, fu2::unique_function<void(us_listen_socket_t *)> &&handler) {
+        return listen({}, port, options, std::move(handler));
+    }
+
+    TemplatedMultiApp &&listen(int port, fu2::unique_function<void(us_listen_socket_t *)> &&handler) {
+        return listen({}, port, 0, std::move(handler));
+    }
+
+    /* Starts all threads one after another and blocks until every one of them has returned */
+    TemplatedMultiApp &&run() {
+        unsigned int numCores = std::max<unsigned int>(1, std::thread::hardware_concurrency());
+        bool allListening = true;
+
+        /* All created up front, probes of running workers look at the others */
+        {
+            std::lock_guard<std::mutex> lock(control->mutex);
+            control->closing = false;
+            control->running = numThreads;
+            workers.clear();
+            for (unsigned int i = 0; i < numThreads; i++) {
+                workers.emplace_back(new Worker);
+            }
+        }
+
+        for (unsigned int i = 0; i < numThreads; i++) {
+            Worker *worker = workers[i].get();
+
+            /* We wait for every thread to listen before starting the next one, as to keep a stable order */
+            std::promise<void> listening;
+            std::future<void> listened = listening.get_future();
+
+            worker->thread = std::thread([this, worker, i, numCores, &listening]() {
+                if (pinThreads) {
+                    pinToCore(i % numCores);
+                }
+
+                {
+                    std::lock_guard<std::mutex> lock(control->mutex);
+                    worker->loop = Loop::get();
+                }
+
+                TemplatedApp<SSL> app(socketContextOptions);
+                if (routeDefinition) {
+                    routeDefinition(app);
+                }
+
+                app.listen(host, port, listenOptions, [this, worker](us_listen_socket_t *listenSocket) {
+                    worker->listenSocket = listenSocket;
+                    if (listenHandler) {
+                        listenHandler(listenSocket);
+                    }
+                });
+
+                /* A close before we had a loop did not reach us, what it deferred after that runs only if we run */
+                {
+                    std::lock_guard<std::mutex> lock(control->mutex);
+                    if (control->closing && worker->listenSocket) {
+                        us_listen_socket_close(SSL, worker->listenSocket);
+                        worker->listenSocket = nullptr;
+                    }
+                }
+
+                bool didListen = worker->listenSocket != nullptr;
+                if (didListen && rebalancing) {
+                    worker->app.store(&app, std::memory_order_release);
+                    worker->probeTimer = worker->loop.load()->setInterval(PROBE_INTERVAL, [this, worker, app = &app, due = (uint64_t) 0]() mutable {
+                        probe(worker, app, due);
+                    });
+                }
+                listening.set_value();
+
+                if (didListen) {
+                    app.run();
+                }
+                worker->app.store(nullptr, std::memory_order_release);
+
+                /* Others may still be handing off to our App, which goes away with our loop and this thread */
+                std::unique_lock<std::mutex> lock(control->mutex);
+                if (!--control->running) {
+                    control->finished.notify_all();
+                }
+                control->finished.wait(lock, [this]() {
+                    return !control->running;
+                });
+                worker->loop = nullptr;
+            });
+
+            listened.wait();
+            allListening &= worker->listenSocket != nullptr;
+        }
+
+        if (steerConnections && allListening) {
+            attachSteeringProgram();
+        }
+
+        for (auto &worker : workers) {
+            worker->thread.join();
+        }
+
+        std::lock_guard<std::mutex> lock(control->mutex);
+        workers.clear();
+
+        return std::move(*this);
+    }
+
+    /* Stops all threads from accepting, each returns from run once its connections are gone.
+     * Can be called from any thread while running, threads yet to start do not run at all */
+    void close() {
+        std::lock_guard<std::mutex> lock(control->mutex);
+        control->closing = true;
+        for (auto &worker : workers) {
+            Worker *w = worker.get();
+            if (Loop *loop = w->loop.load()) {
+                loop->defer([w, loop]() {
+                    LoopData *loopData = (LoopData *) us_loop_ext((us_loop_t *) loop);
+                    loopData->shedQuota = 0;
+                    loopData->shedHandler = nullptr;
+                    if (w->probeTimer) {
+                        loop->clearTimer(w->probeTimer);
+                        w->probeTimer = 0;
+                    }
+                    if (w->listenSocket) {
+                        us_listen_socket_close(SSL, w->listenSocket);
+                        w->listenSocket = nullptr;
+                    }
+                });
+            }
+        }
+    }
+};
+
+typedef TemplatedMultiApp<false> MultiApp;
+typedef TemplatedMultiApp<true> SSLMultiApp;
+
+}
+
+#endif // UWS_MULTIAPP_H
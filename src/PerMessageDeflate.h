@@ -21,29 +21,65 @@
 #define UWS_PERMESSAGEDEFLATE_H
 
 #ifndef UWS_NO_ZLIB
+/* zlib-ng built in compatibility mode is a drop-in replacement and needs nothing but linking against it */
 #include <zlib.h>
 #endif
 
+/* libdeflate only does stateless compression, which is all the shared compressor needs */
+#ifdef UWS_USE_LIBDEFLATE
+#include <libdeflate.h>
+#endif
+
 #include <string>
+#include <algorithm>
 
 namespace uWS {
 
+/* How dedicated compressors are sized. A stream takes about 2^(windowBits + 2) + 2^(memLevel + 9) bytes,
+ * the default of 15 and 8 being 256 kb while 9 and 1 is a mere 3 kb */
+struct CompressionProfile {
+    /* 9 to 15, the server_max_window_bits we negotiate unless the client asks for less */
+    int windowBits = 15;
+    /* 1 to 9 */
+    int memLevel = 8;
+    /* 0 to 9 */
+    int level = 1;
+};
+
 /* Do not compile this module if we don't want it */
 #ifdef UWS_NO_ZLIB
 struct ZlibContext {};
 struct InflationStream {
+    InflationStream(std::string_view dictionary = {}) {}
+
+    template <class Buffer>
+    bool inflateChunk(std::string_view compressed, Buffer &output, size_t maxPayloadLength) {
+        output.append(compressed.data(), compressed.length());
+        return output.length() <= maxPayloadLength;
+    }
+
     std::string_view inflate(ZlibContext *zlibContext, std::string_view compressed, size_t maxPayloadLength) {
         return compressed;
     }
 };
 struct DeflationStream {
+    DeflationStream(int windowBits = 15, int memLevel = 8, int level = 1, std::string_view dictionary = {}) {}
+
     std::string_view deflate(ZlibContext *zlibContext, std::string_view raw, bool reset) {
         return raw;
     }
 };
 #else
 
-#define LARGE_BUFFER_SIZE 1024 * 16 // todo: fix this
+/* Output is produced in chunks of this size, anything larger spills into the dynamic buffers */
+#ifndef LARGE_BUFFER_SIZE
+#define LARGE_BUFFER_SIZE 1024 * 16
+#endif
+
+/* The libdeflate level used in place of zlib's for the shared compressor, 6 is about as fast as zlib's 1 */
+#ifndef UWS_LIBDEFLATE_LEVEL
+#define UWS_LIBDEFLATE_LEVEL 6
+#endif
 
 struct ZlibContext {
     /* Any returned data is valid until next same-class call.
@@ -52,24 +88,48 @@ struct ZlibContext {
     std::string dynamicDeflationBuffer;
     std::string dynamicInflationBuffer;
     char *deflationBuffer;
-    char *inflationBuffer;
 
     ZlibContext() {
         deflationBuffer = (char *) malloc(LARGE_BUFFER_SIZE);
-        inflationBuffer = (char *) malloc(LARGE_BUFFER_SIZE);
     }
 
     ~ZlibContext() {
         free(deflationBuffer);
-        free(inflationBuffer);
     }
 };
 
 struct DeflationStream {
     z_stream deflationStream = {};
 
-    DeflationStream() {
-        deflateInit2(&deflationStream, 1, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY);
+    /* A preset dictionary every message may refer back to, only peers knowing it can inflate what we send */
+    std::string_view dictionary;
+
+#ifdef UWS_USE_LIBDEFLATE
+    /* Allocated the first time we are used as a resetting (shared) compressor */
+    libdeflate_compressor *statelessCompressor = nullptr;
+
+    /* A complete deflate stream ending in a final block, which RFC 7692 allows in place of the stripped sync flush */
+    std::string_view statelessDeflate(ZlibContext *zlibContext, std::string_view raw) {
+        char *output = zlibContext->deflationBuffer;
+        size_t bound = libdeflate_deflate_compress_bound(statelessCompressor, raw.length());
+        if (bound > LARGE_BUFFER_SIZE) {
+            zlibContext->dynamicDeflationBuffer.resize(bound);
+            output = zlibContext->dynamicDeflationBuffer.data();
+        }
+
+        return {output, libdeflate_deflate_compress(statelessCompressor, raw.data(), raw.length(), output, bound)};
+    }
+#endif
+
+    DeflationStream(int windowBits = 15, int memLevel = 8, int level = 1, std::string_view dictionary = {}) : dictionary(dictionary) {
+        deflateInit2(&deflationStream, level, Z_DEFLATED, -windowBits, memLevel, Z_DEFAULT_STRATEGY);
+        setDictionary();
+    }
+
+    void setDictionary() {
+        if (dictionary.length()) {
+            deflateSetDictionary(&deflationStream, (const Bytef *) dictionary.data(), (unsigned int) dictionary.length());
+        }
     }
 
     /* Deflate and optionally reset */
@@ -77,6 +137,18 @@ struct DeflationStream {
         /* Odd place to clear this one, fix */
         zlibContext->dynamicDeflationBuffer.clear();
 
+#ifdef UWS_USE_LIBDEFLATE
+        /* libdeflate knows nothing of preset dictionaries, and zlib does it all should its compressor fail to allocate */
+        if (reset && !dictionary.length()) {
+            if (!statelessCompressor) {
+                statelessCompressor = libdeflate_alloc_compressor(UWS_LIBDEFLATE_LEVEL);
+            }
+            if (statelessCompressor) {
+                return statelessDeflate(zlibContext, raw);
+            }
+        }
+#endif
+
         deflationStream.next_in = (Bytef *) raw.data();
         deflationStream.avail_in = (unsigned int) raw.length();
 
@@ -100,6 +172,7 @@ struct DeflationStream {
         /* This must not change avail_out */
         if (reset) {
             deflateReset(&deflationStream);
+            setDictionary();
         }
 
         if (zlibContext->dynamicDeflationBuffer.length()) {
@@ -116,55 +189,80 @@ struct DeflationStream {
 
     ~DeflationStream() {
         deflateEnd(&deflationStream);
+#ifdef UWS_USE_LIBDEFLATE
+        if (statelessCompressor) {
+            libdeflate_free_compressor(statelessCompressor);
+        }
+#endif
     }
 };
 
 struct InflationStream {
     z_stream inflationStream = {};
 
-    InflationStream() {
+    /* Must be the same dictionary the peer deflated with */
+    std::string_view dictionary;
+
+    InflationStream(std::string_view dictionary = {}) : dictionary(dictionary) {
         inflateInit2(&inflationStream, -15);
+        setDictionary();
+    }
+
+    void setDictionary() {
+        if (dictionary.length()) {
+            inflateSetDictionary(&inflationStream, (const Bytef *) dictionary.data(), (unsigned int) dictionary.length());
+        }
     }
 
     ~InflationStream() {
         inflateEnd(&inflationStream);
     }
 
-    std::string_view inflate(ZlibContext *zlibContext, std::string_view compressed, size_t maxPayloadLength) {
-
-        /* We clear this one here, could be done better */
-        zlibContext->dynamicInflationBuffer.clear();
-
+    /* Inflates straight onto the end of output (anything with data, length and resize) without resetting, so a message can be fed as its fragments arrive.
+     * Output never grows more than one byte past maxPayloadLength, we stop and fail the moment it would */
+    template <class Buffer>
+    bool inflateChunk(std::string_view compressed, Buffer &output, size_t maxPayloadLength) {
         inflationStream.next_in = (Bytef *) compressed.data();
         inflationStream.avail_in = (unsigned int) compressed.length();
 
+        size_t length = output.length();
         int err;
         do {
-            inflationStream.next_out = (Bytef *) zlibContext->inflationBuffer;
-            inflationStream.avail_out = LARGE_BUFFER_SIZE;
-
-            err = ::inflate(&inflationStream, Z_SYNC_FLUSH);
-            if (err == Z_OK && inflationStream.avail_out) {
-                break;
+            /* Grow geometrically, capped at the limit */
+            if (length == output.length()) {
+                output.resize(std::min<size_t>(length + std::max<size_t>(length, LARGE_BUFFER_SIZE), maxPayloadLength + 1));
             }
 
-            zlibContext->dynamicInflationBuffer.append(zlibContext->inflationBuffer, LARGE_BUFFER_SIZE - inflationStream.avail_out);
+            inflationStream.next_out = (Bytef *) output.data() + length;
+            inflationStream.avail_out = (unsigned int) (output.length() - length);
 
+            /* Peers may end a message with a final block rather than a sync flush */
+            err = ::inflate(&inflationStream, Z_SYNC_FLUSH);
+            length = output.length() - inflationStream.avail_out;
+        } while (err == Z_OK && !inflationStream.avail_out && length <= maxPayloadLength);
 
-        } while (inflationStream.avail_out == 0 && zlibContext->dynamicInflationBuffer.length() <= maxPayloadLength);
+        output.resize(length);
+        return (err == Z_OK || err == Z_BUF_ERROR || err == Z_STREAM_END) && length <= maxPayloadLength;
+    }
 
+    /* Readies us for the next message */
+    void reset() {
         inflateReset(&inflationStream);
+        setDictionary();
+    }
 
-        if ((err != Z_BUF_ERROR && err != Z_OK) || zlibContext->dynamicInflationBuffer.length() > maxPayloadLength) {
-            return {nullptr, 0};
-        }
+    /* Inflates a whole message, returns a null view on failure. The view is valid until the next inflation on this context */
+    std::string_view inflate(ZlibContext *zlibContext, std::string_view compressed, size_t maxPayloadLength) {
+        zlibContext->dynamicInflationBuffer.clear();
+
+        bool success = inflateChunk(compressed, zlibContext->dynamicInflationBuffer, maxPayloadLength);
+        reset();
 
-        if (zlibContext->dynamicInflationBuffer.length()) {
-            zlibContext->dynamicInflationBuffer.append(zlibContext->inflationBuffer, LARGE_BUFFER_SIZE - inflationStream.avail_out);
-            return {zlibContext->dynamicInflationBuffer.data(), zlibContext->dynamicInflationBuffer.length()};
+        if (!success) {
+            return {nullptr, 0};
         }
 
-        return {zlibContext->inflationBuffer, LARGE_BUFFER_SIZE - inflationStream.avail_out};
+        return {zlibContext->dynamicInflationBuffer.data(), zlibContext->dynamicInflationBuffer.length()};
     }
 
 };
@@ -0,0 +1,189 @@
+/*
+ * Authored by Alex Hultman, 2018-2019.
+ * Intellectual property of third-party.
+
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+
+ *     http://www.apache.org/licenses/LICENSE-2.0
+
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef UWS_SLABALLOCATOR_H
+#define UWS_SLABALLOCATOR_H
+
+/* Per-loop allocator of small objects in power of two size classes. Blocks are carved from large slabs
+ * and recycled through free lists, no locks as everything allocated here stays on one thread */
+
+#include <cstdlib>
+#include <cstddef>
+#include <cstdint>
+#include <new>
+#include <utility>
+#include <vector>
+
+namespace uWS {
+
+struct SlabAllocator {
+private:
+    /* Size classes of 32, 64, ... 4096 bytes, anything larger goes to malloc */
+    static const unsigned int MIN_SHIFT = 5;
+    static const unsigned int NUM_CLASSES = 8;
+    static const size_t MAX_BLOCK_SIZE = (size_t) 1 << (MIN_SHIFT + NUM_CLASSES - 1);
+    static const size_t SLAB_SIZE = 64 * 1024;
+
+    struct FreeBlock {
+        FreeBlock *next;
+    };
+
+    FreeBlock *freeLists[NUM_CLASSES] = {};
+
+    /* We carve new blocks off the current slab, slabs are only returned when we die */
+    std::vector<char *> slabs;
+    char *slabHead = nullptr, *slabEnd = nullptr;
+
+    static unsigned int sizeClass(size_t size) {
+        unsigned int index = 0;
+        while (((size_t) 1 << (MIN_SHIFT + index)) < size) {
+            index++;
+        }
+        return index;
+    }
+
+public:
+    /* Counters for tuning, a hit is a block reused off a free list */
+    struct Counters {
+        unsigned long long hits = 0;
+        unsigned long long misses = 0;
+        unsigned long long oversized = 0;
+        size_t slabBytes = 0;
+    } counters;
+
+    SlabAllocator() = default;
+    SlabAllocator(const SlabAllocator &) = delete;
+    SlabAllocator &operator=(const SlabAllocator &) = delete;
+
+    ~SlabAllocator() {
+        for (char *slab : slabs) {
+            ::free(slab);
+        }
+    }
+
+    void *allocate(size_t size) {
+        if (size > MAX_BLOCK_SIZE) {
+            counters.oversized++;
+            return malloc(size);
+        }
+
+        unsigned int index = sizeClass(size);
+        if (FreeBlock *block = freeLists[index]) {
+            counters.hits++;
+            freeLists[index] = block->next;
+            return block;
+        }
+
+        counters.misses++;
+        size_t blockSize = (size_t) 1 << (MIN_SHIFT + index);
+        if ((size_t) (slabEnd - slabHead) < blockSize) {
+            /* Whatever is left of the old slab is too small for this class, but we still hand it out
+             * to smaller classes in the future through their free lists */
+            while (slabEnd - slabHead >= (ptrdiff_t) (1 << MIN_SHIFT)) {
+                unsigned int rest = sizeClass(slabEnd - slabHead);
+                if (((size_t) 1 << (MIN_SHIFT + rest)) > (size_t) (slabEnd - slabHead)) {
+                    rest--;
+                }
+                FreeBlock *block = (FreeBlock *) slabHead;
+                block->next = freeLists[rest];
+                freeLists[rest] = block;
+                slabHead += (size_t) 1 << (MIN_SHIFT + rest);
+            }
+
+            slabHead = (char *) malloc(SLAB_SIZE);
+            slabEnd = slabHead + SLAB_SIZE;
+            slabs.push_back(slabHead);
+            counters.slabBytes += SLAB_SIZE;
+        }
+
+        void *block = slabHead;
+        slabHead += blockSize;
+        return block;
+    }
+
+    /* Size has to be what was passed to allocate */
+    void deallocate(void *p, size_t size) {
+        if (!p) {
+            return;
+        }
+
+        if (size > MAX_BLOCK_SIZE) {
+            ::free(p);
+            return;
+        }
+
+        unsigned int index = sizeClass(size);
+        FreeBlock *block = (FreeBlock *) p;
+        block->next = freeLists[index];
+        freeLists[index] = block;
+    }
+
+    template <class T, class... Args>
+    T *create(Args &&... args) {
+        return new (allocate(sizeof(T))) T(std::forward<Args>(args)...);
+    }
+
+    template <class T>
+    void destroy(T *p) {
+        if (p) {
+            p->~T();
+            deallocate(p, sizeof(T));
+        }
+    }
+
+    /* For standard containers, without an allocator this falls back to the heap */
+    template <class T>
+    struct Adapter {
+        typedef T value_type;
+
+        SlabAllocator *slabAllocator = nullptr;
+
+        Adapter(SlabAllocator *slabAllocator = nullptr) : slabAllocator(slabAllocator) {}
+
+        template <class U>
+        Adapter(const Adapter<U> &other) : slabAllocator(other.slabAllocator) {}
+
+        T *allocate(size_t n) {
+            if (slabAllocator) {
+                return (T *) slabAllocator->allocate(n * sizeof(T));
+            }
+            return (T *) ::operator new(n * sizeof(T));
+        }
+
+        void deallocate(T *p, size_t n) {
+            if (slabAllocator) {
+                slabAllocator->deallocate(p, n * sizeof(T));
+            } else {
+                ::operator delete(p);
+            }
+        }
+
+        template <class U>
+        bool operator==(const Adapter<U> &other) const {
+            return slabAllocator == other.slabAllocator;
+        }
+
+        template <class U>
+        bool operator!=(const Adapter<U> &other) const {
+            return slabAllocator != other.slabAllocator;
+        }
+    };
+};
+
+}
+
+#endif // UWS_SLABALLOCATOR_H
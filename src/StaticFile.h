@@ -0,0 +1,87 @@
+/*
+ * Authored by Alex Hultman, 2018-2019.
+ * Intellectual property of third-party.
+
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+
+ *     http://www.apache.org/licenses/LICENSE-2.0
+
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef UWS_STATICFILE_H
+#define UWS_STATICFILE_H
+
+/* A StaticFile is an open, immutable file together with its precomputed response head.
+ * It is shared between the StaticFileCache and every response still sending it */
+
+#ifndef _WIN32
+
+#include <string>
+#include <string_view>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/* Plaintext sockets can send files straight from the page cache */
+#ifdef __linux__
+#include <sys/sendfile.h>
+#define UWS_HAS_SENDFILE
+#endif
+
+namespace uWS {
+
+struct StaticFile {
+private:
+    char *mapped = nullptr;
+
+public:
+    int fd;
+    size_t size;
+
+    /* Quoted, as sent */
+    std::string etag;
+
+    /* Content-Type, ETag, Content-Encoding, Vary and Content-Length, terminating the head */
+    std::string headers;
+
+    StaticFile(int fd, size_t size) : fd(fd), size(size) {}
+    StaticFile(const StaticFile &) = delete;
+    StaticFile &operator=(const StaticFile &) = delete;
+
+    ~StaticFile() {
+        if (mapped) {
+            munmap(mapped, size);
+        }
+        close(fd);
+    }
+
+    /* Maps the whole file on first use, it stays mapped for as long as we live */
+    std::string_view view() {
+        if (!mapped && size) {
+            void *p = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (p != MAP_FAILED) {
+                mapped = (char *) p;
+            }
+        }
+        return {mapped, mapped ? size : 0};
+    }
+
+    bool isMapped() {
+        return mapped != nullptr;
+    }
+};
+
+}
+
+#endif
+
+#endif // UWS_STATICFILE_H
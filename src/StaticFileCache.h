@@ -0,0 +1,344 @@
+/*
+ * Authored by Alex Hultman, 2018-2019.
+ * Intellectual property of third-party.
+
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+
+ *     http://www.apache.org/licenses/LICENSE-2.0
+
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef UWS_STATICFILECACHE_H
+#define UWS_STATICFILECACHE_H
+
+/* A StaticFileCache maps urls under a root to open StaticFiles with their headers precomputed.
+ * Precompressed .br and .gz siblings are picked by Accept-Encoding. Hot small files are kept mapped
+ * for SSL, within a budget, and everything is revalidated with stat at most once per interval.
+ * A cache belongs to one thread, give every App its own */
+
+#ifndef _WIN32
+
+#include "HttpResponse.h"
+
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <list>
+#include <memory>
+#include <chrono>
+
+namespace uWS {
+
+static const char *HTTP_304_NOT_MODIFIED = "304 Not Modified";
+
+struct StaticFileCache {
+    struct Options {
+        /* How many urls we keep open */
+        unsigned int maxEntries = 1024;
+        /* How much we keep mapped in total, and the largest file we map eagerly */
+        size_t maxMappedBytes = 64 * 1024 * 1024;
+        size_t maxMappedFileSize = 256 * 1024;
+        /* How long we trust an entry before asking stat again */
+        std::chrono::milliseconds revalidateInterval = std::chrono::milliseconds(1000);
+    };
+
+private:
+    enum Variant {
+        IDENTITY,
+        GZIP,
+        BROTLI,
+        NUM_VARIANTS
+    };
+
+    struct Entry {
+        std::shared_ptr<StaticFile> variants[NUM_VARIANTS];
+        time_t mtime;
+        off_t size;
+        std::chrono::steady_clock::time_point checked;
+        std::list<std::string>::iterator lru;
+        size_t mappedBytes = 0;
+    };
+
+    std::string root;
+    Options options;
+
+    std::unordered_map<std::string, Entry> entries;
+    /* Most recently used first */
+    std::list<std::string> lru;
+    size_t mappedBytes = 0;
+
+    /* Only plain absolute paths below the root, a trailing slash means its index.html */
+    static bool sanitize(std::string_view url, std::string &path) {
+        if (!url.length() || url[0] != '/') {
+            return false;
+        }
+        for (size_t segment = 1; segment <= url.length(); ) {
+            size_t end = url.find('/', segment);
+            if (end == std::string_view::npos) {
+                end = url.length();
+            }
+            std::string_view name = url.substr(segment, end - segment);
+            if (name == "." || name == ".." || name.find('\0') != std::string_view::npos || name.find('\\') != std::string_view::npos) {
+                return false;
+            }
+            segment = end + 1;
+        }
+
+        path = url;
+        if (path.back() == '/') {
+            path += "index.html";
+        }
+        return true;
+    }
+
+    static std::string_view contentType(std::string_view path) {
+        static const std::pair<std::string_view, std::string_view> types[] = {
+            {".html", "text/html; charset=utf-8"},
+            {".htm", "text/html; charset=utf-8"},
+            {".css", "text/css; charset=utf-8"},
+            {".js", "application/javascript; charset=utf-8"},
+            {".mjs", "application/javascript; charset=utf-8"},
+            {".json", "application/json"},
+            {".txt", "text/plain; charset=utf-8"},
+            {".xml", "application/xml"},
+            {".svg", "image/svg+xml"},
+            {".png", "image/png"},
+            {".jpg", "image/jpeg"},
+            {".jpeg", "image/jpeg"},
+            {".gif", "image/gif"},
+            {".webp", "image/webp"},
+            {".ico", "image/x-icon"},
+            {".wasm", "application/wasm"},
+            {".woff", "font/woff"},
+            {".woff2", "font/woff2"},
+            {".pdf", "application/pdf"},
+            {".mp4", "video/mp4"}
+        };
+
+        size_t dot = path.rfind('.');
+        if (dot != std::string_view::npos && path.find('/', dot) == std::string_view::npos) {
+            std::string_view extension = path.substr(dot);
+            for (auto &type : types) {
+                if (type.first == extension) {
+                    return type.second;
+                }
+            }
+        }
+        return "application/octet-stream";
+    }
+
+    /* Returns the accepted variants as a bit mask, honoring q=0 */
+    static int acceptedVariants(std::string_view acceptEncoding) {
+        int accepted = 1 << IDENTITY;
+        while (acceptEncoding.length()) {
+            size_t comma = acceptEncoding.find(',');
+            std::string_view token = acceptEncoding.substr(0, comma);
+            acceptEncoding.remove_prefix(comma == std::string_view::npos ? acceptEncoding.length() : comma + 1);
+
+            std::string_view parameters;
+            size_t semicolon = token.find(';');
+            if (semicolon != std::string_view::npos) {
+                parameters = token.substr(semicolon + 1);
+                token = token.substr(0, semicolon);
+            }
+            while (token.length() && token.front() == ' ') {
+                token.remove_prefix(1);
+            }
+            while (token.length() && token.back() == ' ') {
+                token.remove_suffix(1);
+            }
+
+            /* Anything of the form q=0, q=0.0 and so on refuses the coding */
+            size_t q = parameters.find("q=");
+            if (q != std::string_view::npos) {
+                std::string_view weight = parameters.substr(q + 2, parameters.find_first_of(" ;", q + 2) - q - 2);
+                if (weight.length() && weight.find_first_not_of("0.") == std::string_view::npos) {
+                    continue;
+                }
+            }
+
+            if (token == "br") {
+                accepted |= 1 << BROTLI;
+            } else if (token == "gzip") {
+                accepted |= 1 << GZIP;
+            }
+        }
+        return accepted;
+    }
+
+    static std::string hex(unsigned long long value) {
+        std::string digits;
+        do {
+            digits.insert(digits.begin(), "0123456789abcdef"[value % 16]);
+            value /= 16;
+        } while (value);
+        return digits;
+    }
+
+    static std::shared_ptr<StaticFile> open(const std::string &fileName, struct stat *st) {
+        int fd = ::open(fileName.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd == -1) {
+            return nullptr;
+        }
+        if (fstat(fd, st) || !S_ISREG(st->st_mode)) {
+            ::close(fd);
+            return nullptr;
+        }
+        return std::make_shared<StaticFile>(fd, (size_t) st->st_size);
+    }
+
+    /* Opens the file with its precompressed siblings as long as those are not older than it */
+    bool load(const std::string &path, Entry &entry) {
+        struct stat st;
+        std::string fileName = root + path;
+        entry.variants[IDENTITY] = open(fileName, &st);
+        if (!entry.variants[IDENTITY]) {
+            return false;
+        }
+        entry.mtime = st.st_mtime;
+        entry.size = st.st_size;
+
+        static const char *suffixes[NUM_VARIANTS] = {"", ".gz", ".br"};
+        static const char *encodings[NUM_VARIANTS] = {"", "gzip", "br"};
+        bool hasVariants = false;
+        for (int variant = GZIP; variant < NUM_VARIANTS; variant++) {
+            struct stat variantStat;
+            entry.variants[variant] = open(fileName + suffixes[variant], &variantStat);
+            if (entry.variants[variant] && variantStat.st_mtime < entry.mtime) {
+                entry.variants[variant] = nullptr;
+            }
+            hasVariants |= entry.variants[variant] != nullptr;
+        }
+
+        std::string_view type = contentType(path);
+        for (int variant = IDENTITY; variant < NUM_VARIANTS; variant++) {
+            StaticFile *file = entry.variants[variant].get();
+            if (!file) {
+                continue;
+            }
+
+            /* Strong validator of size and modification time, differing per encoding */
+            file->etag = "\"" + hex((unsigned long long) entry.size) + "-" + hex((unsigned long long) entry.mtime) + (variant ? std::string("-") + (suffixes[variant] + 1) : std::string()) + "\"";
+
+            file->headers.append("Content-Type: ").append(type).append("\r\n");
+            file->headers.append("ETag: ").append(file->etag).append("\r\n");
+            if (variant) {
+                file->headers.append("Content-Encoding: ").append(encodings[variant]).append("\r\n");
+            }
+            if (hasVariants) {
+                file->headers.append("Vary: Accept-Encoding\r\n");
+            }
+            file->headers.append("Content-Length: ").append(std::to_string(file->size)).append("\r\n\r\n");
+        }
+        return true;
+    }
+
+    void unlink(std::unordered_map<std::string, Entry>::iterator it) {
+        mappedBytes -= it->second.mappedBytes;
+        lru.erase(it->second.lru);
+        entries.erase(it);
+    }
+
+    /* Drops least recently used entries, responses still sending them keep their files alive */
+    void evict() {
+        while (lru.size() > 1 && (lru.size() > options.maxEntries || mappedBytes > options.maxMappedBytes)) {
+            unlink(entries.find(lru.back()));
+        }
+    }
+
+public:
+    StaticFileCache(std::string root) : StaticFileCache(std::move(root), Options()) {}
+
+    StaticFileCache(std::string root, Options options) : root(std::move(root)), options(options) {
+        while (this->root.length() && this->root.back() == '/') {
+            this->root.pop_back();
+        }
+    }
+
+    /* Returns the best variant for this url and Accept-Encoding, or nullptr if there is no such file.
+     * Small files are mapped up front when asked to, as SSL writes from memory */
+    std::shared_ptr<StaticFile> get(std::string_view url, std::string_view acceptEncoding, bool map = false) {
+        std::string path;
+        if (!sanitize(url, path)) {
+            return nullptr;
+        }
+
+        auto now = std::chrono::steady_clock::now();
+        auto it = entries.find(path);
+        if (it != entries.end() && now - it->second.checked >= options.revalidateInterval) {
+            /* Changed files are reopened, and siblings may have come or gone with them */
+            struct stat st;
+            if (stat((root + path).c_str(), &st) || st.st_mtime != it->second.mtime || st.st_size != it->second.size) {
+                unlink(it);
+                it = entries.end();
+            } else {
+                it->second.checked = now;
+            }
+        }
+
+        if (it == entries.end()) {
+            Entry entry;
+            if (!load(path, entry)) {
+                return nullptr;
+            }
+            entry.checked = now;
+            lru.push_front(path);
+            entry.lru = lru.begin();
+            it = entries.emplace(path, std::move(entry)).first;
+        } else if (it->second.lru != lru.begin()) {
+            lru.splice(lru.begin(), lru, it->second.lru);
+        }
+
+        Entry &entry = it->second;
+        int accepted = acceptedVariants(acceptEncoding);
+        std::shared_ptr<StaticFile> file = entry.variants[IDENTITY];
+        for (int variant : {BROTLI, GZIP}) {
+            if ((accepted & (1 << variant)) && entry.variants[variant]) {
+                file = entry.variants[variant];
+                break;
+            }
+        }
+
+        if (map && !file->isMapped() && file->size <= options.maxMappedFileSize) {
+            file->view();
+            if (file->isMapped()) {
+                entry.mappedBytes += file->size;
+                mappedBytes += file->size;
+            }
+        }
+
+        evict();
+        return file;
+    }
+
+    /* Serves the file for this request, answering 304 to a matching If-None-Match. Returns false if there is no such file */
+    template <bool SSL>
+    bool serve(HttpResponse<SSL> *res, HttpRequest *req) {
+        std::shared_ptr<StaticFile> file = get(req->getUrl(), req->getHeader("accept-encoding"), SSL);
+        if (!file) {
+            return false;
+        }
+
+        std::string_view ifNoneMatch = req->getHeader("if-none-match");
+        if (ifNoneMatch == "*" || ifNoneMatch.find(file->etag) != std::string_view::npos) {
+            res->writeStatus(HTTP_304_NOT_MODIFIED)->writeHeader("ETag", file->etag)->endWithoutBody();
+            return true;
+        }
+
+        res->endFile(std::move(file));
+        return true;
+    }
+};
+
+}
+
+#endif
+
+#endif // UWS_STATICFILECACHE_H
@@ -0,0 +1,215 @@
+/*
+ * Authored by Alex Hultman, 2018-2019.
+ * Intellectual property of third-party.
+
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+
+ *     http://www.apache.org/licenses/LICENSE-2.0
+
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef UWS_TIMERWHEEL_H
+#define UWS_TIMERWHEEL_H
+
+/* A hierarchical wheel of millisecond timers: 4 levels of 64 slots, every level 64 times coarser than the one below.
+ * Timers fall down a level as their slot comes around, so setting and clearing timers is constant time however many there are */
+
+#include "f2/function2.hpp"
+
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+
+namespace uWS {
+
+struct TimerWheel {
+private:
+    static const unsigned int LEVELS = 4;
+    static const unsigned int SLOT_BITS = 6;
+    static const unsigned int SLOTS = 1 << SLOT_BITS;
+
+    /* About 4.6 hours, timers further out are parked in the top level and placed again as it comes around */
+    static const uint64_t SPAN = 1ull << (LEVELS * SLOT_BITS);
+
+    struct Timer {
+        uint64_t due;
+        uint64_t interval;
+        fu2::unique_function<void()> cb;
+    };
+
+    /* Slots only hold ids, cleared timers are skipped when their slot comes around */
+    std::vector<uint64_t> slots[LEVELS][SLOTS];
+    size_t counts[LEVELS] = {};
+    std::unordered_map<uint64_t, Timer> timers;
+
+    /* The last millisecond we advanced to */
+    uint64_t current = 0;
+    uint64_t lastId = 0;
+
+    /* Due already ran in this advance, in slot order */
+    std::vector<uint64_t> ready;
+
+    /* Into the finest level that does not wrap before due, due must be later than current */
+    void place(uint64_t id, uint64_t due) {
+        if (due - current >= SPAN) {
+            due = current + SPAN - 1;
+        }
+
+        unsigned int level = 0;
+        while (level < LEVELS - 1 && due - current >= (1ull << (SLOT_BITS * (level + 1)))) {
+            level++;
+        }
+
+        slots[level][(due >> (SLOT_BITS * level)) & (SLOTS - 1)].push_back(id);
+        counts[level]++;
+    }
+
+    /* Everything of this slot is either due or falls down toward its own */
+    void cascade(unsigned int level, unsigned int slot) {
+        std::vector<uint64_t> ids;
+        ids.swap(slots[level][slot]);
+        counts[level] -= ids.size();
+
+        for (uint64_t id : ids) {
+            auto it = timers.find(id);
+            if (it == timers.end()) {
+                continue;
+            }
+            if (it->second.due <= current) {
+                ready.push_back(id);
+            } else {
+                place(id, it->second.due);
+            }
+        }
+
+        /* Keep the capacity of busy slots */
+        if (slots[level][slot].empty()) {
+            ids.clear();
+            slots[level][slot].swap(ids);
+        }
+    }
+
+    /* Coarser levels first, what they hand down for this very millisecond is ready right away */
+    void tick() {
+        for (unsigned int level = LEVELS - 1; level > 0; level--) {
+            if (!(current & ((1ull << (SLOT_BITS * level)) - 1))) {
+                cascade(level, (current >> (SLOT_BITS * level)) & (SLOTS - 1));
+            }
+        }
+        cascade(0, current & (SLOTS - 1));
+    }
+
+    void fire(uint64_t now) {
+        for (size_t i = 0; i < ready.size(); i++) {
+            auto it = timers.find(ready[i]);
+            if (it == timers.end()) {
+                continue;
+            }
+
+            if (!it->second.interval) {
+                fu2::unique_function<void()> cb = std::move(it->second.cb);
+                timers.erase(it);
+                cb();
+                continue;
+            }
+
+            /* Intervals keep their phase, unless we fell behind by whole periods which are skipped */
+            uint64_t id = ready[i];
+            it->second.due += it->second.interval;
+            if (it->second.due <= now) {
+                it->second.due = now + it->second.interval;
+            }
+            place(id, it->second.due);
+
+            /* The callback may clear its own timer */
+            fu2::unique_function<void()> cb = std::move(it->second.cb);
+            cb();
+            if ((it = timers.find(id)) != timers.end()) {
+                it->second.cb = std::move(cb);
+            }
+        }
+        ready.clear();
+    }
+
+public:
+    /* Returns an id for clear, never 0. A zero interval runs cb once */
+    uint64_t set(uint64_t now, uint64_t milliseconds, uint64_t interval, fu2::unique_function<void()> &&cb) {
+        if (timers.empty()) {
+            current = std::max(current, now);
+        }
+
+        uint64_t id = ++lastId;
+        uint64_t due = std::max(now + milliseconds, current + 1);
+        timers.emplace(id, Timer {due, interval, std::move(cb)});
+        place(id, due);
+        return id;
+    }
+
+    /* Returns whether the timer was still set */
+    bool clear(uint64_t id) {
+        return timers.erase(id);
+    }
+
+    bool empty() {
+        return timers.empty();
+    }
+
+    /* Runs everything due up to and including now */
+    void advance(uint64_t now) {
+        while (current < now) {
+            /* Skip to the next millisecond where the finest level holding anything has a slot coming around */
+            unsigned int level = 0;
+            while (level < LEVELS && !counts[level]) {
+                level++;
+            }
+            if (level == LEVELS) {
+                current = now;
+                break;
+            }
+
+            uint64_t next = current + 1;
+            if (level) {
+                next = std::min(now, ((current >> (SLOT_BITS * level)) + 1) << (SLOT_BITS * level));
+            }
+            current = next;
+
+            tick();
+            fire(now);
+        }
+    }
+
+    /* Milliseconds from now until a slot holding anything comes around, 0 if nothing is set */
+    uint64_t timeout(uint64_t now) {
+        if (timers.empty()) {
+            return 0;
+        }
+
+        uint64_t next = UINT64_MAX;
+        for (unsigned int level = 0; level < LEVELS; level++) {
+            if (!counts[level]) {
+                continue;
+            }
+            unsigned int shift = SLOT_BITS * level;
+            for (uint64_t i = 1; i <= SLOTS; i++) {
+                uint64_t at = ((current >> shift) + i) << shift;
+                if (!slots[level][(at >> shift) & (SLOTS - 1)].empty()) {
+                    next = std::min(next, at);
+                    break;
+                }
+            }
+        }
+
+        return next > now ? next - now : 1;
+    }
+};
+
+}
+
+#endif // UWS_TIMERWHEEL_H
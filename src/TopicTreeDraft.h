@@ -20,36 +20,372 @@
 
 #include <iostream>
 #include <vector>
+#include <algorithm>
+#include <cstring>
+#include <cstdlib>
+#include <new>
 #include <map>
+#include <string>
 #include <string_view>
 #include <functional>
-#include <set>
 #include <chrono>
-#include <list>
+#include <cstdint>
+#include <atomic>
+
+#include "SlabAllocator.h"
 
 namespace uWS {
 
+/* A published message is framed once into one of these and then shared (refcounted) by every Topic it hits.
+ * The count is atomic as a Hub shares the very same message between the trees of many threads */
+struct SharedMessage {
+    std::atomic<unsigned int> refCount = 1;
+    unsigned int length;
+
+    /* Only messages that never leave their loop's thread may come from its slab allocator */
+    unsigned int capacity;
+    SlabAllocator *slabAllocator;
+
+    /* A compressed message carries its uncompressed frame along for subscribers that cannot take the former */
+    SharedMessage *uncompressed = nullptr;
+
+    /* Allocates room for length bytes following the header, refCount starts at 1 */
+    static SharedMessage *create(size_t length, SlabAllocator *slabAllocator = nullptr) {
+        size_t size = sizeof(SharedMessage) + length;
+        SharedMessage *sharedMessage = new (slabAllocator ? slabAllocator->allocate(size) : malloc(size)) SharedMessage;
+        sharedMessage->length = sharedMessage->capacity = (unsigned int) length;
+        sharedMessage->slabAllocator = slabAllocator;
+        return sharedMessage;
+    }
+
+    char *data() {
+        return (char *) (this + 1);
+    }
+
+    /* The message a frame of the TopicTree callback is the data of, to hold on to it rather than copy it */
+    static SharedMessage *of(std::string_view frame) {
+        return ((SharedMessage *) frame.data()) - 1;
+    }
+
+    SharedMessage *ref() {
+        refCount.fetch_add(1, std::memory_order_relaxed);
+        return this;
+    }
+
+    void unref() {
+        if (refCount.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+            if (uncompressed) {
+                uncompressed->unref();
+            }
+            if (slabAllocator) {
+                slabAllocator->deallocate(this, sizeof(SharedMessage) + capacity);
+            } else {
+                ::free(this);
+            }
+        }
+    }
+};
+
+/* FNV-1a, continued from a previous hash so that the hash of a whole topic is that of its parent path, a '/' and its segment */
+static inline uint64_t hashTopic(std::string_view data, uint64_t hash = 14695981039346656037ull) {
+    for (unsigned char c : data) {
+        hash = (hash ^ c) * 1099511628211ull;
+    }
+    return hash;
+}
+
+/* Flat open addressing set of pointers by precomputed hash, so lookups are a multiply and a short linear probe.
+ * Erase shifts entries back rather than leaving tombstones and an empty set owns no memory at all */
+template <class T>
+struct HashedSet {
+private:
+    struct Entry {
+        uint64_t hash;
+        T *value;
+    };
+    Entry *entries = nullptr;
+    size_t mask = 0, count = 0;
+
+    size_t home(uint64_t hash) const {
+        return (size_t) ((hash * 0x9e3779b97f4a7c15ull) >> 32) & mask;
+    }
+
+    void grow(size_t capacity = 0) {
+        Entry *old = entries;
+        size_t oldCapacity = entries ? mask + 1 : 0;
+        mask = std::max<size_t>(capacity, oldCapacity ? oldCapacity * 2 : 4) - 1;
+        entries = (Entry *) calloc(mask + 1, sizeof(Entry));
+        for (size_t i = 0; i < oldCapacity; i++) {
+            if (old[i].value) {
+                size_t j = home(old[i].hash);
+                while (entries[j].value) {
+                    j = (j + 1) & mask;
+                }
+                entries[j] = old[i];
+            }
+        }
+        free(old);
+    }
+
+public:
+    HashedSet() = default;
+    HashedSet(const HashedSet &) = delete;
+    HashedSet &operator=(const HashedSet &) = delete;
+
+    ~HashedSet() {
+        free(entries);
+    }
+
+    size_t size() const {
+        return count;
+    }
+
+    /* First value of this hash that equal accepts, or nullptr */
+    template <class Equal>
+    T *find(uint64_t hash, Equal &&equal) const {
+        if (entries) {
+            for (size_t i = home(hash); entries[i].value; i = (i + 1) & mask) {
+                if (entries[i].hash == hash && equal(entries[i].value)) {
+                    return entries[i].value;
+                }
+            }
+        }
+        return nullptr;
+    }
+
+    /* The value must not already be here */
+    void insert(uint64_t hash, T *value) {
+        if (!entries || (count + 1) * 4 > (mask + 1) * 3) {
+            grow();
+        }
+        size_t i = home(hash);
+        while (entries[i].value) {
+            i = (i + 1) & mask;
+        }
+        entries[i] = {hash, value};
+        count++;
+    }
+
+    /* The value must be here */
+    void erase(uint64_t hash, T *value) {
+        size_t i = home(hash);
+        while (entries[i].value != value) {
+            i = (i + 1) & mask;
+        }
+
+        /* Pull back every following entry of the run that may live in the hole */
+        for (size_t j = (i + 1) & mask; entries[j].value; j = (j + 1) & mask) {
+            if (((j - home(entries[j].hash)) & mask) >= ((j - i) & mask)) {
+                entries[i] = entries[j];
+                i = j;
+            }
+        }
+        entries[i] = {0, nullptr};
+
+        if (!--count) {
+            free(entries);
+            entries = nullptr;
+            mask = 0;
+        }
+    }
+
+    /* Room for this many without growing */
+    void reserve(size_t size) {
+        size_t capacity = entries ? mask + 1 : 0;
+        if (size * 4 > capacity * 3) {
+            for (capacity = 4; size * 4 > capacity * 3; capacity *= 2);
+            grow(capacity);
+        }
+    }
+
+    void clear() {
+        free(entries);
+        entries = nullptr;
+        mask = count = 0;
+    }
+
+    template <class F>
+    void forEach(F &&f) const {
+        for (size_t i = 0; entries && i <= mask; i++) {
+            if (entries[i].value) {
+                f(entries[i].value);
+            }
+        }
+    }
+};
+
+/* What a subscription sends a lagging Subscriber (see Subscriber::lagging): everything as usual, nothing at all,
+ * or only the latest message of the topic once the subscriber has caught up. Fresh data is never stuck behind stale data then */
+enum SlowConsumerPolicy : unsigned char {
+    BUFFER,
+    DROP,
+    CONFLATE
+};
+
+/* A message held back from a lagging Subscriber (holding one reference), replaced by later ones of the same topic and subscription */
+struct Conflated {
+    struct Topic *subscription;
+    uint64_t topicHash;
+    unsigned int messageId;
+    SharedMessage *message;
+};
+
 /* A Subscriber is an extension of a socket */
 struct Subscriber {
-    std::list<struct Topic *> subscriptions;
+    /* Every Topic we are subscribed to, by address */
+    HashedSet<struct Topic> subscriptions;
     void *user;
 
+    /* Whether we take compressed frames in place of uncompressed ones */
+    bool compressed = false;
+
+    /* How many retained messages are queued for us, see TopicTree::snapshots */
+    unsigned int snapshots = 0;
+
+    /* Set when the callback reports us over our backpressure limit, cleared by TopicTree::catchUp */
+    bool lagging = false;
+
+    /* The latest message of every topic our CONFLATE subscriptions matched while we lag */
+    HashedSet<Conflated> conflated;
+
     Subscriber(void *user) : user(user) {}
 };
 
+/* Flat, sorted set of Subscribers as to let drain stream through memory rather than chase tree nodes.
+ * Inserts land unsorted in the tail and erases leave tombstones (tagged pointers), both are folded in by commit().
+ * Membership is tracked by the Subscriber itself, so we never insert twice nor erase what is not here. */
+struct SubscriberSet {
+private:
+    std::vector<Subscriber *> subscribers;
+    unsigned int numSorted = 0;
+    unsigned int numTombstones = 0;
+
+    /* While being drained the sorted part must not move, so we only ever append or tombstone */
+    bool frozen = false;
+
+public:
+    static Subscriber *untag(Subscriber *s) {
+        return (Subscriber *) ((uintptr_t) s & ~(uintptr_t) 1);
+    }
+
+    void insert(Subscriber *s) {
+        subscribers.push_back(s);
+
+        /* Keep the unsorted tail short relative to the sorted part, this amortizes to O(log n) */
+        if (!frozen && subscribers.size() - numSorted > std::max<size_t>(64, numSorted)) {
+            commit();
+        }
+    }
+
+    void erase(Subscriber *s) {
+        /* Mass unsubscribes must not scan a long tail for every one of them */
+        if (!frozen && subscribers.size() - numSorted > 64) {
+            commit();
+        }
+
+        /* Recent inserts are simply swapped out of the tail */
+        auto tail = std::find(subscribers.begin() + numSorted, subscribers.end(), s);
+        if (tail != subscribers.end()) {
+            *tail = subscribers.back();
+            subscribers.pop_back();
+            return;
+        }
+
+        /* Otherwise we leave a tombstone in the sorted part, it still sorts as itself */
+        auto it = std::lower_bound(subscribers.begin(), subscribers.begin() + numSorted, s, [](Subscriber *a, Subscriber *b) {
+            return untag(a) < b;
+        });
+        if (it != subscribers.begin() + numSorted && *it == s) {
+            *it = (Subscriber *) ((uintptr_t) s | 1);
+            if (++numTombstones > numSorted / 2 && !frozen) {
+                commit();
+            }
+        }
+    }
+
+    void freeze(bool frozen) {
+        this->frozen = frozen;
+    }
+
+    /* Drops tombstones and merges the tail in, leaving everything sorted and contiguous */
+    void commit() {
+        if (numTombstones) {
+            auto sortedEnd = std::remove_if(subscribers.begin(), subscribers.begin() + numSorted, [](Subscriber *s) {
+                return untag(s) != s;
+            });
+            subscribers.erase(sortedEnd, subscribers.begin() + numSorted);
+            numSorted -= numTombstones;
+            numTombstones = 0;
+        }
+
+        if (numSorted != subscribers.size()) {
+            std::sort(subscribers.begin() + numSorted, subscribers.end());
+            std::inplace_merge(subscribers.begin(), subscribers.begin() + numSorted, subscribers.end());
+            numSorted = (unsigned int) subscribers.size();
+        }
+    }
+
+    size_t size() {
+        return subscribers.size() - numTombstones;
+    }
+
+    /* Length of the sorted part, which is everything right after commit() */
+    size_t sortedSize() {
+        return numSorted;
+    }
+
+    /* Only sorted and without tombstones right after commit() */
+    Subscriber **begin() {
+        return subscribers.data();
+    }
+
+    Subscriber **end() {
+        return subscribers.data() + subscribers.size();
+    }
+};
+
+/* Segment names are interned, wide trees repeat the very same segments (such as "notifications") over and over */
+struct Segment {
+    unsigned int refCount;
+    unsigned int length;
+
+    char *data() {
+        return (char *) (this + 1);
+    }
+};
+
 struct Topic {
-    /* Memory for our name */
+    /* Our name, interned */
     char *name;
     size_t length;
 
+    /* Hash of our name, and of our whole path from the root */
+    uint64_t hash = 0;
+    uint64_t pathHash = 0;
+
     /* Our parent or nullptr */
     Topic *parent = nullptr;
 
     /* Next triggered Topic */
     bool triggered = false;
 
-    /* Exact string matches */
-    std::map<std::string_view, Topic *> children;
+    /* Whether we are reachable by exact topic, see exactTopics */
+    bool indexed = false;
+
+    /* Whether we are in pendingTrims */
+    bool trimPending = false;
+
+    /* What our subscribers get while lagging */
+    SlowConsumerPolicy policy = BUFFER;
+
+    /* Exact string matches (wildcards also live here), by hash of name */
+    HashedSet<Topic> children;
+
+    Topic *findChild(std::string_view segment, uint64_t segmentHash) {
+        return children.find(segmentHash, [segment](Topic *child) {
+            return child->length == segment.length() && !memcmp(child->name, segment.data(), segment.length());
+        });
+    }
 
     /* Wildcard child */
     Topic *wildcardChild = nullptr;
@@ -57,349 +393,933 @@ struct Topic {
     /* Terminating wildcard child */
     Topic *terminatingWildcardChild = nullptr;
 
-    /* What we published */
-    std::map<unsigned int, std::string> messages;
+    /* What we published, in messageId order (each entry holds one reference) */
+    std::vector<std::pair<unsigned int, SharedMessage *>> messages;
 
-    std::set<Subscriber *> subs;
+    /* The last retained message (holding one reference) and its messageId, handed to new subscribers */
+    SharedMessage *retained = nullptr;
+    unsigned int retainedId = 0;
+
+    SubscriberSet subs;
+
+    /* Release our references to anything published but not yet drained */
+    void clearMessages() {
+        for (auto &p : messages) {
+            p.second->unref();
+        }
+        messages.clear();
+    }
 };
 
 struct TopicTree {
 private:
-    std::function<int(Subscriber *, std::string_view)> cb;
+    /* Called once per Subscriber on drain with a scatter list of shared, pre-framed messages (see SharedMessage::of).
+     * Returns nonzero if the subscriber is now lagging, until catchUp is called for it. Must return zero if the subscriber went away */
+    std::function<int(Subscriber *, std::pair<size_t, std::string_view *>)> cb;
 
     Topic *root = new Topic;
 
     /* Global messageId for deduplication of overlapping topics and ordering between topics */
     unsigned int messageId = 0;
 
-    /* The triggered topics */
-    Topic *triggeredTopics[64];
-    int numTriggeredTopics = 0;
-    Subscriber *min = (Subscriber *) UINTPTR_MAX;
-    
-    /* Cull or trim unused Topic nodes from leaf to root */
-    void trimTree(Topic *topic) {
-        if (!topic->subs.size() && !topic->children.size() && !topic->terminatingWildcardChild && !topic->wildcardChild) {
+    /* The triggered topics, there is no limit on how many we batch up per drain */
+    std::vector<Topic *> triggeredTopics;
+
+    /* The batch currently being drained, taken over from triggeredTopics along with their messages */
+    std::vector<std::pair<Topic *, std::vector<std::pair<unsigned int, SharedMessage *>>>> drainingTopics;
+    bool draining = false;
+
+    /* Topics that may have become unused, trimmed a few at a time by trim() rather than right away.
+     * This keeps mass unsubscribes from stalling the loop and lets drain rely on nodes staying alive */
+    std::vector<Topic *> pendingTrims;
+
+    /* Scratch space of the bulk subscribe and unsubscribe */
+    std::vector<Topic *> path;
+
+    /* Retained messages queued for new subscribers (one reference each), sent ahead of the next batch.
+     * Entries of subscribers that left are nulled out rather than erased */
+    std::vector<std::pair<Subscriber *, SharedMessage *>> snapshots, drainingSnapshots;
+    unsigned int numRetained = 0;
+    std::vector<Topic *> pattern;
+
+    /* Merge cursor into the subscribers of one draining topic */
+    struct Cursor {
+        Subscriber *subscriber;
+        unsigned int topicIndex;
+        size_t position, end;
+
+        bool operator>(const Cursor &other) const {
+            return subscriber > other.subscriber || (subscriber == other.subscriber && topicIndex > other.topicIndex);
+        }
+    };
+    std::vector<Cursor> cursors;
+
+    /* All scatter lists of one drain, laid out back to back and reused between drains */
+    std::vector<std::string_view> scatterLists;
+    std::vector<std::pair<unsigned int, SharedMessage *>> unionMessages;
+    std::vector<unsigned int> intersection, lastIntersection;
+
+    /* Hash of the topic of every message published since publishedFrom (and of the draining batch), as CONFLATE
+     * subscriptions keep the latest message per topic rather than per subscription */
+    std::vector<uint64_t> publishedTopics, drainingPublishedTopics;
+    unsigned int publishedFrom = 0, drainingPublishedFrom = 0;
+
+    /* Scratch space of lagging subscribers, which never share scatter lists */
+    std::vector<std::string_view> laggingScatterList;
+
+    /* Every Topic without wildcards on the way to it (wildcard children of its ancestors), by hash of its whole path.
+     * Publishes to such topics cannot match anything else so they skip walking the tree entirely */
+    HashedSet<Topic> exactTopics;
+
+    /* All names in use, shared between Topics */
+    HashedSet<Segment> segments;
+
+    char *intern(std::string_view name, uint64_t hash) {
+        Segment *segment = segments.find(hash, [name](Segment *segment) {
+            return segment->length == name.length() && !memcmp(segment->data(), name.data(), name.length());
+        });
+        if (!segment) {
+            segment = (Segment *) malloc(sizeof(Segment) + name.length());
+            segment->refCount = 0;
+            segment->length = (unsigned int) name.length();
+            memcpy(segment->data(), name.data(), name.length());
+            segments.insert(hash, segment);
+        }
+        segment->refCount++;
+        return segment->data();
+    }
+
+    void release(Topic *topic) {
+        Segment *segment = ((Segment *) topic->name) - 1;
+        if (!--segment->refCount) {
+            segments.erase(topic->hash, segment);
+            free(segment);
+        }
+    }
+
+    static bool hasWildcardChildren(Topic *topic) {
+        return topic->wildcardChild || topic->terminatingWildcardChild;
+    }
+
+    /* Whether children of this topic belong in exactTopics */
+    bool childrenAreExact(Topic *topic) {
+        return (topic == root || topic->indexed) && !hasWildcardChildren(topic);
+    }
+
+    /* Index topic and everything below it that has no wildcards on the way */
+    void indexSubtree(Topic *topic) {
+        topic->indexed = true;
+        exactTopics.insert(topic->pathHash, topic);
+        if (!hasWildcardChildren(topic)) {
+            topic->children.forEach([this](Topic *child) {
+                indexSubtree(child);
+            });
+        }
+    }
+
+    void unindexSubtree(Topic *topic) {
+        if (topic->indexed) {
+            topic->indexed = false;
+            exactTopics.erase(topic->pathHash, topic);
+            topic->children.forEach([this](Topic *child) {
+                unindexSubtree(child);
+            });
+        }
+    }
+
+    /* Whether topic is the full path of this node, walking up from its last segment */
+    bool isPathOf(Topic *node, std::string_view topic) {
+        for (; node != root; node = node->parent) {
+            if (topic.length() < node->length || memcmp(topic.data() + topic.length() - node->length, node->name, node->length)) {
+                return false;
+            }
+            topic.remove_suffix(node->length);
+            if (node->parent != root) {
+                if (!topic.length() || topic.back() != '/') {
+                    return false;
+                }
+                topic.remove_suffix(1);
+            }
+        }
+        return !topic.length();
+    }
+
+    static uint64_t hashPointer(Topic *topic) {
+        return (uint64_t) (uintptr_t) topic;
+    }
+
+    /* Queue the topic for trim() if it looks unused */
+    void scheduleTrim(Topic *topic) {
+        if (!topic->trimPending && topic != root && !topic->subs.size()) {
+            topic->trimPending = true;
+            pendingTrims.push_back(topic);
+        }
+    }
+
+    /* Cull an unused Topic node, queueing its parent as it may have become unused in turn */
+    void trimTopic(Topic *topic) {
+        if (!topic->subs.size() && !topic->retained && topic->policy == BUFFER && !topic->children.size() && !topic->terminatingWildcardChild && !topic->wildcardChild) {
             Topic *parent = topic->parent;
 
-            if (topic->length == 1) {
+            /* Erase us from our parents set (wildcards also live here) */
+            parent->children.erase(topic->hash, topic);
+            if (topic->indexed) {
+                exactTopics.erase(topic->pathHash, topic);
+            }
+
+            if (topic->length == 1 && (topic->name[0] == '#' || topic->name[0] == '+')) {
                 if (topic->name[0] == '#') {
                     parent->terminatingWildcardChild = nullptr;
-                } else if (topic->name[0] == '+') {
+                } else {
                     parent->wildcardChild = nullptr;
                 }
+
+                /* The last wildcard of parent leaving makes its siblings exact again */
+                if (childrenAreExact(parent)) {
+                    parent->children.forEach([this](Topic *child) {
+                        indexSubtree(child);
+                    });
+                }
             }
-            /* Erase us from our parents set (wildcards also live here) */
-            parent->children.erase(std::string_view(topic->name, topic->length));
 
             /* If this node is triggered, make sure to remove it from the triggered list */
             if (topic->triggered) {
-                Topic *tmp[64];
-                int length = 0;
-                for (int i = 0; i < numTriggeredTopics; i++) {
-                    if (triggeredTopics[i] != topic) {
-                        tmp[length++] = triggeredTopics[i];
+                triggeredTopics.erase(std::find(triggeredTopics.begin(), triggeredTopics.end(), topic));
+            }
+
+            /* Free various memory for the node */
+            topic->clearMessages();
+            release(topic);
+            delete topic;
+
+            scheduleTrim(parent);
+        }
+    }
+
+    /* The child of parent by this name, created if need be */
+    Topic *findOrCreateChild(Topic *parent, std::string_view segment) {
+        uint64_t segmentHash = hashTopic(segment);
+        if (Topic *child = parent->findChild(segment, segmentHash)) {
+            return child;
+        }
+
+        /* Allocate and insert new node */
+        Topic *newTopic = new Topic;
+        newTopic->parent = parent;
+        newTopic->name = intern(segment, segmentHash);
+        newTopic->length = segment.length();
+        newTopic->hash = segmentHash;
+        newTopic->pathHash = parent == root ? segmentHash : hashTopic(segment, hashTopic("/", parent->pathHash));
+        newTopic->terminatingWildcardChild = nullptr;
+        newTopic->wildcardChild = nullptr;
+
+        /* For simplicity we do insert wildcards with text */
+        parent->children.insert(segmentHash, newTopic);
+
+        /* Store fast lookup to wildcards */
+        if (segment.length() == 1 && (segment[0] == '+' || segment[0] == '#')) {
+            /* The first wildcard under parent takes its other children out of exactTopics */
+            if (!hasWildcardChildren(parent)) {
+                parent->children.forEach([this](Topic *child) {
+                    unindexSubtree(child);
+                });
+            }
+
+            /* If this segment is '+' it is a wildcard, if it is '#' it is a terminating wildcard */
+            if (segment[0] == '+') {
+                parent->wildcardChild = newTopic;
+            } else {
+                parent->terminatingWildcardChild = newTopic;
+            }
+        } else if (childrenAreExact(parent)) {
+            newTopic->indexed = true;
+            exactTopics.insert(newTopic->pathHash, newTopic);
+        }
+
+        return newTopic;
+    }
+
+    /* Returns the Topic of this exact (wildcards are taken literally) name, or nullptr if it does not exist and we may not create it.
+     * Created walks may start part way in, from iterator at offset start, and append every Topic they pass to trail */
+    Topic *walk(std::string_view topic, bool create, Topic *iterator = nullptr, size_t start = 0, std::vector<Topic *> *trail = nullptr) {
+        iterator = iterator ? iterator : root;
+        for (size_t stop = 0; stop != std::string::npos; start = stop + 1) {
+            stop = topic.find('/', start);
+            std::string_view segment = topic.substr(start, stop - start);
+            iterator = create ? findOrCreateChild(iterator, segment) : iterator->findChild(segment, hashTopic(segment));
+            if (!iterator) {
+                return nullptr;
+            }
+            if (trail) {
+                trail->push_back(iterator);
+            }
+        }
+        return iterator;
+    }
+
+    /* Calls f with the Topic of every given name (or nullptr) in order, every walk resumes from where it shares path with the previous one.
+     * Lists of topics are usually grouped by prefix already, sorting them here costs more than it saves */
+    template <class F>
+    void walkAll(std::pair<size_t, std::string_view *> topics, bool create, F &&f) {
+        /* path holds the Topics of the previous name's segments (root first) as far as they exist */
+        path.assign(1, root);
+        std::string_view previous;
+        for (size_t i = 0; i < topics.first; i++) {
+            std::string_view topic = topics.second[i];
+            /* Count leading whole segments equal to those of previous (and in the path) */
+            size_t depth = 0, offset = 0;
+            bool consumed = false;
+            while (depth + 1 < path.size()) {
+                size_t a = topic.find('/', offset), b = previous.find('/', offset);
+                if (topic.substr(offset, a - offset) != previous.substr(offset, b - offset)) {
+                    break;
+                }
+                depth++;
+                if (a == std::string_view::npos) {
+                    consumed = true;
+                    break;
+                }
+                offset = a + 1;
+            }
+            path.resize(depth + 1);
+
+            if (consumed) {
+                f(path.back());
+            } else if (create) {
+                f(walk(topic, true, path.back(), offset, &path));
+            } else {
+                /* Without creating, extend the path one segment at a time until it runs out */
+                Topic *iterator = path.back();
+                for (size_t start = offset, stop = 0; iterator && stop != std::string::npos; start = stop + 1) {
+                    stop = topic.find('/', start);
+                    std::string_view segment = topic.substr(start, stop - start);
+                    if ((iterator = iterator->findChild(segment, hashTopic(segment)))) {
+                        path.push_back(iterator);
                     }
                 }
+                f(iterator);
+            }
+            previous = topic;
+        }
+    }
+
+    /* Add socket to Topic's set and Topic to our subscriptions only if we weren't already subscribed */
+    void addSubscription(Topic *topic, Subscriber *subscriber, bool sendRetained = true) {
+        if (!subscriber->subscriptions.find(hashPointer(topic), [topic](Topic *t) {return t == topic;})) {
+            topic->subs.insert(subscriber);
+            subscriber->subscriptions.insert(hashPointer(topic), topic);
+            if (numRetained && sendRetained) {
+                queueRetained(topic, subscriber);
+            }
+        }
+    }
+
+    static bool isWildcard(Topic *topic) {
+        return topic->parent && (topic->parent->wildcardChild == topic || topic->parent->terminatingWildcardChild == topic);
+    }
+
+    /* Queue one retained message, unless the subscription already takes it with the pending batch */
+    void queueSnapshot(Topic *retainer, Topic *subscription, Subscriber *subscriber) {
+        auto &messages = subscription->messages;
+        if (!std::binary_search(messages.begin(), messages.end(), std::pair<unsigned int, SharedMessage *>(retainer->retainedId, nullptr), [](auto &a, auto &b) {
+            return a.first < b.first;
+        })) {
+            snapshots.emplace_back(subscriber, retainer->retained->ref());
+            subscriber->snapshots++;
+        }
+    }
 
-                for (int i = 0; i < length; i++) {
-                    triggeredTopics[i] = tmp[i];
+    /* Every retained message below node, which is what a terminating wildcard matches */
+    void queueRetainedBelow(Topic *node, Topic *subscription, Subscriber *subscriber) {
+        node->children.forEach([this, subscription, subscriber](Topic *child) {
+            if (!isWildcard(child)) {
+                if (child->retained) {
+                    queueSnapshot(child, subscription, subscriber);
                 }
-                numTriggeredTopics = length;
+                queueRetainedBelow(child, subscription, subscriber);
             }
+        });
+    }
 
-            /* Free various memory for the node */
-            delete [] topic->name;
-            delete topic;
+    /* Matches pattern from depth on against the literal topics below node, like publish does the other way around */
+    void queueRetainedMatching(Topic *node, size_t depth, Topic *subscription, Subscriber *subscriber) {
+        if (depth == pattern.size()) {
+            if (node->retained) {
+                queueSnapshot(node, subscription, subscriber);
+            }
+            return;
+        }
+
+        Topic *segment = pattern[depth];
+        if (segment->parent->terminatingWildcardChild == segment && depth + 1 == pattern.size()) {
+            queueRetainedBelow(node, subscription, subscriber);
+        } else if (segment->parent->wildcardChild == segment) {
+            node->children.forEach([this, depth, subscription, subscriber](Topic *child) {
+                if (!isWildcard(child)) {
+                    queueRetainedMatching(child, depth + 1, subscription, subscriber);
+                }
+            });
+        } else if (Topic *child = node->findChild(std::string_view(segment->name, segment->length), segment->hash)) {
+            queueRetainedMatching(child, depth + 1, subscription, subscriber);
+        }
+    }
+
+    /* Queue what is retained under a new subscription for the subscriber's next drain */
+    void queueRetained(Topic *subscription, Subscriber *subscriber) {
+        bool wildcards = false;
+        pattern.clear();
+        for (Topic *topic = subscription; topic != root; topic = topic->parent) {
+            pattern.push_back(topic);
+            wildcards |= isWildcard(topic);
+        }
 
-            if (parent != root) {
-                trimTree(parent);
+        if (!wildcards) {
+            if (subscription->retained) {
+                queueSnapshot(subscription, subscription, subscriber);
             }
+        } else {
+            std::reverse(pattern.begin(), pattern.end());
+            queueRetainedMatching(root, 0, subscription, subscriber);
         }
     }
 
-    /* Should be getData and commit? */
-    void publish(Topic *iterator, size_t start, size_t stop, std::string_view topic, std::string_view message) {
-        /* If we already have 64 triggered topics make sure to drain it here */
-        if (numTriggeredTopics == 64) {
-            drain();
+    /* Sends every subscriber its queued retained messages in one go, in the order they were retained */
+    void drainSnapshots() {
+        drainingSnapshots.swap(snapshots);
+        std::stable_sort(drainingSnapshots.begin(), drainingSnapshots.end(), [](auto &a, auto &b) {
+            return a.first < b.first;
+        });
+
+        for (size_t i = 0, j; i < drainingSnapshots.size(); i = j) {
+            Subscriber *subscriber = drainingSnapshots[i].first;
+            scatterLists.clear();
+            for (j = i; j < drainingSnapshots.size() && drainingSnapshots[j].first == subscriber; j++) {
+                SharedMessage *message = drainingSnapshots[j].second;
+                if (subscriber && !subscriber->compressed && message->uncompressed) {
+                    message = message->uncompressed;
+                }
+                scatterLists.emplace_back(message->data(), message->length);
+            }
+            if (subscriber) {
+                subscriber->snapshots -= (unsigned int) (j - i);
+                if (cb(subscriber, {j - i, scatterLists.data()})) {
+                    subscriber->lagging = true;
+                }
+            }
         }
 
-        for (; stop != std::string::npos; start = stop + 1) {
-            stop = topic.find('/', start);
-            std::string_view segment = topic.substr(start, stop - start);
+        for (auto &p : drainingSnapshots) {
+            p.second->unref();
+        }
+        drainingSnapshots.clear();
+    }
 
-            /* Do we have a terminating wildcard child? */
-            if (iterator->terminatingWildcardChild) {
-                iterator->terminatingWildcardChild->messages[messageId] = message;
+    /* Hash of the topic a message of the draining batch was published to */
+    uint64_t publishedTopic(unsigned int id) {
+        unsigned int index = id - drainingPublishedFrom;
+        return index < drainingPublishedTopics.size() ? drainingPublishedTopics[index] : 0;
+    }
 
-                /* Add this topic to triggered */
-                if (!iterator->terminatingWildcardChild->triggered) {
-                    triggeredTopics[numTriggeredTopics++] = iterator->terminatingWildcardChild;
+    static uint64_t conflationHash(Topic *subscription, uint64_t topicHash) {
+        return topicHash ^ hashPointer(subscription);
+    }
 
-                    /* Keep track of lowest subscriber */
-                    if (*iterator->terminatingWildcardChild->subs.begin() < min) {
-                        min = *iterator->terminatingWildcardChild->subs.begin();
-                    }
+    Conflated *findConflated(Subscriber *subscriber, Topic *subscription, uint64_t topicHash) {
+        return subscriber->conflated.find(conflationHash(subscription, topicHash), [subscription, topicHash](Conflated *c) {
+            return c->subscription == subscription && c->topicHash == topicHash;
+        });
+    }
+
+    /* Keep only the latest message of a topic matching a CONFLATE subscription, replacing the one we had */
+    void conflate(Subscriber *subscriber, Topic *subscription, uint64_t topicHash, std::pair<unsigned int, SharedMessage *> &message) {
+        if (Conflated *c = findConflated(subscriber, subscription, topicHash)) {
+            c->message->unref();
+            c->messageId = message.first;
+            c->message = message.second->ref();
+        } else {
+            subscriber->conflated.insert(conflationHash(subscription, topicHash), new Conflated {subscription, topicHash, message.first, message.second->ref()});
+        }
+    }
 
-                    iterator->terminatingWildcardChild->triggered = true;
+    void dropConflated(Subscriber *subscriber, Conflated *c) {
+        subscriber->conflated.erase(conflationHash(c->subscription, c->topicHash), c);
+        c->message->unref();
+        delete c;
+    }
+
+    /* Forget everything a subscription conflated */
+    void dropConflated(Subscriber *subscriber, Topic *subscription) {
+        std::vector<Conflated *> dropped;
+        subscriber->conflated.forEach([subscription, &dropped](Conflated *c) {
+            if (c->subscription == subscription) {
+                dropped.push_back(c);
+            }
+        });
+        for (Conflated *c : dropped) {
+            dropConflated(subscriber, c);
+        }
+    }
+
+    /* Send a lagging subscriber the messages of this intersection its subscriptions still buffer, conflating or dropping the rest */
+    void drainLagging(Subscriber *subscriber) {
+        unionMessages.clear();
+        for (unsigned int i : intersection) {
+            if (drainingTopics[i].first->policy == BUFFER) {
+                auto &messages = drainingTopics[i].second;
+                unionMessages.insert(unionMessages.end(), messages.begin(), messages.end());
+            }
+        }
+        std::sort(unionMessages.begin(), unionMessages.end(), [](auto &a, auto &b) {
+            return a.first < b.first;
+        });
+        unionMessages.erase(std::unique(unionMessages.begin(), unionMessages.end(), [](auto &a, auto &b) {
+            return a.first == b.first;
+        }), unionMessages.end());
+
+        for (unsigned int i : intersection) {
+            Topic *topic = drainingTopics[i].first;
+            if (topic->policy == CONFLATE) {
+                for (auto &message : drainingTopics[i].second) {
+                    uint64_t topicHash = publishedTopic(message.first);
+
+                    /* Going out right now through another subscription, what we held of this topic is older still */
+                    if (std::binary_search(unionMessages.begin(), unionMessages.end(), message, [](auto &a, auto &b) {
+                        return a.first < b.first;
+                    })) {
+                        if (Conflated *c = findConflated(subscriber, topic, topicHash)) {
+                            dropConflated(subscriber, c);
+                        }
+                    } else {
+                        conflate(subscriber, topic, topicHash, message);
+                    }
                 }
             }
+        }
 
-            /* Do we have a wildcard child? */
-            if (iterator->wildcardChild) {
-                publish(iterator->wildcardChild, stop + 1, stop, topic, message);
+        if (unionMessages.size()) {
+            laggingScatterList.clear();
+            for (auto &p : unionMessages) {
+                SharedMessage *message = (!subscriber->compressed && p.second->uncompressed) ? p.second->uncompressed : p.second;
+                laggingScatterList.emplace_back(message->data(), message->length);
             }
+            cb(subscriber, {laggingScatterList.size(), laggingScatterList.data()});
+        }
+    }
 
-            std::map<std::string_view, Topic *>::iterator it = iterator->children.find(segment);
-            if (it == iterator->children.end()) {
-                /* Stop trying to match by exact string */
-                return;
+    bool removeSubscription(Topic *topic, Subscriber *subscriber) {
+        if (topic && subscriber->subscriptions.find(hashPointer(topic), [topic](Topic *t) {return t == topic;})) {
+            if (subscriber->conflated.size()) {
+                dropConflated(subscriber, topic);
             }
+            subscriber->subscriptions.erase(hashPointer(topic), topic);
+            topic->subs.erase(subscriber);
+            scheduleTrim(topic);
+            return true;
+        }
+        return false;
+    }
 
-            iterator = it->second;
+    /* Free the entire tree from this node down */
+    void freeTree(Topic *topic) {
+        topic->children.forEach([this](Topic *child) {
+            freeTree(child);
+        });
+        topic->clearMessages();
+        if (topic->retained) {
+            topic->retained->unref();
+        }
+        if (topic != root) {
+            release(topic);
         }
+        delete topic;
+    }
 
-        /* If we went all the way we matched exactly */
-        iterator->messages[messageId] = message;
+    /* Add a reference of this message to the topic and mark it triggered */
+    void trigger(Topic *topic, SharedMessage *message) {
+        /* The same message can only be added once per topic */
+        if (topic->messages.size() && topic->messages.back().first == messageId) {
+            return;
+        }
+        topic->messages.emplace_back(messageId, message->ref());
 
         /* Add this topic to triggered */
-        if (!iterator->triggered) {
-            triggeredTopics[numTriggeredTopics++] = iterator;
+        if (!topic->triggered) {
+            triggeredTopics.push_back(topic);
+            topic->triggered = true;
+        }
+    }
+
+    /* Should be getData and commit? */
+    void publish(Topic *iterator, size_t start, size_t stop, std::string_view topic, SharedMessage *message) {
+        for (; stop != std::string::npos; start = stop + 1) {
+            stop = topic.find('/', start);
+            std::string_view segment = topic.substr(start, stop - start);
 
-            /* Keep track of lowest subscriber */
-            if (*iterator->subs.begin() < min) {
-                min = *iterator->subs.begin();
+            /* Do we have a terminating wildcard child? */
+            if (iterator->terminatingWildcardChild) {
+                trigger(iterator->terminatingWildcardChild, message);
             }
 
-            iterator->triggered = true;
+            /* Do we have a wildcard child? */
+            if (iterator->wildcardChild) {
+                publish(iterator->wildcardChild, stop + 1, stop, topic, message);
+            }
+
+            iterator = iterator->findChild(segment, hashTopic(segment));
+            if (!iterator) {
+                /* Stop trying to match by exact string */
+                return;
+            }
         }
+
+        /* If we went all the way we matched exactly */
+        trigger(iterator, message);
     }
 
 public:
 
-    TopicTree(std::function<int(Subscriber *, std::string_view)> cb) {
+    TopicTree(std::function<int(Subscriber *, std::pair<size_t, std::string_view *>)> cb) {
         this->cb = cb;
     }
 
     ~TopicTree() {
-        delete root;
+        for (auto &p : snapshots) {
+            p.second->unref();
+        }
+        freeTree(root);
     }
 
     void subscribe(std::string_view topic, Subscriber *subscriber) {
-        /* Start iterating from the root */
-        Topic *iterator = root;
-
         /* Traverse the topic, inserting a node for every new segment separated by / */
-        for (size_t start = 0, stop = 0; stop != std::string::npos; start = stop + 1) {
-            stop = topic.find('/', start);
-            std::string_view segment = topic.substr(start, stop - start);
+        addSubscription(walk(topic, true), subscriber);
+    }
 
-            auto lb = iterator->children.lower_bound(segment);
+    /* Subscribe to many topics at once, neighbours sharing a path only walk it once.
+     * Retained messages can be left out for subscribers which already got them, such as those moving in from another loop */
+    void subscribe(std::pair<size_t, std::string_view *> topics, Subscriber *subscriber, bool sendRetained = true) {
+        subscriber->subscriptions.reserve(subscriber->subscriptions.size() + topics.first);
+        walkAll(topics, true, [this, subscriber, sendRetained](Topic *topic) {
+            addSubscription(topic, subscriber, sendRetained);
+        });
+    }
 
-            if (lb != iterator->children.end() && !(iterator->children.key_comp()(segment, lb->first))) {
-                iterator = lb->second;
-            } else {
-                /* Allocate and insert new node */
-                Topic *newTopic = new Topic;
-                newTopic->parent = iterator;
-                newTopic->name = new char[segment.length()];
-                newTopic->length = segment.length();
-                newTopic->terminatingWildcardChild = nullptr;
-                newTopic->wildcardChild = nullptr;
-                memcpy(newTopic->name, segment.data(), segment.length());
-                
-                /* For simplicity we do insert wildcards with text */
-                iterator->children.insert(lb, {std::string_view(newTopic->name, segment.length()), newTopic});
-
-                /* Store fast lookup to wildcards */
-                if (segment.length() == 1) {
-                    /* If this segment is '+' it is a wildcard */
-                    if (segment[0] == '+') {
-                        iterator->wildcardChild = newTopic;
-                    }
-                    /* If this segment is '#' it is a terminating wildcard */
-                    if (segment[0] == '#') {
-                        iterator->terminatingWildcardChild = newTopic;
+    /* Everything subscriber is subscribed to, named as subscribed to and sorted so that neighbours share their path */
+    std::vector<std::string> getSubscriptions(Subscriber *subscriber) {
+        std::vector<std::string> names;
+        if (subscriber) {
+            names.reserve(subscriber->subscriptions.size());
+            subscriber->subscriptions.forEach([&names](Topic *topic) {
+                std::string name;
+                for (Topic *t = topic; t->parent; t = t->parent) {
+                    name.insert(0, t->name, t->length);
+                    if (t->parent->parent) {
+                        name.insert(0, 1, '/');
                     }
                 }
+                names.push_back(std::move(name));
+            });
+            std::sort(names.begin(), names.end());
+        }
+        return names;
+    }
 
-                iterator = newTopic;
+    /* Publish an already framed message, taking over the caller's reference.
+     * A retained message is also kept by its topic (replacing the last one) and handed to anyone subscribing to it later */
+    void publish(std::string_view topic, SharedMessage *message, bool retain = false) {
+        if (retain) {
+            Topic *retainer = walk(topic, true);
+            if (retainer->retained) {
+                retainer->retained->unref();
+            } else {
+                numRetained++;
             }
+            retainer->retained = message->ref();
+            retainer->retainedId = messageId;
+        }
+
+        /* Nothing pending refers to earlier messages */
+        uint64_t topicHash = hashTopic(topic);
+        if (!triggeredTopics.size()) {
+            publishedTopics.clear();
+            publishedFrom = messageId;
         }
+        publishedTopics.push_back(topicHash);
 
-        /* Add socket to Topic's Set */
-        auto [it, inserted] = iterator->subs.insert(subscriber);
+        Topic *exact = exactTopics.size() ? exactTopics.find(topicHash, [this, topic](Topic *node) {
+            return isPathOf(node, topic);
+        }) : nullptr;
 
-        /* Add Topic to list of subscriptions only if we weren't already subscribed */
-        if (inserted) {
-            subscriber->subscriptions.push_back(iterator);
+        if (exact) {
+            trigger(exact, message);
+        } else {
+            publish(root, 0, 0, topic, message);
         }
+        message->unref();
+        messageId++;
     }
 
-    void publish(std::string_view topic, std::string_view message) {
-        publish(root, 0, 0, topic, message);
-        messageId++;
+    /* Publish a copy of the given bytes */
+    void publish(std::string_view topic, std::string_view message, bool retain = false) {
+        SharedMessage *sharedMessage = SharedMessage::create(message.length());
+        memcpy(sharedMessage->data(), message.data(), message.length());
+        publish(topic, sharedMessage, retain);
     }
 
-    /* Returns whether we were subscribed prior */
-    bool unsubscribe(std::string_view topic, Subscriber *subscriber) {
-        /* Subscribers are likely to have very few subscriptions (20 or fewer) */
-        if (subscriber) {
-            /* Lookup exact Topic ptr from string */
-            Topic *iterator = root;
-            for (size_t start = 0, stop = 0; stop != std::string::npos; start = stop + 1) {
-                stop = topic.find('/', start);
-                std::string_view segment = topic.substr(start, stop - start);
-
-                std::map<std::string_view, Topic *>::iterator it = iterator->children.find(segment);
-                if (it == iterator->children.end()) {
-                    /* This topic does not even exist */
-                    return false;
-                }
+    /* Forgets the retained message of this topic, returns whether there was one */
+    bool clearRetained(std::string_view topic) {
+        Topic *retainer = walk(topic, false);
+        if (!retainer || !retainer->retained) {
+            return false;
+        }
+        retainer->retained->unref();
+        retainer->retained = nullptr;
+        numRetained--;
+        scheduleTrim(retainer);
+        return true;
+    }
 
-                iterator = it->second;
-            }
+    /* Sets what subscribers of this exact topic (or pattern) get while lagging, topics with a policy other than BUFFER are kept around */
+    void setPolicy(std::string_view topic, SlowConsumerPolicy policy) {
+        Topic *subscription = walk(topic, policy != BUFFER);
+        if (subscription) {
+            subscription->policy = policy;
+            scheduleTrim(subscription);
+        }
+    }
 
-            /* Try and remove this topic from our list */
-            for (auto it = subscriber->subscriptions.begin(); it != subscriber->subscriptions.end(); it++) {
-                if (*it == iterator) {
-                    /* Remove topic ptr from our list */
-                    subscriber->subscriptions.erase(it);
+    /* A lagging subscriber has drained enough, sends it what its CONFLATE subscriptions held back in publishing order */
+    void catchUp(Subscriber *subscriber) {
+        subscriber->lagging = false;
+        if (!subscriber->conflated.size()) {
+            return;
+        }
 
-                    /* Remove us from Topic's subs */
-                    iterator->subs.erase(subscriber);
-                    trimTree(iterator);
-                    return true;
-                }
+        /* Overlapping subscriptions may have conflated the very same message */
+        std::vector<Conflated *> conflated;
+        subscriber->conflated.forEach([&conflated](Conflated *c) {
+            conflated.push_back(c);
+        });
+        subscriber->conflated.clear();
+        std::sort(conflated.begin(), conflated.end(), [](Conflated *a, Conflated *b) {
+            return a->messageId < b->messageId;
+        });
+
+        laggingScatterList.clear();
+        for (size_t i = 0; i < conflated.size(); i++) {
+            if (!i || conflated[i]->messageId != conflated[i - 1]->messageId) {
+                SharedMessage *message = (!subscriber->compressed && conflated[i]->message->uncompressed) ? conflated[i]->message->uncompressed : conflated[i]->message;
+                laggingScatterList.emplace_back(message->data(), message->length);
             }
         }
-        return false;
+        if (cb(subscriber, {laggingScatterList.size(), laggingScatterList.data()})) {
+            subscriber->lagging = true;
+        }
+
+        for (Conflated *c : conflated) {
+            c->message->unref();
+            delete c;
+        }
+    }
+
+    /* Returns whether we were subscribed prior */
+    bool unsubscribe(std::string_view topic, Subscriber *subscriber) {
+        return subscriber && removeSubscription(walk(topic, false), subscriber);
     }
 
-    /* Can be called with nullptr, ignore it then */
+    /* Returns how many of these we were subscribed to */
+    size_t unsubscribe(std::pair<size_t, std::string_view *> topics, Subscriber *subscriber) {
+        size_t unsubscribed = 0;
+        if (subscriber) {
+            walkAll(topics, false, [this, subscriber, &unsubscribed](Topic *topic) {
+                unsubscribed += removeSubscription(topic, subscriber);
+            });
+        }
+        return unsubscribed;
+    }
+
+    /* Can be called with nullptr, ignore it then. Unused topics are left for trim() */
     void unsubscribeAll(Subscriber *subscriber) {
         if (subscriber) {
-            for (Topic *topic : subscriber->subscriptions) {
+            subscriber->subscriptions.forEach([this, subscriber](Topic *topic) {
                 topic->subs.erase(subscriber);
-                trimTree(topic);
-            }
+                scheduleTrim(topic);
+            });
             subscriber->subscriptions.clear();
+
+            subscriber->conflated.forEach([](Conflated *c) {
+                c->message->unref();
+                delete c;
+            });
+            subscriber->conflated.clear();
+
+            /* We may be gone before our retained messages are sent */
+            for (auto *list : {&snapshots, &drainingSnapshots}) {
+                for (size_t i = 0; subscriber->snapshots && i < list->size(); i++) {
+                    if ((*list)[i].first == subscriber) {
+                        (*list)[i].first = nullptr;
+                        subscriber->snapshots--;
+                    }
+                }
+            }
+        }
+    }
+
+    /* Frees up to budget Topics that became unused (none while draining), returns whether there is more to do.
+     * Meant to be called every loop iteration so that mass unsubscribes are spread out */
+    bool trim(size_t budget = SIZE_MAX) {
+        while (!draining && pendingTrims.size() && budget) {
+            Topic *topic = pendingTrims.back();
+            pendingTrims.pop_back();
+            topic->trimPending = false;
+            trimTopic(topic);
+            budget--;
         }
+        return pendingTrims.size();
+    }
+
+    /* Whether drain has anything to do */
+    bool hasPendingTopics() {
+        return !draining && (triggeredTopics.size() || snapshots.size());
     }
 
     /* Drain the tree by emitting what to send with every Subscriber */
     /* Better name would be commit() and making it public so that one can commit and shutdown, etc */
     void drain() {
 
-        /* Do nothing if nothing to send */
-        if (!numTriggeredTopics) {
+        /* Do nothing if nothing to send (or if called from within a drain) */
+        if (draining || (!triggeredTopics.size() && !snapshots.size())) {
             return;
         }
 
-        /* bug fix: Filter triggered topics without subscribers */
-        int numFilteredTriggeredTopics = 0;
-        for (int i = 0; i < numTriggeredTopics; i++) {
-            if (triggeredTopics[i]->subs.size()) {
-                triggeredTopics[numFilteredTriggeredTopics++] = triggeredTopics[i];
+        /* Retained messages of new subscriptions go first, they are older than anything in the batch */
+        if (snapshots.size()) {
+            draining = true;
+            drainSnapshots();
+            draining = false;
+        }
+
+        /* Take over the batch, anything published from within the callback ends up in the next one.
+         * bug fix: Filter triggered topics without subscribers (they still need to be reset for next time) */
+        for (Topic *topic : triggeredTopics) {
+            topic->triggered = false;
+            if (topic->subs.size()) {
+                /* Make sure we are sorted and without tombstones before merging */
+                topic->subs.commit();
+                topic->subs.freeze(true);
+                drainingTopics.emplace_back(topic, std::move(topic->messages));
+                topic->messages.clear();
+            } else {
+                topic->clearMessages();
             }
         }
-        numTriggeredTopics = numFilteredTriggeredTopics;
+        triggeredTopics.clear();
+        drainingPublishedTopics.swap(publishedTopics);
+        drainingPublishedFrom = publishedFrom;
+        publishedTopics.clear();
+        publishedFrom = messageId;
 
-        if (!numTriggeredTopics) {
+        if (!drainingTopics.size()) {
             return;
         }
-
-        /* bug fix: update min, as the one tracked via subscribe gets invalid as you unsubscribe */
-        min = (Subscriber *)UINTPTR_MAX;
-        for (int i = 0; i < numTriggeredTopics; i++) {
-            if ((triggeredTopics[i]->subs.size()) && (min > *triggeredTopics[i]->subs.begin())) {
-                min = *triggeredTopics[i]->subs.begin();
-            }
+        draining = true;
+
+        /* Merge all subscriber sets with a min-heap of cursors, one per triggered topic.
+         * We work with indices as sets may grow (but never reorder) from within the callback */
+        cursors.clear();
+        for (unsigned int i = 0; i < drainingTopics.size(); i++) {
+            SubscriberSet &subs = drainingTopics[i].first->subs;
+            cursors.push_back({SubscriberSet::untag(subs.begin()[0]), i, 0, subs.sortedSize()});
         }
+        std::make_heap(cursors.begin(), cursors.end(), std::greater<Cursor>());
+
+        /* Each intersection of topics maps to a (offset, length) slice of scatterLists */
+        std::map<std::string, std::pair<size_t, size_t>, std::less<>> intersectionCache;
+        std::pair<size_t, size_t> lastSlice = {};
+        scatterLists.clear();
+        lastIntersection.clear();
+
+        /* Empty all sets from unique subscribers */
+        while (cursors.size()) {
+            Subscriber *min = cursors.front().subscriber;
+
+            /* Pop every cursor at min, in topic order, and advance them */
+            intersection.clear();
+            while (cursors.size() && cursors.front().subscriber == min) {
+                std::pop_heap(cursors.begin(), cursors.end(), std::greater<Cursor>());
+                Cursor &cursor = cursors.back();
+                Subscriber **subs = drainingTopics[cursor.topicIndex].first->subs.begin();
+
+                /* Tombstones are those who unsubscribed from within the callback */
+                if (subs[cursor.position] == min) {
+                    intersection.push_back(cursor.topicIndex);
+                }
 
-        /* Check if we really have any sockets still */
-        if (min != (Subscriber *)UINTPTR_MAX) {
-
-            /* Up to 64 triggered Topics per batch */
-            std::map<uint64_t, std::string> intersectionCache;
-
-            /* Loop over these here */
-            std::set<Subscriber *>::iterator it[64];
-            std::set<Subscriber *>::iterator end[64];
-            for (int i = 0; i < numTriggeredTopics; i++) {
-                it[i] = triggeredTopics[i]->subs.begin();
-                end[i] = triggeredTopics[i]->subs.end();
+                if (++cursor.position == cursor.end) {
+                    cursors.pop_back();
+                } else {
+                    cursor.subscriber = SubscriberSet::untag(subs[cursor.position]);
+                    std::push_heap(cursors.begin(), cursors.end(), std::greater<Cursor>());
+                }
             }
-            
-            /* Empty all sets from unique subscribers */
-            for (int nonEmpty = numTriggeredTopics; nonEmpty; ) {
 
-                Subscriber *nextMin = (Subscriber *)UINTPTR_MAX;
-
-                /* The message sets relevant for this intersection */
-                std::map<unsigned int, std::string> *perSubscriberIntersectingTopicMessages[64];
-                int numPerSubscriberIntersectingTopicMessages = 0;
+            if (!intersection.size()) {
+                continue;
+            }
 
-                uint64_t intersection = 0;
+            if (min->lagging) {
+                drainLagging(min);
+                continue;
+            }
 
-                for (int i = 0; i < numTriggeredTopics; i++) {
-                    if ((it[i] != end[i]) && (*it[i] == min)) {
+            /* Subscribers taking compressed frames get their own scatter lists, tagged by a trailing marker */
+            intersection.push_back(min->compressed ? ~0u : ~1u);
 
-                        /* Mark this intersection */
-                        intersection |= ((uint64_t)1 << i);
-                        perSubscriberIntersectingTopicMessages[numPerSubscriberIntersectingTopicMessages++] = &triggeredTopics[i]->messages;
+            /* Neighbouring subscribers very often share intersection, skip the lookup then */
+            if (intersection != lastIntersection) {
+                std::string_view key((char *) intersection.data(), intersection.size() * sizeof(unsigned int));
+                auto cached = intersectionCache.find(key);
+                if (cached == intersectionCache.end()) {
 
-                        it[i]++;
-                        if (it[i] == end[i]) {
-                            nonEmpty--;
-                        }
-                        else {
-                            if (nextMin > *it[i]) {
-                                nextMin = *it[i];
-                            }
-                        }
+                    /* Build the union in order without duplicates (common case is one topic, already in order) */
+                    unionMessages.clear();
+                    for (size_t i = 0; i + 1 < intersection.size(); i++) {
+                        auto &messages = drainingTopics[intersection[i]].second;
+                        unionMessages.insert(unionMessages.end(), messages.begin(), messages.end());
                     }
-                    else {
-                        /* We need to lower nextMin to us, in the case of min being the last in a set */
-                        if ((it[i] != end[i]) && (nextMin > *it[i])) {
-                            nextMin = *it[i];
-                        }
-                    }
-                }
-
-                /* Generate cache for intersection */
-                if (intersectionCache[intersection].length() == 0) {
-
-                    /* Build the union in order without duplicates */
-                    std::map<unsigned int, std::string> complete;
-                    for (int i = 0; i < numPerSubscriberIntersectingTopicMessages; i++) {
-                        complete.insert(perSubscriberIntersectingTopicMessages[i]->begin(), perSubscriberIntersectingTopicMessages[i]->end());
+                    if (intersection.size() > 2) {
+                        std::sort(unionMessages.begin(), unionMessages.end(), [](auto &a, auto &b) {
+                            return a.first < b.first;
+                        });
+                        unionMessages.erase(std::unique(unionMessages.begin(), unionMessages.end(), [](auto &a, auto &b) {
+                            return a.first == b.first;
+                        }), unionMessages.end());
                     }
 
-                    /* Create the linear cache */
-                    std::string res;
-                    for (auto &p : complete) {
-                        res.append(p.second);
+                    /* Point straight into the shared messages, no copying */
+                    cached = intersectionCache.emplace(key, std::pair<size_t, size_t>(scatterLists.size(), unionMessages.size())).first;
+                    for (auto &p : unionMessages) {
+                        SharedMessage *message = (!min->compressed && p.second->uncompressed) ? p.second->uncompressed : p.second;
+                        scatterLists.emplace_back(message->data(), message->length);
                     }
-
-                    cb(min, intersectionCache[intersection] = std::move(res));
                 }
-                else {
-                    cb(min, intersectionCache[intersection]);
-                }
-
-                min = nextMin;
+                lastSlice = cached->second;
+                lastIntersection = intersection;
             }
 
+            if (cb(min, {lastSlice.second, scatterLists.data() + lastSlice.first})) {
+                min->lagging = true;
+            }
         }
 
-        /* Clear messages of triggered Topics */
-        for (int i = 0; i < numTriggeredTopics; i++) {
-            triggeredTopics[i]->messages.clear();
-            triggeredTopics[i]->triggered = false;
+        /* Release the batch */
+        for (auto &p : drainingTopics) {
+            p.first->subs.freeze(false);
+            for (auto &m : p.second) {
+                m.second->unref();
+            }
         }
-        numTriggeredTopics = 0;
+        drainingTopics.clear();
+        draining = false;
     }
 
     void print(Topic *root = nullptr, int indentation = 1) {
@@ -408,19 +1328,20 @@ public:
             root = this->root;
         }
 
-        for (auto p : root->children) {
+        root->children.forEach([this, indentation](Topic *child) {
             for (int i = 0; i < indentation; i++) {
                 std::cout << "  ";
             }
-            std::cout << std::string_view(p.second->name, p.second->length) << " = " << p.second->messages.size() << " publishes, " << p.second->subs.size() << " subscribers {";
+            std::cout << std::string_view(child->name, child->length) << " = " << child->messages.size() << " publishes, " << child->subs.size() << " subscribers {";
 
-            for (auto &p : p.second->subs) {
+            child->subs.commit();
+            for (auto *p : child->subs) {
                 std::cout << p << " referring to socket: " << p->user << ", ";
             }
             std::cout << "}" << std::endl;
 
-            print(p.second, indentation + 1);
-        }
+            print(child, indentation + 1);
+        });
     }
 };
 
@@ -30,13 +30,78 @@ namespace uWS {
 template <bool SSL, bool isServer>
 struct WebSocket : AsyncSocket<SSL> {
     template <bool> friend struct TemplatedApp;
+    template <bool> friend struct WebSocketClientContext;
+    template <bool, bool> friend struct WebSocketContext;
 private:
     typedef AsyncSocket<SSL> Super;
 
-    void *init(bool perMessageDeflate, bool slidingCompression, std::string &&backpressure) {
-        new (us_socket_ext(SSL, (us_socket_t *) this)) WebSocketData(perMessageDeflate, slidingCompression, std::move(backpressure));
+    void *init(bool perMessageDeflate, bool slidingCompression, const CompressionProfile &compressionProfile, BackPressure &&backpressure) {
+        WebSocketData *webSocketData = new (us_socket_ext(SSL, (us_socket_t *) this)) WebSocketData(perMessageDeflate, slidingCompression, compressionProfile, std::move(backpressure), &Super::getLoopData()->slabAllocator, &Super::getLoopData()->bufferPool);
+        if constexpr (!isServer) {
+            new (webSocketData->getState<false>()) WebSocketState<false>;
+        }
+        webSocketData->lastActivity = (unsigned int) Super::getLoopData()->getTimestamp();
         return this;
     }
+
+    /* Compresses and frames the message in the pool, everything sent meanwhile queues up behind it */
+    void offloadCompression(CompressionPool *compressionPool, std::string_view message, OpCode opCode) {
+        WebSocketData *webSocketData = (WebSocketData *) Super::getAsyncSocketData();
+        WebSocketData::Extension *extension = webSocketData->getExtension();
+        if (!extension->deferredFrames) {
+            extension->deferredFrames = new DeferredFrames(this);
+        }
+
+        DeferredFrames *deferredFrames = extension->deferredFrames;
+        auto frame = deferredFrames->frames.insert(deferredFrames->frames.end(), {std::string(), false});
+        deferredFrames->refCount++;
+        deferredFrames->bytes += message.length();
+
+        Loop *loop = (Loop *) us_socket_context_loop(SSL, us_socket_context(SSL, (us_socket_t *) this));
+        compressionPool->submit([loop, deferredFrames, frame, message = std::string(message), opCode]() mutable {
+            std::string_view compressed = CompressionPool::deflate(message);
+            std::string data(protocol::messageFrameSize<isServer>(compressed.length()), 0);
+            data.resize(protocol::formatMessage<isServer>(data.data(), compressed.data(), compressed.length(), opCode, compressed.length(), true));
+
+            loop->defer([loop, deferredFrames, frame, rawLength = message.length(), compressedLength = compressed.length(), data = std::move(data)]() mutable {
+                Metrics &metrics = ((LoopData *) us_loop_ext((us_loop_t *) loop))->metrics;
+                metrics.add(Metrics::DEFLATE_BYTES_IN, rawLength);
+                metrics.add(Metrics::DEFLATE_BYTES_OUT, compressedLength);
+
+                deferredFrames->bytes += data.length() - rawLength;
+                frame->data = std::move(data);
+                frame->ready = true;
+                if (deferredFrames->webSocket) {
+                    ((WebSocket *) deferredFrames->webSocket)->flushDeferredFrames();
+                }
+                deferredFrames->unref();
+            });
+        });
+    }
+
+    /* Writes out every frame ready in order, up to the first one still compressing */
+    void flushDeferredFrames() {
+        WebSocketData *webSocketData = (WebSocketData *) Super::getAsyncSocketData();
+        auto &frames = webSocketData->getDeferredFrames()->frames;
+
+        bool corked = Super::canCork() && frames.size() > 1;
+        if (corked) {
+            Super::cork();
+        }
+        while (!frames.empty() && frames.front().ready) {
+            std::string_view frame = frames.front().view();
+            Super::write(frame.data(), (int) frame.length());
+            webSocketData->getDeferredFrames()->popFront();
+        }
+        if (corked) {
+            Super::uncork();
+        }
+
+        /* A close frame may have been waiting in line, we postponed its FIN until now */
+        if (frames.empty() && webSocketData->isShuttingDown && !Super::getBufferedAmount()) {
+            Super::shutdown();
+        }
+    }
 public:
 
     /* Returns pointer to the per socket user data */
@@ -46,20 +111,29 @@ public:
         return (webSocketData + 1);
     }
 
-    /* See AsyncSocket */
-    using Super::getBufferedAmount;
+    /* See AsyncSocket, plus whatever waits for an offloaded compression */
+    int getBufferedAmount() {
+        return Super::getBufferedAmount() + (int) ((WebSocketData *) Super::getAsyncSocketData())->getDeferredBytes();
+    }
+
     using Super::getRemoteAddress;
 
     /* Simple, immediate close of the socket. Emits close event */
     using Super::close;
 
+    /* Milliseconds our last automatic ping took to be answered, 0 until one was */
+    unsigned int getRoundTripTime() {
+        return ((WebSocketData *) Super::getAsyncSocketData())->roundTripTime;
+    }
+
     /* Send or buffer a WebSocket frame, compressed or not. Returns false on increased user space backpressure. */
     bool send(std::string_view message, uWS::OpCode opCode = uWS::OpCode::BINARY, bool compress = false) {
-        /* Every send resets the timeout */
-        WebSocketContextData<SSL> *webSocketContextData = (WebSocketContextData<SSL> *) us_socket_context_ext(SSL,
+        /* Every send counts as activity */
+        WebSocketContextData<SSL, isServer> *webSocketContextData = (WebSocketContextData<SSL, isServer> *) us_socket_context_ext(SSL,
             (us_socket_context_t *) us_socket_context(SSL, (us_socket_t *) this)
         );
-        AsyncSocket<SSL>::timeout(webSocketContextData->idleTimeout);
+        ((WebSocketData *) Super::getAsyncSocketData())->lastActivity = (unsigned int) Super::getLoopData()->getTimestamp();
+        Super::getLoopData()->metrics.add(Metrics::WEBSOCKET_MESSAGES_SENT);
 
         /* Transform the message to compressed domain if requested */
         if (compress) {
@@ -68,26 +142,98 @@ public:
             /* Check and correct the compress hint */
             if (opCode < 3 && webSocketData->compressionStatus == WebSocketData::ENABLED) {
                 LoopData *loopData = Super::getLoopData();
-                /* Compress using either shared or dedicated deflationStream */
-                if (webSocketData->deflationStream) {
-                    message = webSocketData->deflationStream->deflate(loopData->zlibContext, message, false);
+                /* Compress using either shared or dedicated deflationStream, large messages for the shared one can go to the pool */
+                if (!webSocketData->getDeflationStream() && webSocketContextData->compressionPool && message.length() >= webSocketContextData->compressionOffloadThreshold) {
+                    offloadCompression(webSocketContextData->compressionPool, message, opCode);
+                    return (size_t) getBufferedAmount() <= webSocketContextData->maxBackpressure;
+                }
+
+                loopData->metrics.add(Metrics::DEFLATE_BYTES_IN, message.length());
+                if (DeflationStream *deflationStream = webSocketData->getDeflationStream()) {
+                    message = deflationStream->deflate(loopData->zlibContext, message, false);
                 } else {
-                    message = loopData->deflationStream->deflate(loopData->zlibContext, message, true);
+                    message = webSocketContextData->getDeflationStream(loopData)->deflate(loopData->zlibContext, message, true);
                 }
+                loopData->metrics.add(Metrics::DEFLATE_BYTES_OUT, message.length());
             } else {
                 compress = false;
             }
         }
 
+        /* Nothing may overtake an offloaded compression */
+        if (((WebSocketData *) Super::getAsyncSocketData())->hasDeferredFrames()) {
+            std::string frame(protocol::messageFrameSize<isServer>(message.length()), 0);
+            frame.resize(protocol::formatMessage<isServer>(frame.data(), message.data(), message.length(), opCode, message.length(), compress));
+            DeferredFrames *deferredFrames = ((WebSocketData *) Super::getAsyncSocketData())->getDeferredFrames();
+            deferredFrames->bytes += frame.length();
+            deferredFrames->frames.push_back({std::move(frame), true});
+            return (size_t) getBufferedAmount() <= webSocketContextData->maxBackpressure;
+        }
+
+#ifdef UWS_HAS_WRITEV
+        /* Servers do not mask, so the frame header and message can leave together without copying the message */
+        if constexpr (!SSL && isServer) {
+            char header[10];
+            size_t headerLength = protocol::formatMessage<isServer>(header, message.data(), 0, opCode, message.length(), compress);
+            std::string_view chunks[] = {{header, headerLength}, message};
+            auto[written, failed] = Super::writev(chunks, 2);
+
+            /* Return true for success */
+            return !failed;
+        }
+#endif
+
         /* Get size, alloate size, write if needed */
-        size_t messageFrameSize = protocol::messageFrameSize(message.length());
+        size_t messageFrameSize = protocol::messageFrameSize<isServer>(message.length());
         auto[sendBuffer, requiresWrite] = Super::getSendBuffer(messageFrameSize);
         protocol::formatMessage<isServer>(sendBuffer, message.data(), message.length(), opCode, message.length(), compress);
         if (requiresWrite) {
             auto[written, failed] = Super::write(sendBuffer, messageFrameSize);
 
-            /* For now, we are slow here (fix!) */
-            free(sendBuffer);
+            Super::freeSendBuffer(sendBuffer, messageFrameSize);
+
+            /* Return true for success */
+            return !failed;
+        }
+
+        /* Return success */
+        return true;
+    }
+
+    /* Send many messages of the same opCode, framed back to back into one buffer and written at once.
+     * Returns false on increased user space backpressure, like send */
+    bool sendBatch(std::pair<size_t, std::string_view *> messages, uWS::OpCode opCode = uWS::OpCode::BINARY, bool compress = false) {
+        /* Every message is deflated on its own, and nothing may overtake an offloaded compression */
+        WebSocketData *webSocketData = (WebSocketData *) Super::getAsyncSocketData();
+        if ((compress && opCode < 3 && webSocketData->compressionStatus == WebSocketData::ENABLED) || webSocketData->hasDeferredFrames()) {
+            bool ok = true;
+            for (size_t i = 0; i < messages.first; i++) {
+                ok = send(messages.second[i], opCode, compress) && ok;
+            }
+            return ok;
+        }
+
+        webSocketData->lastActivity = (unsigned int) Super::getLoopData()->getTimestamp();
+        Super::getLoopData()->metrics.add(Metrics::WEBSOCKET_MESSAGES_SENT, messages.first);
+
+        size_t batchSize = 0;
+        for (size_t i = 0; i < messages.first; i++) {
+            batchSize += protocol::messageFrameSize<isServer>(messages.second[i].length());
+        }
+        if (!batchSize) {
+            return true;
+        }
+
+        /* Straight into the cork buffer if it fits, otherwise one allocation and one write for all of them */
+        auto[sendBuffer, requiresWrite] = Super::getSendBuffer(batchSize);
+        char *frame = sendBuffer;
+        for (size_t i = 0; i < messages.first; i++) {
+            frame += protocol::formatMessage<isServer>(frame, messages.second[i].data(), messages.second[i].length(), opCode, messages.second[i].length(), false);
+        }
+        if (requiresWrite) {
+            auto[written, failed] = Super::write(sendBuffer, (int) batchSize);
+
+            Super::freeSendBuffer(sendBuffer, batchSize);
 
             /* Return true for success */
             return !failed;
@@ -116,8 +262,8 @@ public:
         bool ok = send(std::string_view(closePayload, closePayloadLength), OpCode::CLOSE);
 
         /* FIN if we are ok and not corked */
-        WebSocket<SSL, true> *webSocket = (WebSocket<SSL, true> *) this;
-        if (!webSocket->isCorked()) {
+        WebSocket<SSL, isServer> *webSocket = (WebSocket<SSL, isServer> *) this;
+        if (!webSocket->isCorked() && !webSocketData->hasDeferredFrames()) {
             if (ok) {
                 /* If we are not corked, and we just sent off everything, we need to FIN right here.
                  * In all other cases, we need to fin either if uncork was successful, or when drainage is complete. */
@@ -126,7 +272,7 @@ public:
         }
 
         /* Emit close event */
-        WebSocketContextData<SSL> *webSocketContextData = (WebSocketContextData<SSL> *) us_socket_context_ext(SSL,
+        WebSocketContextData<SSL, isServer> *webSocketContextData = (WebSocketContextData<SSL, isServer> *) us_socket_context_ext(SSL,
             (us_socket_context_t *) us_socket_context(SSL, (us_socket_t *) this)
         );
         if (webSocketContextData->closeHandler) {
@@ -135,28 +281,43 @@ public:
 
         /* Make sure to unsubscribe from any pub/sub node at exit */
         webSocketContextData->topicTree.unsubscribeAll(webSocketData->subscriber);
-        delete webSocketData->subscriber;
+        webSocketData->slabAllocator->destroy(webSocketData->subscriber);
         webSocketData->subscriber = nullptr;
     }
 
+    /* Make us a subscriber if we aren't yet */
+    Subscriber *getSubscriber() {
+        WebSocketData *webSocketData = (WebSocketData *) us_socket_ext(SSL, (us_socket_t *) this);
+        if (!webSocketData->subscriber) {
+            webSocketData->subscriber = webSocketData->slabAllocator->create<Subscriber>(this);
+
+            /* Publishes are deflated with a reset stream, which a dedicated compressor cannot interleave with */
+            webSocketData->subscriber->compressed = webSocketData->compressionStatus != WebSocketData::DISABLED && !webSocketData->getDeflationStream();
+        }
+        return webSocketData->subscriber;
+    }
+
     /* Subscribe to a topic according to MQTT rules and syntax */
     void subscribe(std::string_view topic) {
-        WebSocketContextData<SSL> *webSocketContextData = (WebSocketContextData<SSL> *) us_socket_context_ext(SSL,
+        WebSocketContextData<SSL, isServer> *webSocketContextData = (WebSocketContextData<SSL, isServer> *) us_socket_context_ext(SSL,
             (us_socket_context_t *) us_socket_context(SSL, (us_socket_t *) this)
         );
 
-        /* Make us a subscriber if we aren't yet */
-        WebSocketData *webSocketData = (WebSocketData *) us_socket_ext(SSL, (us_socket_t *) this);
-        if (!webSocketData->subscriber) {
-            webSocketData->subscriber = new Subscriber(this);
-        }
+        webSocketContextData->topicTree.subscribe(topic, getSubscriber());
+    }
+
+    /* Subscribe to many topics at once, such as when resubscribing after a reconnect. Much cheaper than one by one */
+    void subscribe(std::pair<size_t, std::string_view *> topics) {
+        WebSocketContextData<SSL, isServer> *webSocketContextData = (WebSocketContextData<SSL, isServer> *) us_socket_context_ext(SSL,
+            (us_socket_context_t *) us_socket_context(SSL, (us_socket_t *) this)
+        );
 
-        webSocketContextData->topicTree.subscribe(topic, webSocketData->subscriber);
+        webSocketContextData->topicTree.subscribe(topics, getSubscriber());
     }
 
     /* Unsubscribe from a topic, returns true if we were subscribed */
     bool unsubscribe(std::string_view topic) {
-        WebSocketContextData<SSL> *webSocketContextData = (WebSocketContextData<SSL> *) us_socket_context_ext(SSL,
+        WebSocketContextData<SSL, isServer> *webSocketContextData = (WebSocketContextData<SSL, isServer> *) us_socket_context_ext(SSL,
             (us_socket_context_t *) us_socket_context(SSL, (us_socket_t *) this)
         );
 
@@ -165,13 +326,25 @@ public:
         return webSocketContextData->topicTree.unsubscribe(topic, webSocketData->subscriber);
     }
 
-    /* Publish a message to a topic according to MQTT rules and syntax */
-    void publish(std::string_view topic, std::string_view message, OpCode opCode = OpCode::TEXT, bool compress = false) {
-        WebSocketContextData<SSL> *webSocketContextData = (WebSocketContextData<SSL> *) us_socket_context_ext(SSL,
+    /* Unsubscribe from many topics at once, returns how many of them we were subscribed to */
+    size_t unsubscribe(std::pair<size_t, std::string_view *> topics) {
+        WebSocketContextData<SSL, isServer> *webSocketContextData = (WebSocketContextData<SSL, isServer> *) us_socket_context_ext(SSL,
+            (us_socket_context_t *) us_socket_context(SSL, (us_socket_t *) this)
+        );
+
+        WebSocketData *webSocketData = (WebSocketData *) us_socket_ext(SSL, (us_socket_t *) this);
+
+        return webSocketContextData->topicTree.unsubscribe(topics, webSocketData->subscriber);
+    }
+
+    /* Publish a message to a topic according to MQTT rules and syntax.
+     * A retained message is kept, already framed, and sent to everyone subscribing to the topic later on */
+    void publish(std::string_view topic, std::string_view message, OpCode opCode = OpCode::TEXT, bool compress = false, bool retain = false) {
+        WebSocketContextData<SSL, isServer> *webSocketContextData = (WebSocketContextData<SSL, isServer> *) us_socket_context_ext(SSL,
             (us_socket_context_t *) us_socket_context(SSL, (us_socket_t *) this)
         );
         /* Is the same as publishing per websocket context */
-        webSocketContextData->publish(topic, message, opCode, compress);
+        webSocketContextData->publish(topic, message, opCode, compress, retain);
     }
 };
 
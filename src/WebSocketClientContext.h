@@ -0,0 +1,325 @@
+/*
+ * Authored by Alex Hultman, 2018-2019.
+ * Intellectual property of third-party.
+
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+
+ *     http://www.apache.org/licenses/LICENSE-2.0
+
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef UWS_WEBSOCKETCLIENTCONTEXT_H
+#define UWS_WEBSOCKETCLIENTCONTEXT_H
+
+/* This class connects a pool of client WebSockets to one upstream, upgrades them and keeps them connected.
+ * Upgraded sockets are adopted by a WebSocketContext<SSL, false> which is a child of ours */
+
+#include "Loop.h"
+#include "AsyncSocket.h"
+#include "WebSocketClientContextData.h"
+#include "WebSocketContext.h"
+#include "WebSocketHandshake.h"
+
+#include <string_view>
+
+namespace uWS {
+
+template <bool SSL>
+struct WebSocketClientContext {
+    template <bool> friend struct TemplatedApp;
+private:
+    WebSocketClientContext() = delete;
+
+    /* Upstreams answering with longer response heads are refused */
+    static const unsigned int MAX_RESPONSE_HEAD = 4096;
+
+    us_socket_context_t *getSocketContext() {
+        return (us_socket_context_t *) this;
+    }
+
+    WebSocketClientContextData<SSL> *getSocketContextData() {
+        return (WebSocketClientContextData<SSL> *) us_socket_context_ext(SSL, getSocketContext());
+    }
+
+    static WebSocketClientContextData<SSL> *getSocketContextDataS(us_socket_t *s) {
+        return (WebSocketClientContextData<SSL> *) us_socket_context_ext(SSL, us_socket_context(SSL, s));
+    }
+
+    /* A random 16 byte key in base64, and what the upstream has to answer it with */
+    static void generateKey(char key[24], char secWebSocketAccept[28]) {
+        unsigned char nonce[16];
+        for (int i = 0; i < 16; i += 4) {
+            uint32_t random = protocol::maskKey();
+            memcpy(nonce + i, &random, 4);
+        }
+        WebSocketHandshake::base64(nonce, 16, key);
+        WebSocketHandshake::generate(key, secWebSocketAccept);
+    }
+
+    static bool equalsIgnoreCase(std::string_view a, std::string_view lowerCase) {
+        if (a.length() != lowerCase.length()) {
+            return false;
+        }
+        for (size_t i = 0; i < a.length(); i++) {
+            if ((a[i] | 32) != lowerCase[i]) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    /* Whether this response head (without its final empty line) upgrades us with our key */
+    static bool isUpgrade(std::string_view head, std::string_view secWebSocketAccept) {
+        if (head.length() < 12 || head.substr(0, 7) != "HTTP/1." || head.substr(8, 4) != " 101") {
+            return false;
+        }
+
+        bool accepted = false;
+        for (size_t start = head.find("\r\n"); start != std::string_view::npos; ) {
+            start += 2;
+            size_t end = head.find("\r\n", start);
+            std::string_view line = head.substr(start, end - start);
+            size_t colon = line.find(':');
+            if (colon != std::string_view::npos && equalsIgnoreCase(line.substr(0, colon), "sec-websocket-accept")) {
+                std::string_view value = line.substr(colon + 1);
+                while (value.length() && (value.front() == ' ' || value.front() == '\t')) {
+                    value.remove_prefix(1);
+                }
+                while (value.length() && (value.back() == ' ' || value.back() == '\t')) {
+                    value.remove_suffix(1);
+                }
+                accepted = value == secWebSocketAccept;
+            }
+            start = end;
+        }
+        return accepted;
+    }
+
+    /* One of ours is gone, the pool is topped up again after a while (unless that is already pending) */
+    static void lost(WebSocketClientContextData<SSL> *contextData, bool failed) {
+        contextData->numSockets--;
+        if (failed) {
+            contextData->failures++;
+        }
+        if (contextData->closing || !contextData->reconnectDelay || contextData->reconnectPending) {
+            return;
+        }
+
+        /* Exponential backoff, jittered to between half and all of the delay */
+        unsigned int shift = std::min<unsigned int>(contextData->failures ? contextData->failures - 1 : 0, 16);
+        long long delay = std::min<long long>((long long) contextData->reconnectDelay << shift, std::max(contextData->maxReconnectDelay, contextData->reconnectDelay));
+        delay = delay / 2 + protocol::maskKey() % (delay / 2 + 1);
+
+        contextData->reconnectPending = true;
+        us_timer_set(contextData->reconnectTimer, [](us_timer_t *t) {
+            (*(WebSocketClientContext **) us_timer_ext(t))->topUp();
+        }, (int) std::max<long long>(delay, 1), 0);
+    }
+
+    /* Connect until we have as many connections as we should */
+    void topUp() {
+        WebSocketClientContextData<SSL> *contextData = getSocketContextData();
+        contextData->reconnectPending = false;
+
+        while (contextData->numSockets < contextData->connections) {
+            us_socket_t *s = us_socket_context_connect(SSL, getSocketContext(), contextData->host.c_str(), contextData->port, 0, sizeof(WebSocketClientSocketData<SSL>));
+            contextData->numSockets++;
+            if (!s) {
+                lost(contextData, true);
+                return;
+            }
+
+            /* Constructed right away, failing connections are closed without ever opening */
+            new (us_socket_ext(SSL, s)) WebSocketClientSocketData<SSL>;
+        }
+    }
+
+    /* Hands the socket over to our WebSocketContext, feeding it whatever followed the response head */
+    static us_socket_t *upgrade(us_socket_t *s, char *data, int length) {
+        WebSocketClientContextData<SSL> *contextData = getSocketContextDataS(s);
+        WebSocketClientSocketData<SSL> *socketData = (WebSocketClientSocketData<SSL> *) us_socket_ext(SSL, s);
+
+        /* Move any backpressure, then we are done with the handshake */
+        BackPressure backpressure(std::move(socketData->buffer));
+        socketData->~WebSocketClientSocketData<SSL>();
+
+        /* Adopting a socket invalidates it, data points into the receive buffer so it stays valid */
+        WebSocket<SSL, false> *webSocket = (WebSocket<SSL, false> *) us_socket_context_adopt_socket(SSL,
+                    (us_socket_context_t *) contextData->webSocketContext, s, sizeof(WebSocketData) + contextData->userDataSize);
+        webSocket->init(false, false, CompressionProfile{}, std::move(backpressure));
+
+        AsyncSocket<SSL> *asyncSocket = (AsyncSocket<SSL> *) webSocket;
+        asyncSocket->getLoopData()->metrics.add(Metrics::WEBSOCKETS);
+        asyncSocket->timeout(contextData->idleTimeout);
+        contextData->failures = 0;
+
+        /* Whatever open sends leaves together with the replies to what came along with the upgrade */
+        asyncSocket->cork();
+        if (contextData->openHandler) {
+            contextData->openHandler(webSocket);
+        }
+        if (length && !us_socket_is_closed(SSL, (us_socket_t *) webSocket)) {
+            WebSocketContext<SSL, false>::handleData((us_socket_t *) webSocket, data, length);
+        }
+        asyncSocket->uncork();
+
+        return (us_socket_t *) webSocket;
+    }
+
+    /* Init the WebSocketClientContext by registering libusockets event handlers */
+    WebSocketClientContext<SSL> *init() {
+        /* Send the upgrade request as soon as we are connected */
+        us_socket_context_on_open(SSL, getSocketContext(), [](us_socket_t *s, int, char *, int) {
+            WebSocketClientContextData<SSL> *contextData = getSocketContextDataS(s);
+            WebSocketClientSocketData<SSL> *socketData = (WebSocketClientSocketData<SSL> *) us_socket_ext(SSL, s);
+
+            char key[24];
+            generateKey(key, socketData->secWebSocketAccept);
+
+            std::string request;
+            request.reserve(contextData->request.length() + 48);
+            request.append(contextData->request).append("Sec-WebSocket-Key: ").append(key, 24).append("\r\n\r\n");
+            ((AsyncSocket<SSL> *) s)->write(request.data(), (int) request.length());
+
+            us_socket_timeout(SSL, s, contextData->handshakeTimeout);
+            return s;
+        });
+
+        /* Failed connects end up here too, without ever opening */
+        us_socket_context_on_close(SSL, getSocketContext(), [](us_socket_t *s) {
+            ((WebSocketClientSocketData<SSL> *) us_socket_ext(SSL, s))->~WebSocketClientSocketData<SSL>();
+            lost(getSocketContextDataS(s), true);
+            return s;
+        });
+
+        /* Wait for the response head, we are upgraded or closed as soon as we have it */
+        us_socket_context_on_data(SSL, getSocketContext(), [](us_socket_t *s, char *data, int length) {
+            WebSocketClientSocketData<SSL> *socketData = (WebSocketClientSocketData<SSL> *) us_socket_ext(SSL, s);
+
+            std::string_view head;
+            size_t headLength;
+            if (!socketData->head.length() && (headLength = std::string_view(data, length).find("\r\n\r\n")) != std::string_view::npos) {
+                head = std::string_view(data, headLength);
+                headLength += 4;
+            } else {
+                /* The empty line may straddle reads */
+                size_t previous = socketData->head.length();
+                socketData->head.append(data, length);
+                headLength = std::string_view(socketData->head).find("\r\n\r\n", previous >= 3 ? previous - 3 : 0);
+                if (headLength == std::string_view::npos) {
+                    if (socketData->head.length() > MAX_RESPONSE_HEAD) {
+                        return us_socket_close(SSL, s);
+                    }
+                    return s;
+                }
+                head = std::string_view(socketData->head.data(), headLength);
+                headLength += 4 - previous;
+            }
+
+            if (head.length() > MAX_RESPONSE_HEAD || !isUpgrade(head, std::string_view(socketData->secWebSocketAccept, 28))) {
+                return us_socket_close(SSL, s);
+            }
+            return upgrade(s, data + headLength, length - (int) headLength);
+        });
+
+        /* Stream out what is left of the upgrade request */
+        us_socket_context_on_writable(SSL, getSocketContext(), [](us_socket_t *s) {
+            ((AsyncSocket<SSL> *) s)->write(nullptr, 0);
+            return s;
+        });
+
+        /* Upstreams closing or not answering in time are simply closed and replaced */
+        us_socket_context_on_end(SSL, getSocketContext(), [](us_socket_t *s) {
+            return us_socket_close(SSL, s);
+        });
+
+        us_socket_context_on_timeout(SSL, getSocketContext(), [](us_socket_t *s) {
+            return us_socket_close(SSL, s);
+        });
+
+        return this;
+    }
+
+    /* Destruct the WebSocketClientContext, it does not follow RAII. Nothing is replaced from here on */
+    void free() {
+        WebSocketClientContextData<SSL> *contextData = getSocketContextData();
+        contextData->closing = true;
+        us_timer_close(contextData->reconnectTimer);
+        contextData->webSocketContext->free();
+        contextData->~WebSocketClientContextData<SSL>();
+
+        us_socket_context_free(SSL, getSocketContext());
+    }
+
+public:
+    /* Starts connecting right away, userDataSize is what every upgraded WebSocket holds after its WebSocketData */
+    static WebSocketClientContext *create(Loop *loop, std::string host, int port, std::string path, WebSocketClientBehavior<SSL> &&behavior, unsigned int userDataSize, us_socket_context_options_t options = {}) {
+        WebSocketClientContext *webSocketClientContext = (WebSocketClientContext *) us_create_socket_context(SSL, (us_loop_t *) loop, sizeof(WebSocketClientContextData<SSL>), options);
+        if (!webSocketClientContext) {
+            return nullptr;
+        }
+
+        WebSocketClientContextData<SSL> *contextData = new (us_socket_context_ext(SSL, (us_socket_context_t *) webSocketClientContext)) WebSocketClientContextData<SSL>;
+        contextData->webSocketContext = WebSocketContext<SSL, false>::create(loop, (us_socket_context_t *) webSocketClientContext);
+        if (!contextData->webSocketContext) {
+            contextData->~WebSocketClientContextData<SSL>();
+            us_socket_context_free(SSL, (us_socket_context_t *) webSocketClientContext);
+            return nullptr;
+        }
+
+        /* The request is the same for every connection but for its key */
+        contextData->host = host;
+        contextData->port = port;
+        contextData->request.append("GET ").append(path.length() ? path : "/").append(" HTTP/1.1\r\n")
+            .append("Host: ").append(host).append(":").append(std::to_string(port)).append("\r\n")
+            .append("Upgrade: websocket\r\n")
+            .append("Connection: Upgrade\r\n")
+            .append("Sec-WebSocket-Version: 13\r\n")
+            .append(behavior.headers);
+
+        contextData->connections = behavior.connections;
+        contextData->reconnectDelay = behavior.reconnectDelay;
+        contextData->maxReconnectDelay = behavior.maxReconnectDelay;
+        contextData->handshakeTimeout = behavior.handshakeTimeout;
+        contextData->idleTimeout = behavior.idleTimeout;
+        contextData->userDataSize = userDataSize;
+        contextData->openHandler = std::move(behavior.open);
+
+        /* Copy handlers and settings of the upgraded sockets, every close makes room for a replacement */
+        WebSocketContextData<SSL, false> *webSocketContextData = contextData->webSocketContext->getExt();
+        webSocketContextData->messageTracePoint.attach(&((LoopData *) us_loop_ext((us_loop_t *) loop))->metrics, "WS client " + host + ":" + std::to_string(port) + path);
+        webSocketContextData->messageHandler = std::move(behavior.message);
+        webSocketContextData->drainHandler = std::move(behavior.drain);
+        webSocketContextData->pingHandler = std::move(behavior.ping);
+        webSocketContextData->pongHandler = std::move(behavior.pong);
+        webSocketContextData->closeHandler = [contextData, closeHandler = std::move(behavior.close)](WebSocket<SSL, false> *webSocket, int code, std::string_view message) mutable {
+            if (closeHandler) {
+                closeHandler(webSocket, code, message);
+            }
+            lost(contextData, false);
+        };
+        webSocketContextData->maxPayloadLength = behavior.maxPayloadLength;
+        webSocketContextData->idleTimeout = behavior.idleTimeout;
+        webSocketContextData->sendPingsAutomatically = behavior.sendPingsAutomatically;
+        webSocketContextData->maxBackpressure = behavior.maxBackpressure;
+        webSocketContextData->lagBackpressure = behavior.lagBackpressure;
+
+        /* This timer is what keeps the pool (and so the loop) alive in between reconnects */
+        contextData->reconnectTimer = us_create_timer((us_loop_t *) loop, 0, sizeof(WebSocketClientContext *));
+        *(WebSocketClientContext **) us_timer_ext(contextData->reconnectTimer) = webSocketClientContext;
+
+        webSocketClientContext->init()->topUp();
+        return webSocketClientContext;
+    }
+};
+
+}
+
+#endif // UWS_WEBSOCKETCLIENTCONTEXT_H
@@ -0,0 +1,106 @@
+/*
+ * Authored by Alex Hultman, 2018-2019.
+ * Intellectual property of third-party.
+
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+
+ *     http://www.apache.org/licenses/LICENSE-2.0
+
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef UWS_WEBSOCKETCLIENTCONTEXTDATA_H
+#define UWS_WEBSOCKETCLIENTCONTEXTDATA_H
+
+#include "f2/function2.hpp"
+#include "AsyncSocketData.h"
+#include "WebSocketProtocol.h"
+
+#include <string>
+#include <string_view>
+
+struct us_timer_t;
+
+namespace uWS {
+
+template <bool, bool> struct WebSocket;
+template <bool, bool> struct WebSocketContext;
+
+/* One upstream: a pool of client WebSockets to the same host, port and path, kept open as they drop */
+template <bool SSL>
+struct WebSocketClientBehavior {
+    /* How many connections we keep open (or opening) at all times */
+    unsigned int connections = 1;
+    /* Milliseconds until lost connections are replaced, doubling with every failed attempt in a row up to maxReconnectDelay.
+     * Delays are jittered so that many edges losing the same upstream do not all come back at once. 0 never reconnects */
+    int reconnectDelay = 1000;
+    int maxReconnectDelay = 30000;
+    /* Seconds we give the upstream to upgrade us */
+    int handshakeTimeout = 10;
+    /* Added to the upgrade request as is, every line ending with \r\n (such as an Authorization header) */
+    std::string headers;
+    int maxPayloadLength = 16 * 1024;
+    /* In whole seconds and with the same granularity as TemplatedApp::WebSocketBehavior::idleTimeout */
+    int idleTimeout = 120;
+    /* Opt in to have connections idle for idleTimeout pinged, and replaced only if that goes unanswered for another idleTimeout */
+    bool sendPingsAutomatically = false;
+    int maxBackpressure = 1 * 1024 * 1024;
+    /* Subscribers buffering more than this lag, see TemplatedApp::setSlowConsumerPolicy */
+    int lagBackpressure = 64 * 1024;
+    fu2::unique_function<void(uWS::WebSocket<SSL, false> *)> open = nullptr;
+    fu2::unique_function<void(uWS::WebSocket<SSL, false> *, std::string_view, uWS::OpCode)> message = nullptr;
+    fu2::unique_function<void(uWS::WebSocket<SSL, false> *)> drain = nullptr;
+    fu2::unique_function<void(uWS::WebSocket<SSL, false> *)> ping = nullptr;
+    fu2::unique_function<void(uWS::WebSocket<SSL, false> *)> pong = nullptr;
+    fu2::unique_function<void(uWS::WebSocket<SSL, false> *, int, std::string_view)> close = nullptr;
+};
+
+/* A connection of the pool until it is upgraded, then it becomes a WebSocket of the child context */
+template <bool SSL>
+struct WebSocketClientSocketData : AsyncSocketData<SSL> {
+    /* The response head, only copied here if it spans reads */
+    std::string head;
+
+    /* What the upstream has to answer our key with */
+    char secWebSocketAccept[28];
+};
+
+template <bool SSL>
+struct WebSocketClientContextData {
+    /* Where we connect, and the upgrade request up to its key */
+    std::string host;
+    int port = 0;
+    std::string request;
+
+    unsigned int connections = 1;
+    int reconnectDelay = 0;
+    int maxReconnectDelay = 0;
+    int handshakeTimeout = 0;
+    int idleTimeout = 0;
+
+    /* Upgraded connections live here */
+    WebSocketContext<SSL, false> *webSocketContext = nullptr;
+    unsigned int userDataSize = 0;
+    fu2::unique_function<void(uWS::WebSocket<SSL, false> *)> openHandler = nullptr;
+
+    /* Connections opening or open, and attempts failed in a row */
+    unsigned int numSockets = 0;
+    unsigned int failures = 0;
+
+    /* Tops the pool up again, armed whenever we lose a connection (and it is not armed already) */
+    us_timer_t *reconnectTimer = nullptr;
+    bool reconnectPending = false;
+
+    /* Set while freeing, nothing is replaced then */
+    bool closing = false;
+};
+
+}
+
+#endif // UWS_WEBSOCKETCLIENTCONTEXTDATA_H
@@ -23,12 +23,15 @@
 #include "WebSocketData.h"
 #include "WebSocket.h"
 
+#include <memory>
+
 namespace uWS {
 
 template <bool SSL, bool isServer>
 struct WebSocketContext {
     template <bool> friend struct TemplatedApp;
     template <bool, typename> friend struct WebSocketProtocol;
+    template <bool> friend struct WebSocketClientContext;
 private:
     WebSocketContext() = delete;
 
@@ -36,8 +39,8 @@ private:
         return (us_socket_context_t *) this;
     }
 
-    WebSocketContextData<SSL> *getExt() {
-        return (WebSocketContextData<SSL> *) us_socket_context_ext(SSL, (us_socket_context_t *) this);
+    WebSocketContextData<SSL, isServer> *getExt() {
+        return (WebSocketContextData<SSL, isServer> *) us_socket_context_ext(SSL, (us_socket_context_t *) this);
     }
 
     /* If we have negotiated compression, set this frame compressed */
@@ -56,27 +59,61 @@ private:
         us_socket_close(SSL, (us_socket_t *) s);
     }
 
+    /* Pings are answered right away, a pong to our automatic ping measures the round trip. Returns true on breakage */
+    static bool handlePingPong(WebSocket<SSL, isServer> *webSocket, WebSocketData *webSocketData, int opCode, std::string_view payload) {
+        WebSocketContextData<SSL, isServer> *webSocketContextData = (WebSocketContextData<SSL, isServer> *) us_socket_context_ext(SSL,
+            us_socket_context(SSL, (us_socket_t *) webSocket)
+        );
+
+        if (opCode == PING) {
+            webSocket->send(payload, (OpCode) OpCode::PONG);
+            if (!webSocketContextData->pingHandler) {
+                return false;
+            }
+            webSocketContextData->pingHandler(webSocket);
+        } else if (opCode == PONG) {
+            if (webSocketData->awaitingPong) {
+                /* The iteration may have been busy for long before getting to us, the round trip reads the clock itself */
+                LoopData *loopData = ((AsyncSocket<SSL> *) webSocket)->getLoopData();
+                loopData->updateTimestamp();
+                webSocketData->awaitingPong = false;
+                webSocketData->roundTripTime = (unsigned int) loopData->timestamp - webSocketData->pingSent;
+            }
+            if (!webSocketContextData->pongHandler) {
+                return false;
+            }
+            webSocketContextData->pongHandler(webSocket);
+        } else {
+            return false;
+        }
+
+        return us_socket_is_closed(SSL, (us_socket_t *) webSocket) || webSocketData->isShuttingDown;
+    }
+
     /* Returns true on breakage */
     static bool handleFragment(char *data, size_t length, unsigned int remainingBytes, int opCode, bool fin, uWS::WebSocketState<isServer> *webSocketState, void *s) {
         /* WebSocketData and WebSocketContextData */
-        WebSocketContextData<SSL> *webSocketContextData = (WebSocketContextData<SSL> *) us_socket_context_ext(SSL, us_socket_context(SSL, (us_socket_t *) s));
+        WebSocketContextData<SSL, isServer> *webSocketContextData = (WebSocketContextData<SSL, isServer> *) us_socket_context_ext(SSL, us_socket_context(SSL, (us_socket_t *) s));
         WebSocketData *webSocketData = (WebSocketData *) us_socket_ext(SSL, (us_socket_t *) s);
+        Metrics &metrics = ((AsyncSocket<SSL> *) s)->getLoopData()->metrics;
 
         /* Is this a non-control frame? */
         if (opCode < 3) {
             /* Did we get everything in one go? */
-            if (!remainingBytes && fin && !webSocketData->fragmentBuffer.length()) {
+            if (!remainingBytes && fin && !webSocketData->fragmentBuffer.length() && !webSocketData->getInflationStream()) {
 
                 /* Handle compressed frame */
                 if (webSocketData->compressionStatus == WebSocketData::CompressionStatus::COMPRESSED_FRAME) {
                         webSocketData->compressionStatus = WebSocketData::CompressionStatus::ENABLED;
 
                         LoopData *loopData = (LoopData *) us_loop_ext(us_socket_context_loop(SSL, us_socket_context(SSL, (us_socket_t *) s)));
-                        std::string_view inflatedFrame = loopData->inflationStream->inflate(loopData->zlibContext, {data, length}, webSocketContextData->maxPayloadLength);
-                        if (!inflatedFrame.length()) {
+                        std::string_view inflatedFrame = webSocketContextData->getInflationStream(loopData)->inflate(loopData->zlibContext, {data, length}, webSocketContextData->maxPayloadLength);
+                        if (!inflatedFrame.data()) {
                             forceClose(webSocketState, s);
                             return true;
                         } else {
+                            metrics.add(Metrics::INFLATE_BYTES_IN, length);
+                            metrics.add(Metrics::INFLATE_BYTES_OUT, inflatedFrame.length());
                             data = (char *) inflatedFrame.data();
                             length = inflatedFrame.length();
                         }
@@ -89,68 +126,86 @@ private:
                 }
 
                 /* Emit message event & break if we are closed or shut down when returning */
+                metrics.add(Metrics::WEBSOCKET_MESSAGES_RECEIVED);
                 if (webSocketContextData->messageHandler) {
-                    webSocketContextData->messageHandler((WebSocket<SSL, isServer> *) s, std::string_view(data, length), (uWS::OpCode) opCode);
+                    ((AsyncSocket<SSL> *) s)->getLoopData()->trace(&webSocketContextData->messageTracePoint, [&]() {
+                        webSocketContextData->messageHandler((WebSocket<SSL, isServer> *) s, std::string_view(data, length), (uWS::OpCode) opCode);
+                    });
                     if (us_socket_is_closed(SSL, (us_socket_t *) s) || webSocketData->isShuttingDown) {
                         return true;
                     }
                 }
             } else {
-                /* Allocate fragment buffer up front first time */
-                if (!webSocketData->fragmentBuffer.length()) {
-                    webSocketData->fragmentBuffer.reserve(length + remainingBytes);
-                }
-                webSocketData->fragmentBuffer.append(data, length);
+                /* Text is validated slice by slice as it streams in, never in a second pass over the whole message */
+                size_t validatedLength = webSocketData->fragmentBuffer.length();
 
-                /* Are we done now? */
-                // todo: what if we don't have any remaining bytes yet we are not fin? forceclose!
-                if (!remainingBytes && fin) {
-
-                    /* Handle compression */
-                    if (webSocketData->compressionStatus == WebSocketData::CompressionStatus::COMPRESSED_FRAME) {
-                            webSocketData->compressionStatus = WebSocketData::CompressionStatus::ENABLED;
+                if (webSocketData->compressionStatus == WebSocketData::CompressionStatus::COMPRESSED_FRAME) {
+                    /* The shared inflater cannot be held across reads, so this message gets a stream of its own until done */
+                    WebSocketData::Extension *extension = webSocketData->getExtension();
+                    if (!extension->inflationStream) {
+                        extension->inflationStream = webSocketData->slabAllocator->create<InflationStream>(webSocketContextData->compressionDictionary);
+                    }
 
-                            // what's really the story here?
-                            webSocketData->fragmentBuffer.append("....");
+                    /* Only the inflated message is ever buffered, and bombs die as soon as they cross the limit */
+                    if (!extension->inflationStream->inflateChunk({data, length}, webSocketData->fragmentBuffer, webSocketContextData->maxPayloadLength)) {
+                        forceClose(webSocketState, s);
+                        return true;
+                    }
+                    metrics.add(Metrics::INFLATE_BYTES_IN, length);
+                    metrics.add(Metrics::INFLATE_BYTES_OUT, webSocketData->fragmentBuffer.length() - validatedLength);
+                } else {
+                    /* Each frame is held to the limit on its own, the message they make up is too */
+                    if (webSocketData->fragmentBuffer.length() + length + remainingBytes > webSocketContextData->maxPayloadLength) {
+                        forceClose(webSocketState, s);
+                        return true;
+                    }
 
-                            LoopData *loopData = (LoopData *) us_loop_ext(
-                                us_socket_context_loop(SSL,
-                                    us_socket_context(SSL, (us_socket_t *) s)
-                                )
-                            );
+                    /* A single frame spanning reads gets a buffer of exactly its size up front, no further copies */
+                    if (!webSocketData->fragmentBuffer.length()) {
+                        webSocketData->fragmentBuffer.reserve(length + remainingBytes);
+                    }
+                    webSocketData->fragmentBuffer.append(data, length);
+                }
 
-                            std::string_view inflatedFrame = loopData->inflationStream->inflate(loopData->zlibContext, {webSocketData->fragmentBuffer.data(), webSocketData->fragmentBuffer.length() - 4}, webSocketContextData->maxPayloadLength);
-                            if (!inflatedFrame.length()) {
-                                forceClose(webSocketState, s);
-                                return true;
-                            } else {
-                                data = (char *) inflatedFrame.data();
-                                length = inflatedFrame.length();
-                            }
+                /* Whatever this slice added, inflated or not, while still in cache */
+                if (opCode == 1 && !protocol::isValidUtf8Stream(webSocketState->utf8State, (unsigned char *) webSocketData->fragmentBuffer.data() + validatedLength, webSocketData->fragmentBuffer.length() - validatedLength)) {
+                    forceClose(webSocketState, s);
+                    return true;
+                }
 
+                /* Are we done now? */
+                // todo: what if we don't have any remaining bytes yet we are not fin? forceclose!
+                if (!remainingBytes && fin) {
 
-                    } else {
-                        // reset length and data ptrs
-                        length = webSocketData->fragmentBuffer.length();
-                        data = webSocketData->fragmentBuffer.data();
+                    /* The stream is only needed again by the next compressed message spanning reads */
+                    if (InflationStream *inflationStream = webSocketData->getInflationStream()) {
+                        webSocketData->compressionStatus = WebSocketData::CompressionStatus::ENABLED;
+                        webSocketData->slabAllocator->destroy(inflationStream);
+                        webSocketData->extension->inflationStream = nullptr;
                     }
 
-                    /* Check text messages for Utf-8 validity */
-                    if (opCode == 1 && !protocol::isValidUtf8((unsigned char *) data, length)) {
+                    length = webSocketData->fragmentBuffer.length();
+                    data = webSocketData->fragmentBuffer.data();
+
+                    /* Everything but a sequence cut short by the end has been validated already */
+                    if (opCode == 1 && !protocol::isValidUtf8End(webSocketState->utf8State)) {
                         forceClose(webSocketState, s);
                         return true;
                     }
 
                     /* Emit message and check for shutdown or close */
+                    metrics.add(Metrics::WEBSOCKET_MESSAGES_RECEIVED);
                     if (webSocketContextData->messageHandler) {
-                        webSocketContextData->messageHandler((WebSocket<SSL, isServer> *) s, std::string_view(data, length), (uWS::OpCode) opCode);
+                        ((AsyncSocket<SSL> *) s)->getLoopData()->trace(&webSocketContextData->messageTracePoint, [&]() {
+                            webSocketContextData->messageHandler((WebSocket<SSL, isServer> *) s, std::string_view(data, length), (uWS::OpCode) opCode);
+                        });
                         if (us_socket_is_closed(SSL, (us_socket_t *) s) || webSocketData->isShuttingDown) {
                             return true;
                         }
                     }
 
                     /* If we shutdown or closed, this will be taken care of elsewhere */
-                    webSocketData->fragmentBuffer.clear();
+                    webSocketData->fragmentBuffer.release();
                 }
             }
         } else {
@@ -163,17 +218,8 @@ private:
                     webSocket->end(closeFrame.code, std::string_view(closeFrame.message, closeFrame.length));
                     return true;
                 } else {
-                    if (opCode == PING) {
-                        webSocket->send(std::string_view(data, length), (OpCode) OpCode::PONG);
-                        /*group->pingHandler(webSocket, data, length);
-                        if (webSocket->isClosed() || webSocket->isShuttingDown()) {
-                            return true;
-                        }*/
-                    } else if (opCode == PONG) {
-                        /*group->pongHandler(webSocket, data, length);
-                        if (webSocket->isClosed() || webSocket->isShuttingDown()) {
-                            return true;
-                        }*/
+                    if (handlePingPong(webSocket, webSocketData, opCode, std::string_view(data, length))) {
+                        return true;
                     }
                 }
             } else {
@@ -188,23 +234,19 @@ private:
                         webSocket->end(closeFrame.code, std::string_view(closeFrame.message, closeFrame.length));
                         return true;
                     } else {
-                        if (opCode == PING) {
-                            webSocket->send(std::string_view(controlBuffer, webSocketData->controlTipLength), (OpCode) OpCode::PONG);
-                            /*group->pingHandler(webSocket, controlBuffer, webSocket->controlTipLength);
-                            if (webSocket->isClosed() || webSocket->isShuttingDown()) {
-                                return true;
-                            }*/
-                        } else if (opCode == PONG) {
-                            /*group->pongHandler(webSocket, controlBuffer, webSocket->controlTipLength);
-                            if (webSocket->isClosed() || webSocket->isShuttingDown()) {
-                                return true;
-                            }*/
+                        if (handlePingPong(webSocket, webSocketData, opCode, std::string_view(controlBuffer, webSocketData->controlTipLength))) {
+                            return true;
                         }
                     }
 
                     /* Same here, we do not care for any particular smart allocation scheme */
                     webSocketData->fragmentBuffer.resize(webSocketData->fragmentBuffer.length() - webSocketData->controlTipLength);
                     webSocketData->controlTipLength = 0;
+
+                    /* Unless we interrupted a message there is nothing to hold on to */
+                    if (!webSocketData->fragmentBuffer.length()) {
+                        webSocketData->fragmentBuffer.release();
+                    }
                 }
             }
         }
@@ -212,12 +254,63 @@ private:
     }
 
     static bool refusePayloadLength(uint64_t length, uWS::WebSocketState<isServer> *wState, void *s) {
-        auto *webSocketContextData = (WebSocketContextData<SSL> *) us_socket_context_ext(SSL, us_socket_context(SSL, (us_socket_t *) s));
+        auto *webSocketContextData = (WebSocketContextData<SSL, isServer> *) us_socket_context_ext(SSL, us_socket_context(SSL, (us_socket_t *) s));
 
         /* Return true for refuse, false for accept */
         return webSocketContextData->maxPayloadLength < length;
     }
 
+    /* Also fed by WebSocketClientContext with whatever followed the upgrade response */
+    static us_socket_t *handleData(us_socket_t *s, char *data, int length) {
+
+        /* We need the websocket data */
+        WebSocketData *webSocketData = (WebSocketData *) (us_socket_ext(SSL, s));
+
+        /* When in websocket shutdown mode, we do not care for ANY message, whether responding close frame or not.
+         * We only care for the TCP FIN really, not emitting any message after closing is key */
+        if (webSocketData->isShuttingDown) {
+            return s;
+        }
+
+        auto *asyncSocket = (AsyncSocket<SSL> *) s;
+
+        /* Every time we get data and not in shutdown state we count it as activity */
+        webSocketData->lastActivity = (unsigned int) asyncSocket->getLoopData()->getTimestamp();
+
+        /* We always cork on data */
+        asyncSocket->cork();
+
+        /* This parser has virtually no overhead */
+        uWS::WebSocketProtocol<isServer, WebSocketContext<SSL, isServer>>::consume(data, length, webSocketData->template getState<isServer>(), s);
+
+        /* Uncorking a closed socekt is fine, in fact it is needed */
+        asyncSocket->uncork();
+
+        /* If uncorking was successful and we are in shutdown state then send TCP FIN */
+        if (asyncSocket->getBufferedAmount() == 0 && !webSocketData->hasDeferredFrames()) {
+            /* We can now be in shutdown state */
+            if (webSocketData->isShuttingDown) {
+                /* Shutting down a closed socket is handled by uSockets and just fine */
+                asyncSocket->shutdown();
+            }
+        }
+
+        /* A rebalancer wants some of our sockets elsewhere, readable ones are the ones making us busy. See TemplatedApp::shed */
+        if constexpr (isServer) {
+            LoopData *loopData = asyncSocket->getLoopData();
+            if (loopData->shedQuota && !us_socket_is_closed(SSL, (us_socket_t *) s) && !webSocketData->stayPut) {
+                if (loopData->shedHandler((us_socket_t *) s)) {
+                    loopData->shedQuota--;
+                } else if (!us_socket_is_closed(SSL, (us_socket_t *) s)) {
+                    /* Not tried again, sockets that cannot move now are likely to be just as busy next read */
+                    webSocketData->stayPut = true;
+                }
+            }
+        }
+
+        return s;
+    }
+
     WebSocketContext<SSL, isServer> *init() {
         /* Adopting a socket does not trigger open event.
          * We arreive as WebSocket with timeout set and
@@ -229,62 +322,34 @@ private:
             WebSocketData *webSocketData = (WebSocketData *) (us_socket_ext(SSL, s));
             if (!webSocketData->isShuttingDown) {
                 /* Emit close event */
-                auto *webSocketContextData = (WebSocketContextData<SSL> *) us_socket_context_ext(SSL, us_socket_context(SSL, (us_socket_t *) s));
+                auto *webSocketContextData = (WebSocketContextData<SSL, isServer> *) us_socket_context_ext(SSL, us_socket_context(SSL, (us_socket_t *) s));
 
                 if (webSocketContextData->closeHandler) {
-                    webSocketContextData->closeHandler((WebSocket<SSL, true> *) s, 1006, {});
+                    webSocketContextData->closeHandler((WebSocket<SSL, isServer> *) s, 1006, {});
                 }
 
                 /* Make sure to unsubscribe from any pub/sub node at exit */
                 webSocketContextData->topicTree.unsubscribeAll(webSocketData->subscriber);
-                delete webSocketData->subscriber;
+                webSocketData->slabAllocator->destroy(webSocketData->subscriber);
                 webSocketData->subscriber = nullptr;
             }
 
             /* Destruct in-placed data struct */
             webSocketData->~WebSocketData();
+            ((AsyncSocket<SSL> *) s)->getLoopData()->metrics.sub(Metrics::WEBSOCKETS);
 
             return s;
         });
 
         /* Handle WebSocket data streams */
-        us_socket_context_on_data(SSL, getSocketContext(), [](auto *s, char *data, int length) {
-
-            /* We need the websocket data */
-            WebSocketData *webSocketData = (WebSocketData *) (us_socket_ext(SSL, s));
-
-            /* When in websocket shutdown mode, we do not care for ANY message, whether responding close frame or not.
-             * We only care for the TCP FIN really, not emitting any message after closing is key */
-            if (webSocketData->isShuttingDown) {
-                return s;
-            }
-
-            auto *webSocketContextData = (WebSocketContextData<SSL> *) us_socket_context_ext(SSL, us_socket_context(SSL, (us_socket_t *) s));
-            auto *asyncSocket = (AsyncSocket<SSL> *) s;
-
-            /* Every time we get data and not in shutdown state we simply reset the timeout */
-            asyncSocket->timeout(webSocketContextData->idleTimeout);
-
-            /* We always cork on data */
-            asyncSocket->cork();
-
-            /* This parser has virtually no overhead */
-            uWS::WebSocketProtocol<isServer, WebSocketContext<SSL, isServer>>::consume(data, length, (WebSocketState<isServer> *) webSocketData, s);
-
-            /* Uncorking a closed socekt is fine, in fact it is needed */
-            asyncSocket->uncork();
-
-            /* If uncorking was successful and we are in shutdown state then send TCP FIN */
-            if (asyncSocket->getBufferedAmount() == 0) {
-                /* We can now be in shutdown state */
-                if (webSocketData->isShuttingDown) {
-                    /* Shutting down a closed socket is handled by uSockets and just fine */
-                    asyncSocket->shutdown();
-                }
-            }
+        us_socket_context_on_data(SSL, getSocketContext(), handleData);
 
+#ifdef UWS_HAS_SOCKET_FROM_FD
+        /* Handed off sockets open here, arrive sets them up */
+        us_socket_context_on_open(SSL, getSocketContext(), [](auto *s, int, char *, int) {
             return s;
         });
+#endif
 
         /* Handle HTTP write out (note: SSL_read may trigger this spuriously, the app need to handle spurious calls) */
         us_socket_context_on_writable(SSL, getSocketContext(), [](auto *s) {
@@ -303,22 +368,31 @@ private:
             /* Drain as much as possible */
             asyncSocket->write(nullptr, 0);
 
-            /* Behavior: if we actively drain backpressure, always reset timeout (even if we are in shutdown) */
+            /* Behavior: if we actively drain backpressure, always count it as activity (even if we are in shutdown) */
             if (backpressure < asyncSocket->getBufferedAmount()) {
-                auto *webSocketContextData = (WebSocketContextData<SSL> *) us_socket_context_ext(SSL, us_socket_context(SSL, (us_socket_t *) s));
-                asyncSocket->timeout(webSocketContextData->idleTimeout);
+                webSocketData->lastActivity = (unsigned int) asyncSocket->getLoopData()->getTimestamp();
             }
 
             /* Are we in (WebSocket) shutdown mode? */
             if (webSocketData->isShuttingDown) {
-                /* Check if we just now drained completely */
-                if (asyncSocket->getBufferedAmount() == 0) {
+                /* Check if we just now drained completely, frames still compressing will FIN when done */
+                if (asyncSocket->getBufferedAmount() == 0 && !webSocketData->hasDeferredFrames()) {
                     /* Now perform the actual TCP/TLS shutdown which was postponed due to backpressure */
                     asyncSocket->shutdown();
                 }
             } else if (backpressure > asyncSocket->getBufferedAmount()) {
                 /* Only call drain if we actually drained backpressure */
-                auto *webSocketContextData = (WebSocketContextData<SSL> *) us_socket_context_ext(SSL, us_socket_context(SSL, (us_socket_t *) s));
+                auto *webSocketContextData = (WebSocketContextData<SSL, isServer> *) us_socket_context_ext(SSL, us_socket_context(SSL, (us_socket_t *) s));
+
+                /* A lagging subscriber that drained enough gets the latest of what its subscriptions conflated meanwhile */
+                Subscriber *subscriber = webSocketData->subscriber;
+                if (subscriber && subscriber->lagging && (size_t) asyncSocket->getBufferedAmount() + webSocketData->getDeferredBytes() <= webSocketContextData->lagBackpressure / 2) {
+                    webSocketContextData->topicTree.catchUp(subscriber);
+                    if (us_socket_is_closed(SSL, (us_socket_t *) s)) {
+                        return s;
+                    }
+                }
+
                 if (webSocketContextData->drainHandler) {
                     webSocketContextData->drainHandler((WebSocket<SSL, isServer> *) s);
                 }
@@ -339,6 +413,33 @@ private:
 
         /* Handle socket timeouts, simply close them so to not confuse client with FIN */
         us_socket_context_on_timeout(SSL, getSocketContext(), [](auto *s) {
+            auto *webSocketContextData = (WebSocketContextData<SSL, isServer> *) us_socket_context_ext(SSL, us_socket_context(SSL, (us_socket_t *) s));
+            WebSocketData *webSocketData = (WebSocketData *)(us_socket_ext(SSL, s));
+            AsyncSocket<SSL> *asyncSocket = (AsyncSocket<SSL> *) s;
+
+            /* Activity only stamps the socket, if there was any we wait for what is left of the timeout since then */
+            unsigned int idle = (unsigned int) asyncSocket->getLoopData()->getTimestamp() - webSocketData->lastActivity;
+            unsigned int idleTimeout = (unsigned int) webSocketContextData->idleTimeout * 1000;
+            if (idle < idleTimeout) {
+                asyncSocket->timeout((idleTimeout - idle + 999) / 1000);
+                return s;
+            }
+
+            /* Idle sockets get pinged and another idleTimeout to show any sign of life, unless our last ping already went unanswered.
+             * All sockets timing out in the same sweep are pinged in it, there are no per-socket timers */
+            bool answered = !webSocketData->awaitingPong || (int) (webSocketData->lastActivity - webSocketData->pingSent) > 0;
+            if (webSocketContextData->sendPingsAutomatically && !webSocketData->isShuttingDown && answered) {
+                unsigned int lastActivity = webSocketData->lastActivity;
+                webSocketData->awaitingPong = true;
+                asyncSocket->getLoopData()->updateTimestamp();
+                webSocketData->pingSent = (unsigned int) asyncSocket->getLoopData()->timestamp;
+                ((WebSocket<SSL, isServer> *) s)->send({}, OpCode::PING);
+
+                /* Our own ping is no sign of life */
+                webSocketData->lastActivity = lastActivity;
+                asyncSocket->timeout(webSocketContextData->idleTimeout);
+                return s;
+            }
 
             /* Timeout is very simple; we just close it */
             us_socket_close(SSL, (us_socket_t *) s);
@@ -349,8 +450,106 @@ private:
         return this;
     }
 
+#ifdef UWS_HAS_SOCKET_FROM_FD
+    /* Takes a socket off this loop without a close event, leaving a duplicate of its fd open for another loop to pick up.
+     * Returns nullptr (leaving it be) unless it is between messages, has nothing buffered and nothing tied to this loop:
+     * no dedicated compressor, no compression in the pool, no retained messages queued and it is not lagging */
+    static std::unique_ptr<WebSocketHandoff> depart(WebSocket<SSL, isServer> *webSocket) {
+        if constexpr (SSL) {
+            /* The TLS session lives in uSockets */
+            return nullptr;
+        }
+
+        us_socket_t *s = (us_socket_t *) webSocket;
+        AsyncSocket<SSL> *asyncSocket = (AsyncSocket<SSL> *) s;
+        WebSocketData *webSocketData = (WebSocketData *) us_socket_ext(SSL, s);
+        WebSocketState<isServer> *webSocketState = webSocketData->template getState<isServer>();
+        DeferredFrames *deferredFrames = webSocketData->getDeferredFrames();
+        Subscriber *subscriber = webSocketData->subscriber;
+
+        if (us_socket_is_closed(SSL, s) || us_socket_is_shut_down(SSL, s) || webSocketData->isShuttingDown || asyncSocket->isCorked() || asyncSocket->getBufferedAmount()) {
+            return nullptr;
+        }
+        if (!webSocketState->state.wantsHead || webSocketState->state.spillLength || webSocketState->state.opStack != -1 || webSocketState->utf8State.tailLength
+            || webSocketData->fragmentBuffer.length() || webSocketData->controlTipLength) {
+            return nullptr;
+        }
+        if (webSocketData->getDeflationStream() || webSocketData->getInflationStream() || webSocketData->hasDeferredFrames() || (deferredFrames && deferredFrames->refCount > 1)
+            || (subscriber && (subscriber->lagging || subscriber->snapshots))) {
+            return nullptr;
+        }
+
+        int fd = dup(us_poll_fd((us_poll_t *) s));
+        if (fd == -1) {
+            return nullptr;
+        }
+
+        auto *webSocketContextData = (WebSocketContextData<SSL, isServer> *) us_socket_context_ext(SSL, us_socket_context(SSL, s));
+        std::unique_ptr<WebSocketHandoff> handoff(new WebSocketHandoff);
+        handoff->fd = fd;
+        handoff->state = *webSocketData->template getState<true>();
+        handoff->perMessageDeflate = webSocketData->compressionStatus != WebSocketData::CompressionStatus::DISABLED;
+        handoff->roundTripTime = webSocketData->roundTripTime;
+
+        if (webSocketContextData->departHandler) {
+            webSocketContextData->departHandler(webSocket);
+            if (us_socket_is_closed(SSL, s)) {
+                return nullptr;
+            }
+        }
+
+        /* Taken as the depart handler left them */
+        handoff->subscriptions = webSocketContextData->topicTree.getSubscriptions(webSocketData->subscriber);
+        handoff->userData.assign((char *) webSocket->getUserData(), webSocketContextData->userDataSize);
+
+        /* As if closed, but without a close event. The duplicate keeps the connection open, no FIN is sent */
+        webSocketContextData->topicTree.unsubscribeAll(webSocketData->subscriber);
+        webSocketData->slabAllocator->destroy(webSocketData->subscriber);
+        webSocketData->subscriber = nullptr;
+        webSocketData->isShuttingDown = true;
+        us_socket_close(SSL, s);
+
+        return handoff;
+    }
+
+    /* Picks up a socket another loop let go of, on our loop. Returns nullptr if it was dropped (closing it) */
+    WebSocket<SSL, isServer> *arrive(std::unique_ptr<WebSocketHandoff> handoff) {
+        WebSocketContextData<SSL, isServer> *webSocketContextData = getExt();
+        if (handoff->userData.length() != webSocketContextData->userDataSize) {
+            return nullptr;
+        }
+
+        us_socket_t *s = us_socket_from_fd(getSocketContext(), (int) (sizeof(WebSocketData) + webSocketContextData->userDataSize), handoff->fd);
+        if (!s) {
+            return nullptr;
+        }
+        handoff->fd = -1;
+
+        WebSocket<SSL, isServer> *webSocket = (WebSocket<SSL, isServer> *) s;
+        webSocket->init(handoff->perMessageDeflate, false, {}, BackPressure());
+        WebSocketData *webSocketData = (WebSocketData *) us_socket_ext(SSL, s);
+        *webSocketData->template getState<true>() = handoff->state;
+        webSocketData->roundTripTime = handoff->roundTripTime;
+        memcpy(webSocket->getUserData(), handoff->userData.data(), handoff->userData.length());
+
+        webSocket->getLoopData()->metrics.add(Metrics::WEBSOCKETS);
+        us_socket_timeout(SSL, s, webSocketContextData->idleTimeout);
+
+        /* Retained messages were already sent on the old loop */
+        if (handoff->subscriptions.size()) {
+            std::vector<std::string_view> topics(handoff->subscriptions.begin(), handoff->subscriptions.end());
+            webSocketContextData->topicTree.subscribe({topics.size(), topics.data()}, webSocket->getSubscriber(), false);
+        }
+
+        if (webSocketContextData->arriveHandler) {
+            webSocketContextData->arriveHandler(webSocket);
+        }
+        return webSocket;
+    }
+#endif
+
     void free() {
-        WebSocketContextData<SSL> *webSocketContextData = (WebSocketContextData<SSL> *) us_socket_context_ext(SSL, (us_socket_context_t *) this);
+        WebSocketContextData<SSL, isServer> *webSocketContextData = (WebSocketContextData<SSL, isServer> *) us_socket_context_ext(SSL, (us_socket_context_t *) this);
         webSocketContextData->~WebSocketContextData();
 
         us_socket_context_free(SSL, (us_socket_context_t *) this);
@@ -359,13 +558,13 @@ private:
 public:
     /* WebSocket contexts are always child contexts to a HTTP context so no SSL options are needed as they are inherited */
     static WebSocketContext *create(Loop *loop, us_socket_context_t *parentSocketContext) {
-        WebSocketContext *webSocketContext = (WebSocketContext *) us_create_child_socket_context(SSL, parentSocketContext, sizeof(WebSocketContextData<SSL>));
+        WebSocketContext *webSocketContext = (WebSocketContext *) us_create_child_socket_context(SSL, parentSocketContext, sizeof(WebSocketContextData<SSL, isServer>));
         if (!webSocketContext) {
             return nullptr;
         }
 
         /* Init socket context data */
-        new ((WebSocketContextData<SSL> *) us_socket_context_ext(SSL, (us_socket_context_t *)webSocketContext)) WebSocketContextData<SSL>;
+        new ((WebSocketContextData<SSL, isServer> *) us_socket_context_ext(SSL, (us_socket_context_t *)webSocketContext)) WebSocketContextData<SSL, isServer>;
         return webSocketContext->init();
     }
 };
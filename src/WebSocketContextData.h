@@ -23,6 +23,9 @@
 
 #include "WebSocketProtocol.h"
 #include "TopicTreeDraft.h"
+#include "WebSocketData.h"
+#include "Hub.h"
+#include "CompressionPool.h"
 
 namespace uWS {
 
@@ -30,68 +33,208 @@ template <bool, bool> struct WebSocket;
 
 /* todo: this looks identical to WebSocketBehavior, why not just std::move that entire thing in? */
 
-template <bool SSL>
+template <bool SSL, bool isServer = true>
 struct WebSocketContextData {
+    /* How many unused topics we free per loop iteration, mass disconnects are spread out over iterations like this */
+    static const size_t TOPIC_TRIM_BUDGET = 1024;
+
     /* The callbacks for this context */
-    fu2::unique_function<void(WebSocket<SSL, true> *, std::string_view, uWS::OpCode)> messageHandler = nullptr;
-    fu2::unique_function<void(WebSocket<SSL, true> *)> drainHandler = nullptr;
-    fu2::unique_function<void(WebSocket<SSL, true> *, int, std::string_view)> closeHandler = nullptr;
+    fu2::unique_function<void(WebSocket<SSL, isServer> *, std::string_view, uWS::OpCode)> messageHandler = nullptr;
+    fu2::unique_function<void(WebSocket<SSL, isServer> *)> drainHandler = nullptr;
+    fu2::unique_function<void(WebSocket<SSL, isServer> *, int, std::string_view)> closeHandler = nullptr;
+    fu2::unique_function<void(WebSocket<SSL, isServer> *)> pingHandler = nullptr;
+    fu2::unique_function<void(WebSocket<SSL, isServer> *)> pongHandler = nullptr;
+
+    /* Handed off sockets leave through the one of their old loop and arrive through the one of their new loop, see TemplatedApp::handoff */
+    fu2::unique_function<void(WebSocket<SSL, isServer> *)> departHandler = nullptr;
+    fu2::unique_function<void(WebSocket<SSL, isServer> *)> arriveHandler = nullptr;
+
+    /* Bytes of user data in every socket ext, after the WebSocketData */
+    unsigned int userDataSize = 0;
 
     /* Settings for this context */
     size_t maxPayloadLength = 0;
     int idleTimeout = 0;
 
+    /* Idle sockets are pinged rather than closed, and closed when that goes unanswered for another idleTimeout */
+    bool sendPingsAutomatically = false;
+
     /* There needs to be a maxBackpressure which will force close everything over that limit */
     size_t maxBackpressure = 0;
 
+    /* Subscribers buffering more than this lag, DROP and CONFLATE subscriptions stop adding to their backpressure until it has halved */
+    size_t lagBackpressure = 0;
+
+    /* Messages at least this large are compressed in the pool, if we have one */
+    CompressionPool *compressionPool = nullptr;
+    size_t compressionOffloadThreshold = 0;
+
+    /* Message handlers are traced here, named after the route */
+    Metrics::TracePoint messageTracePoint;
+
+    /* Streams preloaded with the dictionary of this route, if it has one */
+    std::string compressionDictionary;
+    DeflationStream *dictionaryDeflationStream = nullptr;
+    InflationStream *dictionaryInflationStream = nullptr;
+
     /* Each websocket context has a topic tree for pub/sub */
     TopicTree topicTree;
 
+    /* Publishes from other threads end up here if we joined a Hub */
+    HubQueue hubQueue;
+
     ~WebSocketContextData() {
+        /* Stop receiving from the Hub before our tree goes away */
+        if (hubQueue.hub) {
+            hubQueue.hub->leave(&hubQueue);
+        }
+
         /* We must unregister any loop post handler here */
         Loop::get()->removePostHandler(this);
         Loop::get()->removePreHandler(this);
+
+        delete dictionaryDeflationStream;
+        delete dictionaryInflationStream;
+    }
+
+    /* The streams keep views of the dictionary we own */
+    void setCompressionDictionary(std::string &&dictionary) {
+        compressionDictionary = std::move(dictionary);
+        dictionaryDeflationStream = new DeflationStream(15, 8, 1, compressionDictionary);
+        dictionaryInflationStream = new InflationStream(compressionDictionary);
+    }
+
+    /* The shared streams of this route, the loop's ones unless we have a dictionary */
+    DeflationStream *getDeflationStream(LoopData *loopData) {
+        return dictionaryDeflationStream ? dictionaryDeflationStream : loopData->deflationStream;
+    }
+
+    InflationStream *getInflationStream(LoopData *loopData) {
+        return dictionaryInflationStream ? dictionaryInflationStream : loopData->inflationStream;
     }
 
-    WebSocketContextData() : topicTree([this](Subscriber *s, std::string_view data) -> int {
+    WebSocketContextData() : topicTree([this](Subscriber *s, std::pair<size_t, std::string_view *> messages) -> int {
         /* We rely on writing to regular asyncSockets */
         auto *asyncSocket = (AsyncSocket<SSL> *) s->user;
 
-        auto [written, failed] = asyncSocket->write(data.data(), data.length());
+        bool failed = false;
+        AsyncSocketData<SSL> *asyncSocketData = asyncSocket->getAsyncSocketData();
+        WebSocketData *webSocketData = (WebSocketData *) asyncSocketData;
+        if (webSocketData->hasDeferredFrames()) {
+            /* Publishes queue up behind offloaded compressions like any other send, and count as backpressure */
+            DeferredFrames *deferredFrames = webSocketData->getDeferredFrames();
+            for (size_t i = 0; i < messages.first; i++) {
+                deferredFrames->bytes += messages.second[i].length();
+                deferredFrames->frames.push_back({std::string(), true, SharedMessage::of(messages.second[i])->ref()});
+            }
+
+            size_t backpressure = (size_t) asyncSocket->getBufferedAmount() + deferredFrames->bytes;
+            if (backpressure > maxBackpressure) {
+                asyncSocket->close();
+                return 0;
+            }
+            return backpressure > lagBackpressure;
+        } else if (asyncSocketData->buffer.length()) {
+            /* We already poll for writable, trying the kernel once per drain for every lagging socket is a waste */
+            for (size_t i = 0; i < messages.first; i++) {
+                asyncSocketData->buffer.append(messages.second[i].data(), messages.second[i].length());
+            }
+            failed = true;
+        } else {
+#ifdef UWS_HAS_WRITEV
+            if constexpr (!SSL) {
+                /* All messages to this subscriber leave in one gathered syscall, straight from the shared frames */
+                failed = asyncSocket->writev(messages.second, (int) messages.first).second;
+            } else
+#endif
+            {
+                /* Gather many shared messages via the cork buffer if it is free, so that they leave in one syscall */
+                bool corked = messages.first > 1 && asyncSocket->canCork();
+                if (corked) {
+                    asyncSocket->cork();
+                }
+
+                for (size_t i = 0; i < messages.first; i++) {
+                    failed |= asyncSocket->write(messages.second[i].data(), messages.second[i].length()).second;
+                }
+
+                if (corked) {
+                    failed |= asyncSocket->uncork().second;
+                }
+            }
+        }
+
         if (!failed) {
-            asyncSocket->timeout(this->idleTimeout);
+            webSocketData->lastActivity = (unsigned int) asyncSocket->getLoopData()->getTimestamp();
         } else {
             /* Note: this assumes we are not corked, as corking will swallow things and fail later on */
 
             /* Check if we now have too much backpressure (todo: don't buffer up before check) */
             if (asyncSocket->getBufferedAmount() > maxBackpressure) {
                 asyncSocket->close();
+
+                /* We are no longer a subscriber */
+                return 0;
             }
         }
 
-        /* Reserved, unused */
-        return 0;
+        /* Tell the tree we lag, we catch up on drain (see WebSocketContext) */
+        return (size_t) asyncSocket->getBufferedAmount() > lagBackpressure;
     }) {
+        hubQueue.loop = (us_loop_t *) Loop::get();
+        hubQueue.topicTree = &topicTree;
+
         /* We empty for both pre and post just to make sure */
         Loop::get()->addPostHandler(this, [this](Loop *loop) {
             /* Commit pub/sub batches every loop iteration */
-            topicTree.drain();
+            hubQueue.drain();
+            drainTopicTree();
+
+            /* Free topics left unused by unsubscribes, a bounded amount per iteration */
+            topicTree.trim(TOPIC_TRIM_BUDGET);
         });
 
         Loop::get()->addPreHandler(this, [this](Loop *loop) {
             /* Commit pub/sub batches every loop iteration */
-            topicTree.drain();
+            hubQueue.drain();
+            drainTopicTree();
         });
     }
 
-    /* Helper for topictree publish, common path from app and ws */
-    void publish(std::string_view topic, std::string_view message, OpCode opCode, bool compress) {
-        /* We frame the message right here and only pass raw bytes to the pub/subber */
-        char *dst = (char *) malloc(protocol::messageFrameSize(message.size()));
-        size_t dst_length = protocol::formatMessage<true>(dst, message.data(), message.length(), opCode, message.length(), false);
+    /* Sends out the current pub/sub batch, timed whenever there is one */
+    void drainTopicTree() {
+        if (topicTree.hasPendingTopics()) {
+            Metrics &metrics = ((LoopData *) us_loop_ext(hubQueue.loop))->metrics;
+            MetricsTimer timer(&metrics, metrics.topicDrain);
+            topicTree.drain();
+        }
+    }
 
-        topicTree.publish(topic, std::string_view(dst, dst_length));
-        ::free(dst);
+    /* Frames the message once into a buffer shared by every subscriber of this loop. Compressed messages are deflated once
+     * with a reset stream, like the shared compressor does, and carry their uncompressed frame along.
+     * Client frames are masked with one fresh key per message and shared all the same */
+    static SharedMessage *frame(LoopData *loopData, std::string_view message, OpCode opCode, bool compress) {
+        loopData->metrics.add(Metrics::WEBSOCKET_PUBLISHES);
+        SharedMessage *sharedMessage = SharedMessage::create(protocol::messageFrameSize<isServer>(message.size()), &loopData->slabAllocator);
+        sharedMessage->length = (unsigned int) protocol::formatMessage<isServer>(sharedMessage->data(), message.data(), message.length(), opCode, message.length(), false);
+
+        /* Without a zlibContext nobody on this loop negotiated permessage-deflate, clients never offer it */
+        if (isServer && compress && opCode < 3 && loopData->zlibContext) {
+            std::string_view compressed = loopData->deflationStream->deflate(loopData->zlibContext, message, true);
+            loopData->metrics.add(Metrics::DEFLATE_BYTES_IN, message.length());
+            loopData->metrics.add(Metrics::DEFLATE_BYTES_OUT, compressed.length());
+            SharedMessage *compressedMessage = SharedMessage::create(protocol::messageFrameSize(compressed.size()), &loopData->slabAllocator);
+            compressedMessage->length = (unsigned int) protocol::formatMessage<true>(compressedMessage->data(), compressed.data(), compressed.length(), opCode, compressed.length(), true);
+            compressedMessage->uncompressed = sharedMessage;
+            return compressedMessage;
+        }
+        return sharedMessage;
+    }
+
+    /* Helper for topictree publish, common path from app and ws */
+    void publish(std::string_view topic, std::string_view message, OpCode opCode, bool compress, bool retain = false) {
+        /* The tree takes over our reference */
+        topicTree.publish(topic, frame((LoopData *) us_loop_ext(hubQueue.loop), message, opCode, compress), retain);
     }
 };
 
@@ -21,17 +21,104 @@
 #include "WebSocketProtocol.h"
 #include "AsyncSocketData.h"
 #include "PerMessageDeflate.h"
+#include "SlabAllocator.h"
+#include "BufferPool.h"
+#include "TopicTreeDraft.h"
 
 #include <string>
+#include <list>
+#include <vector>
+
+#ifndef _WIN32
+#include <unistd.h>
+#endif
 
 namespace uWS {
 
+/* Frames which have to wait for an offloaded compression ahead of them, in send order.
+ * Shared with the jobs in flight, the socket may go away before they finish */
+struct DeferredFrames {
+    struct Frame {
+        std::string data;
+        bool ready;
+        /* Published frames are shared rather than copied into data, holding one reference */
+        SharedMessage *shared = nullptr;
+
+        std::string_view view() {
+            return shared ? std::string_view(shared->data(), shared->length) : std::string_view(data);
+        }
+    };
+    std::list<Frame> frames;
+
+    /* Counted as backpressure of the socket, frames still compressing by the length of their message */
+    size_t bytes = 0;
+
+    /* Nulled when the socket goes away */
+    void *webSocket;
+    int refCount = 1;
+
+    DeferredFrames(void *webSocket) : webSocket(webSocket) {}
+
+    ~DeferredFrames() {
+        for (Frame &frame : frames) {
+            if (frame.shared) {
+                frame.shared->unref();
+            }
+        }
+    }
+
+    /* Writing out or dropping the first frame */
+    void popFront() {
+        bytes -= frames.front().view().length();
+        if (frames.front().shared) {
+            frames.front().shared->unref();
+        }
+        frames.pop_front();
+    }
+
+    /* Only ever touched on the loop thread */
+    void unref() {
+        if (!--refCount) {
+            delete this;
+        }
+    }
+};
+
+/* A WebSocket on its way to another loop, owned by neither meanwhile. Only sockets between messages and with nothing
+ * buffered are moved, so besides a duplicate of the fd this is all there is to one. See TemplatedApp::handoff */
+struct WebSocketHandoff {
+    int fd = -1;
+    WebSocketState<true> state;
+    bool perMessageDeflate = false;
+    unsigned int roundTripTime = 0;
+    std::vector<std::string> subscriptions;
+
+    /* Moved as is, bytewise */
+    std::string userData;
+
+    WebSocketHandoff() = default;
+    WebSocketHandoff(const WebSocketHandoff &) = delete;
+    WebSocketHandoff &operator=(const WebSocketHandoff &) = delete;
+
+    /* Dropped on the way, such as when the receiving loop went away first */
+    ~WebSocketHandoff() {
+#ifndef _WIN32
+        if (fd != -1) {
+            ::close(fd);
+        }
+#endif
+    }
+};
+
 struct WebSocketData : AsyncSocketData<false>, WebSocketState<true> {
     template <bool, bool> friend struct WebSocketContext;
     template <bool, bool> friend struct WebSocket;
+    template <bool, bool> friend struct WebSocketContextData;
+    template <bool> friend struct WebSocketClientContext;
 private:
-    std::string fragmentBuffer;
-    int controlTipLength = 0;
+    bool awaitingPong = false;
+    /* Could not be handed off when shed, see WebSocketContext::handleData */
+    bool stayPut = false;
     bool isShuttingDown = 0;
     enum CompressionStatus : char {
         DISABLED,
@@ -39,32 +126,95 @@ private:
         COMPRESSED_FRAME
     } compressionStatus;
 
-    /* We might have a dedicated compressor */
-    DeflationStream *deflationStream = nullptr;
+    /* Messages spanning reads are reassembled here, the memory goes back to the loop's pool once emitted */
+    PooledBuffer fragmentBuffer;
+    int controlTipLength = 0;
+    /* Low bits of LoopData::timestamp as of our last send or receive, the idle timeout is only re-armed as it fires */
+    unsigned int lastActivity = 0;
+    /* When our automatic ping left, and how long the last one took to be answered in milliseconds */
+    unsigned int pingSent = 0;
+    unsigned int roundTripTime = 0;
+
+    /* What only compressing or offloading sockets need, off the socket and created on first use */
+    struct Extension {
+        /* We might have a dedicated compressor */
+        DeflationStream *deflationStream = nullptr;
+
+        /* Compressed messages spanning several reads are inflated into fragmentBuffer as they arrive, using this */
+        InflationStream *inflationStream = nullptr;
+
+        /* Created on the first offloaded compression */
+        DeferredFrames *deferredFrames = nullptr;
+    } *extension = nullptr;
 
     /* We could be a subscriber */
     Subscriber *subscriber = nullptr;
+
+    /* Our loop's allocator, backing the above */
+    SlabAllocator *slabAllocator;
+
+    Extension *getExtension() {
+        if (!extension) {
+            extension = slabAllocator->create<Extension>();
+        }
+        return extension;
+    }
+
+    DeflationStream *getDeflationStream() {
+        return extension ? extension->deflationStream : nullptr;
+    }
+
+    InflationStream *getInflationStream() {
+        return extension ? extension->inflationStream : nullptr;
+    }
+
+    DeferredFrames *getDeferredFrames() {
+        return extension ? extension->deferredFrames : nullptr;
+    }
+
+    bool hasDeferredFrames() {
+        DeferredFrames *deferredFrames = getDeferredFrames();
+        return deferredFrames && !deferredFrames->frames.empty();
+    }
+
+    size_t getDeferredBytes() {
+        DeferredFrames *deferredFrames = getDeferredFrames();
+        return deferredFrames ? deferredFrames->bytes : 0;
+    }
+
+    /* The parser state, clients lay their (smaller) WebSocketState<false> over the very same memory */
+    template <bool isServer>
+    WebSocketState<isServer> *getState() {
+        static_assert(sizeof(WebSocketState<false>) <= sizeof(WebSocketState<true>) && alignof(WebSocketState<false>) <= alignof(WebSocketState<true>));
+        return (WebSocketState<isServer> *) (WebSocketState<true> *) this;
+    }
 public:
-    WebSocketData(bool perMessageDeflate, bool slidingCompression, std::string &&backpressure) : AsyncSocketData<false>(std::move(backpressure)), WebSocketState<true>() {
+    WebSocketData(bool perMessageDeflate, bool slidingCompression, const CompressionProfile &compressionProfile, BackPressure &&backpressure, SlabAllocator *slabAllocator, BufferPool *bufferPool) : AsyncSocketData<false>(std::move(backpressure)), WebSocketState<true>(), fragmentBuffer(bufferPool), slabAllocator(slabAllocator) {
         compressionStatus = perMessageDeflate ? ENABLED : DISABLED;
 
         /* Initialize the dedicated sliding window */
         if (perMessageDeflate && slidingCompression) {
-            deflationStream = new DeflationStream;
+            getExtension()->deflationStream = slabAllocator->create<DeflationStream>(compressionProfile.windowBits, compressionProfile.memLevel, compressionProfile.level);
         }
     }
 
     ~WebSocketData() {
-        if (deflationStream) {
-            delete deflationStream;
-        }
-
-        if (subscriber) {
-            delete subscriber;
+        if (extension) {
+            if (extension->deferredFrames) {
+                extension->deferredFrames->webSocket = nullptr;
+                extension->deferredFrames->unref();
+            }
+            slabAllocator->destroy(extension->deflationStream);
+            slabAllocator->destroy(extension->inflationStream);
+            slabAllocator->destroy(extension);
         }
+        slabAllocator->destroy(subscriber);
     }
 };
 
+/* Every socket carries one, mind what is added */
+static_assert(sizeof(WebSocketData) <= 96, "WebSocketData grew past its budget");
+
 }
 
 #endif // UWS_WEBSOCKETDATA_H
@@ -19,7 +19,9 @@
 #define UWS_WEBSOCKETEXTENSIONS_H
 
 #include <climits>
+#include <string>
 #include <string_view>
+#include <algorithm>
 
 namespace uWS {
 
@@ -114,9 +116,14 @@ struct ExtensionsNegotiator {
 protected:
     int options;
 
+    /* The LZ77 window we compress with, at most what the client allows. Once asked for, it has to be answered */
+    int serverMaxWindowBits;
+    bool answerServerMaxWindowBits = false;
+
 public:
-    ExtensionsNegotiator(int wantedOptions) {
+    ExtensionsNegotiator(int wantedOptions, int wantedServerMaxWindowBits = 15) {
         options = wantedOptions;
+        serverMaxWindowBits = wantedServerMaxWindowBits;
     }
 
     std::string generateOffer() {
@@ -128,6 +135,11 @@ public:
                 extensionsOffer += "; client_no_context_takeover";
             }
 
+            /* A server may always limit its own window, whether the client asked for it or not */
+            if (serverMaxWindowBits < 15 || answerServerMaxWindowBits) {
+                extensionsOffer += "; server_max_window_bits=" + std::to_string(serverMaxWindowBits);
+            }
+
             /* It is questionable sending this improves anything */
             /*if (options & Options::SERVER_NO_CONTEXT_TAKEOVER) {
                 extensionsOffer += "; server_no_context_takeover";
@@ -151,6 +163,21 @@ public:
                 }/* else {
                     options &= ~SERVER_NO_CONTEXT_TAKEOVER;
                 }*/
+
+                /* Shared compressors always run at 15 bits */
+                if (options & SERVER_NO_CONTEXT_TAKEOVER) {
+                    serverMaxWindowBits = 15;
+                }
+
+                /* A limit on our window applies within messages too. Raw deflate cannot go below 9 bits,
+                 * and shared compressors cannot go below 15, so in those cases we decline */
+                if (extensionsParser.serverMaxWindowBits > 1) {
+                    serverMaxWindowBits = std::min<int>(serverMaxWindowBits, extensionsParser.serverMaxWindowBits);
+                    answerServerMaxWindowBits = true;
+                    if (serverMaxWindowBits < 9 || (serverMaxWindowBits < 15 && (options & SERVER_NO_CONTEXT_TAKEOVER))) {
+                        options &= ~PERMESSAGE_DEFLATE;
+                    }
+                }
             } else {
                 options &= ~PERMESSAGE_DEFLATE;
             }
@@ -162,6 +189,10 @@ public:
     int getNegotiatedOptions() {
         return options;
     }
+
+    int getNegotiatedServerMaxWindowBits() {
+        return serverMaxWindowBits;
+    }
 };
 
 }
@@ -18,8 +18,16 @@
 #ifndef UWS_WEBSOCKETHANDSHAKE_H
 #define UWS_WEBSOCKETHANDSHAKE_H
 
+/* Accept keys are hashed with the SHA extensions where the build targets them (-msha or -march=native on most x86-64
+ * from the last few years), else with the portable rounds below */
+
 #include <cstdint>
 #include <cstddef>
+#include <cstring>
+
+#if defined(__SHA__)
+#include <immintrin.h>
+#endif
 
 namespace uWS {
 
@@ -77,6 +85,49 @@ struct WebSocketHandshake {
         }
     };
 
+#if defined(__SHA__)
+    /* Four rounds per step, every register of msg holds four words of the schedule with the first one in the top lane */
+    template <int i>
+    static inline void sha1Rounds(__m128i &abcd, __m128i e[2], __m128i msg[4]) {
+        if constexpr (i == 0) {
+            e[0] = _mm_add_epi32(e[0], msg[0]);
+        } else {
+            e[i & 1] = _mm_sha1nexte_epu32(e[i & 1], msg[i & 3]);
+        }
+        e[(i + 1) & 1] = abcd;
+        if constexpr (i >= 3 && i <= 18) {
+            msg[(i + 1) & 3] = _mm_sha1msg2_epu32(msg[(i + 1) & 3], msg[i & 3]);
+        }
+        abcd = _mm_sha1rnds4_epu32(abcd, e[i & 1], i / 5);
+        if constexpr (i >= 1 && i <= 16) {
+            msg[(i - 1) & 3] = _mm_sha1msg1_epu32(msg[(i - 1) & 3], msg[i & 3]);
+        }
+        if constexpr (i >= 2 && i <= 17) {
+            msg[(i - 2) & 3] = _mm_xor_si128(msg[(i - 2) & 3], msg[i & 3]);
+        }
+        if constexpr (i < 19) {
+            sha1Rounds<i + 1>(abcd, e, msg);
+        }
+    }
+
+    static inline void sha1(uint32_t hash[5], uint32_t b[16]) {
+        __m128i abcd = _mm_shuffle_epi32(_mm_loadu_si128((__m128i *) hash), 0x1b);
+        __m128i abcdSaved = abcd;
+        __m128i e[2] = {_mm_set_epi32((int) hash[4], 0, 0, 0), _mm_setzero_si128()};
+        __m128i eSaved = e[0];
+        __m128i msg[4];
+        for (int i = 0; i < 4; i++) {
+            msg[i] = _mm_shuffle_epi32(_mm_loadu_si128((__m128i *) (b + 4 * i)), 0x1b);
+        }
+
+        sha1Rounds<0>(abcd, e, msg);
+
+        e[0] = _mm_sha1nexte_epu32(e[0], eSaved);
+        abcd = _mm_add_epi32(abcd, abcdSaved);
+        _mm_storeu_si128((__m128i *) hash, _mm_shuffle_epi32(abcd, 0x1b));
+        hash[4] = (uint32_t) _mm_cvtsi128_si32(_mm_srli_si128(e[0], 12));
+    }
+#else
     static inline void sha1(uint32_t hash[5], uint32_t b[16]) {
         uint32_t a[5] = {hash[4], hash[3], hash[2], hash[1], hash[0]};
         static_for<16, Sha1Loop<1>>()(a, b);
@@ -86,22 +137,34 @@ struct WebSocketHandshake {
         static_for<20, Sha1Loop<5>>()(a, b);
         static_for<5, Sha1Loop<6>>()(a, hash);
     }
+#endif
 
-    static inline void base64(unsigned char *src, char *dst) {
-        const char *b64 = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
-        for (int i = 0; i < 18; i += 3) {
-            *dst++ = b64[(src[i] >> 2) & 63];
-            *dst++ = b64[((src[i] & 3) << 4) | ((src[i + 1] & 240) >> 4)];
-            *dst++ = b64[((src[i + 1] & 15) << 2) | ((src[i + 2] & 192) >> 6)];
-            *dst++ = b64[src[i + 2] & 63];
+public:
+    /* What every upgrade answers with, the accept key follows and writeStatus adds the rest */
+    static constexpr char UPGRADE_STATUS[] = "101 Switching Protocols\r\nUpgrade: websocket\r\nConnection: Upgrade\r\nSec-WebSocket-Accept: ";
+    static const size_t UPGRADE_STATUS_LENGTH = sizeof(UPGRADE_STATUS) - 1 + 28;
+
+    /* Padded base64 of length bytes, returns how many chars were written. Both our accept keys and the keys of our clients go through here */
+    static inline size_t base64(const unsigned char *src, size_t length, char *dst) {
+        static const char *b64 = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+        char *start = dst;
+        for (; length >= 3; src += 3, length -= 3) {
+            uint32_t triple = (uint32_t) src[0] << 16 | (uint32_t) src[1] << 8 | src[2];
+            *dst++ = b64[triple >> 18];
+            *dst++ = b64[(triple >> 12) & 63];
+            *dst++ = b64[(triple >> 6) & 63];
+            *dst++ = b64[triple & 63];
         }
-        *dst++ = b64[(src[18] >> 2) & 63];
-        *dst++ = b64[((src[18] & 3) << 4) | ((src[19] & 240) >> 4)];
-        *dst++ = b64[((src[19] & 15) << 2)];
-        *dst++ = '=';
+        if (length) {
+            uint32_t triple = (uint32_t) src[0] << 16 | (length == 2 ? (uint32_t) src[1] << 8 : 0);
+            *dst++ = b64[triple >> 18];
+            *dst++ = b64[(triple >> 12) & 63];
+            *dst++ = length == 2 ? b64[(triple >> 6) & 63] : '=';
+            *dst++ = '=';
+        }
+        return (size_t) (dst - start);
     }
 
-public:
     static inline void generate(const char input[24], char output[28]) {
         uint32_t b_output[5] = {
             0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476, 0xc3d2e1f0
@@ -125,7 +188,13 @@ public:
             bytes[1] = (tmp >> 16) & 0xff;
             bytes[0] = (tmp >> 24) & 0xff;
         }
-        base64((unsigned char *) b_output, output);
+        base64((unsigned char *) b_output, 20, output);
+    }
+
+    /* UPGRADE_STATUS with the accept key for input, UPGRADE_STATUS_LENGTH chars in one go */
+    static inline void generateUpgradeStatus(const char input[24], char output[UPGRADE_STATUS_LENGTH]) {
+        memcpy(output, UPGRADE_STATUS, sizeof(UPGRADE_STATUS) - 1);
+        generate(input, output + sizeof(UPGRADE_STATUS) - 1);
     }
 };
 
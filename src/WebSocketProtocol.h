@@ -21,6 +21,14 @@
 #include <cstdint>
 #include <cstring>
 #include <cstdlib>
+#include <random>
+
+/* Unmasking is vectorized with whatever the compiler targets */
+#if defined(__SSE2__) || defined(_M_X64)
+#include <immintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
 
 namespace uWS {
 
@@ -68,6 +76,12 @@ public:
     // 8 bytes
     unsigned int remainingBytes = 0;
     char mask[isServer ? 4 : 1];
+
+    /* The last sequence of a text message slice, if cut short, waits here for the next slice */
+    struct Utf8State {
+        unsigned char tail[3];
+        unsigned char tailLength = 0;
+    } utf8State;
 };
 
 namespace protocol {
@@ -102,10 +116,11 @@ T cond_byte_swap(T value) {
 // https://www.cl.cam.ac.uk/~mgk25/ucs/utf8_check.c
 // Optimized for predominantly 7-bit content by Alex Hultman, 2016
 // Licensed as Zlib, like the rest of this project
-static bool isValidUtf8(unsigned char *s, size_t length)
+static bool isValidUtf8Scalar(unsigned char *s, size_t length)
 {
     for (unsigned char *e = s + length; s != e; ) {
-        if (s + 4 <= e && ((*(uint32_t *) s) & 0x80808080) == 0) {
+        uint32_t word;
+        if (s + 4 <= e && (memcpy(&word, s, 4), (word & 0x80808080) == 0)) {
             s += 4;
         } else {
             while (!(*s & 0x80)) {
@@ -139,6 +154,207 @@ static bool isValidUtf8(unsigned char *s, size_t length)
     return true;
 }
 
+/* The vector path needs SSSE3 or NEON. Plain x86 builds get it compiled for SSSE3 anyway, taken only if the CPU has it */
+#if defined(__SSSE3__) || (defined(__ARM_NEON) && defined(__aarch64__))
+#define UWS_UTF8_SIMD
+#define UWS_UTF8_TARGET
+#elif (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__) && defined(__SSE2__)
+#define UWS_UTF8_SIMD
+#define UWS_UTF8_SIMD_DISPATCH
+#define UWS_UTF8_TARGET __attribute__((target("ssse3")))
+#endif
+
+#ifdef UWS_UTF8_SIMD
+// Vectorized lookup validation after Keiser & Lemire, "Validating UTF-8 In Less Than One Instruction Per Byte"
+// Every byte gets classified by three 16-entry tables: high and low nibble of the previous byte and high nibble
+// of itself. Their AND is nonzero for any error within a 2-byte window, longer sequences are checked separately.
+namespace utf8 {
+
+#if defined(__SSSE3__) || defined(UWS_UTF8_SIMD_DISPATCH)
+typedef __m128i vector;
+UWS_UTF8_TARGET static inline vector load(const unsigned char *s) {return _mm_loadu_si128((const __m128i *) s);}
+UWS_UTF8_TARGET static inline vector splat(uint8_t b) {return _mm_set1_epi8((char) b);}
+UWS_UTF8_TARGET static inline vector vand(vector a, vector b) {return _mm_and_si128(a, b);}
+UWS_UTF8_TARGET static inline vector vor(vector a, vector b) {return _mm_or_si128(a, b);}
+UWS_UTF8_TARGET static inline vector vxor(vector a, vector b) {return _mm_xor_si128(a, b);}
+UWS_UTF8_TARGET static inline vector lookup(vector table, vector nibbles) {return _mm_shuffle_epi8(table, nibbles);}
+UWS_UTF8_TARGET static inline vector highNibbles(vector v) {return _mm_and_si128(_mm_srli_epi16(v, 4), splat(0x0f));}
+UWS_UTF8_TARGET static inline vector lowNibbles(vector v) {return _mm_and_si128(v, splat(0x0f));}
+UWS_UTF8_TARGET static inline vector saturatingSub(vector v, uint8_t b) {return _mm_subs_epu8(v, splat(b));}
+template <int N> UWS_UTF8_TARGET static inline vector prev(vector input, vector previous) {return _mm_alignr_epi8(input, previous, 16 - N);}
+UWS_UTF8_TARGET static inline bool isAscii(vector v) {return !_mm_movemask_epi8(v);}
+UWS_UTF8_TARGET static inline bool isZero(vector v) {return _mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_setzero_si128())) == 0xffff;}
+#else
+typedef uint8x16_t vector;
+UWS_UTF8_TARGET static inline vector load(const unsigned char *s) {return vld1q_u8(s);}
+UWS_UTF8_TARGET static inline vector splat(uint8_t b) {return vdupq_n_u8(b);}
+UWS_UTF8_TARGET static inline vector vand(vector a, vector b) {return vandq_u8(a, b);}
+UWS_UTF8_TARGET static inline vector vor(vector a, vector b) {return vorrq_u8(a, b);}
+UWS_UTF8_TARGET static inline vector vxor(vector a, vector b) {return veorq_u8(a, b);}
+UWS_UTF8_TARGET static inline vector lookup(vector table, vector nibbles) {return vqtbl1q_u8(table, nibbles);}
+UWS_UTF8_TARGET static inline vector highNibbles(vector v) {return vshrq_n_u8(v, 4);}
+UWS_UTF8_TARGET static inline vector lowNibbles(vector v) {return vandq_u8(v, splat(0x0f));}
+UWS_UTF8_TARGET static inline vector saturatingSub(vector v, uint8_t b) {return vqsubq_u8(v, splat(b));}
+template <int N> UWS_UTF8_TARGET static inline vector prev(vector input, vector previous) {return vextq_u8(previous, input, 16 - N);}
+UWS_UTF8_TARGET static inline bool isAscii(vector v) {return vmaxvq_u8(v) < 0x80;}
+UWS_UTF8_TARGET static inline bool isZero(vector v) {return !vmaxvq_u8(v);}
+#endif
+
+enum : uint8_t {
+    TOO_SHORT = 1 << 0, TOO_LONG = 1 << 1, OVERLONG_3 = 1 << 2, TOO_LARGE = 1 << 3,
+    SURROGATE = 1 << 4, OVERLONG_2 = 1 << 5, TOO_LARGE_1000 = 1 << 6, OVERLONG_4 = 1 << 6,
+    TWO_CONTS = 1 << 7, CARRY = TOO_SHORT | TOO_LONG | TWO_CONTS
+};
+
+alignas(16) static const uint8_t byte1High[16] = {
+    TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG,
+    TWO_CONTS, TWO_CONTS, TWO_CONTS, TWO_CONTS,
+    TOO_SHORT | OVERLONG_2,
+    TOO_SHORT,
+    TOO_SHORT | OVERLONG_3 | SURROGATE,
+    TOO_SHORT | TOO_LARGE | TOO_LARGE_1000 | OVERLONG_4
+};
+
+alignas(16) static const uint8_t byte1Low[16] = {
+    CARRY | OVERLONG_3 | OVERLONG_2 | OVERLONG_4,
+    CARRY | OVERLONG_2,
+    CARRY,
+    CARRY,
+    CARRY | TOO_LARGE,
+    CARRY | TOO_LARGE | TOO_LARGE_1000,
+    CARRY | TOO_LARGE | TOO_LARGE_1000, CARRY | TOO_LARGE | TOO_LARGE_1000,
+    CARRY | TOO_LARGE | TOO_LARGE_1000, CARRY | TOO_LARGE | TOO_LARGE_1000,
+    CARRY | TOO_LARGE | TOO_LARGE_1000, CARRY | TOO_LARGE | TOO_LARGE_1000,
+    CARRY | TOO_LARGE | TOO_LARGE_1000,
+    CARRY | TOO_LARGE | TOO_LARGE_1000 | SURROGATE,
+    CARRY | TOO_LARGE | TOO_LARGE_1000,
+    CARRY | TOO_LARGE | TOO_LARGE_1000
+};
+
+alignas(16) static const uint8_t byte2High[16] = {
+    TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT,
+    TOO_LONG | OVERLONG_2 | TWO_CONTS | OVERLONG_3 | TOO_LARGE_1000 | OVERLONG_4,
+    TOO_LONG | OVERLONG_2 | TWO_CONTS | OVERLONG_3 | TOO_LARGE,
+    TOO_LONG | OVERLONG_2 | TWO_CONTS | SURROGATE | TOO_LARGE,
+    TOO_LONG | OVERLONG_2 | TWO_CONTS | SURROGATE | TOO_LARGE,
+    TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT
+};
+
+/* Accumulates any error of input, given the 16 bytes before it */
+UWS_UTF8_TARGET static inline void check(vector input, vector previous, vector &error) {
+    vector prev1 = prev<1>(input, previous);
+    vector special = vand(vand(lookup(load(byte1High), highNibbles(prev1)), lookup(load(byte1Low), lowNibbles(prev1))),
+                          lookup(load(byte2High), highNibbles(input)));
+
+    /* Third and fourth bytes must be continuations, which is exactly when special says TWO_CONTS */
+    vector must23 = vor(saturatingSub(prev<2>(input, previous), 0xe0 - 0x80), saturatingSub(prev<3>(input, previous), 0xf0 - 0x80));
+    error = vor(error, vxor(vand(must23, splat(0x80)), special));
+}
+
+UWS_UTF8_TARGET static inline bool isValid(const unsigned char *s, size_t length) {
+    vector error = splat(0), previous = splat(0);
+    bool previousAscii = true;
+
+    size_t i = 0;
+    for (; i + 16 <= length; i += 16) {
+        vector input = load(s + i);
+
+        /* ASCII following ASCII cannot be wrong, which is the common case */
+        bool ascii = isAscii(input);
+        if (!ascii || !previousAscii) {
+            check(input, previous, error);
+        }
+        previousAscii = ascii;
+        previous = input;
+    }
+
+    /* The tail is padded with at least one zero, which also catches a sequence cut short at the very end */
+    unsigned char tail[16] = {};
+    memcpy(tail, s + i, length - i);
+    check(load(tail), previous, error);
+
+    return isZero(error);
+}
+
+}
+#endif
+
+static inline bool isValidUtf8(unsigned char *s, size_t length) {
+#if defined(UWS_UTF8_SIMD_DISPATCH)
+    static const bool ssse3 = (__builtin_cpu_init(), __builtin_cpu_supports("ssse3"));
+    /* Short strings are faster done in scalar */
+    if (length >= 16 && ssse3) {
+        return utf8::isValid(s, length);
+    }
+#elif defined(UWS_UTF8_SIMD)
+    /* Short strings are faster done in scalar */
+    if (length >= 16) {
+        return utf8::isValid(s, length);
+    }
+#endif
+    return isValidUtf8Scalar(s, length);
+}
+
+/* Length of the sequence this lead byte starts, stray continuation and invalid bytes count as one and fail later */
+static inline unsigned int utf8SequenceLength(unsigned char lead) {
+    if (lead < 0xc0) {
+        return 1;
+    } else if (lead < 0xe0) {
+        return 2;
+    } else if (lead < 0xf0) {
+        return 3;
+    }
+    return lead < 0xf8 ? 4 : 1;
+}
+
+/* Validates a message slice by slice, each byte once as it streams by. Returns false as soon as the
+ * message can no longer be valid, isValidUtf8End then tells whether it ended on a whole sequence */
+template <class State>
+static inline bool isValidUtf8Stream(State &state, unsigned char *s, size_t length) {
+    /* Complete the sequence we were cut off in */
+    if (state.tailLength) {
+        unsigned int sequenceLength = utf8SequenceLength(state.tail[0]);
+        unsigned int missing = sequenceLength - state.tailLength;
+        if (length < missing) {
+            memcpy(state.tail + state.tailLength, s, length);
+            state.tailLength += (unsigned char) length;
+            return true;
+        }
+
+        unsigned char sequence[4];
+        memcpy(sequence, state.tail, state.tailLength);
+        memcpy(sequence + state.tailLength, s, missing);
+        state.tailLength = 0;
+        if (!isValidUtf8Scalar(sequence, sequenceLength)) {
+            return false;
+        }
+        s += missing;
+        length -= missing;
+    }
+
+    /* Hold back a last sequence running past the slice */
+    size_t cut = length;
+    for (size_t k = 1; k <= 3 && k <= length; k++) {
+        if ((s[length - k] & 0xc0) != 0x80) {
+            if (utf8SequenceLength(s[length - k]) > k) {
+                cut = length - k;
+            }
+            break;
+        }
+    }
+
+    memcpy(state.tail, s + cut, length - cut);
+    state.tailLength = (unsigned char) (length - cut);
+    return isValidUtf8(s, cut);
+}
+
+template <class State>
+static inline bool isValidUtf8End(State &state) {
+    bool whole = !state.tailLength;
+    state.tailLength = 0;
+    return whole;
+}
+
 struct CloseFrame {
     uint16_t code;
     char *message;
@@ -168,13 +384,61 @@ static inline size_t formatClosePayload(char *dst, uint16_t code, const char *me
     return 0;
 }
 
+/* Clients mask, which takes 4 more bytes */
+template <bool isServer = true>
 static inline size_t messageFrameSize(size_t messageSize) {
+    size_t maskSize = isServer ? 0 : 4;
     if (messageSize < 126) {
-        return 2 + messageSize;
+        return 2 + maskSize + messageSize;
     } else if (messageSize <= UINT16_MAX) {
-        return 4 + messageSize;
+        return 4 + maskSize + messageSize;
     }
-    return 10 + messageSize;
+    return 10 + maskSize + messageSize;
+}
+
+/* XORs as many whole vectors as fit in bytes with the repeated mask, returns how many bytes were done.
+ * Every vector is loaded before it is stored so dst may trail src */
+static inline size_t xorVectors(char *dst, const char *src, uint32_t mask32, size_t bytes) {
+    size_t done = 0;
+    (void) mask32;
+
+#if defined(__AVX2__)
+    __m256i mask256 = _mm256_set1_epi32((int) mask32);
+    for (; done + 32 <= bytes; done += 32) {
+        __m256i v = _mm256_loadu_si256((__m256i *) (src + done));
+        _mm256_storeu_si256((__m256i *) (dst + done), _mm256_xor_si256(v, mask256));
+    }
+#endif
+
+#if defined(__SSE2__) || defined(_M_X64)
+    __m128i mask128 = _mm_set1_epi32((int) mask32);
+    for (; done + 16 <= bytes; done += 16) {
+        __m128i v = _mm_loadu_si128((__m128i *) (src + done));
+        _mm_storeu_si128((__m128i *) (dst + done), _mm_xor_si128(v, mask128));
+    }
+#elif defined(__ARM_NEON)
+    uint8x16_t mask128 = vreinterpretq_u8_u32(vdupq_n_u32(mask32));
+    for (; done + 16 <= bytes; done += 16) {
+        uint8x16_t v = vld1q_u8((uint8_t *) (src + done));
+        vst1q_u8((uint8_t *) (dst + done), veorq_u8(v, mask128));
+    }
+#endif
+
+    return done;
+}
+
+/* Mask keys only need to be unpredictable to whoever writes our payloads (RFC 6455 10.3), not cryptographically strong.
+ * One xorshift state per thread, which is per loop, seeded from the system once */
+static inline uint32_t maskKey() {
+    static thread_local uint64_t state = 0;
+    if (!state) {
+        std::random_device device;
+        state = ((uint64_t) device() << 32 | device()) | 1;
+    }
+    state ^= state >> 12;
+    state ^= state << 25;
+    state ^= state >> 27;
+    return (uint32_t) ((state * 0x2545f4914f6cdd1dull) >> 32);
 }
 
 enum {
@@ -208,30 +472,23 @@ static inline size_t formatMessage(char *dst, const char *src, size_t length, Op
         dst[0] |= opCode;
     }
 
-    char mask[4];
-    if (!isServer) {
-        dst[1] |= 0x80;
-        uint32_t random = rand();
-        memcpy(mask, &random, 4);
-        memcpy(dst + headerLength, &random, 4);
-        headerLength += 4;
-    }
-
     messageLength = headerLength + length;
-    memcpy(dst + headerLength, src, length);
-
     if (!isServer) {
-
-        // overwrites up to 3 bytes outside of the given buffer!
-        //WebSocketProtocol<isServer>::unmaskInplace(dst + headerLength, dst + headerLength + length, mask);
-
-        // this is not optimal
-        char *start = dst + headerLength;
-        char *stop = start + length;
-        int i = 0;
-        while (start != stop) {
-            (*start++) ^= mask[i++ % 4];
+        /* The payload is masked as it is copied in, whole vectors at a time (vectors are multiples of 4 so the mask stays in phase) */
+        dst[1] |= 0x80;
+        char mask[4];
+        uint32_t mask32 = maskKey();
+        memcpy(mask, &mask32, 4);
+        memcpy(dst + headerLength, mask, 4);
+        dst += headerLength + 4;
+        messageLength += 4;
+
+        size_t done = xorVectors(dst, src, mask32, length);
+        for (; done < length; done++) {
+            dst[done] = src[done] ^ mask[done % 4];
         }
+    } else {
+        memcpy(dst + headerLength, src, length);
     }
     return messageLength;
 }
@@ -253,8 +510,21 @@ protected:
     static inline bool rsv23(char *frame) {return *((unsigned char *) frame) & 48;}
     static inline bool rsv1(char *frame) {return *((unsigned char *) frame) & 64;}
 
+    /* See protocol::xorVectors, dst may trail src like it does for unmaskImprecise */
+    static inline size_t unmaskVectors(char *dst, char *src, char *mask, size_t bytes) {
+        uint32_t mask32;
+        memcpy(&mask32, mask, 4);
+        return protocol::xorVectors(dst, src, mask32, bytes);
+    }
+
+    /* Unmasks length bytes rounded up to the next multiple of 4, reading into CONSUME_POST_PADDING */
     static inline void unmaskImprecise(char *dst, char *src, char *mask, unsigned int length) {
-        for (unsigned int n = (length >> 2) + 1; n; n--) {
+        size_t bytes = ((size_t) (length >> 2) + 1) * 4;
+        size_t done = unmaskVectors(dst, src, mask, bytes);
+        dst += done;
+        src += done;
+
+        for (size_t n = (bytes - done) >> 2; n; n--) {
             *(dst++) = *(src++) ^ mask[0];
             *(dst++) = *(src++) ^ mask[1];
             *(dst++) = *(src++) ^ mask[2];
@@ -276,6 +546,7 @@ protected:
     }
 
     static inline void unmaskInplace(char *data, char *stop, char *mask) {
+        data += unmaskVectors(data, data, mask, (size_t) (stop - data));
         while (data < stop) {
             *(data++) ^= mask[0];
             *(data++) ^= mask[1];
@@ -0,0 +1,150 @@
+/* Corking and gathered writes of AsyncSocket, over real socket pairs standing in for uSockets sockets */
+
+#include "libusockets.h"
+#include "AsyncSocket.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <unistd.h>
+#include <fcntl.h>
+
+/* Just enough of uSockets for AsyncSocket, every socket being one end of a socketpair */
+struct us_loop_t {
+    alignas(16) char ext[sizeof(uWS::LoopData)];
+};
+
+struct us_socket_context_t {
+    us_loop_t *loop;
+};
+
+struct us_socket_t {
+    us_socket_context_t *context;
+    int fd;
+    alignas(16) char ext[sizeof(uWS::AsyncSocketData<false>)];
+};
+
+extern "C" {
+
+void *us_loop_ext(us_loop_t *loop) {
+    return loop->ext;
+}
+
+us_loop_t *us_socket_context_loop(int, us_socket_context_t *context) {
+    return context->loop;
+}
+
+us_socket_context_t *us_socket_context(int, us_socket_t *s) {
+    return s->context;
+}
+
+void *us_socket_ext(int, us_socket_t *s) {
+    return s->ext;
+}
+
+int us_poll_fd(us_poll_t *p) {
+    return ((us_socket_t *) p)->fd;
+}
+
+int us_socket_is_closed(int, us_socket_t *) {
+    return 0;
+}
+
+int us_socket_write(int, us_socket_t *s, const char *data, int length, int) {
+    ssize_t written = send(s->fd, data, (size_t) length, MSG_NOSIGNAL);
+    return written < 0 ? 0 : (int) written;
+}
+
+}
+
+/* Exposes what the contexts use */
+struct Socket : uWS::AsyncSocket<false> {
+    using uWS::AsyncSocket<false>::cork;
+    using uWS::AsyncSocket<false>::uncork;
+    using uWS::AsyncSocket<false>::write;
+    using uWS::AsyncSocket<false>::writev;
+    using uWS::AsyncSocket<false>::getBufferedAmount;
+};
+
+static int failures = 0;
+
+static void check(bool ok, const char *what) {
+    if (!ok) {
+        printf("FAILED: %s\n", what);
+        failures++;
+    }
+}
+
+/* Everything the peer got so far */
+static std::string drain(int fd) {
+    std::string received;
+    char buffer[4096];
+    ssize_t length;
+    while ((length = recv(fd, buffer, sizeof(buffer), MSG_DONTWAIT)) > 0) {
+        received.append(buffer, (size_t) length);
+    }
+    return received;
+}
+
+int main() {
+    us_loop_t loop;
+    new (loop.ext) uWS::LoopData;
+    us_socket_context_t context = {&loop};
+
+    us_socket_t sockets[2];
+    int peers[2];
+    for (int i = 0; i < 2; i++) {
+        int pair[2];
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, pair)) {
+            perror("socketpair");
+            return 1;
+        }
+        fcntl(pair[0], F_SETFL, O_NONBLOCK);
+        sockets[i].context = &context;
+        sockets[i].fd = pair[0];
+        peers[i] = pair[1];
+        new (sockets[i].ext) uWS::AsyncSocketData<false>;
+    }
+    Socket *a = (Socket *) &sockets[0], *b = (Socket *) &sockets[1];
+
+    /* Sending to another socket while one is corked must leave the cork buffer be */
+    a->cork();
+    a->write("corked for a", 12);
+    std::string_view toB[] = {"to ", "b"};
+    b->writev(toB, 2);
+    check(drain(peers[1]) == "to b", "the uncorked socket gets its gathered write");
+    check(drain(peers[0]).empty(), "nothing leaves the corked socket before uncork");
+    a->uncork();
+    check(drain(peers[0]) == "corked for a", "the corked socket keeps what it corked");
+
+    /* Gathering on the corked socket itself sends the cork buffer first */
+    a->cork();
+    a->write("first ", 6);
+    std::string large(uWS::LoopData::DEFAULT_CORK_BUFFER_SIZE, 'x');
+    std::string_view chunks[] = {large};
+    a->writev(chunks, 1);
+    a->uncork();
+    check(drain(peers[0]) == "first " + large, "corked data goes out ahead of a gathered write");
+
+    /* A write too large for the kernel is buffered, in order */
+    std::string huge(4 * 1024 * 1024, 'y');
+    std::string_view hugeChunks[] = {huge, "z"};
+    b->writev(hugeChunks, 2);
+    check(b->getBufferedAmount() > 0, "what the kernel did not take is buffered");
+    std::string received;
+    while (received.length() < huge.length() + 1) {
+        received += drain(peers[1]);
+        b->write(nullptr, 0);
+    }
+    check(received == huge + "z" && !b->getBufferedAmount(), "buffered data drains in order");
+
+    for (int i = 0; i < 2; i++) {
+        ((uWS::AsyncSocketData<false> *) sockets[i].ext)->~AsyncSocketData();
+        close(sockets[i].fd);
+        close(peers[i]);
+    }
+    ((uWS::LoopData *) loop.ext)->~LoopData();
+
+    printf(failures ? "AsyncSocket: %d failures\n" : "AsyncSocket: ok\n", failures);
+    return failures != 0;
+}
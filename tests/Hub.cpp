@@ -0,0 +1,85 @@
+/* Publishing to a Hub from many threads while its members join and leave */
+
+#include "Hub.h"
+
+#include <cstdio>
+#include <thread>
+
+/* Our queues are drained by hand, nothing to wake up */
+extern "C" void us_wakeup_loop(us_loop_t *) {}
+
+static int failures = 0;
+
+static void check(bool ok, const char *what) {
+    if (!ok) {
+        printf("FAILED: %s\n", what);
+        failures++;
+    }
+}
+
+int main() {
+    const int PUBLISHERS = 4, PUBLISHES = 20000;
+
+    uWS::Hub hub;
+    size_t stayed = 0, churned = 0;
+    uWS::TopicTree stayingTree([&](uWS::Subscriber *, std::pair<size_t, std::string_view *> messages) {
+        stayed += messages.first;
+        return 0;
+    });
+    uWS::TopicTree churningTree([&](uWS::Subscriber *, std::pair<size_t, std::string_view *> messages) {
+        churned += messages.first;
+        return 0;
+    });
+    uWS::Subscriber stayingSubscriber(nullptr), churningSubscriber(nullptr);
+    stayingTree.subscribe("t", &stayingSubscriber);
+    churningTree.subscribe("t", &churningSubscriber);
+
+    uWS::HubQueue staying, churning;
+    staying.topicTree = &stayingTree;
+    churning.topicTree = &churningTree;
+    hub.join(&staying);
+
+    std::atomic<int> done = 0;
+    std::vector<std::thread> publishers;
+    for (int i = 0; i < PUBLISHERS; i++) {
+        publishers.emplace_back([&]() {
+            for (int j = 0; j < PUBLISHES; j++) {
+                hub.publish("t", "hello", uWS::TEXT);
+            }
+            done++;
+        });
+    }
+
+    /* Whatever publishes raced our leave, none may reach us after it */
+    bool quiet = true;
+    while (done < PUBLISHERS) {
+        hub.join(&churning);
+        std::this_thread::yield();
+        churning.drain();
+        churningTree.drain();
+        hub.leave(&churning);
+
+        size_t before = churned;
+        churning.drain();
+        churningTree.drain();
+        quiet &= churned == before;
+
+        staying.drain();
+        stayingTree.drain();
+    }
+    for (std::thread &publisher : publishers) {
+        publisher.join();
+    }
+    staying.drain();
+    stayingTree.drain();
+
+    check(quiet, "nothing is pushed to a queue once it left");
+    check(stayed == (size_t) PUBLISHERS * PUBLISHES, "a member present throughout gets every publish");
+
+    hub.leave(&staying);
+    stayingTree.unsubscribeAll(&stayingSubscriber);
+    churningTree.unsubscribeAll(&churningSubscriber);
+
+    printf(failures ? "Hub: %d failures\n" : "Hub: ok\n", failures);
+    return failures != 0;
+}
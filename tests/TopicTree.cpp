@@ -0,0 +1,578 @@
+/* Randomized checks of TopicTreeDraft.h against naive reference models.
+ * HashedSet and SubscriberSet are checked directly, the TopicTree as a whole by replaying every callback
+ * it made against a model of subscriptions, retained messages, slow consumer policies and lagging */
+
+#include "TopicTreeDraft.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <deque>
+#include <map>
+#include <random>
+#include <set>
+#include <string>
+#include <tuple>
+#include <vector>
+
+using namespace uWS;
+
+static int failures = 0;
+
+static bool check(bool ok, const char *what, int round) {
+    if (!ok && failures++ < 10) {
+        printf("FAILED: %s (round %d)\n", what, round);
+    }
+    return ok;
+}
+
+/* Inserts, erases (shifting back) and finds against a std::map, with hashes that collide more or less all the time */
+static void testHashedSet(std::mt19937 &rng, int rounds) {
+    const int VALUES = 200;
+    int values[VALUES];
+
+    for (int round = 0; round < rounds; round++) {
+        int collisions = round % 3;
+        std::vector<uint64_t> hashes(VALUES);
+        for (uint64_t &hash : hashes) {
+            hash = collisions == 0 ? ((uint64_t) rng() << 32 | rng()) : collisions == 1 ? rng() % 4 : 7;
+        }
+
+        HashedSet<int> set;
+        std::map<int *, uint64_t> model;
+        for (int op = 0; op < 400; op++) {
+            int i = (int) (rng() % VALUES);
+            unsigned int what = rng() % 100;
+            if (what < 50) {
+                if (!model.count(&values[i])) {
+                    set.insert(hashes[i], &values[i]);
+                    model[&values[i]] = hashes[i];
+                }
+            } else if (what < 95) {
+                if (model.count(&values[i])) {
+                    set.erase(hashes[i], &values[i]);
+                    model.erase(&values[i]);
+                }
+            } else if (what < 98) {
+                set.reserve(rng() % 64);
+            } else {
+                set.clear();
+                model.clear();
+            }
+
+            check(set.size() == model.size(), "HashedSet size", round);
+            for (int j = 0; j < VALUES; j++) {
+                int *found = set.find(hashes[j], [&](int *value) { return value == &values[j]; });
+                if (!check(found == (model.count(&values[j]) ? &values[j] : nullptr), "HashedSet finds exactly what is in it", round)) {
+                    return;
+                }
+            }
+            std::set<int *> visited;
+            set.forEach([&](int *value) { visited.insert(value); });
+            check(visited.size() == model.size() && std::equal(visited.begin(), visited.end(), model.begin(), [](int *a, auto &b) {
+                return a == b.first;
+            }), "HashedSet forEach visits each value once", round);
+        }
+    }
+}
+
+/* Inserts and erases, part of them while frozen as drain does it, against a std::set */
+static void testSubscriberSet(std::mt19937 &rng, int rounds) {
+    std::deque<Subscriber> pool;
+    for (int i = 0; i < 300; i++) {
+        pool.emplace_back(nullptr);
+    }
+
+    for (int round = 0; round < rounds; round++) {
+        SubscriberSet subs;
+        std::set<Subscriber *> model;
+        std::vector<Subscriber *> frozenPrefix;
+        bool frozen = false;
+
+        /* Long frozen spans pile up a tail which must not be merged in before thawing */
+        unsigned int thaw = round % 4 == 1 ? 998 : 950;
+        for (int op = 0; op < 2000; op++) {
+            Subscriber *s = &pool[rng() % (round % 2 ? 300 : 20)];
+            unsigned int what = rng() % 1000;
+            if (what < (frozen ? 700u : 450u)) {
+                if (!model.count(s)) {
+                    subs.insert(s);
+                    model.insert(s);
+                }
+            } else if (what < thaw) {
+                if (model.count(s)) {
+                    subs.erase(s);
+                    model.erase(s);
+                }
+            } else if (!frozen) {
+                /* Just like drain */
+                subs.commit();
+                subs.freeze(true);
+                frozen = true;
+                frozenPrefix.assign(subs.begin(), subs.begin() + subs.sortedSize());
+            } else {
+                subs.freeze(false);
+                frozen = false;
+            }
+
+            check(subs.size() == model.size(), "SubscriberSet size", round);
+            if (frozen) {
+                /* Whoever is being merged must stay in place, at most tombstoned */
+                bool inPlace = subs.sortedSize() == frozenPrefix.size();
+                for (size_t i = 0; inPlace && i < frozenPrefix.size(); i++) {
+                    inPlace = SubscriberSet::untag(subs.begin()[i]) == frozenPrefix[i];
+                }
+                check(inPlace, "SubscriberSet keeps its sorted part in place while frozen", round);
+            } else if (rng() % 8 == 0) {
+                subs.commit();
+                check(subs.sortedSize() == model.size() && std::equal(subs.begin(), subs.end(), model.begin(), model.end()),
+                      "SubscriberSet is sorted and without tombstones after commit", round);
+            }
+        }
+    }
+}
+
+/* The TopicTree model. Message ids are ours, every message is "m<id>" or, as taken by compressed subscribers, "z<id>" */
+struct TopicTreeModel {
+    struct Message {
+        std::string topic;
+        bool compressed;
+    };
+
+    struct Action {
+        enum { UNSUBSCRIBE, UNSUBSCRIBE_ALL, SUBSCRIBE } kind;
+        Subscriber *subscriber;
+        std::vector<std::string> topics;
+        bool sendRetained;
+        size_t result;
+    };
+
+    struct Call {
+        Subscriber *subscriber;
+        std::vector<std::string> messages;
+        int result;
+        std::vector<Action> actions;
+    };
+
+    std::mt19937 &rng;
+    int round;
+    /* Few names make subscriptions overlap a lot */
+    bool narrow;
+    std::deque<Subscriber> pool;
+    std::vector<Subscriber *> subscribers;
+    TopicTree tree;
+
+    std::vector<Message> messages;
+    std::map<Subscriber *, std::set<std::string>> subscriptions;
+    std::map<std::string, unsigned int> retained;
+    std::map<std::string, SlowConsumerPolicy> policies;
+    std::map<Subscriber *, std::vector<unsigned int>> snapshots;
+    std::map<Subscriber *, bool> lagging;
+    std::map<std::tuple<Subscriber *, std::string, std::string>, unsigned int> conflated;
+
+    /* What the tree called back with, replayed against the model after the fact */
+    std::vector<Call> calls;
+    size_t replayed = 0;
+    bool actionsAllowed = false;
+    unsigned int batchFrom = 0;
+
+    static std::vector<std::string> split(const std::string &name) {
+        std::vector<std::string> segments;
+        for (size_t start = 0, stop = 0; stop != std::string::npos; start = stop + 1) {
+            stop = name.find('/', start);
+            segments.push_back(name.substr(start, stop - start));
+        }
+        return segments;
+    }
+
+    /* MQTT style, '#' only matches at the end and only below its parent */
+    static bool matches(const std::string &pattern, const std::string &topic) {
+        std::vector<std::string> p = split(pattern), t = split(topic);
+        for (size_t i = 0; i < p.size(); i++) {
+            if (p[i] == "#") {
+                return i + 1 == p.size() && i < t.size();
+            }
+            if (i >= t.size() || (p[i] != "+" && p[i] != t[i])) {
+                return false;
+            }
+        }
+        return p.size() == t.size();
+    }
+
+    std::string randomName(bool wildcards) {
+        static const char *segments[] = {"a", "b", "c", "+", "#"};
+        std::string name;
+        for (int depth = 1 + (int) (rng() % (narrow ? 2 : 3)), i = 0; i < depth; i++) {
+            name += i ? "/" : "";
+            name += narrow ? segments[wildcards ? (rng() % 2 ? 3 + rng() % 2 : rng() % 2) : rng() % 2] : segments[rng() % (wildcards ? 5 : 3)];
+        }
+        return name;
+    }
+
+    Subscriber *randomSubscriber() {
+        return subscribers[rng() % subscribers.size()];
+    }
+
+    std::string render(Subscriber *subscriber, unsigned int id) {
+        return (subscriber->compressed && messages[id].compressed ? "z" : "m") + std::to_string(id);
+    }
+
+    TopicTreeModel(std::mt19937 &rng, int round, int numSubscribers) : rng(rng), round(round), narrow(round % 2), tree([this](Subscriber *s, std::pair<size_t, std::string_view *> batch) {
+        return callback(s, batch);
+    }) {
+        for (int i = 0; i < numSubscribers; i++) {
+            pool.emplace_back(nullptr);
+            subscribers.push_back(&pool.back());
+            pool.back().compressed = rng() % 2;
+        }
+        std::sort(subscribers.begin(), subscribers.end());
+    }
+
+    /* Records the call and, if allowed, does to other subscribers what a message handler might */
+    int callback(Subscriber *s, std::pair<size_t, std::string_view *> batch) {
+        Call call = {s, {}, rng() % 4 == 0, {}};
+        for (size_t i = 0; i < batch.first; i++) {
+            call.messages.emplace_back(batch.second[i]);
+        }
+
+        /* Retained snapshots are all older than the batch, others may only subscribe along with the batch */
+        bool snapshotPhase = call.messages.size() && (unsigned int) atoi(call.messages[0].c_str() + 1) < batchFrom;
+        for (int n = rng() % 3; actionsAllowed && n; n--) {
+            Action action = {Action::UNSUBSCRIBE, randomSubscriber(), {}, (bool) (rng() % 2), 0};
+            unsigned int what = rng() % 10;
+            if (what < 5 && action.subscriber != s) {
+                std::set<std::string> &current = subscriptions[action.subscriber];
+                action.topics.push_back(current.size() && rng() % 4 ? *std::next(current.begin(), rng() % current.size()) : randomName(true));
+                action.result = tree.unsubscribe(action.topics[0], action.subscriber);
+            } else if (what < 7) {
+                /* Such as closing from within the handler, ourselves included */
+                action.kind = Action::UNSUBSCRIBE_ALL;
+                if (rng() % 2) {
+                    action.subscriber = s;
+                    call.result = 0;
+                }
+                tree.unsubscribeAll(action.subscriber);
+            } else if (!snapshotPhase && action.subscriber != s) {
+                action.kind = Action::SUBSCRIBE;
+                for (int i = 1 + (int) (rng() % 3); i; i--) {
+                    action.topics.push_back(randomName(true));
+                }
+                std::vector<std::string_view> topics(action.topics.begin(), action.topics.end());
+                tree.subscribe({topics.size(), topics.data()}, action.subscriber, action.sendRetained);
+                /* Trimming must wait for the drain to end */
+                tree.trim();
+            } else {
+                continue;
+            }
+            call.actions.push_back(action);
+        }
+
+        calls.push_back(call);
+        return call.result;
+    }
+
+    /* Model side of subscribing, returns whether we were not already */
+    bool subscribe(Subscriber *subscriber, const std::string &topic, bool sendRetained = true) {
+        if (!subscriptions[subscriber].insert(topic).second) {
+            return false;
+        }
+        for (auto &[name, id] : retained) {
+            if (sendRetained && matches(topic, name)) {
+                snapshots[subscriber].push_back(id);
+            }
+        }
+        return true;
+    }
+
+    bool unsubscribe(Subscriber *subscriber, const std::string &topic) {
+        if (!subscriptions[subscriber].erase(topic)) {
+            return false;
+        }
+        for (auto it = conflated.begin(); it != conflated.end(); ) {
+            it = std::get<0>(it->first) == subscriber && std::get<1>(it->first) == topic ? conflated.erase(it) : std::next(it);
+        }
+        return true;
+    }
+
+    void unsubscribeAll(Subscriber *subscriber) {
+        subscriptions[subscriber].clear();
+        snapshots[subscriber].clear();
+        for (auto it = conflated.begin(); it != conflated.end(); ) {
+            it = std::get<0>(it->first) == subscriber ? conflated.erase(it) : std::next(it);
+        }
+    }
+
+    /* The next recorded call must be this one, then we apply what it did */
+    Call *expect(Subscriber *subscriber, std::vector<std::string> expected, bool ordered, const char *what) {
+        if (!check(replayed < calls.size() && calls[replayed].subscriber == subscriber, what, round)) {
+            replayed = calls.size();
+            return nullptr;
+        }
+        Call &call = calls[replayed++];
+        std::vector<std::string> got = call.messages;
+        if (!ordered) {
+            std::sort(got.begin(), got.end());
+            std::sort(expected.begin(), expected.end());
+        }
+        check(got == expected, what, round);
+        return &call;
+    }
+
+    void apply(Call *call, std::map<Subscriber *, std::vector<unsigned int>> &draining, std::set<std::pair<Subscriber *, std::string>> *removed) {
+        for (Action &action : call->actions) {
+            if (action.kind == Action::UNSUBSCRIBE) {
+                check(unsubscribe(action.subscriber, action.topics[0]) == (bool) action.result, "unsubscribe from within the callback", round);
+                if (removed) {
+                    removed->emplace(action.subscriber, action.topics[0]);
+                }
+            } else if (action.kind == Action::UNSUBSCRIBE_ALL) {
+                if (removed) {
+                    for (const std::string &topic : subscriptions[action.subscriber]) {
+                        removed->emplace(action.subscriber, topic);
+                    }
+                }
+                unsubscribeAll(action.subscriber);
+                draining[action.subscriber].clear();
+            } else {
+                for (const std::string &topic : action.topics) {
+                    subscribe(action.subscriber, topic, action.sendRetained);
+                }
+            }
+        }
+    }
+
+    void catchUp(Subscriber *subscriber) {
+        calls.clear();
+        replayed = 0;
+        actionsAllowed = false;
+        tree.catchUp(subscriber);
+
+        lagging[subscriber] = false;
+        std::set<unsigned int> ids;
+        for (auto it = conflated.begin(); it != conflated.end(); ) {
+            if (std::get<0>(it->first) == subscriber) {
+                ids.insert(it->second);
+                it = conflated.erase(it);
+            } else {
+                it++;
+            }
+        }
+        if (ids.size()) {
+            std::vector<std::string> expected;
+            for (unsigned int id : ids) {
+                expected.push_back(render(subscriber, id));
+            }
+            if (Call *call = expect(subscriber, expected, true, "catchUp sends what was conflated, in order")) {
+                lagging[subscriber] = call->result;
+            }
+        }
+        check(replayed == calls.size(), "catchUp calls back once at most", round);
+    }
+
+    /* Replays a drain of everything published from batchFrom on */
+    void drain() {
+        calls.clear();
+        replayed = 0;
+        actionsAllowed = true;
+        tree.drain();
+        actionsAllowed = false;
+
+        /* Retained messages first, one call per subscriber in address order */
+        std::map<Subscriber *, std::vector<unsigned int>> draining, none;
+        draining.swap(snapshots);
+        for (Subscriber *subscriber : subscribers) {
+            if (draining[subscriber].size()) {
+                std::vector<std::string> expected;
+                for (unsigned int id : draining[subscriber]) {
+                    expected.push_back(render(subscriber, id));
+                }
+                draining[subscriber].clear();
+                if (Call *call = expect(subscriber, expected, false, "retained messages of new subscriptions go out first")) {
+                    lagging[subscriber] |= (bool) call->result;
+                    apply(call, draining, nullptr);
+                }
+            }
+        }
+
+        /* Then the batch to whoever was subscribed as it began, less those unsubscribed since */
+        std::map<Subscriber *, std::set<std::string>> subscribedAtStart = subscriptions;
+        std::set<std::pair<Subscriber *, std::string>> removed;
+        for (Subscriber *subscriber : subscribers) {
+            std::set<unsigned int> buffered;
+            std::vector<std::pair<std::string, std::vector<unsigned int>>> conflating;
+            bool matched = false;
+            for (const std::string &topic : subscribedAtStart[subscriber]) {
+                if (removed.count({subscriber, topic})) {
+                    continue;
+                }
+                std::vector<unsigned int> ids;
+                for (unsigned int id = batchFrom; id < messages.size(); id++) {
+                    if (matches(topic, messages[id].topic)) {
+                        ids.push_back(id);
+                    }
+                }
+                matched |= ids.size() > 0;
+                SlowConsumerPolicy policy = policies.count(topic) ? policies[topic] : BUFFER;
+                if (!lagging[subscriber] || policy == BUFFER) {
+                    buffered.insert(ids.begin(), ids.end());
+                } else if (policy == CONFLATE) {
+                    conflating.emplace_back(topic, ids);
+                }
+            }
+            if (!matched) {
+                continue;
+            }
+
+            bool wasLagging = lagging[subscriber];
+            for (auto &[topic, ids] : conflating) {
+                for (unsigned int id : ids) {
+                    auto key = std::make_tuple(subscriber, topic, messages[id].topic);
+                    if (buffered.count(id)) {
+                        conflated.erase(key);
+                    } else {
+                        conflated[key] = id;
+                    }
+                }
+            }
+            if (buffered.size()) {
+                std::vector<std::string> expected;
+                for (unsigned int id : buffered) {
+                    expected.push_back(render(subscriber, id));
+                }
+                if (Call *call = expect(subscriber, expected, true, wasLagging ? "lagging subscribers only get what they buffer" : "subscribers get what they match, in order and once")) {
+                    if (!wasLagging) {
+                        lagging[subscriber] = call->result;
+                    }
+                    apply(call, none, &removed);
+                }
+            }
+        }
+        check(replayed == calls.size(), "drain calls back nobody else", round);
+        batchFrom = (unsigned int) messages.size();
+    }
+
+    void publish(const std::string &topic, bool retain, bool compressed) {
+        unsigned int id = (unsigned int) messages.size();
+        std::string text = std::to_string(id);
+        SharedMessage *message = SharedMessage::create(text.length() + 1);
+        message->data()[0] = compressed ? 'z' : 'm';
+        memcpy(message->data() + 1, text.data(), text.length());
+        if (compressed) {
+            message->uncompressed = SharedMessage::create(text.length() + 1);
+            message->uncompressed->data()[0] = 'm';
+            memcpy(message->uncompressed->data() + 1, text.data(), text.length());
+        }
+        tree.publish(topic, message, retain);
+
+        messages.push_back({topic, compressed});
+        if (retain) {
+            retained[topic] = id;
+        }
+    }
+
+    /* Random changes, all outside of drain */
+    void mutate() {
+        for (int n = (int) (rng() % 30); n; n--) {
+            Subscriber *subscriber = randomSubscriber();
+            unsigned int what = rng() % 100;
+            if (what < 40) {
+                std::string topic = randomName(true);
+                tree.subscribe(topic, subscriber);
+                subscribe(subscriber, topic);
+            } else if (what < 50) {
+                std::vector<std::string> names;
+                for (int i = 1 + (int) (rng() % 4); i; i--) {
+                    names.push_back(randomName(true));
+                }
+                std::sort(names.begin(), names.end());
+                std::vector<std::string_view> topics(names.begin(), names.end());
+                bool sendRetained = rng() % 4;
+                tree.subscribe({topics.size(), topics.data()}, subscriber, sendRetained);
+                for (const std::string &topic : names) {
+                    subscribe(subscriber, topic, sendRetained);
+                }
+            } else if (what < 70) {
+                std::set<std::string> &current = subscriptions[subscriber];
+                std::string topic = current.size() && rng() % 4 ? *std::next(current.begin(), rng() % current.size()) : randomName(true);
+                check(tree.unsubscribe(topic, subscriber) == unsubscribe(subscriber, topic), "unsubscribe returns whether we were", round);
+            } else if (what < 75) {
+                std::vector<std::string> names(subscriptions[subscriber].begin(), subscriptions[subscriber].end());
+                names.push_back(randomName(true));
+                std::vector<std::string_view> topics(names.begin(), names.end());
+                size_t unsubscribed = 0;
+                for (const std::string &topic : std::set<std::string>(names.begin(), names.end())) {
+                    unsubscribed += unsubscribe(subscriber, topic);
+                }
+                check(tree.unsubscribe({topics.size(), topics.data()}, subscriber) == unsubscribed, "bulk unsubscribe counts", round);
+            } else if (what < 79) {
+                tree.unsubscribeAll(subscriber);
+                unsubscribeAll(subscriber);
+            } else if (what < 85) {
+                std::string topic = randomName(true);
+                SlowConsumerPolicy policy = (SlowConsumerPolicy) (rng() % 3);
+                tree.setPolicy(topic, policy);
+                policies[topic] = policy;
+            } else if (what < 88) {
+                std::string topic = randomName(false);
+                check(tree.clearRetained(topic) == (retained.erase(topic) > 0), "clearRetained returns whether there was one", round);
+            } else if (what < 94) {
+                catchUp(subscriber);
+            } else if (what < 98) {
+                tree.trim(rng() % 4);
+            } else {
+                subscriber->compressed = !subscriber->compressed;
+            }
+        }
+
+        for (Subscriber *subscriber : subscribers) {
+            check(subscriber->snapshots == snapshots[subscriber].size(), "Subscriber::snapshots counts what is queued", round);
+            check(subscriber->lagging == lagging[subscriber], "Subscriber::lagging", round);
+        }
+        Subscriber *subscriber = randomSubscriber();
+        std::vector<std::string> names = tree.getSubscriptions(subscriber);
+        check(std::equal(names.begin(), names.end(), subscriptions[subscriber].begin(), subscriptions[subscriber].end()), "getSubscriptions", round);
+    }
+
+    void run(int iterations) {
+        for (int i = 0; i < iterations; i++) {
+            mutate();
+            for (int n = (int) (rng() % (i % 7 ? 20 : 200)); n; n--) {
+                publish(randomName(false), rng() % 8 == 0, rng() % 3 == 0);
+            }
+            drain();
+        }
+
+        /* Everything unused is trimmed, a few at a time */
+        for (Subscriber *subscriber : subscribers) {
+            tree.unsubscribeAll(subscriber);
+            unsubscribeAll(subscriber);
+        }
+        for (auto &[topic, id] : retained) {
+            check(tree.clearRetained(topic), "retained messages stay until cleared", round);
+        }
+        retained.clear();
+        calls.clear();
+        tree.drain();
+        check(calls.empty(), "nobody is left to get queued retained messages", round);
+        int steps = 0;
+        while (tree.trim(1 + rng() % 3) && steps < 100000) {
+            steps++;
+        }
+        check(steps < 100000 && !tree.trim(), "trim comes to an end", round);
+        check(!tree.hasPendingTopics(), "nothing is left to drain", round);
+    }
+};
+
+int main(int argc, char **argv) {
+    int rounds = argc > 1 ? atoi(argv[1]) : 100;
+    std::mt19937 rng(argc > 2 ? (unsigned int) atoi(argv[2]) : 1);
+
+    testHashedSet(rng, rounds);
+    testSubscriberSet(rng, rounds);
+    for (int round = 0; round < rounds; round++) {
+        TopicTreeModel model(rng, round, 1 + (int) (rng() % (round % 2 ? 8 : 40)));
+        model.run(30);
+    }
+
+    printf(failures ? "TopicTree: %d failures\n" : "TopicTree: ok\n", failures);
+    return failures != 0;
+}